@@ -30,19 +30,111 @@ typedef enum {
     PMXE_OK,		/* no error */
     PMXE_ENOMEM,	/* memory allocation failure */
     PMXE_EIO,		/* error writing to underlying file stream */
+    PMXE_EFORMAT,	/* malformed input */
 } pmx_error_t;
 
+/*
+ * Output formats.  PMXF_JSON emits newline-separated JSON objects.  PMXF_BINARY
+ * emits a compact tagged binary format (described in pmx_binary.c), which can
+ * be converted to the JSON form with pmx_import_binary().  PMXF_SQLITE records
+ * the export in a sqlite database (described in pmx_sqlite.c).  Since that's
+ * written to a file rather than a stdio stream, sqlite streams are created with
+ * pmx_create_stream_sqlite().  PMXF_NULL discards all output (and the output
+ * stream may be NULL), which is useful for measuring the cost of everything
+ * other than serialization.
+ */
+typedef enum {
+    PMXF_JSON,
+    PMXF_BINARY,
+    PMXF_SQLITE,
+    PMXF_NULL
+} pmx_format_t;
+
+/*
+ * Compression of JSON and binary output.  PMXC_GZIP writes the output as a
+ * series of independently-compressed gzip members (which together form a valid
+ * gzip file), optionally with an index of where each member starts.  See
+ * pmx_create_stream_compressed() and pmx_output.c.
+ */
+typedef enum {
+    PMXC_NONE,
+    PMXC_GZIP
+} pmx_compress_t;
+
+/*
+ * Options for output written through a memory mapping, which may be combined.
+ * See pmx_create_stream_mmap() and pmx_mmap.c.
+ */
+typedef enum {
+    PMXM_SEQUENTIAL	= 0x1,	/* advise sequential access */
+    PMXM_WRITEBACK	= 0x2,	/* start writeback as each extent fills */
+    PMXM_SYNC		= 0x4	/* wait for stable storage when done */
+} pmx_mmap_flag_t;
+
+/*
+ * Interning of string contents.  See pmx_intern_strings() and pmx_strtab.c.
+ */
+typedef enum {
+    PMXI_EVICT_NONE,	/* when full, write new strings inline */
+    PMXI_EVICT_CLOCK	/* when full, evict least-recently-used entries */
+} pmx_intern_policy_t;
+
+typedef struct {
+    uint64_t	pxis_nlookups;		/* strings looked up */
+    uint64_t	pxis_nhits;		/* strings found in the table */
+    uint64_t	pxis_nevicted;		/* entries evicted */
+    uint64_t	pxis_nbytessaved;	/* bytes of contents not written */
+    uint64_t	pxis_nentries;		/* current entries */
+    uint64_t	pxis_nbytes;		/* current memory charged to entries */
+} pmx_intern_stats_t;
+
 typedef enum {
     PB_FALSE,
     PB_TRUE
 } pmx_boolean_t;
 
+/*
+ * Validation of references between values.  See pmx_validate_refs() and
+ * pmx_validate.c.
+ */
+typedef struct {
+    uint64_t	pxvs_ndefined;		/* distinct values emitted */
+    uint64_t	pxvs_nreferences;	/* references checked */
+    uint64_t	pxvs_nduplicates;	/* values emitted more than once */
+    uint64_t	pxvs_nunresolved;	/* references to values not emitted */
+    uint64_t	pxvs_nmissing;		/* values referenced, not emitted */
+    uint64_t	pxvs_nbytes;		/* memory used by the tables */
+    pmx_boolean_t pxvs_incomplete;	/* validation ran out of memory */
+} pmx_validate_stats_t;
+
 pmx_stream_t *pmx_create_stream(FILE *, FILE *);
+pmx_stream_t *pmx_create_stream_format(FILE *, FILE *, pmx_format_t);
+pmx_stream_t *pmx_create_stream_sqlite(const char *, FILE *);
+pmx_stream_t *pmx_create_stream_compressed(FILE *, FILE *, pmx_format_t,
+    pmx_compress_t, FILE *);
+pmx_stream_t *pmx_create_stream_mmap(const char *, FILE *, pmx_format_t,
+    unsigned int);
+pmx_stream_t *pmx_create_stream_arena(FILE *, FILE *, pmx_format_t, void *,
+    size_t);
+pmx_stream_t *pmx_create_stream_static(int, pmx_format_t, void *, size_t);
+int pmx_async_output(pmx_stream_t *, unsigned int);
+void pmx_done(pmx_stream_t *);
 void pmx_free(pmx_stream_t *);
 
+/*
+ * Sharded exports.  pmx_create_shard() creates a stream that may be driven
+ * from its own thread, in parallel with other shards of the same parent, and
+ * whose output is merged into the parent afterwards with pmx_merge_shard().
+ */
+pmx_stream_t *pmx_create_shard(pmx_stream_t *, FILE *);
+void pmx_merge_shard(pmx_stream_t *, pmx_stream_t *);
+
 pmx_error_t pmx_errno(pmx_stream_t *);
 const char *pmx_errmsg(pmx_stream_t *);
 
+void pmx_byte_counts(pmx_stream_t *, uint64_t *, uint64_t *);
+void pmx_memory_usage(pmx_stream_t *, size_t *, size_t *);
+
 void pmx_emit_metadata(pmx_stream_t *, const char *, const char *);
 void pmx_emit_node_boolean(pmx_stream_t *, pmx_value_t, pmx_boolean_t,
     pmx_value_t);
@@ -64,6 +156,78 @@ void pmx_emit_node_string_slice(pmx_stream_t *, pmx_value_t, pmx_value_t,
 
 void pmx_emit_string_data(pmx_stream_t *, pmx_value_t, size_t, const uint8_t *);
 
+/*
+ * After pmx_intern_strings(), string contents passed to pmx_emit_string_data()
+ * are written once per distinct value and referred to by a content id
+ * thereafter.  The table of contents seen so far uses at most "maxbytes" bytes
+ * of memory (approximately), and the policy determines what happens when it's
+ * full.  This must be called before any string data is emitted, and is not
+ * supported for PMXF_SQLITE.  pmx_intern_stats() reports how effective it's
+ * been: the hit rate is pxis_nhits / pxis_nlookups.
+ */
+int pmx_intern_strings(pmx_stream_t *, size_t, pmx_intern_policy_t);
+void pmx_intern_stats(pmx_stream_t *, pmx_intern_stats_t *);
+
+/*
+ * After pmx_validate_refs(), the stream keeps track of the values emitted (as
+ * nodes or string data) and the values referred to by nodes' fields and edges,
+ * and when the stream is finished, it warns about any references to values
+ * that were never emitted, broken down by the type of the referring node.
+ * This must be called before anything is emitted, and not on shards (the
+ * contents of shards are checked as they're merged into the parent).
+ * pmx_validate_stats() reports the counts so far; before the stream is
+ * finished, "unresolved" references may yet be resolved.
+ */
+int pmx_validate_refs(pmx_stream_t *);
+void pmx_validate_stats(pmx_stream_t *, pmx_validate_stats_t *);
+
+/*
+ * After pmx_index_values(), the stream records where each value (node or
+ * string data) is written, and when the stream is finished, it writes an index
+ * of them (along with the names used by edges) to the given stream.  See
+ * pmx_index_open() for reading it.  This must be called before anything is
+ * emitted, only on streams with uncompressed JSON output that aren't shards,
+ * and not together with pmx_intern_strings().  See pmx_index.c.
+ */
+int pmx_index_values(pmx_stream_t *, FILE *);
+
+/*
+ * Batch interfaces.  Exporters walking a large heap can collect a group of
+ * nodes of the same type and emit them all with a single call, which is
+ * equivalent to (but cheaper than) emitting each one individually.  For arrays,
+ * pxa_smi may be NULL if none of the elements are small integers, and
+ * otherwise pxa_smi[i] is non-zero if element "i" is a small integer.
+ */
+typedef struct {
+    pmx_value_t		pxh_ident;
+    double		pxh_value;
+} pmx_heapnumber_t;
+
+typedef struct {
+    pmx_value_t		pxsf_ident;
+    pmx_value_t		pxsf_length;
+    pmx_value_t		pxsf_data;
+} pmx_string_flat_t;
+
+typedef struct {
+    pmx_value_t		pxsc_ident;
+    pmx_value_t		pxsc_length;
+    pmx_value_t		pxsc_s1;
+    pmx_value_t		pxsc_s2;
+} pmx_string_cons_t;
+
+typedef struct {
+    pmx_value_t		pxa_ident;
+    size_t		pxa_length;
+    const pmx_value_t	*pxa_elements;
+    const uint8_t	*pxa_smi;
+} pmx_array_t;
+
+void pmx_emit_heapnumbers(pmx_stream_t *, const pmx_heapnumber_t *, size_t);
+void pmx_emit_strings_flat(pmx_stream_t *, const pmx_string_flat_t *, size_t);
+void pmx_emit_strings_cons(pmx_stream_t *, const pmx_string_cons_t *, size_t);
+void pmx_emit_arrays(pmx_stream_t *, const pmx_array_t *, size_t);
+
 void pmx_function_start(pmx_stream_t *, pmx_value_t);
 void pmx_function_label(pmx_stream_t *, pmx_value_t);
 void pmx_function_script_name(pmx_stream_t *, pmx_value_t);
@@ -75,15 +239,169 @@ void pmx_closure_parent(pmx_stream_t *, pmx_value_t);
 void pmx_closure_variable(pmx_stream_t *, pmx_value_t, const char *);
 void pmx_closure_done(pmx_stream_t *);
 
+/*
+ * The "size_t" argument to pmx_object_done() is the number of properties
+ * emitted for the object.
+ */
 void pmx_object_start(pmx_stream_t *, pmx_value_t);
 void pmx_object_constructor(pmx_stream_t *, pmx_value_t);
-void pmx_object_done(pmx_stream_t *);
+void pmx_object_done(pmx_stream_t *, size_t);
 void pmx_object_property(pmx_stream_t *, pmx_value_t, pmx_value_t,
     const char *);
 
+/*
+ * The "int" argument to pmx_array_element() is non-zero if the element is a
+ * small integer rather than a reference to another node.
+ */
 void pmx_array(pmx_stream_t *, pmx_value_t, size_t);
 void pmx_array_element(pmx_stream_t *, pmx_value_t, pmx_value_t, int, size_t);
 
+void pmx_import_binary(pmx_stream_t *, FILE *);
+
+/*
+ * Reading JSON exports.  A reader returns each record of an export in turn,
+ * either to a caller pulling them with pmx_reader_next() or to a callback with
+ * pmx_reader_walk() (which stops early if the callback returns non-zero).
+ * Strings are views of the input, which is mapped into memory: pxsv_ptr points
+ * to the JSON encoding of the string (not NUL-terminated), and strings with
+ * pxsv_escaped set must be decoded with pmx_strview_decode() into a buffer of
+ * at least pxsv_len bytes.  Views remain valid until the reader is closed, but
+ * pxr_edges is only valid until the next record is read.  See pmx_reader.c.
+ *
+ * Which members of a record are valid depends on its type:
+ *
+ *     PMXR_METADATA	pxr_key, pxr_str (the value)
+ *     PMXR_STRING	pxr_ident, and pxr_id (a content id) if pxr_hascontent,
+ *     			or else pxr_str (the contents)
+ *     PMXR_CONTENT	pxr_id, pxr_str (the contents)
+ *     PMXR_NAME	pxr_id, pxr_str (the name)
+ *     PMXR_NODE	pxr_subtype, pxr_ident, pxr_fieldmask, pxr_fields
+ *     PMXR_EDGES	pxr_ident (the source), pxr_edges, pxr_nedges
+ *
+ * Bit "i" of pxr_fieldmask is set if field "i" of the node is present, and
+ * pmx_node_typename() and pmx_node_fieldname() describe node types and their
+ * fields.  pmx_node_fieldisref() reports whether a field holds the ident of
+ * another value.  Double-precision fields hold the bits of the IEEE 754 value.
+ */
+typedef struct pmx_reader pmx_reader_t;
+
+#define	PMXR_MAXFIELDS	3
+
+typedef enum {
+    PMXR_METADATA,
+    PMXR_STRING,
+    PMXR_CONTENT,
+    PMXR_NAME,
+    PMXR_NODE,
+    PMXR_EDGES
+} pmx_rectype_t;
+
+typedef struct {
+    const char		*pxsv_ptr;
+    size_t		pxsv_len;
+    pmx_boolean_t	pxsv_escaped;
+} pmx_strview_t;
+
+typedef struct {
+    unsigned int	pxre_kind;	/* 1 property, 2 element, */
+					/* 3 variable, 4 small int element */
+    uint64_t		pxre_target;
+    uint64_t		pxre_key;	/* element index or name id */
+} pmx_redge_t;
+
+typedef struct {
+    pmx_rectype_t	pxr_type;
+    uint64_t		pxr_offset;	/* byte offset in the input */
+    uint64_t		pxr_ident;
+    uint64_t		pxr_id;
+    pmx_boolean_t	pxr_hascontent;
+    pmx_strview_t	pxr_key;
+    pmx_strview_t	pxr_str;
+    unsigned int	pxr_subtype;
+    unsigned int	pxr_fieldmask;
+    uint64_t		pxr_fields[PMXR_MAXFIELDS];
+    const pmx_redge_t	*pxr_edges;
+    size_t		pxr_nedges;
+} pmx_record_t;
+
+typedef int (pmx_reader_f)(const pmx_record_t *, void *);
+
+pmx_reader_t *pmx_reader_open(const char *);
+pmx_reader_t *pmx_reader_open_buf(const void *, size_t);
+int pmx_reader_next(pmx_reader_t *, pmx_record_t *);
+int pmx_reader_walk(pmx_reader_t *, pmx_reader_f *, void *);
+pmx_error_t pmx_reader_errno(pmx_reader_t *);
+const char *pmx_reader_errmsg(pmx_reader_t *);
+void pmx_reader_close(pmx_reader_t *);
+int pmx_strview_decode(const pmx_strview_t *, char *, size_t *);
+const char *pmx_node_typename(unsigned int);
+const char *pmx_node_fieldname(unsigned int, unsigned int);
+pmx_boolean_t pmx_node_fieldisref(unsigned int, unsigned int);
+
+/*
+ * Random access to an export written with pmx_index_values().  pmx_index_open()
+ * opens the export and its index (returning NULL with errno set on failure,
+ * including EINVAL if the index is malformed or doesn't match the export).
+ * pmx_index_lookup() reads the records for one value with a single pread(2)
+ * and returns a reader over them: the value's own record, preceded by any edge
+ * records for it (and possibly name records).  The reader belongs to the index
+ * and is only valid until the next lookup.  If the value isn't in the export,
+ * this returns NULL with errno set to ENOENT, and on other failures, it returns
+ * NULL with errno set accordingly.  pmx_index_name() returns the name with the
+ * given id (as used by property and variable edges), or NULL if there's none.
+ */
+typedef struct pmx_index pmx_index_t;
+
+pmx_index_t *pmx_index_open(const char *, const char *);
+void pmx_index_close(pmx_index_t *);
+pmx_reader_t *pmx_index_lookup(pmx_index_t *, uint64_t);
+const char *pmx_index_name(pmx_index_t *, uint64_t);
+uint64_t pmx_index_nvalues(pmx_index_t *);
+
+/*
+ * pmx_stats() reports what a stream has emitted so far.  Records are counted
+ * by type (as pmx_rectype_t, except that PMXR_EDGES counts edges rather than
+ * records), and nodes are also counted by node type (as used by
+ * pmx_node_typename()).  The byte counts are the size of each kind of record
+ * in the serialized output, before compression, so they're only kept for JSON
+ * and binary streams.  For PMXR_STRING, pxst_nstringbytes is the total size of
+ * the contents passed to pmx_emit_string_data(), and pxst_ninternhits and
+ * pxst_ninternsaved say how many of those were written as references to
+ * contents written earlier (see pmx_intern_strings()) and how many bytes of
+ * contents that saved.  Records merged from shards are counted by the parent.
+ *
+ * After pmx_stats_timing(), the stream also measures the time spent from then
+ * on serializing records in the backend (pxst_serialize_ns) and writing output
+ * (pxst_output_ns, which includes compression, or with pmx_async_output(),
+ * handing output to the writer thread), along with the total time elapsed
+ * (pxst_elapsed_ns).  The rest of the elapsed time was spent by the caller or
+ * the rest of libpmx.  Times are measured with the CPU's cycle counter where
+ * there is one (and converted to nanoseconds using the clock), which costs a
+ * few nanoseconds per record.
+ */
+#define	PMXR_NTYPES		(PMXR_EDGES + 1)
+#define	PMX_NODE_NTYPES		10
+
+typedef struct {
+    uint64_t		pxst_nrecords[PMXR_NTYPES];	/* by record type */
+    uint64_t		pxst_nbytes[PMXR_NTYPES];	/* by record type */
+    uint64_t		pxst_nnodes[PMX_NODE_NTYPES];	/* by node type */
+    uint64_t		pxst_nnodebytes[PMX_NODE_NTYPES]; /* by node type */
+    uint64_t		pxst_nstringbytes;	/* string contents emitted */
+    uint64_t		pxst_ninternhits;	/* strings found interned */
+    uint64_t		pxst_ninternsaved;	/* contents not written */
+    uint64_t		pxst_nwarnings;		/* warnings reported */
+    uint64_t		pxst_nbytesraw;		/* see pmx_byte_counts() */
+    uint64_t		pxst_nbytesout;
+    pmx_boolean_t	pxst_timed;		/* pmx_stats_timing() called */
+    uint64_t		pxst_elapsed_ns;
+    uint64_t		pxst_serialize_ns;
+    uint64_t		pxst_output_ns;
+} pmx_stats_t;
+
+void pmx_stats(pmx_stream_t *, pmx_stats_t *);
+void pmx_stats_timing(pmx_stream_t *);
+
 /* XXX */
 #define	PMX_SMI_VALUE(x)	((x) << 1)
 
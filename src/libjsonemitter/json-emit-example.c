@@ -19,9 +19,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "jsonemitter.h"
 
+#define	JSX_BUFSZ	(64 * 1024)
+
 static int jsx_example_coverage(json_emit_t *);
 static int jsx_example_maxdepth(json_emit_t *);
 static int jsx_example_toodeep(json_emit_t *);
@@ -47,27 +50,42 @@ main(int argc __attribute__((__unused__)),
 {
 	json_emit_t *jse;
 	char errbuf[256];
-	int i, nexamples;
+	int i, nexamples, buffered;
 
+	/*
+	 * Run each example once with a stdio emitter and once with a buffered
+	 * emitter.  The output should be identical.
+	 */
 	nexamples = sizeof (json_examples) / sizeof (json_examples[0]);
-	for (i = 0; i < nexamples; i++) {
-		(void) fprintf(stderr, "example: %s\n",
-		    json_examples[i].jsx_name);
-		jse = json_create_stdio(stdout);
-		if (jse == NULL) {
-			err(EXIT_FAILURE, "json_create_stream");
-		}
-
-		if (json_examples[i].jsx_func(jse) != 0) {
-			warnx("jsonemit: example function failed");
+	for (buffered = 0; buffered < 2; buffered++) {
+		for (i = 0; i < nexamples; i++) {
+			(void) fprintf(stderr, "example: %s (%s)\n",
+			    json_examples[i].jsx_name,
+			    buffered ? "buffered" : "stdio");
+			if (buffered) {
+				(void) fflush(stdout);
+				jse = json_create_fd(STDOUT_FILENO, JSX_BUFSZ);
+			} else {
+				jse = json_create_stdio(stdout);
+			}
+
+			if (jse == NULL) {
+				err(EXIT_FAILURE, "json_create_stream");
+			}
+
+			if (json_examples[i].jsx_func(jse) != 0) {
+				warnx("jsonemit: example function failed");
+			}
+
+			json_flush(jse);
+			if (json_get_error(jse, errbuf,
+			    sizeof (errbuf)) != JSE_NONE) {
+				warnx("jsonemit: %s", errbuf);
+			}
+
+			(void) printf("\n");
+			json_fini(jse);
 		}
-
-		if (json_get_error(jse, errbuf, sizeof (errbuf)) != JSE_NONE) {
-			warnx("jsonemit: %s", errbuf);
-		}
-
-		(void) printf("\n");
-		json_fini(jse);
 	}
 
 	return (0);
@@ -142,9 +160,15 @@ jsx_example_coverage(json_emit_t *jse)
 	json_boolean(jse, "boolean: false", JSON_B_FALSE);
 	json_utf8string(jse, "string: empty", "");
 	json_utf8string(jse, "string: non-empty", "bump!");
-	/* XXX add utf8 literals */
+	json_utf8string(jse, "string: utf8",
+	    "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80");
 	json_utf8string(jse, "string: special values",
 	    "newline\ntab\treturn\rspace quote\"squote'backslash\\");
+	json_utf8string(jse, "string: long with special values",
+	    "a string long enough to be scanned in several chunks, "
+	    "with a \"quote\" after the first chunk, a control character "
+	    "(\x01) after the second, and a non-ASCII one (\xc3\xa9) "
+	    "after the third");
 
 	json_object_end(jse);
 	json_newline(jse);
@@ -0,0 +1,986 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * json-test.c: check libjsonemitter's optimized routines against reference
+ * implementations
+ *
+ * This program uses private jsonemitter functions (see jsonemitter_impl.h).
+ * It's run by "make check", and exits with status 1 after describing the
+ * first mismatch it finds.  Each test can also be run by name.  Test inputs
+ * are generated from a fixed seed, so every run checks the same inputs.
+ *
+ * "scan" checks string emission with each implementation of json_scan_plain()
+ * that the CPU supports.  Each test string (printable ASCII, ASCII with
+ * characters that need escaping, valid and truncated UTF-8 multibyte
+ * sequences, invalid bytes, and arbitrary bytes, of lengths that cover each
+ * vector width and the tail after it) is scanned from every starting offset
+ * and checked with json_utf8_validlen(), and the results must match those of
+ * the portable implementation.  The string is also emitted with
+ * json_utf8string_len(), and the output and whether the emitter reported an
+ * error must match those of jt_ref_utf8string(), a copy of the byte-at-a-time
+ * encoder that json_emit_utf8string() used before json_scan_plain() existed.
+ *
+ * "number" checks json_format_uint64(), json_format_int64(), and
+ * json_format_double() against the C library.  Integers must be formatted
+ * exactly as printf() formats them, and doubles must be valid JSON numbers,
+ * laid out the way JavaScript prints them, that strtod() reads back as the
+ * same value, bit for bit (including the sign of zero).  Inputs include
+ * boundary values, powers of 2 and 10 and their neighbors, and random values
+ * of every magnitude: random bit patterns for doubles, as well as integers,
+ * decimal fractions, and subnormals.
+ */
+
+#include <err.h>
+#include <float.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jsonemitter.h"
+#include "jsonemitter_impl.h"
+
+#define	EXIT_USAGE 2
+
+/* Seed for generated inputs. */
+#define	JT_SEED		0x706d786a736f6e31ULL
+/* Longest generated string. */
+#define	JT_MAXLEN	200
+/* Number of strings generated of each kind. */
+#define	JT_NSTRINGS	5000
+/* The smallest allowed, so that long strings are written out in pieces. */
+#define	JT_BUFSZ	512
+/* Every byte of a string may be emitted as a 6-byte escape sequence. */
+#define	JT_MAXOUT	(6 * JT_MAXLEN + 2)
+/* Number of random values generated of each kind. */
+#define	JT_NNUMBERS	200000
+
+static int jt_test_scan(void);
+static int jt_test_number(void);
+
+static struct {
+	const char	*jtt_name;
+	int		(*jtt_func)(void);
+} jt_tests[] = {
+	{ "scan", jt_test_scan },
+	{ "number", jt_test_number },
+};
+
+#define	JT_NTESTS	(sizeof (jt_tests) / sizeof (jt_tests[0]))
+
+static uint64_t jt_rand_state = JT_SEED;
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: json-test [TEST...]\n");
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t i;
+	int j;
+
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < JT_NTESTS; i++) {
+			if (strcmp(argv[j], jt_tests[i].jtt_name) == 0) {
+				break;
+			}
+		}
+
+		if (i == JT_NTESTS) {
+			warnx("no such test: \"%s\"", argv[j]);
+			usage();
+		}
+	}
+
+	for (i = 0; i < JT_NTESTS; i++) {
+		for (j = 1; j < argc; j++) {
+			if (strcmp(argv[j], jt_tests[i].jtt_name) == 0) {
+				break;
+			}
+		}
+
+		if (argc > 1 && j == argc) {
+			continue;
+		}
+
+		if (jt_tests[i].jtt_func() != 0) {
+			(void) printf("json-test: %s: FAILED\n",
+			    jt_tests[i].jtt_name);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Returns the next number from a xorshift64* generator.
+ */
+static uint64_t
+jt_rand(void)
+{
+	jt_rand_state ^= jt_rand_state >> 12;
+	jt_rand_state ^= jt_rand_state << 25;
+	jt_rand_state ^= jt_rand_state >> 27;
+	return (jt_rand_state * 0x2545f4914f6cdd1dULL);
+}
+
+static unsigned int
+jt_rand_below(unsigned int n)
+{
+	return ((unsigned int)(jt_rand() % n));
+}
+
+static void
+jt_hexdump(const char *label, const char *buf, size_t len)
+{
+	size_t i;
+
+	(void) fprintf(stderr, "%s (%zu bytes):", label, len);
+	for (i = 0; i < len; i++) {
+		(void) fprintf(stderr, "%s%02x", i % 32 == 0 ? "\n    " : " ",
+		    (unsigned char)buf[i]);
+	}
+
+	(void) fprintf(stderr, "\n");
+}
+
+/*
+ * scan test.  See the comment at the top of this file.
+ */
+
+typedef enum {
+	JT_ASCII,	/* printable ASCII that needs no escaping */
+	JT_ESCAPES,	/* ASCII with quotes, backslashes, and controls */
+	JT_MULTIBYTE,	/* ASCII and valid UTF-8 multibyte characters */
+	JT_TRUNCATED,	/* valid, but ending partway through a character */
+	JT_INVALID,	/* ASCII with bytes that can't start a character */
+	JT_BYTES,	/* arbitrary bytes */
+	JT_NKINDS
+} jt_kind_t;
+
+static const char *jt_kind_names[JT_NKINDS] = {
+	"ascii", "escapes", "multibyte", "truncated", "invalid", "bytes"
+};
+
+/*
+ * Bytes that json_scan_plain() must stop at, and neighbors that it mustn't.
+ */
+static const unsigned char jt_special[] = {
+	0x00, 0x01, 0x08, 0x09, 0x0a, 0x1f, '"', '\\',
+	0x80, 0xbf, 0xc3, 0xe2, 0xf0, 0xf8, 0xff
+};
+static const unsigned char jt_plain[] = { 0x20, '!', '#', '[', ']', 0x7f };
+
+typedef struct {
+	char		jtr_out[JT_MAXOUT + 1];
+	size_t		jtr_outlen;
+	size_t		jtr_scan[JT_MAXLEN];	/* from each offset */
+	size_t		jtr_validlen;
+	json_error_t	jtr_error;
+} jt_result_t;
+
+/*
+ * Emitters write to this temporary file, and their output is read back from it
+ * by jt_collect().
+ */
+static int jt_outfd = -1;
+
+static void
+jt_collect(jt_result_t *jtr)
+{
+	ssize_t n;
+
+	if (lseek(jt_outfd, 0, SEEK_SET) == -1) {
+		err(EXIT_FAILURE, "lseek");
+	}
+
+	jtr->jtr_outlen = 0;
+	while ((n = read(jt_outfd, jtr->jtr_out + jtr->jtr_outlen,
+	    sizeof (jtr->jtr_out) - jtr->jtr_outlen)) > 0) {
+		jtr->jtr_outlen += (size_t)n;
+		if (jtr->jtr_outlen == sizeof (jtr->jtr_out)) {
+			errx(EXIT_FAILURE, "emitted more output than expected");
+		}
+	}
+
+	if (n < 0) {
+		err(EXIT_FAILURE, "read");
+	}
+}
+
+/*
+ * Appends a random printable ASCII character that needs no escaping.
+ */
+static size_t
+jt_gen_plain(char *buf)
+{
+	char c;
+
+	do {
+		c = (char)(0x20 + jt_rand_below(0x7f - 0x20));
+	} while (c == '"' || c == '\\');
+
+	buf[0] = c;
+	return (1);
+}
+
+/*
+ * Appends a random valid UTF-8 multibyte character (of at most "avail" bytes)
+ * and returns its length.
+ */
+static size_t
+jt_gen_utf8(char *buf, size_t avail)
+{
+	uint32_t cp;
+	size_t n;
+
+	n = 2 + jt_rand_below(avail < 4 ? (unsigned int)avail - 1 : 3);
+	switch (n) {
+	case 2:
+		cp = 0x80 + jt_rand_below(0x800 - 0x80);
+		buf[0] = (char)(0xc0 | (cp >> 6));
+		buf[1] = (char)(0x80 | (cp & 0x3f));
+		break;
+	case 3:
+		cp = 0x800 + jt_rand_below(0x10000 - 0x800);
+		buf[0] = (char)(0xe0 | (cp >> 12));
+		buf[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		buf[2] = (char)(0x80 | (cp & 0x3f));
+		break;
+	default:
+		cp = 0x10000 + jt_rand_below(0x110000 - 0x10000);
+		buf[0] = (char)(0xf0 | (cp >> 18));
+		buf[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+		buf[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		buf[3] = (char)(0x80 | (cp & 0x3f));
+		break;
+	}
+
+	return (n);
+}
+
+/*
+ * Fills "buf" with a string of kind "kind" and returns its length.
+ */
+static size_t
+jt_gen(jt_kind_t kind, char *buf)
+{
+	size_t target, len, n;
+	unsigned int r;
+
+	target = jt_rand_below(JT_MAXLEN + 1);
+	len = 0;
+	while (len < target) {
+		r = jt_rand_below(16);
+		switch (kind) {
+		case JT_ESCAPES:
+			if (r < 2) {
+				buf[len++] = (char)jt_special[jt_rand_below(8)];
+				continue;
+			}
+			break;
+
+		case JT_MULTIBYTE:
+		case JT_TRUNCATED:
+			if (r < 3 && target - len >= 2) {
+				len += jt_gen_utf8(buf + len, target - len);
+				continue;
+			}
+			break;
+
+		case JT_INVALID:
+			if (r < 1) {
+				buf[len++] = (char)((jt_rand() & 1) != 0 ?
+				    0x80 + jt_rand_below(0x40) :
+				    0xf8 + jt_rand_below(8));
+				continue;
+			}
+			break;
+
+		case JT_BYTES:
+			buf[len++] = (char)jt_rand_below(256);
+			continue;
+
+		default:
+			break;
+		}
+
+		len += jt_gen_plain(buf + len);
+	}
+
+	if (kind == JT_TRUNCATED && len + 4 <= JT_MAXLEN) {
+		n = jt_gen_utf8(buf + len, 4);
+		len += 1 + jt_rand_below((unsigned int)n - 1);
+	}
+
+	return (len);
+}
+
+/*
+ * Appends "c" to the reference output in "jtr".
+ */
+static void
+jt_ref_emitc(jt_result_t *jtr, char c)
+{
+	if (jtr->jtr_outlen == sizeof (jtr->jtr_out)) {
+		errx(EXIT_FAILURE, "emitted more output than expected");
+	}
+
+	jtr->jtr_out[jtr->jtr_outlen++] = c;
+}
+
+/*
+ * Reference encoder: this is json_emit_utf8string() as it was before it used
+ * json_scan_plain(), except that it emits the "len"-byte string "str" (which
+ * may contain NUL characters) into "jtr" and records an error there rather
+ * than in an emitter.  Don't change it to match the emitter.
+ */
+static void
+jt_ref_utf8string(const char *str, size_t len, jt_result_t *jtr)
+{
+	unsigned utf8_more_bytes = 0;
+	const char *cp;
+
+	jtr->jtr_outlen = 0;
+	jtr->jtr_error = JSE_NONE;
+	jt_ref_emitc(jtr, '"');
+
+	for (cp = str; cp < str + len; cp++) {
+		char c = *cp;
+		unsigned char code = c;
+
+		if (utf8_more_bytes > 0) {
+			/*
+			 * We need to collect one or more additional
+			 * bytes to complete this UTF-8 multibyte character.
+			 *
+			 * Every continuation byte matches the bit pattern:
+			 * 	10xxxxxx
+			 */
+			if ((code & 0xC0) != 0x80) {
+				/*
+				 * This is not a valid continuation byte.
+				 */
+				jtr->jtr_error = JSE_INVAL;
+				return;
+			}
+
+			jt_ref_emitc(jtr, c);
+			utf8_more_bytes--;
+			continue;
+		}
+
+		switch (c) {
+		/*
+		 * Control characters with C-style escape sequences.  After we
+		 * emit each of these, we're done with this character.
+		 */
+		case '\b':
+			jt_ref_emitc(jtr, '\\');
+			jt_ref_emitc(jtr, 'b');
+			continue;
+		case '\f':
+			jt_ref_emitc(jtr, '\\');
+			jt_ref_emitc(jtr, 'f');
+			continue;
+		case '\n':
+			jt_ref_emitc(jtr, '\\');
+			jt_ref_emitc(jtr, 'n');
+			continue;
+		case '\r':
+			jt_ref_emitc(jtr, '\\');
+			jt_ref_emitc(jtr, 'r');
+			continue;
+		case '\t':
+			jt_ref_emitc(jtr, '\\');
+			jt_ref_emitc(jtr, 't');
+			continue;
+
+		/*
+		 * The string delimiter itself (quotation mark) and the escape
+		 * sequence initiator (reverse solidus) must be escaped before
+		 * printing them as normal characters below.
+		 */
+		case '"':
+		case '\\':
+			jt_ref_emitc(jtr, '\\');
+			break;
+		}
+
+		if (code <= 0x1F) {
+			/*
+			 * This is a control character that was not handled
+			 * above.  Use the four hex digit escape sequence.
+			 */
+			char numbuf[5];
+
+			(void) snprintf(numbuf, sizeof (numbuf), "%04x",
+			    (unsigned)code);
+
+			jt_ref_emitc(jtr, '\\');
+			jt_ref_emitc(jtr, 'u');
+			jt_ref_emitc(jtr, numbuf[0]);
+			jt_ref_emitc(jtr, numbuf[1]);
+			jt_ref_emitc(jtr, numbuf[2]);
+			jt_ref_emitc(jtr, numbuf[3]);
+			continue;
+		}
+
+		if (code <= 0x7F) {
+			/*
+			 * This is a regular ASCII character and may be copied
+			 * directly into the output string.
+			 */
+			jt_ref_emitc(jtr, c);
+			continue;
+		}
+
+		/*
+		 * Check for a UTF-8 multibyte character.
+		 *
+		 * 	2-byte		110xxxxx  (0xC0)
+		 * 	3-byte		1110xxxx  (0xE0)
+		 * 	4-byte		11110xxx  (0xF0)
+		 */
+		if ((code & 0xE0) == 0xC0) {
+			utf8_more_bytes = 1;
+		} else if ((code & 0xF0) == 0xE0) {
+			utf8_more_bytes = 2;
+		} else if ((code & 0xF8) == 0xF0) {
+			utf8_more_bytes = 3;
+		} else {
+			/*
+			 * This is not a valid UTF-8 character.
+			 */
+			jtr->jtr_error = JSE_INVAL;
+			return;
+		}
+
+		/*
+		 * For a valid UTF-8 multibyte character, we must copy all
+		 * related bytes into the output string together.  Copy the
+		 * first now; subsequent bytes will be checked and copied
+		 * because we set "utf8_more_bytes" above.
+		 */
+		jt_ref_emitc(jtr, c);
+	}
+
+	if (utf8_more_bytes != 0) {
+		/*
+		 * The string ended in the middle of a character.
+		 */
+		jtr->jtr_error = JSE_INVAL;
+		return;
+	}
+
+	jt_ref_emitc(jtr, '"');
+}
+
+/*
+ * Runs everything that depends on json_scan_plain() on the "len"-byte string
+ * "str" with the current implementation.
+ */
+static void
+jt_scan_run(const char *str, size_t len, jt_result_t *jtr)
+{
+	json_emit_t *jse;
+	char errmsg[128];
+	size_t i;
+
+	(void) memset(jtr, 0, sizeof (*jtr));
+	for (i = 0; i < len; i++) {
+		jtr->jtr_scan[i] = json_scan_plain(str + i, len - i);
+	}
+
+	jtr->jtr_validlen = json_utf8_validlen(str, len);
+
+	if (ftruncate(jt_outfd, 0) != 0 || lseek(jt_outfd, 0, SEEK_SET) == -1) {
+		err(EXIT_FAILURE, "truncate output file");
+	}
+
+	if ((jse = json_create_fd(jt_outfd, JT_BUFSZ)) == NULL) {
+		err(EXIT_FAILURE, "json_create_fd");
+	}
+
+	json_utf8string_len(jse, NULL, str, len);
+	json_flush(jse);
+	jtr->jtr_error = json_get_error(jse, errmsg, sizeof (errmsg));
+	json_fini(jse);
+	jt_collect(jtr);
+}
+
+static int
+jt_scan_compare(const char *impl, const char *str, size_t len,
+    const jt_result_t *expected, const jt_result_t *actual)
+{
+	const char *what = NULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (expected->jtr_scan[i] != actual->jtr_scan[i]) {
+			(void) fprintf(stderr, "json-test: scan: %s: from "
+			    "offset %zu, scanned %zu bytes (expected %zu)\n",
+			    impl, i, actual->jtr_scan[i],
+			    expected->jtr_scan[i]);
+			jt_hexdump("input", str, len);
+			return (-1);
+		}
+	}
+
+	if (expected->jtr_validlen != actual->jtr_validlen) {
+		(void) fprintf(stderr, "json-test: scan: %s: "
+		    "json_utf8_validlen() returned %zu (expected %zu)\n",
+		    impl, actual->jtr_validlen, expected->jtr_validlen);
+		jt_hexdump("input", str, len);
+		return (-1);
+	}
+
+	if (expected->jtr_outlen != actual->jtr_outlen ||
+	    memcmp(expected->jtr_out, actual->jtr_out,
+	    expected->jtr_outlen) != 0) {
+		what = "emitted output";
+	} else if (expected->jtr_error != actual->jtr_error) {
+		what = "error state";
+	}
+
+	if (what == NULL) {
+		return (0);
+	}
+
+	(void) fprintf(stderr, "json-test: scan: %s: %s differs from the "
+	    "reference encoder (error %d; expected error %d)\n", impl, what,
+	    (int)actual->jtr_error, (int)expected->jtr_error);
+	jt_hexdump("input", str, len);
+	jt_hexdump("output", actual->jtr_out, actual->jtr_outlen);
+	jt_hexdump("expected output", expected->jtr_out,
+	    expected->jtr_outlen);
+	return (-1);
+}
+
+/*
+ * Checks one string with each implementation.  The string is copied into its
+ * own allocation of exactly its length, so that tools like ASan can catch
+ * reads past the end.  The expected scan results come from the portable
+ * implementation, and the expected output and error state from the reference
+ * encoder.
+ */
+static int
+jt_scan_check(const char *const *impls, size_t nimpls, const char *input,
+    size_t len)
+{
+	static jt_result_t expected, actual;
+	char *str;
+	size_t i;
+	int rv = 0;
+
+	if ((str = malloc(len > 0 ? len : 1)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	(void) memcpy(str, input, len);
+	(void) json_scan_use("portable");
+	jt_scan_run(str, len, &expected);
+	jt_ref_utf8string(str, len, &expected);
+	for (i = 0; i < nimpls && rv == 0; i++) {
+		(void) json_scan_use(impls[i]);
+		jt_scan_run(str, len, &actual);
+		rv = jt_scan_compare(impls[i], str, len, &expected, &actual);
+	}
+
+	free(str);
+	return (rv);
+}
+
+static int
+jt_test_scan(void)
+{
+	static const char *const candidates[] = { "portable", "sse2", "avx2" };
+	const char *impls[sizeof (candidates) / sizeof (candidates[0])];
+	char buf[JT_MAXLEN];
+	size_t nimpls, i, len, pos;
+	unsigned long nstrings;
+	jt_kind_t kind;
+	FILE *outfp;
+	int n;
+
+	if ((outfp = tmpfile()) == NULL) {
+		err(EXIT_FAILURE, "tmpfile");
+	}
+
+	jt_outfd = fileno(outfp);
+	nimpls = 0;
+	for (i = 0; i < sizeof (candidates) / sizeof (candidates[0]); i++) {
+		if (json_scan_use(candidates[i]) == 0) {
+			impls[nimpls++] = candidates[i];
+		} else {
+			(void) printf("json-test: scan: %s not supported "
+			    "here, skipped\n", candidates[i]);
+		}
+	}
+
+	nstrings = 0;
+
+	/*
+	 * Put each special (and nearly special) byte at each position of
+	 * strings of each length up to a few vectors.
+	 */
+	for (len = 1; len <= 100; len++) {
+		for (pos = 0; pos < len; pos++) {
+			for (i = 0; i < sizeof (jt_special) +
+			    sizeof (jt_plain); i++) {
+				(void) memset(buf, 'a', len);
+				buf[pos] = (char)(i < sizeof (jt_special) ?
+				    jt_special[i] :
+				    jt_plain[i - sizeof (jt_special)]);
+				if (jt_scan_check(impls, nimpls, buf,
+				    len) != 0) {
+					(void) fclose(outfp);
+					return (-1);
+				}
+
+				nstrings++;
+			}
+		}
+	}
+
+	for (kind = 0; kind < JT_NKINDS; kind++) {
+		for (n = 0; n < JT_NSTRINGS; n++) {
+			len = jt_gen(kind, buf);
+			if (jt_scan_check(impls, nimpls, buf, len) != 0) {
+				(void) fprintf(stderr, "json-test: scan: "
+				    "(generated %s string %d)\n",
+				    jt_kind_names[kind], n);
+				(void) fclose(outfp);
+				return (-1);
+			}
+
+			nstrings++;
+		}
+	}
+
+	(void) printf("json-test: scan: %lu strings,", nstrings);
+	for (i = 0; i < nimpls; i++) {
+		(void) printf(" %s", impls[i]);
+	}
+
+	(void) printf(" matched the reference encoder\n");
+	(void) fclose(outfp);
+	return (0);
+}
+
+/*
+ * number test.  See the comment at the top of this file.
+ */
+
+static uint64_t jt_nnumbers;
+
+/*
+ * Formats "value" into its own allocation of exactly JSON_NUMBUF_MAX bytes (so
+ * that tools like ASan can catch writes past the end) and copies the result,
+ * NUL-terminated, into "out".
+ */
+static size_t
+jt_number_format(size_t (*fmt)(char *, uint64_t), uint64_t value, char *out)
+{
+	char *buf;
+	size_t len;
+
+	if ((buf = malloc(JSON_NUMBUF_MAX)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	len = fmt(buf, value);
+	if (len == 0 || len >= JSON_NUMBUF_MAX) {
+		errx(EXIT_FAILURE, "number: formatted %zu bytes", len);
+	}
+
+	(void) memcpy(out, buf, len);
+	out[len] = '\0';
+	free(buf);
+	jt_nnumbers++;
+	return (len);
+}
+
+/*
+ * Adapters so that each formatter can be called through jt_number_format().
+ */
+static size_t
+jt_fmt_uint64(char *buf, uint64_t value)
+{
+	return (json_format_uint64(buf, value));
+}
+
+static size_t
+jt_fmt_int64(char *buf, uint64_t value)
+{
+	return (json_format_int64(buf, (int64_t)value));
+}
+
+static size_t
+jt_fmt_double(char *buf, uint64_t bits)
+{
+	double value;
+
+	(void) memcpy(&value, &bits, sizeof (value));
+	return (json_format_double(buf, value));
+}
+
+static int
+jt_number_uint64(uint64_t value)
+{
+	char out[JSON_NUMBUF_MAX], expected[JSON_NUMBUF_MAX];
+	char *endp;
+
+	(void) jt_number_format(jt_fmt_uint64, value, out);
+	(void) snprintf(expected, sizeof (expected), "%" PRIu64, value);
+	if (strcmp(out, expected) != 0 ||
+	    strtoull(out, &endp, 10) != value || *endp != '\0') {
+		(void) fprintf(stderr, "json-test: number: uint64 %s "
+		    "formatted as \"%s\"\n", expected, out);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+jt_number_int64(int64_t value)
+{
+	char out[JSON_NUMBUF_MAX], expected[JSON_NUMBUF_MAX];
+	char *endp;
+
+	(void) jt_number_format(jt_fmt_int64, (uint64_t)value, out);
+	(void) snprintf(expected, sizeof (expected), "%" PRId64, value);
+	if (strcmp(out, expected) != 0 ||
+	    strtoll(out, &endp, 10) != value || *endp != '\0') {
+		(void) fprintf(stderr, "json-test: number: int64 %s "
+		    "formatted as \"%s\"\n", expected, out);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns whether "str" is a number according to the JSON grammar.
+ */
+static int
+jt_number_valid(const char *str)
+{
+	const char *p = str;
+
+	if (*p == '-') {
+		p++;
+	}
+
+	if (*p == '0') {
+		p++;
+	} else if (*p >= '1' && *p <= '9') {
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+	} else {
+		return (0);
+	}
+
+	if (*p == '.') {
+		if (*++p < '0' || *p > '9') {
+			return (0);
+		}
+
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		if (*++p == '+' || *p == '-') {
+			p++;
+		}
+
+		if (*p < '0' || *p > '9') {
+			return (0);
+		}
+
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+
+	return (*p == '\0');
+}
+
+static int
+jt_number_double(double value)
+{
+	char out[JSON_NUMBUF_MAX];
+	char *endp;
+	uint64_t bits, rbits;
+	double rvalue;
+	int exponent;
+
+	if (!isfinite(value)) {
+		return (0);
+	}
+
+	(void) memcpy(&bits, &value, sizeof (bits));
+	(void) jt_number_format(jt_fmt_double, bits, out);
+	rvalue = strtod(out, &endp);
+	(void) memcpy(&rbits, &rvalue, sizeof (rbits));
+	if (!jt_number_valid(out) || *endp != '\0' || rbits != bits) {
+		(void) fprintf(stderr, "json-test: number: double %.17g "
+		    "(0x%016" PRIx64 ") formatted as \"%s\", which reads "
+		    "back as 0x%016" PRIx64 "\n", value, bits, out, rbits);
+		return (-1);
+	}
+
+	/* Like JavaScript, exponents are used only outside [1e-6, 1e21). */
+	exponent = fabs(value) != 0 &&
+	    (fabs(value) < 1e-6 || fabs(value) >= 1e21);
+	if ((strchr(out, 'e') != NULL) != exponent) {
+		(void) fprintf(stderr, "json-test: number: double %.17g "
+		    "formatted as \"%s\"\n", value, out);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Checks "value" and its neighbors as each kind of number.
+ */
+static int
+jt_number_all(uint64_t value)
+{
+	uint64_t v;
+	double d;
+	int i;
+
+	for (i = -1; i <= 1; i++) {
+		v = value + (uint64_t)i;
+		d = (double)v;
+		if (jt_number_uint64(v) != 0 ||
+		    jt_number_int64((int64_t)v) != 0 ||
+		    jt_number_int64((int64_t)(0 - v)) != 0 ||
+		    jt_number_double(d) != 0 ||
+		    jt_number_double(-d) != 0) {
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+static int
+jt_test_number(void)
+{
+	static const double special[] = {
+		0.0, 1.0, 0.1, 0.5, 1.5, 123.456, 0.30000000000000004,
+		1e-7, 1e-6, 1e20, 1e21, 1e22, 1e23, DBL_EPSILON,
+		9007199254740991.0, 9007199254740993.0,
+		5e-324, 2.2250738585072009e-308, DBL_MIN, DBL_MAX
+	};
+	char str[16];
+	uint64_t p, bits;
+	double d, scale;
+	size_t i;
+	int n, e;
+
+	/* Powers of 2 and 10, and their neighbors. */
+	for (i = 0; i < 64; i++) {
+		if (jt_number_all(1ULL << i) != 0) {
+			return (-1);
+		}
+	}
+
+	for (p = 1, i = 0; i < 20; i++, p *= 10) {
+		if (jt_number_all(p) != 0) {
+			return (-1);
+		}
+	}
+
+	if (jt_number_all(0) != 0 || jt_number_all(UINT64_MAX) != 0 ||
+	    jt_number_int64(INT64_MIN) != 0 ||
+	    jt_number_int64(INT64_MAX) != 0) {
+		return (-1);
+	}
+
+	for (i = 0; i < sizeof (special) / sizeof (special[0]); i++) {
+		if (jt_number_double(special[i]) != 0 ||
+		    jt_number_double(-special[i]) != 0 ||
+		    jt_number_double(nextafter(special[i], 0)) != 0 ||
+		    jt_number_double(nextafter(special[i], DBL_MAX)) != 0) {
+			return (-1);
+		}
+	}
+
+	for (e = -1074; e <= 1023; e++) {
+		if (jt_number_double(ldexp(1.0, e)) != 0) {
+			return (-1);
+		}
+	}
+
+	for (e = -323; e <= 308; e++) {
+		(void) snprintf(str, sizeof (str), "1e%d", e);
+		d = strtod(str, NULL);
+		if (jt_number_double(d) != 0 ||
+		    jt_number_double(nextafter(d, 0)) != 0 ||
+		    jt_number_double(nextafter(d, DBL_MAX)) != 0) {
+			return (-1);
+		}
+	}
+
+	/*
+	 * Random values.  Integers have a random number of significant bits,
+	 * so that every length is covered.
+	 */
+	for (n = 0; n < JT_NNUMBERS; n++) {
+		p = jt_rand() >> jt_rand_below(64);
+		if (jt_number_uint64(p) != 0 ||
+		    jt_number_int64((int64_t)jt_rand() >>
+		    jt_rand_below(64)) != 0 ||
+		    jt_number_double((double)p) != 0) {
+			return (-1);
+		}
+
+		bits = jt_rand();
+		(void) memcpy(&d, &bits, sizeof (d));
+		if (jt_number_double(d) != 0) {
+			return (-1);
+		}
+
+		/* Subnormals. */
+		bits &= (1ULL << 63) | ((1ULL << 52) - 1);
+		(void) memcpy(&d, &bits, sizeof (d));
+		if (jt_number_double(d) != 0) {
+			return (-1);
+		}
+
+		/* Decimal fractions, like 12.34 or 0.000567. */
+		scale = pow(10.0, (double)jt_rand_below(12));
+		d = (double)jt_rand_below(1000000) / scale;
+		if (jt_number_double(d) != 0) {
+			return (-1);
+		}
+	}
+
+	(void) printf("json-test: number: %" PRIu64 " numbers round-tripped\n",
+	    jt_nnumbers);
+	return (0);
+}
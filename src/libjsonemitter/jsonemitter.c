@@ -15,19 +15,25 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <math.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "jsonemitter.h"
+#include "jsonemitter_impl.h"
 
 /*
  * JSON_MAX_DEPTH is the maximum supported level of nesting of JSON objects.
  */
 #define	JSON_MAX_DEPTH	255
 
+/*
+ * JSON_MIN_BUFSZ is the smallest output buffer that may be used with a
+ * buffered emitter.
+ */
+#define	JSON_MIN_BUFSZ	512
+
 typedef enum {
 	JSON_NONE,	/* no object is nested at the current depth */
 	JSON_OBJECT,	/* an object is nested at the current depth */
@@ -35,6 +41,13 @@ typedef enum {
 } json_depthdesc_t;
 
 /*
+ * An emitter writes either to a stdio stream ("json_stream") or, for emitters
+ * created with json_create_fd() or json_create_cb(), into a buffer owned by
+ * the emitter ("json_buf") that is written out whenever it fills up, either to
+ * the file descriptor "json_fd" with write(2) or by calling the caller's
+ * function "json_writecb".  The buffered form avoids taking stdio locks (and
+ * making a library call) for every character emitted.
+ *
  * A note on depth management: We allow JSON documents to be nested up to
  * JSON_MAX_DEPTH.  In order to validate output as we emit it, we maintain a
  * stack indicating which type of object is nested at each level of depth
@@ -46,8 +59,18 @@ typedef enum {
 struct json_emit {
 	FILE			*json_stream;		/* output stream */
 
+	/* Buffered output (json_create_fd() only). */
+	int			json_fd;		/* output fd */
+	json_write_f		*json_writecb;		/* output function */
+	void			*json_writearg;		/* json_writecb arg */
+	char			*json_buf;		/* output buffer */
+	size_t			json_bufsz;		/* size of json_buf */
+	size_t			json_bufused;		/* bytes in json_buf */
+	int			json_external;		/* caller's memory */
+
 	/* Error conditions. */
 	int			json_error_stdio;	/* last stdio error */
+	int			json_error_write;	/* last write error */
 	int			json_depth_exceeded;	/* max depth exceeded */
 	unsigned int		json_stdio_nskipped;	/* skip due to error */
 	unsigned int		json_nbadfloats;	/* bad FP values */
@@ -64,19 +87,18 @@ struct json_emit {
  */
 #define	VERIFY(x) ((void)((x) || json_assert_fail(#x, __FILE__, __LINE__)))
 
-/*
- * Macros used to apply function attributes.
- */
-#define	JSON_PRINTFLIKE2 __attribute__((__format__(__printf__, 2, 3)))
-
 static char json_panicstr[256];
 static int json_assert_fail(const char *, const char *, int);
 
 static int json_has_error(json_emit_t *);
 
-JSON_PRINTFLIKE2 static void json_emit(json_emit_t *, const char *, ...);
-static void json_vemit(json_emit_t *, const char *, va_list);
+static void json_emitc(json_emit_t *, char);
+static void json_emitn(json_emit_t *, const char *, size_t);
+static void json_emits(json_emit_t *, const char *);
+static json_emit_t *json_create_buffered(size_t);
+static void json_buf_flush(json_emit_t *);
 static void json_emit_utf8string(json_emit_t *, const char *);
+static void json_emit_utf8(json_emit_t *, const char *, size_t);
 static void json_emit_prepare(json_emit_t *, const char *);
 
 static json_depthdesc_t json_nest_kind(json_emit_t *);
@@ -99,37 +121,162 @@ json_create_stdio(FILE *outstream)
 	}
 
 	jse->json_stream = outstream;
+	jse->json_fd = -1;
+	return (jse);
+}
+
+json_emit_t *
+json_create_fd(int fd, size_t bufsz)
+{
+	json_emit_t *jse;
+
+	if (fd < 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	jse = json_create_buffered(bufsz);
+	if (jse != NULL) {
+		jse->json_fd = fd;
+	}
+
+	return (jse);
+}
+
+json_emit_t *
+json_create_cb(json_write_f *writecb, void *arg, size_t bufsz)
+{
+	json_emit_t *jse;
+
+	if (writecb == NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	jse = json_create_buffered(bufsz);
+	if (jse != NULL) {
+		jse->json_writecb = writecb;
+		jse->json_writearg = arg;
+	}
+
+	return (jse);
+}
+
+json_emit_t *
+json_create_cb_mem(json_write_f *writecb, void *arg, void *mem, size_t memsz)
+{
+	json_emit_t *jse;
+
+	if (writecb == NULL || mem == NULL ||
+	    memsz < json_mem_size(JSON_MIN_BUFSZ)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	jse = mem;
+	(void) memset(jse, 0, sizeof (*jse));
+	jse->json_buf = (char *)mem + sizeof (*jse);
+	jse->json_bufsz = memsz - sizeof (*jse);
+	jse->json_fd = -1;
+	jse->json_external = 1;
+	jse->json_writecb = writecb;
+	jse->json_writearg = arg;
+	return (jse);
+}
+
+size_t
+json_mem_size(size_t bufsz)
+{
+	return (sizeof (json_emit_t) + bufsz);
+}
+
+static json_emit_t *
+json_create_buffered(size_t bufsz)
+{
+	json_emit_t *jse;
+
+	if (bufsz < JSON_MIN_BUFSZ) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	jse = calloc(1, sizeof (*jse));
+	if (jse == NULL) {
+		return (NULL);
+	}
+
+	jse->json_buf = malloc(bufsz);
+	if (jse->json_buf == NULL) {
+		free(jse);
+		return (NULL);
+	}
+
+	jse->json_fd = -1;
+	jse->json_bufsz = bufsz;
 	return (jse);
 }
 
+void
+json_flush(json_emit_t *jse)
+{
+	if (jse->json_buf != NULL) {
+		json_buf_flush(jse);
+	}
+}
+
+size_t
+json_nbuffered(json_emit_t *jse)
+{
+	return (jse->json_bufused);
+}
+
 void
 json_fini(json_emit_t *jse)
 {
-	free(jse);
+	if (jse->json_buf != NULL) {
+		json_buf_flush(jse);
+	}
+
+	if (!jse->json_external) {
+		free(jse->json_buf);
+		free(jse);
+	}
 }
 
+/*
+ * If "bufsz" is 0, this doesn't call any stdio functions, so it can be used
+ * where those aren't safe.
+ */
 json_error_t
 json_get_error(json_emit_t *jse, char *buf, size_t bufsz)
 {
 	json_error_t kind;
+	const char *prefix = "";
+	const char *msg = NULL;
+	int err = errno;
 
 	if (jse->json_error_stdio != 0) {
 		kind = JSE_STDIO;
-		(void) snprintf(buf, bufsz, "%s", strerror(errno));
+	} else if (jse->json_error_write != 0) {
+		kind = JSE_IO;
+		prefix = "write: ";
+		err = jse->json_error_write;
 	} else if (jse->json_depth_exceeded != 0) {
 		kind = JSE_TOODEEP;
-		(void) snprintf(buf, bufsz, "exceeded maximum supported depth");
+		msg = "exceeded maximum supported depth";
 	} else if (jse->json_nbadfloats) {
 		kind = JSE_INVAL;
-		(void) snprintf(buf, bufsz, "unsupported floating point value");
+		msg = "unsupported floating point value";
 	} else if (jse->json_error_utf8 != 0) {
 		kind = JSE_INVAL;
-		(void) snprintf(buf, bufsz, "%s", strerror(errno));
 	} else {
 		kind = JSE_NONE;
-		if (bufsz > 0) {
-			buf[0] = '\0';
-		}
+		msg = "";
+	}
+
+	if (bufsz > 0) {
+		(void) snprintf(buf, bufsz, "%s%s", prefix,
+		    msg != NULL ? msg : strerror(err));
 	}
 
 	return (kind);
@@ -156,50 +303,137 @@ json_assert_fail(const char *cond, const char *file, int line)
 static int
 json_has_error(json_emit_t *jse)
 {
-	return (jse->json_error_stdio != 0 || jse->json_depth_exceeded != 0 ||
-	    jse->json_error_utf8 != 0);
+	return (jse->json_error_stdio != 0 || jse->json_error_write != 0 ||
+	    jse->json_depth_exceeded != 0 || jse->json_error_utf8 != 0);
 }
 
 static void
-json_emit(json_emit_t *jse, const char *fmt, ...)
+json_emitc(json_emit_t *jse, char c)
 {
-	va_list args;
+	int rv;
 
-	va_start(args, fmt);
-	json_vemit(jse, fmt, args);
-	va_end(args);
+	if (json_has_error(jse)) {
+		jse->json_stdio_nskipped++;
+		return;
+	}
+
+	if (jse->json_buf != NULL) {
+		if (jse->json_bufused == jse->json_bufsz) {
+			json_buf_flush(jse);
+			if (json_has_error(jse)) {
+				return;
+			}
+		}
+
+		jse->json_buf[jse->json_bufused++] = c;
+		return;
+	}
+
+	rv = fputc(c, jse->json_stream);
+	if (rv == EOF) {
+		jse->json_error_stdio = errno;
+	}
 }
 
+/*
+ * Emits "len" bytes starting at "str" verbatim.
+ */
 static void
-json_vemit(json_emit_t *jse, const char *fmt, va_list args)
+json_emitn(json_emit_t *jse, const char *str, size_t len)
 {
-	int rv;
+	size_t n;
 
 	if (json_has_error(jse)) {
 		jse->json_stdio_nskipped++;
 		return;
 	}
 
-	rv = vfprintf(jse->json_stream, fmt, args);
-	if (rv < 0) {
-		jse->json_error_stdio = errno;
+	if (jse->json_buf == NULL) {
+		if (fwrite(str, 1, len, jse->json_stream) != len) {
+			jse->json_error_stdio = errno;
+		}
+		return;
+	}
+
+	while (len > 0) {
+		if (jse->json_bufused == jse->json_bufsz) {
+			json_buf_flush(jse);
+			if (json_has_error(jse)) {
+				return;
+			}
+		}
+
+		n = jse->json_bufsz - jse->json_bufused;
+		if (n > len) {
+			n = len;
+		}
+
+		(void) memcpy(jse->json_buf + jse->json_bufused, str, n);
+		jse->json_bufused += n;
+		str += n;
+		len -= n;
 	}
 }
 
 static void
-json_emitc(json_emit_t *jse, char c)
+json_emits(json_emit_t *jse, const char *str)
 {
-	int rv;
+	json_emitn(jse, str, strlen(str));
+}
 
-	if (json_has_error(jse)) {
-		jse->json_stdio_nskipped++;
+/*
+ * Writes out the contents of the output buffer of a buffered emitter.  If this
+ * fails, the error is recorded and the rest of the buffered output is
+ * discarded, since nothing more will be emitted anyway.
+ */
+static void
+json_buf_flush(json_emit_t *jse)
+{
+	size_t nbytes = jse->json_bufused;
+	const char *p;
+	ssize_t rv;
+	int err;
+
+	JSON_PROBE1(flush_start, nbytes);
+	if (jse->json_writecb != NULL) {
+		if (jse->json_bufused > 0 && jse->json_error_write == 0) {
+			err = jse->json_writecb(jse->json_writearg,
+			    jse->json_buf, jse->json_bufused);
+			if (err != 0) {
+				jse->json_error_write = err;
+			}
+		}
+
+		jse->json_bufused = 0;
+		JSON_PROBE2(flush_done, nbytes, jse->json_error_write);
 		return;
 	}
 
-	rv = fputc(c, jse->json_stream);
-	if (rv == EOF) {
-		jse->json_error_stdio = errno;
+	p = jse->json_buf;
+	while (jse->json_bufused > 0 && jse->json_error_write == 0) {
+		rv = write(jse->json_fd, p, jse->json_bufused);
+		if (rv < 0) {
+			if (errno != EINTR) {
+				jse->json_error_write = errno;
+			}
+			continue;
+		}
+
+		if (rv == 0) {
+			/*
+			 * This shouldn't happen for a non-zero count, but if it
+			 * does, retrying would never make progress.
+			 */
+			jse->json_error_write = EIO;
+			continue;
+		}
+
+		p += rv;
+		jse->json_bufused -= rv;
 	}
+
+	jse->json_bufused = 0;
+	JSON_PROBE2(flush_done, nbytes, jse->json_error_write);
 }
 
 /*
@@ -209,71 +443,68 @@ json_emitc(json_emit_t *jse, char c)
 static void
 json_emit_utf8string(json_emit_t *jse, const char *utf8str)
 {
-	unsigned utf8_more_bytes = 0;
-	const char *cp;
+	json_emit_utf8(jse, utf8str, strlen(utf8str));
+}
 
-	json_emitc(jse, '"');
+/*
+ * Emits the "len"-byte UTF-8 string "utf8str".  Runs of characters that need no
+ * special handling are found by json_scan_plain() and copied to the output in
+ * bulk.  Everything else is handled here one character at a time.
+ */
+static void
+json_emit_utf8(json_emit_t *jse, const char *utf8str, size_t len)
+{
+	unsigned utf8_more_bytes;
+	unsigned char code;
+	size_t i, n;
+	char c;
 
-	for (cp = utf8str; *cp != '\0'; cp++) {
-		char c = *cp;
-		unsigned char code = c;
+	json_emitc(jse, '"');
 
-		if (utf8_more_bytes > 0) {
-			/*
-			 * We need to collect one or more additional
-			 * bytes to complete this UTF-8 multibyte character.
-			 *
-			 * Every continuation byte matches the bit pattern:
-			 * 	10xxxxxx
-			 */
-			if ((code & 0xC0) != 0x80) {
-				/*
-				 * This is not a valid continuation byte.
-				 */
-				jse->json_error_utf8 = EILSEQ;
-				return;
+	i = 0;
+	while (i < len) {
+		n = json_scan_plain(utf8str + i, len - i);
+		if (n > 0) {
+			json_emitn(jse, utf8str + i, n);
+			i += n;
+			if (i == len) {
+				break;
 			}
-
-			json_emitc(jse, c);
-			utf8_more_bytes--;
-			continue;
 		}
 
+		c = utf8str[i++];
+		code = c;
+
 		switch (c) {
 		/*
 		 * Control characters with C-style escape sequences.  After we
 		 * emit each of these, we're done with this character.
 		 */
 		case '\b':
-			json_emitc(jse, '\\');
-			json_emitc(jse, 'b');
+			json_emitn(jse, "\\b", 2);
 			continue;
 		case '\f':
-			json_emitc(jse, '\\');
-			json_emitc(jse, 'f');
+			json_emitn(jse, "\\f", 2);
 			continue;
 		case '\n':
-			json_emitc(jse, '\\');
-			json_emitc(jse, 'n');
+			json_emitn(jse, "\\n", 2);
 			continue;
 		case '\r':
-			json_emitc(jse, '\\');
-			json_emitc(jse, 'r');
+			json_emitn(jse, "\\r", 2);
 			continue;
 		case '\t':
-			json_emitc(jse, '\\');
-			json_emitc(jse, 't');
+			json_emitn(jse, "\\t", 2);
 			continue;
 
 		/*
 		 * The string delimiter itself (quotation mark) and the escape
-		 * sequence initiator (reverse solidus) must be escaped before
-		 * printing them as normal characters below.
+		 * sequence initiator (reverse solidus) must be escaped.
 		 */
 		case '"':
 		case '\\':
 			json_emitc(jse, '\\');
-			break;
+			json_emitc(jse, c);
+			continue;
 		}
 
 		if (code <= 0x1F) {
@@ -281,31 +512,19 @@ json_emit_utf8string(json_emit_t *jse, const char *utf8str)
 			 * This is a control character that was not handled
 			 * above.  Use the four hex digit escape sequence.
 			 */
-			char numbuf[5];
-
-			(void) snprintf(numbuf, sizeof (numbuf), "%04x",
-			    (unsigned)code);
+			static const char hex[] = "0123456789abcdef";
+			char numbuf[6] = { '\\', 'u', '0', '0' };
 
-			json_emitc(jse, '\\');
-			json_emitc(jse, 'u');
-			json_emitc(jse, numbuf[0]);
-			json_emitc(jse, numbuf[1]);
-			json_emitc(jse, numbuf[2]);
-			json_emitc(jse, numbuf[3]);
-			continue;
-		}
-
-		if (code <= 0x7F) {
-			/*
-			 * This is a regular ASCII character and may be copied
-			 * directly into the output string.
-			 */
-			json_emitc(jse, c);
+			numbuf[4] = hex[code >> 4];
+			numbuf[5] = hex[code & 0xf];
+			json_emitn(jse, numbuf, 6);
 			continue;
 		}
 
 		/*
-		 * Check for a UTF-8 multibyte character.
+		 * json_scan_plain() stops only at the characters handled above
+		 * and at bytes with the high bit set.  Check for a UTF-8
+		 * multibyte character.
 		 *
 		 * 	2-byte		110xxxxx  (0xC0)
 		 * 	3-byte		1110xxxx  (0xE0)
@@ -327,19 +546,34 @@ json_emit_utf8string(json_emit_t *jse, const char *utf8str)
 
 		/*
 		 * For a valid UTF-8 multibyte character, we must copy all
-		 * related bytes into the output string together.  Copy the
-		 * first now; subsequent bytes will be checked and copied
-		 * because we set "utf8_more_bytes" above.
+		 * related bytes into the output string together.  Every
+		 * continuation byte matches the bit pattern:
+		 *
+		 * 	10xxxxxx
 		 */
 		json_emitc(jse, c);
-	}
+		for (; utf8_more_bytes > 0; utf8_more_bytes--) {
+			if (i == len) {
+				/*
+				 * The string ended in the middle of a
+				 * character.
+				 */
+				jse->json_error_utf8 = EILSEQ;
+				return;
+			}
 
-	if (utf8_more_bytes != 0) {
-		/*
-		 * The string ended in the middle of a character.
-		 */
-		jse->json_error_utf8 = EILSEQ;
-		return;
+			c = utf8str[i++];
+			code = c;
+			if ((code & 0xC0) != 0x80) {
+				/*
+				 * This is not a valid continuation byte.
+				 */
+				jse->json_error_utf8 = EILSEQ;
+				return;
+			}
+
+			json_emitc(jse, c);
+		}
 	}
 
 	json_emitc(jse, '"');
@@ -353,18 +587,24 @@ json_emit_utf8string(json_emit_t *jse, const char *utf8str)
  * the argument is consistent with our state, and then we emit the label if we
  * need to.
  *
- * It is illegal to call this function if we've experienced any stdio errors
- * already.
+ * Once we've experienced an error, we stop tracking nesting (see
+ * json_nest_begin()), so there's nothing to verify and nothing more will be
+ * emitted.  With a buffered emitter, errors can happen in the middle of an
+ * object, and callers may reasonably finish the object before checking.
  */
 static void
 json_emit_prepare(json_emit_t *jse, const char *label)
 {
 	json_depthdesc_t kind;
 
+	if (json_has_error(jse)) {
+		return;
+	}
+
 	kind = json_nest_kind(jse);
 	if ((kind == JSON_OBJECT || kind == JSON_ARRAY) &&
 	    jse->json_nemitted[jse->json_depth] > 0) {
-		json_emit(jse, ",");
+		json_emitc(jse, ',');
 	}
 
 	if (label == NULL) {
@@ -374,7 +614,7 @@ json_emit_prepare(json_emit_t *jse, const char *label)
 
 	VERIFY(kind == JSON_OBJECT);
 	json_emit_utf8string(jse, label);
-	json_emit(jse, ":");
+	json_emitc(jse, ':');
 }
 
 static void
@@ -434,7 +674,7 @@ void
 json_object_begin(json_emit_t *jse, const char *label)
 {
 	json_emit_prepare(jse, label);
-	json_emit(jse, "{");
+	json_emitc(jse, '{');
 	json_nest_begin(jse, JSON_OBJECT);
 }
 
@@ -442,7 +682,7 @@ void
 json_object_end(json_emit_t *jse)
 {
 	json_nest_end(jse, JSON_OBJECT);
-	json_emit(jse, "}");
+	json_emitc(jse, '}');
 	json_emit_finish(jse);
 }
 
@@ -450,7 +690,7 @@ void
 json_array_begin(json_emit_t *jse, const char *label)
 {
 	json_emit_prepare(jse, label);
-	json_emit(jse, "[");
+	json_emitc(jse, '[');
 	json_nest_begin(jse, JSON_ARRAY);
 }
 
@@ -458,7 +698,7 @@ void
 json_array_end(json_emit_t *jse)
 {
 	json_nest_end(jse, JSON_ARRAY);
-	json_emit(jse, "]");
+	json_emitc(jse, ']');
 	json_emit_finish(jse);
 }
 
@@ -471,7 +711,7 @@ json_newline(json_emit_t *jse)
 
 	VERIFY(json_nest_kind(jse) == JSON_NONE);
 	VERIFY(jse->json_depth == 0);
-	json_emit(jse, "\n");
+	json_emitc(jse, '\n');
 }
 
 void
@@ -479,7 +719,7 @@ json_boolean(json_emit_t *jse, const char *label, json_boolean_t value)
 {
 	VERIFY(value == JSON_B_FALSE || value == JSON_B_TRUE);
 	json_emit_prepare(jse, label);
-	json_emit(jse, "%s", value == JSON_B_TRUE ? "true" : "false");
+	json_emits(jse, value == JSON_B_TRUE ? "true" : "false");
 	json_emit_finish(jse);
 }
 
@@ -487,36 +727,42 @@ void
 json_null(json_emit_t *jse, const char *label)
 {
 	json_emit_prepare(jse, label);
-	json_emit(jse, "null");
+	json_emits(jse, "null");
 	json_emit_finish(jse);
 }
 
 void
 json_int64(json_emit_t *jse, const char *label, int64_t value)
 {
+	char buf[JSON_NUMBUF_MAX];
+
 	json_emit_prepare(jse, label);
-	json_emit(jse, "%" PRId64, value);
+	json_emitn(jse, buf, json_format_int64(buf, value));
 	json_emit_finish(jse);
 }
 
 void
 json_uint64(json_emit_t *jse, const char *label, uint64_t value)
 {
+	char buf[JSON_NUMBUF_MAX];
+
 	json_emit_prepare(jse, label);
-	json_emit(jse, "%" PRIu64, value);
+	json_emitn(jse, buf, json_format_uint64(buf, value));
 	json_emit_finish(jse);
 }
 
 void
 json_double(json_emit_t *jse, const char *label, double value)
 {
+	char buf[JSON_NUMBUF_MAX];
+
 	if (!isfinite(value)) {
 		jse->json_nbadfloats++;
 		return;
 	}
 
 	json_emit_prepare(jse, label);
-	json_emit(jse, "%.10e", value);
+	json_emitn(jse, buf, json_format_double(buf, value));
 	json_emit_finish(jse);
 }
 
@@ -527,3 +773,67 @@ json_utf8string(json_emit_t *jse, const char *label, const char *value)
 	json_emit_utf8string(jse, value);
 	json_emit_finish(jse);
 }
+
+void
+json_utf8string_len(json_emit_t *jse, const char *label, const char *value,
+    size_t len)
+{
+	json_emit_prepare(jse, label);
+	json_emit_utf8(jse, value, len);
+	json_emit_finish(jse);
+}
+
+/*
+ * Returns the length of the longest prefix of the "len"-byte buffer "str" that
+ * consists of complete, valid UTF-8 characters (as accepted by
+ * json_utf8string_len()).
+ */
+size_t
+json_utf8_validlen(const char *str, size_t len)
+{
+	unsigned utf8_more_bytes;
+	unsigned char code;
+	size_t i, j;
+
+	i = 0;
+	while (i < len) {
+		i += json_scan_plain(str + i, len - i);
+		if (i == len) {
+			break;
+		}
+
+		code = str[i];
+		if (code <= 0x7F) {
+			i++;
+			continue;
+		}
+
+		if ((code & 0xE0) == 0xC0) {
+			utf8_more_bytes = 1;
+		} else if ((code & 0xF0) == 0xE0) {
+			utf8_more_bytes = 2;
+		} else if ((code & 0xF8) == 0xF0) {
+			utf8_more_bytes = 3;
+		} else {
+			break;
+		}
+
+		if (len - i <= utf8_more_bytes) {
+			break;
+		}
+
+		for (j = 1; j <= utf8_more_bytes; j++) {
+			if ((str[i + j] & 0xC0) != 0x80) {
+				break;
+			}
+		}
+
+		if (j <= utf8_more_bytes) {
+			break;
+		}
+
+		i += j;
+	}
+
+	return (i);
+}
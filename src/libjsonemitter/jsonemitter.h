@@ -25,11 +25,55 @@
  *
  *     json_create_stdio() returns NULL on failure with errno set appropriately.
  *
- *     When you've completed the operation and checked for errors, use
- *     json_fini() to free resources created by the emitter.  After that, no
- *     other functions may be called using the emitter.  (This does nothing to
- *     the underlying stdio stream.  The caller may wish to flush or close that
- *     stream.)
+ *     Alternatively, you can instantiate a buffered emitter that writes to a
+ *     file descriptor:
+ *
+ *         int fd = ...
+ *         json_emit_t *jse = json_create_fd(fd, bufsz);
+ *
+ *     The emitter allocates an output buffer of "bufsz" bytes (which must be
+ *     at least 512 bytes) and writes it to "fd" using write(2) each time it
+ *     fills up.  This is considerably cheaper than emitting through stdio for
+ *     large documents.  Output may remain in the buffer until the buffer fills
+ *     up or until the caller invokes json_flush() or json_fini().
+ *     json_create_fd() returns NULL on failure with errno set appropriately.
+ *
+ *     Finally, a buffered emitter can hand its output to a function of the
+ *     caller's instead of writing it to a file descriptor:
+ *
+ *         int mywrite(void *arg, const char *buf, size_t len) { ... }
+ *         json_emit_t *jse = json_create_cb(mywrite, arg, bufsz);
+ *
+ *     The function is invoked with "arg" each time the buffer fills up (and
+ *     on json_flush() and json_fini()) and must consume all "len" bytes.  It
+ *     returns 0 on success or an errno value on failure, in which case the
+ *     emitter records a JSE_IO error and emits nothing more.  This can be used
+ *     to compress or otherwise transform the output.
+ *
+ *     A callback emitter can also be created in memory supplied by the caller,
+ *     in which case the emitter doesn't allocate any memory itself:
+ *
+ *         void *mem = ...
+ *         json_emit_t *jse = json_create_cb_mem(mywrite, arg, mem, memsz);
+ *
+ *     The emitter's state is stored at the start of the "memsz" bytes at "mem"
+ *     (which must be suitably aligned for any type), and the rest is used as
+ *     the output buffer.  json_mem_size(bufsz) returns the number of bytes
+ *     needed for a buffer of "bufsz" bytes.  The memory must remain valid until
+ *     json_fini(), which does not free it.
+ *
+ *     json_nbuffered() returns the number of bytes emitted but not yet handed
+ *     to the file descriptor or function (always 0 for stdio emitters), so
+ *     callers that count the bytes written out can tell how far into the
+ *     output the next value will be.
+ *
+ *     When you've completed the operation, use json_flush() to write out any
+ *     buffered output, then check for errors, then use json_fini() to free
+ *     resources created by the emitter.  After that, no other functions may be
+ *     called using the emitter.  (json_fini() also writes out buffered output,
+ *     but it has no way to report errors doing so.  It does nothing to the
+ *     underlying stdio stream or file descriptor.  The caller may wish to flush
+ *     or close that stream.)
  *
  * (2) Emitting data
  *
@@ -42,10 +86,18 @@
  *        json_uint64()
  *        json_double()*
  *        json_utf8string()
+ *        json_utf8string_len()
  *
- *     Note that double-precision floating-point values are emitted with ten
- *     digits in the current implementation, but this is subject to change to
- *     in the future without sacrificing precision.
+ *     Note that double-precision floating-point values are emitted using the
+ *     shortest representation that reads back as the same value, laid out as
+ *     JavaScript would (e.g., "3.7", "100", "1e+21", "4.56e-123").  Numbers
+ *     are formatted the same way regardless of the current locale.
+ *
+ *     json_utf8string() emits a NUL-terminated string.  json_utf8string_len()
+ *     emits a string of a given length, which need not be NUL-terminated and
+ *     may contain NUL characters (which are escaped in the output).  Both
+ *     require the string to be valid UTF-8.  json_utf8_validlen() can be used
+ *     beforehand to find the longest prefix of a buffer that is valid UTF-8.
  *
  *     You can emit objects and arrays using the functions:
  *
@@ -83,6 +135,9 @@
  *
  *         JSE_STDIO	An error was encountered calling a stdio function.
  *
+ *         JSE_IO	An error was encountered writing buffered output to the
+ *         		underlying file descriptor.
+ *
  *         JSE_TOODEEP	The caller attempted to emit more than the supported
  *         		number of nested objects or arrays.  Currently, 255 is
  *         		the maximum level of nesting that's supported.
@@ -129,10 +184,19 @@ typedef enum {
 	JSE_STDIO,	/* error from stdio function */
 	JSE_TOODEEP,	/* exceeded maximum supported depth */
 	JSE_INVAL,	/* unsupported value emitted (e.g., NaN) */
+	JSE_IO,		/* error writing to file descriptor */
 } json_error_t;
 
 json_emit_t *json_create_stdio(FILE *);
+json_emit_t *json_create_fd(int, size_t);
+
+typedef int (json_write_f)(void *, const char *, size_t);
+json_emit_t *json_create_cb(json_write_f *, void *, size_t);
+json_emit_t *json_create_cb_mem(json_write_f *, void *, void *, size_t);
+size_t json_mem_size(size_t);
+size_t json_nbuffered(json_emit_t *);
 json_error_t json_get_error(json_emit_t *, char *, size_t);
+void json_flush(json_emit_t *);
 void json_fini(json_emit_t *);
 
 void json_object_begin(json_emit_t *, const char *);
@@ -149,5 +213,8 @@ void json_int64(json_emit_t *, const char *, int64_t);
 void json_uint64(json_emit_t *, const char *, uint64_t);
 void json_double(json_emit_t *, const char *, double);
 void json_utf8string(json_emit_t *, const char *, const char *);
+void json_utf8string_len(json_emit_t *, const char *, const char *, size_t);
+
+size_t json_utf8_validlen(const char *, size_t);
 
 #endif /* not defined _JSONEMITTER_H_ */
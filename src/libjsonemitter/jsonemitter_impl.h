@@ -0,0 +1,70 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * jsonemitter_impl.h: private declarations shared by the libjsonemitter source
+ * files
+ */
+
+#ifndef	_JSONEMITTER_IMPL_H
+#define	_JSONEMITTER_IMPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Returns the number of leading bytes of the "len"-byte buffer "str" that can
+ * be copied into a JSON string verbatim, without escaping and without UTF-8
+ * decoding.  Those are the printable ASCII characters other than quotation
+ * mark and reverse solidus.  See jsonemitter_scan.c.
+ */
+extern size_t json_scan_plain(const char *, size_t);
+
+/*
+ * For testing, json_scan_use() makes json_scan_plain() use the named
+ * implementation ("portable", "sse2", or "avx2") from then on.  It returns -1
+ * if there's no such implementation on this platform or the CPU doesn't
+ * support it.
+ */
+extern int json_scan_use(const char *);
+
+/*
+ * Number formatting (see jsonemitter_number.c).  Each of these writes a number
+ * into a buffer of at least JSON_NUMBUF_MAX bytes and returns the number of
+ * bytes written.  The result is not NUL-terminated.
+ */
+#define	JSON_NUMBUF_MAX	32
+
+extern size_t json_format_uint64(char *, uint64_t);
+extern size_t json_format_int64(char *, int64_t);
+extern size_t json_format_double(char *, double);
+
+/*
+ * Static tracepoints in the "jsonemitter" provider.  These work like the ones
+ * in libpmx (see pmx_impl.h):
+ *
+ *     flush_start	nbytes		buffered output being written out
+ *     flush_done	nbytes, error	... done (error is an errno value, or 0)
+ */
+#if !defined(PMX_NOSDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef STAP_PROBE
+#define	JSON_PROBE1(name, a1)		STAP_PROBE1(jsonemitter, name, a1)
+#define	JSON_PROBE2(name, a1, a2)	STAP_PROBE2(jsonemitter, name, a1, a2)
+#else
+#define	JSON_PROBE1(name, a1)		((void) (a1))
+#define	JSON_PROBE2(name, a1, a2)	((void) (a1), (void) (a2))
+#endif
+
+#endif /* not defined _JSONEMITTER_IMPL_H */
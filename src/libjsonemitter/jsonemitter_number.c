@@ -0,0 +1,448 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * jsonemitter_number.c: formatting of integers and floating-point numbers
+ *
+ * Nearly every value that pmx emits is an integer, so formatting numbers with
+ * printf(3C) (which must parse the format string and consult the locale on
+ * every call) is a large share of the cost of emitting JSON.  These functions
+ * format numbers directly into a caller-supplied buffer instead.
+ *
+ * Integers are converted two digits at a time using a table of the decimal
+ * representations of 0 through 99.
+ *
+ * Doubles are converted using Grisu2 (see Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010),
+ * which produces the shortest (or very nearly the shortest) string of digits
+ * that reads back as exactly the same double.  This uses only 64-bit integer
+ * arithmetic and a table of cached powers of ten.  The digits are then laid out
+ * the way JavaScript's Number.prototype.toString() does, so that the output is
+ * valid JSON and familiar to consumers.  None of this depends on the locale.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "jsonemitter_impl.h"
+
+/*
+ * A "do-it-yourself floating-point" number: the value f * 2^e.
+ */
+typedef struct {
+	uint64_t	jdf_f;
+	int		jdf_e;
+} json_diyfp_t;
+
+#define	JSON_DP_SIGNIFICAND_MASK	0x000fffffffffffffULL
+#define	JSON_DP_EXPONENT_MASK		0x7ff0000000000000ULL
+#define	JSON_DP_HIDDEN_BIT		0x0010000000000000ULL
+#define	JSON_DP_SIGNIFICAND_SIZE	52
+#define	JSON_DP_EXPONENT_BIAS		(0x3ff + JSON_DP_SIGNIFICAND_SIZE)
+#define	JSON_DP_MIN_EXPONENT		(-JSON_DP_EXPONENT_BIAS)
+
+static const char json_digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint64_t json_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+#define	JSON_NPOW10	(sizeof (json_pow10) / sizeof (json_pow10[0]))
+
+/*
+ * Normalized 64-bit approximations (rounded to nearest) of 10^k for
+ * k = -348, -340, ..., 340, as required by json_cached_power().
+ */
+static const json_diyfp_t json_cached_powers[] = {
+	{ 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 },
+	{ 0x8b16fb203055ac76ULL, -1166 }, { 0xcf42894a5dce35eaULL, -1140 },
+	{ 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+	{ 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 },
+	{ 0xbe5691ef416bd60cULL, -1007 }, { 0x8dd01fad907ffc3cULL, -980 },
+	{ 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+	{ 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 },
+	{ 0x823c12795db6ce57ULL, -847 }, { 0xc21094364dfb5637ULL, -821 },
+	{ 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+	{ 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 },
+	{ 0xb23867fb2a35b28eULL, -688 }, { 0x84c8d4dfd2c63f3bULL, -661 },
+	{ 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+	{ 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 },
+	{ 0xf3e2f893dec3f126ULL, -529 }, { 0xb5b5ada8aaff80b8ULL, -502 },
+	{ 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+	{ 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 },
+	{ 0xa6dfbd9fb8e5b88fULL, -369 }, { 0xf8a95fcf88747d94ULL, -343 },
+	{ 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+	{ 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 },
+	{ 0xe45c10c42a2b3b06ULL, -210 }, { 0xaa242499697392d3ULL, -183 },
+	{ 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+	{ 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 },
+	{ 0x9c40000000000000ULL, -50 }, { 0xe8d4a51000000000ULL, -24 },
+	{ 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+	{ 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 },
+	{ 0xd5d238a4abe98068ULL, 109 }, { 0x9f4f2726179a2245ULL, 136 },
+	{ 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+	{ 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 },
+	{ 0x924d692ca61be758ULL, 269 }, { 0xda01ee641a708deaULL, 295 },
+	{ 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+	{ 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 },
+	{ 0xc83553c5c8965d3dULL, 428 }, { 0x952ab45cfa97a0b3ULL, 455 },
+	{ 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+	{ 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 },
+	{ 0x88fcf317f22241e2ULL, 588 }, { 0xcc20ce9bd35c78a5ULL, 614 },
+	{ 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+	{ 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 },
+	{ 0xbb764c4ca7a44410ULL, 747 }, { 0x8bab8eefb6409c1aULL, 774 },
+	{ 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+	{ 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 },
+	{ 0x80444b5e7aa7cf85ULL, 907 }, { 0xbf21e44003acdd2dULL, 933 },
+	{ 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+	{ 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 },
+	{ 0xaf87023b9bf0ee6bULL, 1066 },
+};
+
+static json_diyfp_t json_diyfp_mul(json_diyfp_t, json_diyfp_t);
+static json_diyfp_t json_diyfp_normalize(json_diyfp_t);
+static json_diyfp_t json_cached_power(int, int *);
+static void json_grisu_round(char *, size_t, uint64_t, uint64_t, uint64_t,
+    uint64_t);
+static size_t json_digit_gen(json_diyfp_t, json_diyfp_t, uint64_t, char *,
+    int *);
+static size_t json_grisu2(double, char *, int *);
+static size_t json_format_digits(char *, const char *, size_t, int);
+
+/*
+ * Writes the decimal representation of "value" to "buf", which must have room
+ * for at least JSON_NUMBUF_MAX bytes, and returns the number of bytes written.
+ * The result is not NUL-terminated.
+ */
+size_t
+json_format_uint64(char *buf, uint64_t value)
+{
+	char tmp[20];
+	char *p = tmp + sizeof (tmp);
+	size_t len;
+	unsigned int i;
+
+	while (value >= 100) {
+		i = (unsigned int)(value % 100) * 2;
+		value /= 100;
+		*--p = json_digit_pairs[i + 1];
+		*--p = json_digit_pairs[i];
+	}
+
+	if (value >= 10) {
+		i = (unsigned int)value * 2;
+		*--p = json_digit_pairs[i + 1];
+		*--p = json_digit_pairs[i];
+	} else {
+		*--p = (char)('0' + value);
+	}
+
+	len = tmp + sizeof (tmp) - p;
+	(void) memcpy(buf, p, len);
+	return (len);
+}
+
+size_t
+json_format_int64(char *buf, int64_t value)
+{
+	if (value < 0) {
+		buf[0] = '-';
+		/* Negate in unsigned arithmetic so that INT64_MIN works. */
+		return (1 + json_format_uint64(buf + 1, -(uint64_t)value));
+	}
+
+	return (json_format_uint64(buf, (uint64_t)value));
+}
+
+/*
+ * Like json_format_uint64(), but for finite double-precision values.  The
+ * result is the shortest representation that json_double()'s consumers will
+ * read back as exactly "value" (see above).
+ */
+size_t
+json_format_double(char *buf, double value)
+{
+	char digits[JSON_NUMBUF_MAX];
+	size_t ndigits, len;
+	uint64_t bits;
+	int k;
+
+	(void) memcpy(&bits, &value, sizeof (bits));
+	len = 0;
+	if ((bits >> 63) != 0) {
+		buf[len++] = '-';
+		bits &= ~(1ULL << 63);
+		(void) memcpy(&value, &bits, sizeof (value));
+	}
+
+	if (bits == 0) {
+		buf[len++] = '0';
+		return (len);
+	}
+
+	ndigits = json_grisu2(value, digits, &k);
+	return (len + json_format_digits(buf + len, digits, ndigits, k));
+}
+
+/*
+ * Lays out the digits "digits" (representing the value digits * 10^k) in
+ * "buf" using the same rules as JavaScript: plain decimal notation if the
+ * decimal exponent is between -7 and 21 and exponential notation otherwise.
+ */
+static size_t
+json_format_digits(char *buf, const char *digits, size_t ndigits, int k)
+{
+	int n, nd, i;
+	char *p = buf;
+
+	nd = (int)ndigits;
+	n = nd + k;		/* value is 0.DIGITS * 10^n */
+
+	if (nd <= n && n <= 21) {
+		/* integer: DIGITS followed by zeros */
+		(void) memcpy(p, digits, nd);
+		p += nd;
+		for (i = nd; i < n; i++) {
+			*p++ = '0';
+		}
+	} else if (0 < n && n <= 21) {
+		/* DDD.DDD */
+		(void) memcpy(p, digits, n);
+		p += n;
+		*p++ = '.';
+		(void) memcpy(p, digits + n, nd - n);
+		p += nd - n;
+	} else if (-6 < n && n <= 0) {
+		/* 0.000DDD */
+		*p++ = '0';
+		*p++ = '.';
+		for (i = n; i < 0; i++) {
+			*p++ = '0';
+		}
+		(void) memcpy(p, digits, nd);
+		p += nd;
+	} else {
+		/* D.DDDe+NNN */
+		*p++ = digits[0];
+		if (nd > 1) {
+			*p++ = '.';
+			(void) memcpy(p, digits + 1, nd - 1);
+			p += nd - 1;
+		}
+		*p++ = 'e';
+		*p++ = n - 1 < 0 ? '-' : '+';
+		p += json_format_uint64(p, n - 1 < 0 ? 1 - n : n - 1);
+	}
+
+	return (p - buf);
+}
+
+/*
+ * Grisu2 implementation
+ */
+
+static json_diyfp_t
+json_diyfp_mul(json_diyfp_t a, json_diyfp_t b)
+{
+	json_diyfp_t r;
+	uint64_t ah, al, bh, bl, hh, hl, lh, ll, mid;
+
+	ah = a.jdf_f >> 32;
+	al = a.jdf_f & 0xffffffffULL;
+	bh = b.jdf_f >> 32;
+	bl = b.jdf_f & 0xffffffffULL;
+	hh = ah * bh;
+	hl = ah * bl;
+	lh = al * bh;
+	ll = al * bl;
+
+	/* Round the low 64 bits of the 128-bit product. */
+	mid = (ll >> 32) + (hl & 0xffffffffULL) + (lh & 0xffffffffULL);
+	mid += 1ULL << 31;
+	r.jdf_f = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+	r.jdf_e = a.jdf_e + b.jdf_e + 64;
+	return (r);
+}
+
+static json_diyfp_t
+json_diyfp_normalize(json_diyfp_t v)
+{
+	int shift;
+
+	shift = __builtin_clzll(v.jdf_f);
+	v.jdf_f <<= shift;
+	v.jdf_e -= shift;
+	return (v);
+}
+
+/*
+ * Returns a cached power of ten c = 10^-k such that multiplying a normalized
+ * value with binary exponent "e" by "c" yields a binary exponent in the range
+ * [-60, -32], and stores "k" into "kp".
+ */
+static json_diyfp_t
+json_cached_power(int e, int *kp)
+{
+	double dk;
+	int k;
+	unsigned int idx;
+
+	dk = (-61 - e) * 0.30102999566398114 + 347;
+	k = (int)dk;
+	if (dk - k > 0.0) {
+		k++;
+	}
+
+	idx = (unsigned int)((k >> 3) + 1);
+	*kp = -(-348 + (int)idx * 8);
+	return (json_cached_powers[idx]);
+}
+
+/*
+ * Moves the last digit generated towards the exact value while it remains
+ * within the rounding interval.
+ */
+static void
+json_grisu_round(char *buf, size_t len, uint64_t delta, uint64_t rest,
+    uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	    (rest + ten_kappa < wp_w ||
+	    wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+/*
+ * Generates the digits of "mp" (the scaled upper boundary of the value) until
+ * the result is within "delta" of it.  "w" is the scaled value itself.
+ */
+static size_t
+json_digit_gen(json_diyfp_t w, json_diyfp_t mp, uint64_t delta, char *buf,
+    int *kp)
+{
+	uint64_t one_f, wp_w, p2, tmp;
+	uint32_t p1, d;
+	unsigned int one_e;
+	size_t len;
+	int kappa;
+
+	one_e = (unsigned int)-mp.jdf_e;
+	one_f = 1ULL << one_e;
+	wp_w = mp.jdf_f - w.jdf_f;
+	p1 = (uint32_t)(mp.jdf_f >> one_e);
+	p2 = mp.jdf_f & (one_f - 1);
+
+	for (kappa = 10; kappa > 1 && p1 < json_pow10[kappa - 1]; kappa--)
+		continue;
+
+	len = 0;
+	while (kappa > 0) {
+		d = p1 / (uint32_t)json_pow10[kappa - 1];
+		p1 %= (uint32_t)json_pow10[kappa - 1];
+		if (d != 0 || len != 0) {
+			buf[len++] = (char)('0' + d);
+		}
+		kappa--;
+		tmp = ((uint64_t)p1 << one_e) + p2;
+		if (tmp <= delta) {
+			*kp += kappa;
+			json_grisu_round(buf, len, delta, tmp,
+			    json_pow10[kappa] << one_e, wp_w);
+			return (len);
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		d = (uint32_t)(p2 >> one_e);
+		if (d != 0 || len != 0) {
+			buf[len++] = (char)('0' + d);
+		}
+		p2 &= one_f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*kp += kappa;
+			json_grisu_round(buf, len, delta, p2, one_f,
+			    -kappa < (int)JSON_NPOW10 ?
+			    wp_w * json_pow10[-kappa] : 0);
+			return (len);
+		}
+	}
+}
+
+/*
+ * Stores the digits of the positive, finite double "value" into "buf" (which
+ * must have room for JSON_NUMBUF_MAX digits, though no more than 17 are ever
+ * generated) and returns how many there are.  The value is
+ * DIGITS * 10^k, where "k" is stored into "kp".
+ */
+static size_t
+json_grisu2(double value, char *buf, int *kp)
+{
+	json_diyfp_t v, w, plus, minus, c;
+	uint64_t bits, f;
+	int biased_e;
+
+	(void) memcpy(&bits, &value, sizeof (bits));
+	biased_e = (int)((bits & JSON_DP_EXPONENT_MASK) >>
+	    JSON_DP_SIGNIFICAND_SIZE);
+	f = bits & JSON_DP_SIGNIFICAND_MASK;
+	if (biased_e != 0) {
+		v.jdf_f = f + JSON_DP_HIDDEN_BIT;
+		v.jdf_e = biased_e - JSON_DP_EXPONENT_BIAS;
+	} else {
+		v.jdf_f = f;
+		v.jdf_e = JSON_DP_MIN_EXPONENT + 1;
+	}
+
+	/*
+	 * Compute the boundaries of the rounding interval, m- and m+, with m+
+	 * normalized and m- scaled to the same exponent.
+	 */
+	plus.jdf_f = (v.jdf_f << 1) + 1;
+	plus.jdf_e = v.jdf_e - 1;
+	plus = json_diyfp_normalize(plus);
+	if (v.jdf_f == JSON_DP_HIDDEN_BIT) {
+		minus.jdf_f = (v.jdf_f << 2) - 1;
+		minus.jdf_e = v.jdf_e - 2;
+	} else {
+		minus.jdf_f = (v.jdf_f << 1) - 1;
+		minus.jdf_e = v.jdf_e - 1;
+	}
+	minus.jdf_f <<= minus.jdf_e - plus.jdf_e;
+	minus.jdf_e = plus.jdf_e;
+
+	c = json_cached_power(plus.jdf_e, kp);
+	w = json_diyfp_mul(json_diyfp_normalize(v), c);
+	plus = json_diyfp_mul(plus, c);
+	minus = json_diyfp_mul(minus, c);
+	minus.jdf_f++;
+	plus.jdf_f--;
+	return (json_digit_gen(w, plus, plus.jdf_f - minus.jdf_f, buf, kp));
+}
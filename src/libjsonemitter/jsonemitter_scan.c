@@ -0,0 +1,200 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * jsonemitter_scan.c: fast scanning of string data for characters that need
+ * special handling
+ *
+ * Most strings that we emit consist entirely of printable ASCII characters that
+ * need no escaping.  json_scan_plain() finds the length of the leading run of
+ * such characters so that the caller can copy the whole run into the output at
+ * once, falling back to the byte-at-a-time encoder only for quotation marks,
+ * reverse solidus, control characters, and UTF-8 multibyte sequences.
+ *
+ * On x86 we provide SSE2 and AVX2 implementations that examine 16 and 32 bytes
+ * per step, respectively.  The best implementation supported by the current CPU
+ * is selected the first time json_scan_plain() is called.  Elsewhere (and on
+ * x86 CPUs without SSE2), we use a portable implementation.  The vectorized
+ * implementations must return exactly what the portable one does for every
+ * input, which json-test.c checks for each one the CPU supports (see
+ * json_scan_use()).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "jsonemitter_impl.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	JSON_SCAN_X86
+#include <immintrin.h>
+#endif
+
+static size_t json_scan_resolve(const char *, size_t);
+static size_t json_scan_portable(const char *, size_t);
+#ifdef JSON_SCAN_X86
+static size_t json_scan_sse2(const char *, size_t);
+static size_t json_scan_avx2(const char *, size_t);
+#endif
+
+/*
+ * Implementation currently in use.  This initially points to a function that
+ * selects the implementation and then replaces this pointer.  If multiple
+ * threads race to do that, they'll all store the same value.
+ */
+static size_t (*json_scan_impl)(const char *, size_t) = json_scan_resolve;
+
+size_t
+json_scan_plain(const char *str, size_t len)
+{
+	return (json_scan_impl(str, len));
+}
+
+static size_t
+json_scan_resolve(const char *str, size_t len)
+{
+	size_t (*impl)(const char *, size_t) = json_scan_portable;
+
+#ifdef JSON_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		impl = json_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		impl = json_scan_sse2;
+	}
+#endif
+
+	json_scan_impl = impl;
+	return (impl(str, len));
+}
+
+int
+json_scan_use(const char *name)
+{
+	size_t (*impl)(const char *, size_t);
+
+	if (strcmp(name, "portable") == 0) {
+		impl = json_scan_portable;
+#ifdef JSON_SCAN_X86
+	} else if (strcmp(name, "sse2") == 0) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2")) {
+			return (-1);
+		}
+
+		impl = json_scan_sse2;
+	} else if (strcmp(name, "avx2") == 0) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2")) {
+			return (-1);
+		}
+
+		impl = json_scan_avx2;
+#endif
+	} else {
+		return (-1);
+	}
+
+	json_scan_impl = impl;
+	return (0);
+}
+
+/*
+ * Returns true if "c" can be copied verbatim into a JSON string.
+ */
+static int
+json_scan_isplain(unsigned char c)
+{
+	return (c >= 0x20 && c <= 0x7F && c != '"' && c != '\\');
+}
+
+static size_t
+json_scan_portable(const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (!json_scan_isplain((unsigned char)str[i])) {
+			break;
+		}
+	}
+
+	return (i);
+}
+
+#ifdef JSON_SCAN_X86
+
+/*
+ * Both vectorized implementations use the same approach.  Comparing each byte
+ * against 0x20 as a _signed_ value identifies both control characters (which
+ * are less than 0x20) and every byte with the high bit set (which are
+ * negative), which covers everything that's not plain except for the two
+ * characters that we compare against explicitly.  The byte mask tells us where
+ * the first such character is.
+ */
+__attribute__((__target__("sse2")))
+static size_t
+json_scan_sse2(const char *str, size_t len)
+{
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	__m128i chunk, special;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		chunk = _mm_loadu_si128((const __m128i *)(str + i));
+		special = _mm_or_si128(_mm_cmplt_epi8(chunk, space),
+		    _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+		    _mm_cmpeq_epi8(chunk, bslash)));
+		mask = (unsigned int)_mm_movemask_epi8(special);
+		if (mask != 0) {
+			return (i + __builtin_ctz(mask));
+		}
+	}
+
+	return (i + json_scan_portable(str + i, len - i));
+}
+
+__attribute__((__target__("avx2")))
+static size_t
+json_scan_avx2(const char *str, size_t len)
+{
+	const __m256i space = _mm256_set1_epi8(0x20);
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i bslash = _mm256_set1_epi8('\\');
+	__m256i chunk, special;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+		special = _mm256_or_si256(_mm256_cmpgt_epi8(space, chunk),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+		    _mm256_cmpeq_epi8(chunk, bslash)));
+		mask = (unsigned int)_mm256_movemask_epi8(special);
+		if (mask != 0) {
+			return (i + __builtin_ctz(mask));
+		}
+	}
+
+	/*
+	 * Use the SSE2 version for what's left, since that may still cover a
+	 * 16-byte chunk.  That's compiled without VEX encoding, and running
+	 * legacy SSE instructions while the upper halves of the YMM registers
+	 * are dirty can make each one many times slower, so clear them first.
+	 */
+	_mm256_zeroupper();
+	return (i + json_scan_sse2(str + i, len - i));
+}
+
+#endif /* JSON_SCAN_X86 */
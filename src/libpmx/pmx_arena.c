@@ -0,0 +1,364 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_arena.c: per-stream memory arena
+ *
+ * Each stream allocates its own state (the stream itself, the edge buffer, the
+ * name table, the interned string table, backend buffers, and so on) from an
+ * arena that's freed all at once with the stream.  Allocation just advances a
+ * pointer through the current chunk.  When that's exhausted, a new chunk is
+ * obtained from malloc(), starting at PMX_ARENA_MINCHUNK bytes and doubling up
+ * to PMX_ARENA_MAXCHUNK (larger requests get a chunk to themselves).  Since
+ * chunks are large and allocations are rare once the tables have warmed up,
+ * an export makes very few calls to malloc() after the stream is created.
+ *
+ * Alternatively, the arena can be confined to a single block of memory
+ * supplied by the caller (see pmx_create_stream_arena()), in which case it
+ * never calls malloc() at all and allocations fail once the block is used up.
+ *
+ * Memory can be returned with pmx_arena_free(), which puts it on a free list
+ * for reuse by a later allocation of about the same size.  Small blocks are
+ * kept on a list for their exact (rounded) size, and larger ones on a list for
+ * their power-of-2 size class.  Blocks that were given a chunk to themselves
+ * are instead returned to malloc() along with the chunk, since a table that
+ * keeps doubling would never reuse them.  This is enough for the patterns the
+ * library needs: tables that double when they grow and small entries that are
+ * evicted and replaced.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/* Alignment of every allocation (and smallest size class). */
+#define	PMX_ARENA_ALIGN		16
+/* Bounds on the size of chunks obtained from malloc(). */
+#define	PMX_ARENA_MINCHUNK	(256 * 1024)
+#define	PMX_ARENA_MAXCHUNK	(4 * 1024 * 1024)
+/*
+ * Free lists: one for each multiple of PMX_ARENA_ALIGN up to PMX_ARENA_SMALL
+ * bytes, then one for each power of 2.
+ */
+#define	PMX_ARENA_SMALL		1024
+#define	PMX_ARENA_NSMALL	(PMX_ARENA_SMALL / PMX_ARENA_ALIGN)
+#define	PMX_ARENA_NCLASSES	(PMX_ARENA_NSMALL + 64)
+
+#define	PMX_ARENA_ROUNDUP(x)	\
+	(((x) + PMX_ARENA_ALIGN - 1) & ~((size_t)PMX_ARENA_ALIGN - 1))
+
+/*
+ * Chunk header, which precedes the chunk's memory.
+ */
+typedef struct pmx_arena_chunk {
+	struct pmx_arena_chunk	*pac_next;	/* next older chunk */
+	size_t			pac_size;	/* usable bytes */
+	size_t			pac_used;	/* bytes handed out */
+	uint8_t			*pac_base;	/* start of usable bytes */
+} pmx_arena_chunk_t;
+
+/*
+ * Blocks on a free list.
+ */
+typedef struct pmx_arena_free {
+	struct pmx_arena_free	*paf_next;
+} pmx_arena_free_t;
+
+struct pmx_arena {
+	pmx_arena_chunk_t	*pa_chunk;	/* current chunk */
+	pmx_arena_chunk_t	pa_first;	/* first chunk */
+	void			*pa_heapfirst;	/* pa_first from malloc() */
+	pmx_boolean_t		pa_fixed;	/* confined to pa_first */
+	size_t			pa_nextsz;	/* size of next chunk */
+	size_t			pa_reserved;	/* bytes in all chunks */
+	size_t			pa_used;	/* bytes in use */
+	pmx_arena_free_t	*pa_free[PMX_ARENA_NCLASSES];
+};
+
+static void *pmx_arena_carve(pmx_arena_chunk_t *, size_t);
+static pmx_arena_chunk_t *pmx_arena_grow(pmx_arena_t *, size_t);
+static pmx_boolean_t pmx_arena_release(pmx_arena_t *, void *, size_t);
+static unsigned int pmx_arena_class(size_t, pmx_boolean_t);
+
+/*
+ * Creates an arena.  If "mem" is NULL, the arena obtains chunks from malloc()
+ * as needed.  Otherwise, the arena (including its own bookkeeping) lives
+ * entirely within the "memsz" bytes at "mem".  Returns NULL if there's not
+ * enough memory.
+ */
+pmx_arena_t *
+pmx_arena_create(void *mem, size_t memsz)
+{
+	pmx_arena_t *pa;
+	uint8_t *base, *end;
+	void *heap = NULL;
+
+	if (mem == NULL) {
+		memsz = PMX_ARENA_MINCHUNK;
+		heap = mem = malloc(memsz);
+		if (heap == NULL) {
+			return (NULL);
+		}
+	}
+
+	base = (uint8_t *)PMX_ARENA_ROUNDUP((uintptr_t)mem);
+	end = (uint8_t *)mem + memsz;
+	if (end < base ||
+	    (size_t)(end - base) < PMX_ARENA_ROUNDUP(sizeof (*pa))) {
+		free(heap);
+		return (NULL);
+	}
+
+	pa = (pmx_arena_t *)base;
+	(void) memset(pa, 0, sizeof (*pa));
+	base += PMX_ARENA_ROUNDUP(sizeof (*pa));
+	pa->pa_first.pac_base = base;
+	pa->pa_first.pac_size = (size_t)(end - base);
+	pa->pa_chunk = &pa->pa_first;
+	pa->pa_heapfirst = heap;
+	pa->pa_fixed = heap == NULL ? PB_TRUE : PB_FALSE;
+	pa->pa_nextsz = 2 * PMX_ARENA_MINCHUNK;
+	pa->pa_reserved = memsz;
+	return (pa);
+}
+
+/*
+ * Frees the arena, all memory allocated from it, and (for arenas backed by
+ * malloc()) all of its chunks.  The arena must not be used afterwards.
+ */
+void
+pmx_arena_destroy(pmx_arena_t *pa)
+{
+	pmx_arena_chunk_t *pac, *next;
+
+	for (pac = pa->pa_chunk; pac != NULL; pac = next) {
+		next = pac->pac_next;
+		if (pac != &pa->pa_first) {
+			free(pac);
+		}
+	}
+
+	/* The arena itself lives in the first chunk. */
+	if (pa->pa_heapfirst != NULL) {
+		free(pa->pa_heapfirst);
+	}
+}
+
+/*
+ * Returns "size" bytes of memory (aligned to PMX_ARENA_ALIGN bytes), or NULL
+ * if there's no memory available.  The memory is not zeroed.
+ */
+void *
+pmx_arena_alloc(pmx_arena_t *pa, size_t size)
+{
+	pmx_arena_free_t *paf;
+	pmx_arena_chunk_t *pac;
+	unsigned int c;
+	void *p;
+
+	if (size == 0) {
+		size = 1;
+	}
+
+	if (size > SIZE_MAX / 2) {
+		return (NULL);
+	}
+
+	size = PMX_ARENA_ROUNDUP(size);
+	c = pmx_arena_class(size, PB_TRUE);
+	if ((paf = pa->pa_free[c]) != NULL) {
+		pa->pa_free[c] = paf->paf_next;
+		pa->pa_used += size;
+		return (paf);
+	}
+
+	p = pmx_arena_carve(pa->pa_chunk, size);
+	if (p == NULL) {
+		if (pa->pa_fixed || (pac = pmx_arena_grow(pa, size)) == NULL) {
+			return (NULL);
+		}
+
+		p = pmx_arena_carve(pac, size);
+		VERIFY(p != NULL);
+	}
+
+	pa->pa_used += size;
+	return (p);
+}
+
+/*
+ * Like pmx_arena_alloc(), but the memory is zeroed.
+ */
+void *
+pmx_arena_zalloc(pmx_arena_t *pa, size_t size)
+{
+	void *p;
+
+	p = pmx_arena_alloc(pa, size);
+	if (p != NULL) {
+		(void) memset(p, 0, size);
+	}
+
+	return (p);
+}
+
+/*
+ * Returns the "size" bytes at "p" (which must have been allocated from this
+ * arena with at least that size) for reuse.
+ */
+void
+pmx_arena_free(pmx_arena_t *pa, void *p, size_t size)
+{
+	pmx_arena_free_t *paf = p;
+	unsigned int c;
+
+	if (p == NULL) {
+		return;
+	}
+
+	if (size == 0) {
+		size = 1;
+	}
+
+	size = PMX_ARENA_ROUNDUP(size);
+	if (size > PMX_ARENA_MINCHUNK && pmx_arena_release(pa, p, size)) {
+		pa->pa_used -= size;
+		return;
+	}
+
+	c = pmx_arena_class(size, PB_FALSE);
+	paf->paf_next = pa->pa_free[c];
+	pa->pa_free[c] = paf;
+	pa->pa_used -= size;
+}
+
+/*
+ * Reports the bytes currently allocated from the arena and the total size of
+ * the memory it's using.
+ */
+void
+pmx_arena_usage(pmx_arena_t *pa, size_t *usedp, size_t *reservedp)
+{
+	*usedp = pa->pa_used;
+	*reservedp = pa->pa_reserved;
+}
+
+static void *
+pmx_arena_carve(pmx_arena_chunk_t *pac, size_t size)
+{
+	void *p;
+
+	if (pac->pac_size - pac->pac_used < size) {
+		return (NULL);
+	}
+
+	p = pac->pac_base + pac->pac_used;
+	pac->pac_used += size;
+	return (p);
+}
+
+/*
+ * Adds a new chunk with room for at least "size" bytes from malloc().  Usually
+ * this becomes the current chunk and whatever's left in the old one is
+ * abandoned, but a chunk made just for an oversized request is filled by that
+ * request, so it's put behind the current chunk instead.
+ */
+static pmx_arena_chunk_t *
+pmx_arena_grow(pmx_arena_t *pa, size_t size)
+{
+	pmx_arena_chunk_t *pac;
+	size_t chunksz, hdrsz;
+
+	hdrsz = PMX_ARENA_ROUNDUP(sizeof (*pac));
+	chunksz = size > pa->pa_nextsz ? size : pa->pa_nextsz;
+	if (chunksz > SIZE_MAX - hdrsz) {
+		return (NULL);
+	}
+
+	pac = malloc(hdrsz + chunksz);
+	if (pac == NULL) {
+		return (NULL);
+	}
+
+	pac->pac_base = (uint8_t *)pac + hdrsz;
+	pac->pac_size = chunksz;
+	pac->pac_used = 0;
+	pa->pa_reserved += hdrsz + chunksz;
+	if (size > pa->pa_nextsz) {
+		pac->pac_next = pa->pa_chunk->pac_next;
+		pa->pa_chunk->pac_next = pac;
+		return (pac);
+	}
+
+	pac->pac_next = pa->pa_chunk;
+	pa->pa_chunk = pac;
+	if (pa->pa_nextsz < PMX_ARENA_MAXCHUNK) {
+		pa->pa_nextsz *= 2;
+	}
+
+	return (pac);
+}
+
+/*
+ * If "p" is an oversized block that was given its own chunk by
+ * pmx_arena_grow(), frees the chunk and returns true.
+ */
+static pmx_boolean_t
+pmx_arena_release(pmx_arena_t *pa, void *p, size_t size)
+{
+	pmx_arena_chunk_t *prev, *pac;
+
+	prev = pa->pa_chunk;
+	for (pac = prev->pac_next; pac != NULL; pac = pac->pac_next) {
+		if (pac->pac_base == p && pac->pac_size == size &&
+		    pac != &pa->pa_first) {
+			prev->pac_next = pac->pac_next;
+			pa->pa_reserved -= PMX_ARENA_ROUNDUP(sizeof (*pac)) +
+			    pac->pac_size;
+			free(pac);
+			return (PB_TRUE);
+		}
+
+		prev = pac;
+	}
+
+	return (PB_FALSE);
+}
+
+/*
+ * Returns the free list for blocks of "size" bytes (a multiple of
+ * PMX_ARENA_ALIGN).  Small sizes have a list to themselves.  Otherwise, a free
+ * block goes on the list for the largest power of 2 not greater than its size,
+ * and an allocation ("alloc" is true) is satisfied from the list for the
+ * smallest power of 2 not less than its size, so every block on the list is
+ * big enough.
+ */
+static unsigned int
+pmx_arena_class(size_t size, pmx_boolean_t alloc)
+{
+	unsigned int c = 0;
+	size_t s;
+
+	if (size <= PMX_ARENA_SMALL) {
+		return (size / PMX_ARENA_ALIGN - 1);
+	}
+
+	for (s = size; s > 1; s >>= 1) {
+		c++;
+	}
+
+	if (alloc && ((size_t)1 << c) != size) {
+		c++;
+	}
+
+	return (PMX_ARENA_NSMALL + c);
+}
@@ -0,0 +1,988 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_binary.c: compact binary output backend
+ *
+ * The JSON form of an export repeats property names and spells out every
+ * integer in decimal, so it's several times larger than the data it describes.
+ * The binary form records the same information as a sequence of tagged
+ * records:
+ *
+ *     header		"PMXB" (4 bytes), version (1 byte), 3 reserved bytes
+ *
+ *     metadata		tag 0x01, key (str), value (str)
+ *
+ *     string data	tag 0x02, ident (varint), contents (str)
+ *
+ *     name		tag 0x03, id (varint), name (str)
+ *
+ *     content		tag 0x05, id (varint), contents (str)
+ *
+ *     string reference	tag 0x06, ident (varint), content id (varint)
+ *
+ *     edges		tag 0x04, source ident (varint), count (varint),
+ *     			"count" edge entries of 17 bytes each:
+ *     			    kind (1 byte, the pmx_edgetype_t)
+ *     			    target (8 bytes)
+ *     			    key (8 bytes)
+ *
+ *     node		tag 0x10 + subtype (the pmx_nodetype_t),
+ *     			ident (varint),
+ *     			field mask (1 byte),
+ *     			each field present in the mask, in schema order
+ *
+ *     end		tag 0x00 (written when the export completes)
+ *
+ * where "varint" is an unsigned LEB128 integer (7 bits per byte, least
+ * significant group first, high bit set on all bytes but the last) and "str"
+ * is a varint byte count followed by that many bytes.  The layout of each node
+ * record is fixed by its type: the fields are those listed in
+ * pmx_node_schemas[] for that type, and bit "i" of the field mask indicates
+ * whether field "i" is present.  Integer and reference fields are varints.
+ * Double-precision fields are 8 bytes containing the IEEE 754 representation,
+ * least significant byte first.
+ *
+ * Edge entries are fixed-width (with multi-byte values least significant byte
+ * first) so that they can be written and read in a tight loop and so that a
+ * consumer can index into a block of them directly.  The "key" of an edge is
+ * the element index for array elements or the id of a name (defined by an
+ * earlier name record) for properties and closure variables.  Name ids are
+ * assigned sequentially from 0.  All of the edges for a node precede the node
+ * record itself, and a node's edges may be split across several edge records.
+ *
+ * String contents are recorded exactly as provided, even if they're not valid
+ * UTF-8.
+ *
+ * Streams that intern string contents (see pmx_strtab.c) write each distinct
+ * string once as a content record and then write string reference records in
+ * place of string data records.  Content ids are assigned sequentially from 0.
+ *
+ * pmx_import_binary() reads this format and replays each record into another
+ * stream, which is how a binary export is converted to JSON.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+#define	PMXB_MAGIC		"PMXB"
+#define	PMXB_MAGICLEN		4
+#define	PMXB_VERSION		1
+#define	PMXB_HEADERLEN		8
+
+#define	PMXB_T_END		0x00
+#define	PMXB_T_METADATA		0x01
+#define	PMXB_T_STRING		0x02
+#define	PMXB_T_NAME		0x03
+#define	PMXB_T_EDGES		0x04
+#define	PMXB_T_CONTENT		0x05
+#define	PMXB_T_STRINGREF	0x06
+#define	PMXB_T_NODE		0x10
+
+/* Maximum encoded size of a varint. */
+#define	PMXB_VARINT_MAX		10
+/* Maximum encoded size of any node record. */
+#define	PMXB_NODE_MAX		\
+	(1 + PMXB_VARINT_MAX + 1 + PMX_MAXFIELDS * PMXB_VARINT_MAX)
+/* Size of each entry in an edge record. */
+#define	PMXB_EDGE_SIZE		17
+
+/* Size of the input buffer used by pmx_import_binary(). */
+#define	PMXB_READBUFSZ		(64 * 1024)
+
+static int pmx_bin_init(pmx_stream_t *);
+static void pmx_bin_fini(pmx_stream_t *);
+static void pmx_bin_done(pmx_stream_t *);
+static void pmx_bin_metadata(pmx_stream_t *, const char *, const char *);
+static void pmx_bin_node(pmx_stream_t *);
+static void pmx_bin_string(pmx_stream_t *, pmx_value_t, size_t,
+    const uint8_t *);
+static void pmx_bin_name(pmx_stream_t *, uint64_t, const char *);
+static void pmx_bin_content(pmx_stream_t *, uint64_t, size_t,
+    const uint8_t *);
+static void pmx_bin_stringref(pmx_stream_t *, pmx_value_t, uint64_t);
+static void pmx_bin_edges(pmx_stream_t *, pmx_value_t, const pmx_edge_t *,
+    size_t);
+
+const pmx_backend_t pmx_backend_binary = {
+	.pxb_name = "binary",
+	.pxb_init = pmx_bin_init,
+	.pxb_fini = pmx_bin_fini,
+	.pxb_done = pmx_bin_done,
+	.pxb_metadata = pmx_bin_metadata,
+	.pxb_node = pmx_bin_node,
+	.pxb_string = pmx_bin_string,
+	.pxb_edgename = pmx_bin_name,
+	.pxb_content = pmx_bin_content,
+	.pxb_stringref = pmx_bin_stringref,
+	.pxb_edges = pmx_bin_edges,
+};
+
+static void pmx_bin_write(pmx_stream_t *, const void *, size_t);
+static uint8_t *pmx_bin_reserve(pmx_stream_t *, size_t);
+static void pmx_bin_str(pmx_stream_t *, const uint8_t *, size_t);
+
+/*
+ * Writer
+ */
+
+static int
+pmx_bin_init(pmx_stream_t *pmxp)
+{
+	uint8_t *header;
+
+	pmxp->pxs_binbuf = pmx_arena_alloc(pmxp->pxs_arena, PMX_BINBUFSZ);
+	if (pmxp->pxs_binbuf == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	if (pmx_output_init(pmxp) != 0) {
+		return (-1);
+	}
+
+	header = pmxp->pxs_binbuf;
+	(void) memset(header, 0, PMXB_HEADERLEN);
+	(void) memcpy(header, PMXB_MAGIC, PMXB_MAGICLEN);
+	header[PMXB_MAGICLEN] = PMXB_VERSION;
+	pmxp->pxs_binbufused = PMXB_HEADERLEN;
+	return (0);
+}
+
+static void
+pmx_bin_fini(pmx_stream_t *pmxp)
+{
+	pmx_output_fini(pmxp);
+}
+
+/*
+ * Writes the end record and any buffered output.
+ */
+static void
+pmx_bin_done(pmx_stream_t *pmxp)
+{
+	*(pmx_bin_reserve(pmxp, 1)) = PMXB_T_END;
+	pmxp->pxs_binbufused++;
+
+	(void) pmx_output_write(pmxp, pmxp->pxs_binbuf, pmxp->pxs_binbufused);
+	pmxp->pxs_binbufused = 0;
+	pmx_output_flush(pmxp);
+}
+
+/*
+ * Returns a pointer to at least "len" bytes of free space at the end of the
+ * output buffer, writing out the buffer first if necessary.  "len" must not
+ * exceed PMX_BINBUFSZ.  The caller advances pxs_binbufused by however much it
+ * uses.  If we've already failed to write output, the buffer is simply reused.
+ */
+static uint8_t *
+pmx_bin_reserve(pmx_stream_t *pmxp, size_t len)
+{
+	if (PMX_BINBUFSZ - pmxp->pxs_binbufused < len) {
+		(void) pmx_output_write(pmxp, pmxp->pxs_binbuf,
+		    pmxp->pxs_binbufused);
+		pmxp->pxs_binbufused = 0;
+	}
+
+	return (pmxp->pxs_binbuf + pmxp->pxs_binbufused);
+}
+
+static void
+pmx_bin_write(pmx_stream_t *pmxp, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t n;
+
+	while (len > 0) {
+		n = len < PMX_BINBUFSZ ? len : PMX_BINBUFSZ;
+		(void) memcpy(pmx_bin_reserve(pmxp, n), p, n);
+		pmxp->pxs_binbufused += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+ * Encodes "val" as a varint at "p" and returns a pointer just past the encoded
+ * value, which uses at most PMXB_VARINT_MAX bytes.
+ */
+uint8_t *
+pmx_varint_encode(uint8_t *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+
+	*p++ = (uint8_t)val;
+	return (p);
+}
+
+/*
+ * Encodes "val" as 8 bytes, least significant first, at "p" and returns a
+ * pointer just past the encoded value.
+ */
+uint8_t *
+pmx_u64_encode(uint8_t *p, uint64_t val)
+{
+	p[0] = (uint8_t)val;
+	p[1] = (uint8_t)(val >> 8);
+	p[2] = (uint8_t)(val >> 16);
+	p[3] = (uint8_t)(val >> 24);
+	p[4] = (uint8_t)(val >> 32);
+	p[5] = (uint8_t)(val >> 40);
+	p[6] = (uint8_t)(val >> 48);
+	p[7] = (uint8_t)(val >> 56);
+	return (p + 8);
+}
+
+/*
+ * Decodes a value encoded by pmx_u64_encode().
+ */
+uint64_t
+pmx_u64_decode(const uint8_t *p)
+{
+	return ((uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	    (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	    (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
+
+static void
+pmx_bin_str(pmx_stream_t *pmxp, const uint8_t *str, size_t len)
+{
+	uint8_t *start, *p;
+
+	start = pmx_bin_reserve(pmxp, PMXB_VARINT_MAX);
+	p = pmx_varint_encode(start, len);
+	pmxp->pxs_binbufused += p - start;
+	pmx_bin_write(pmxp, str, len);
+}
+
+static void
+pmx_bin_metadata(pmx_stream_t *pmxp, const char *key, const char *value)
+{
+	*(pmx_bin_reserve(pmxp, 1)) = PMXB_T_METADATA;
+	pmxp->pxs_binbufused++;
+	pmx_bin_str(pmxp, (const uint8_t *)key, strlen(key));
+	pmx_bin_str(pmxp, (const uint8_t *)value, strlen(value));
+}
+
+static void
+pmx_bin_string(pmx_stream_t *pmxp, pmx_value_t jsv, size_t sz,
+    const uint8_t *bytes)
+{
+	uint8_t *start, *p;
+
+	start = pmx_bin_reserve(pmxp, 1 + PMXB_VARINT_MAX);
+	p = start;
+	*p++ = PMXB_T_STRING;
+	p = pmx_varint_encode(p, jsv);
+	pmxp->pxs_binbufused += p - start;
+	pmx_bin_str(pmxp, bytes, sz);
+}
+
+static void
+pmx_bin_node(pmx_stream_t *pmxp)
+{
+	const pmx_nodeschema_t *schema;
+	uint8_t *start, *p;
+	unsigned int i;
+	uint64_t v;
+
+	schema = &pmx_node_schemas[pmxp->pxs_subtype];
+	start = pmx_bin_reserve(pmxp, PMXB_NODE_MAX);
+	p = start;
+	*p++ = PMXB_T_NODE + pmxp->pxs_subtype;
+	p = pmx_varint_encode(p, pmxp->pxs_ident);
+	*p++ = (uint8_t)pmxp->pxs_fieldmask;
+	for (i = 0; i < schema->pxn_nfields; i++) {
+		if ((pmxp->pxs_fieldmask & (1U << i)) == 0) {
+			continue;
+		}
+
+		v = pmxp->pxs_fields[i];
+		if (schema->pxn_fields[i].pxf_kind == PMXFK_DOUBLE) {
+			p = pmx_u64_encode(p, v);
+		} else {
+			p = pmx_varint_encode(p, v);
+		}
+	}
+
+	pmxp->pxs_binbufused += p - start;
+}
+
+static void
+pmx_bin_name(pmx_stream_t *pmxp, uint64_t id, const char *name)
+{
+	uint8_t *start, *p;
+
+	start = pmx_bin_reserve(pmxp, 1 + PMXB_VARINT_MAX);
+	p = start;
+	*p++ = PMXB_T_NAME;
+	p = pmx_varint_encode(p, id);
+	pmxp->pxs_binbufused += p - start;
+	pmx_bin_str(pmxp, (const uint8_t *)name, strlen(name));
+}
+
+static void
+pmx_bin_content(pmx_stream_t *pmxp, uint64_t id, size_t sz,
+    const uint8_t *bytes)
+{
+	uint8_t *start, *p;
+
+	start = pmx_bin_reserve(pmxp, 1 + PMXB_VARINT_MAX);
+	p = start;
+	*p++ = PMXB_T_CONTENT;
+	p = pmx_varint_encode(p, id);
+	pmxp->pxs_binbufused += p - start;
+	pmx_bin_str(pmxp, bytes, sz);
+}
+
+static void
+pmx_bin_stringref(pmx_stream_t *pmxp, pmx_value_t jsv, uint64_t id)
+{
+	uint8_t *start, *p;
+
+	start = pmx_bin_reserve(pmxp, 1 + 2 * PMXB_VARINT_MAX);
+	p = start;
+	*p++ = PMXB_T_STRINGREF;
+	p = pmx_varint_encode(p, jsv);
+	p = pmx_varint_encode(p, id);
+	pmxp->pxs_binbufused += p - start;
+}
+
+static void
+pmx_bin_edges(pmx_stream_t *pmxp, pmx_value_t source, const pmx_edge_t *edges,
+    size_t nedges)
+{
+	const pmx_edge_t *edge, *end;
+	uint8_t *start, *p;
+	size_t n;
+
+	start = pmx_bin_reserve(pmxp, 1 + 2 * PMXB_VARINT_MAX);
+	p = start;
+	*p++ = PMXB_T_EDGES;
+	p = pmx_varint_encode(p, source);
+	p = pmx_varint_encode(p, nedges);
+	pmxp->pxs_binbufused += p - start;
+
+	/*
+	 * Write the entries as many at a time as will fit in the buffer.
+	 */
+	edge = edges;
+	end = edges + nedges;
+	while (edge < end) {
+		n = end - edge;
+		if (n > PMX_BINBUFSZ / PMXB_EDGE_SIZE) {
+			n = PMX_BINBUFSZ / PMXB_EDGE_SIZE;
+		}
+
+		p = pmx_bin_reserve(pmxp, n * PMXB_EDGE_SIZE);
+		pmxp->pxs_binbufused += n * PMXB_EDGE_SIZE;
+		for (; n > 0; n--, edge++) {
+			*p++ = (uint8_t)edge->pxe_kind;
+			p = pmx_u64_encode(p, edge->pxe_target);
+			p = pmx_u64_encode(p, edge->pxe_key);
+		}
+	}
+}
+
+
+/*
+ * Importer
+ */
+
+typedef struct {
+	uint8_t		*pbc_data;
+	size_t		pbc_len;
+} pmx_brcontent_t;
+
+typedef struct {
+	pmx_stream_t	*pbr_dst;		/* stream to replay into */
+	FILE		*pbr_src;		/* input stream */
+	uint8_t		*pbr_buf;		/* input buffer */
+	size_t		pbr_bufpos;		/* next byte to read */
+	size_t		pbr_buflen;		/* valid bytes in pbr_buf */
+	uint64_t	pbr_offset;		/* input offset of pbr_buf */
+	uint8_t		*pbr_scratch;		/* buffer for strings */
+	size_t		pbr_scratchsz;		/* size of pbr_scratch */
+	int		pbr_failed;		/* error already reported */
+	char		**pbr_names;		/* names, indexed by id */
+	size_t		pbr_nnames;		/* number of valid names */
+	size_t		pbr_namecap;		/* allocated pbr_names */
+	pmx_brcontent_t	*pbr_contents;		/* contents, indexed by id */
+	size_t		pbr_ncontents;		/* number of valid contents */
+	size_t		pbr_contentcap;		/* allocated pbr_contents */
+} pmx_binreader_t;
+
+static int pmx_br_fill(pmx_binreader_t *);
+static int pmx_br_byte(pmx_binreader_t *, uint8_t *);
+static int pmx_br_varint(pmx_binreader_t *, uint64_t *);
+static int pmx_br_str(pmx_binreader_t *, size_t *);
+static char *pmx_br_strcopy(pmx_binreader_t *, size_t);
+static int pmx_br_node(pmx_binreader_t *, uint8_t);
+static int pmx_br_name(pmx_binreader_t *);
+static int pmx_br_content(pmx_binreader_t *);
+static int pmx_br_stringref(pmx_binreader_t *);
+static int pmx_br_edges(pmx_binreader_t *);
+static pmx_boolean_t pmx_br_metadata_valid(pmx_binreader_t *, size_t);
+
+PMX_PRINTFLIKE2
+static void pmx_br_error(pmx_binreader_t *, const char *, ...);
+
+/*
+ * Reads a binary export from "src" and emits every record it contains into the
+ * stream "dst" (which would typically use a different output format).  Errors
+ * reading or parsing the input are reported as errors on "dst".
+ */
+void
+pmx_import_binary(pmx_stream_t *dst, FILE *src)
+{
+	pmx_binreader_t pbr;
+	uint8_t header[PMXB_HEADERLEN];
+	uint64_t ident;
+	uint8_t tag;
+	size_t i, len;
+	char *key;
+
+	(void) memset(&pbr, 0, sizeof (pbr));
+	pbr.pbr_dst = dst;
+	pbr.pbr_src = src;
+	pbr.pbr_buf = malloc(PMXB_READBUFSZ);
+	if (pbr.pbr_buf == NULL) {
+		pmx_set_errno(dst, PMXE_ENOMEM);
+		return;
+	}
+
+	for (i = 0; i < sizeof (header); i++) {
+		if (pmx_br_byte(&pbr, &header[i]) != 0) {
+			goto out;
+		}
+	}
+
+	if (memcmp(header, PMXB_MAGIC, PMXB_MAGICLEN) != 0) {
+		pmx_br_error(&pbr, "not a binary pmx export");
+		goto out;
+	}
+
+	if (header[PMXB_MAGICLEN] != PMXB_VERSION) {
+		pmx_br_error(&pbr, "unsupported version: %u",
+		    header[PMXB_MAGICLEN]);
+		goto out;
+	}
+
+	for (;;) {
+		if (pmx_br_byte(&pbr, &tag) != 0) {
+			goto out;
+		}
+
+		switch (tag) {
+		case PMXB_T_END:
+			goto out;
+
+		case PMXB_T_METADATA:
+			/*
+			 * Both strings have to be available at once, so the
+			 * key is copied out of the scratch buffer.
+			 */
+			if (pmx_br_str(&pbr, &len) != 0) {
+				goto out;
+			}
+
+			if (!pmx_br_metadata_valid(&pbr, len)) {
+				goto out;
+			}
+
+			key = pmx_br_strcopy(&pbr, len);
+			if (key == NULL) {
+				pmx_set_errno(dst, PMXE_ENOMEM);
+				goto out;
+			}
+
+			if (pmx_br_str(&pbr, &len) != 0 ||
+			    !pmx_br_metadata_valid(&pbr, len)) {
+				free(key);
+				goto out;
+			}
+
+			pmx_emit_metadata(dst, key, (char *)pbr.pbr_scratch);
+			free(key);
+			break;
+
+		case PMXB_T_STRING:
+			if (pmx_br_varint(&pbr, &ident) != 0 ||
+			    pmx_br_str(&pbr, &len) != 0) {
+				goto out;
+			}
+
+			pmx_emit_string_data(dst, (pmx_value_t)ident, len,
+			    pbr.pbr_scratch);
+			break;
+
+		case PMXB_T_NAME:
+			if (pmx_br_name(&pbr) != 0) {
+				goto out;
+			}
+			break;
+
+		case PMXB_T_EDGES:
+			if (pmx_br_edges(&pbr) != 0) {
+				goto out;
+			}
+			break;
+
+		case PMXB_T_CONTENT:
+			if (pmx_br_content(&pbr) != 0) {
+				goto out;
+			}
+			break;
+
+		case PMXB_T_STRINGREF:
+			if (pmx_br_stringref(&pbr) != 0) {
+				goto out;
+			}
+			break;
+
+		default:
+			if (pmx_br_node(&pbr, tag) != 0) {
+				goto out;
+			}
+			break;
+		}
+	}
+
+out:
+	for (i = 0; i < pbr.pbr_nnames; i++) {
+		free(pbr.pbr_names[i]);
+	}
+	free(pbr.pbr_names);
+	for (i = 0; i < pbr.pbr_ncontents; i++) {
+		free(pbr.pbr_contents[i].pbc_data);
+	}
+	free(pbr.pbr_contents);
+	free(pbr.pbr_buf);
+	free(pbr.pbr_scratch);
+}
+
+static void
+pmx_br_error(pmx_binreader_t *pbr, const char *fmt, ...)
+{
+	char buf[PMX_ERRMSGLEN];
+	va_list args;
+
+	va_start(args, fmt);
+	(void) vsnprintf(buf, sizeof (buf), fmt, args);
+	va_end(args);
+
+	pmx_error(pbr->pbr_dst, PMXE_EFORMAT, "at offset %" PRIu64 ": %s",
+	    pbr->pbr_offset + pbr->pbr_bufpos, buf);
+	pbr->pbr_failed = 1;
+}
+
+/*
+ * Refills the (empty) input buffer.
+ */
+static int
+pmx_br_fill(pmx_binreader_t *pbr)
+{
+	size_t rv;
+
+	pbr->pbr_offset += pbr->pbr_buflen;
+	pbr->pbr_bufpos = 0;
+	rv = fread(pbr->pbr_buf, 1, PMXB_READBUFSZ, pbr->pbr_src);
+	pbr->pbr_buflen = rv;
+	if (rv == 0) {
+		if (ferror(pbr->pbr_src)) {
+			pmx_error(pbr->pbr_dst, PMXE_EIO, "read: %s",
+			    strerror(errno));
+			pbr->pbr_failed = 1;
+		} else {
+			pmx_br_error(pbr, "unexpected end of input");
+		}
+
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+pmx_br_byte(pmx_binreader_t *pbr, uint8_t *bytep)
+{
+	if (pbr->pbr_bufpos == pbr->pbr_buflen && pmx_br_fill(pbr) != 0) {
+		return (-1);
+	}
+
+	*bytep = pbr->pbr_buf[pbr->pbr_bufpos++];
+	return (0);
+}
+
+static int
+pmx_br_varint(pmx_binreader_t *pbr, uint64_t *valp)
+{
+	uint64_t val = 0;
+	unsigned int shift;
+	uint8_t b;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (pmx_br_byte(pbr, &b) != 0) {
+			return (-1);
+		}
+
+		val |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) {
+			*valp = val;
+			return (0);
+		}
+	}
+
+	pmx_br_error(pbr, "invalid varint");
+	return (-1);
+}
+
+/*
+ * Reads a length-prefixed string into the scratch buffer.  The string is also
+ * NUL-terminated there for the convenience of callers that need a C string.
+ */
+static int
+pmx_br_str(pmx_binreader_t *pbr, size_t *lenp)
+{
+	uint64_t len;
+	size_t i, n;
+	uint8_t *newbuf;
+
+	if (pmx_br_varint(pbr, &len) != 0) {
+		return (-1);
+	}
+
+	if (len >= SIZE_MAX) {
+		pmx_br_error(pbr, "string too long");
+		return (-1);
+	}
+
+	if (len + 1 > pbr->pbr_scratchsz) {
+		newbuf = realloc(pbr->pbr_scratch, len + 1);
+		if (newbuf == NULL) {
+			pmx_set_errno(pbr->pbr_dst, PMXE_ENOMEM);
+			pbr->pbr_failed = 1;
+			return (-1);
+		}
+
+		pbr->pbr_scratch = newbuf;
+		pbr->pbr_scratchsz = len + 1;
+	}
+
+	for (i = 0; i < len; i += n) {
+		if (pbr->pbr_bufpos == pbr->pbr_buflen &&
+		    pmx_br_fill(pbr) != 0) {
+			return (-1);
+		}
+
+		n = pbr->pbr_buflen - pbr->pbr_bufpos;
+		if (n > len - i) {
+			n = len - i;
+		}
+
+		(void) memcpy(&pbr->pbr_scratch[i],
+		    &pbr->pbr_buf[pbr->pbr_bufpos], n);
+		pbr->pbr_bufpos += n;
+	}
+
+	pbr->pbr_scratch[len] = '\0';
+	*lenp = len;
+	return (0);
+}
+
+/*
+ * Returns a copy of the "len"-byte string most recently read by pmx_br_str(),
+ * or NULL on allocation failure.
+ */
+static char *
+pmx_br_strcopy(pmx_binreader_t *pbr, size_t len)
+{
+	char *copy;
+
+	copy = malloc(len + 1);
+	if (copy != NULL) {
+		(void) memcpy(copy, pbr->pbr_scratch, len + 1);
+	}
+
+	return (copy);
+}
+
+/*
+ * Metadata keys and values are accepted by pmx_emit_metadata() only if they're
+ * printable and contain no quotes, so check that before emitting them.  The
+ * string is in the scratch buffer.
+ */
+static pmx_boolean_t
+pmx_br_metadata_valid(pmx_binreader_t *pbr, size_t len)
+{
+	const char *str = (const char *)pbr->pbr_scratch;
+
+	if (strlen(str) != len || !pmx_cstr_printable(str) ||
+	    strchr(str, '"') != NULL) {
+		pmx_br_error(pbr, "invalid metadata string");
+		return (PB_FALSE);
+	}
+
+	return (PB_TRUE);
+}
+
+/*
+ * Reads a node record whose tag has already been read.  The whole record is
+ * read before anything is emitted so that a truncated record doesn't leave the
+ * destination stream in the middle of a node.
+ */
+static int
+pmx_br_node(pmx_binreader_t *pbr, uint8_t tag)
+{
+	const pmx_nodeschema_t *schema;
+	pmx_nodetype_t subtype;
+	uint64_t ident, v, fields[PMX_MAXFIELDS];
+	uint8_t mask, b;
+	unsigned int i, j;
+
+	if (tag <= PMXB_T_NODE || tag >= PMXB_T_NODE + PMXN_NTYPES) {
+		pmx_br_error(pbr, "unknown record type: 0x%x", tag);
+		return (-1);
+	}
+
+	subtype = tag - PMXB_T_NODE;
+	schema = &pmx_node_schemas[subtype];
+	if (pmx_br_varint(pbr, &ident) != 0 || pmx_br_byte(pbr, &mask) != 0) {
+		return (-1);
+	}
+
+	if ((mask >> schema->pxn_nfields) != 0) {
+		pmx_br_error(pbr, "invalid field mask for %s: 0x%x",
+		    schema->pxn_name, mask);
+		return (-1);
+	}
+
+	for (i = 0; i < schema->pxn_nfields; i++) {
+		if ((mask & (1U << i)) == 0) {
+			continue;
+		}
+
+		if (schema->pxn_fields[i].pxf_kind == PMXFK_DOUBLE) {
+			v = 0;
+			for (j = 0; j < 8; j++) {
+				if (pmx_br_byte(pbr, &b) != 0) {
+					return (-1);
+				}
+				v |= (uint64_t)b << (8 * j);
+			}
+		} else if (pmx_br_varint(pbr, &v) != 0) {
+			return (-1);
+		}
+
+		fields[i] = v;
+	}
+
+	pmx_node_begin(pbr->pbr_dst, (pmx_value_t)ident, subtype);
+	for (i = 0; i < schema->pxn_nfields; i++) {
+		if ((mask & (1U << i)) != 0) {
+			pmx_node_field(pbr->pbr_dst, i, fields[i]);
+		}
+	}
+
+	pmx_node_end(pbr->pbr_dst);
+	return (0);
+}
+
+/*
+ * Reads a name record whose tag has already been read.  Names are only
+ * remembered here: the destination stream interns them itself as edges that
+ * use them are replayed.
+ */
+static int
+pmx_br_name(pmx_binreader_t *pbr)
+{
+	uint64_t id;
+	size_t len, newcap;
+	char **newnames, *name;
+
+	if (pmx_br_varint(pbr, &id) != 0 || pmx_br_str(pbr, &len) != 0) {
+		return (-1);
+	}
+
+	if (id != pbr->pbr_nnames) {
+		pmx_br_error(pbr, "name %" PRIu64 " out of sequence", id);
+		return (-1);
+	}
+
+	if (strlen((char *)pbr->pbr_scratch) != len) {
+		pmx_br_error(pbr, "name %" PRIu64 " contains NUL byte", id);
+		return (-1);
+	}
+
+	if (pbr->pbr_nnames == pbr->pbr_namecap) {
+		newcap = pbr->pbr_namecap == 0 ? 64 : 2 * pbr->pbr_namecap;
+		newnames = realloc(pbr->pbr_names, newcap * sizeof (char *));
+		if (newnames == NULL) {
+			pmx_set_errno(pbr->pbr_dst, PMXE_ENOMEM);
+			pbr->pbr_failed = 1;
+			return (-1);
+		}
+
+		pbr->pbr_names = newnames;
+		pbr->pbr_namecap = newcap;
+	}
+
+	name = pmx_br_strcopy(pbr, len);
+	if (name == NULL) {
+		pmx_set_errno(pbr->pbr_dst, PMXE_ENOMEM);
+		pbr->pbr_failed = 1;
+		return (-1);
+	}
+
+	pbr->pbr_names[pbr->pbr_nnames++] = name;
+	return (0);
+}
+
+/*
+ * Reads a content record whose tag has already been read and saves the
+ * contents for later string reference records.
+ */
+static int
+pmx_br_content(pmx_binreader_t *pbr)
+{
+	uint64_t id;
+	size_t len, newcap;
+	pmx_brcontent_t *newcontents, *pbc;
+
+	if (pmx_br_varint(pbr, &id) != 0 || pmx_br_str(pbr, &len) != 0) {
+		return (-1);
+	}
+
+	if (id != pbr->pbr_ncontents) {
+		pmx_br_error(pbr, "content %" PRIu64 " out of sequence", id);
+		return (-1);
+	}
+
+	if (pbr->pbr_ncontents == pbr->pbr_contentcap) {
+		newcap = pbr->pbr_contentcap == 0 ? 64 :
+		    2 * pbr->pbr_contentcap;
+		newcontents = realloc(pbr->pbr_contents,
+		    newcap * sizeof (pmx_brcontent_t));
+		if (newcontents == NULL) {
+			pmx_set_errno(pbr->pbr_dst, PMXE_ENOMEM);
+			pbr->pbr_failed = 1;
+			return (-1);
+		}
+
+		pbr->pbr_contents = newcontents;
+		pbr->pbr_contentcap = newcap;
+	}
+
+	pbc = &pbr->pbr_contents[pbr->pbr_ncontents];
+	pbc->pbc_data = malloc(len > 0 ? len : 1);
+	if (pbc->pbc_data == NULL) {
+		pmx_set_errno(pbr->pbr_dst, PMXE_ENOMEM);
+		pbr->pbr_failed = 1;
+		return (-1);
+	}
+
+	(void) memcpy(pbc->pbc_data, pbr->pbr_scratch, len);
+	pbc->pbc_len = len;
+	pbr->pbr_ncontents++;
+	return (0);
+}
+
+/*
+ * Reads a string reference record whose tag has already been read and emits
+ * the referenced contents as ordinary string data.  (If "dst" also interns
+ * strings, they'll be interned again there.)
+ */
+static int
+pmx_br_stringref(pmx_binreader_t *pbr)
+{
+	uint64_t ident, id;
+	pmx_brcontent_t *pbc;
+
+	if (pmx_br_varint(pbr, &ident) != 0 || pmx_br_varint(pbr, &id) != 0) {
+		return (-1);
+	}
+
+	if (id >= pbr->pbr_ncontents) {
+		pmx_br_error(pbr, "string 0x%" PRIx64 ": unknown content %"
+		    PRIu64, ident, id);
+		return (-1);
+	}
+
+	pbc = &pbr->pbr_contents[id];
+	pmx_emit_string_data(pbr->pbr_dst, (pmx_value_t)ident, pbc->pbc_len,
+	    pbc->pbc_data);
+	return (0);
+}
+
+/*
+ * Reads an edge record whose tag has already been read and replays each of its
+ * edges.
+ */
+static int
+pmx_br_edges(pmx_binreader_t *pbr)
+{
+	uint8_t entry[PMXB_EDGE_SIZE];
+	uint64_t source, count, key, target;
+	pmx_edgetype_t kind;
+	const char *name;
+	uint64_t i;
+	size_t j;
+
+	if (pmx_br_varint(pbr, &source) != 0 ||
+	    pmx_br_varint(pbr, &count) != 0) {
+		return (-1);
+	}
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < sizeof (entry); j++) {
+			if (pmx_br_byte(pbr, &entry[j]) != 0) {
+				return (-1);
+			}
+		}
+
+		kind = entry[0];
+		target = pmx_u64_decode(&entry[1]);
+		key = pmx_u64_decode(&entry[9]);
+		name = NULL;
+		switch (kind) {
+		case PMXEG_PROPERTY:
+		case PMXEG_VARIABLE:
+			if (key >= pbr->pbr_nnames) {
+				pmx_br_error(pbr, "undefined name: %" PRIu64,
+				    key);
+				return (-1);
+			}
+			name = pbr->pbr_names[key];
+			break;
+
+		case PMXEG_ELEMENT:
+		case PMXEG_SMI_ELEMENT:
+			break;
+
+		default:
+			pmx_br_error(pbr, "unknown edge type: %u", entry[0]);
+			return (-1);
+		}
+
+		pmx_edge_add(pbr->pbr_dst, (pmx_value_t)source, kind,
+		    (pmx_value_t)target, key, name);
+	}
+
+	return (0);
+}
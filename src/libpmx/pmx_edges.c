@@ -0,0 +1,273 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_edges.c: emitting edges (object properties, array elements, and closure
+ * variables)
+ *
+ * Heaps typically have several times as many edges as nodes, so edges are not
+ * handed to the backend one at a time.  Instead, the front-end appends each
+ * edge to a fixed-size buffer of pmx_edge_t records, and the buffer is handed
+ * to the backend whenever it fills up, the source node changes, or the source
+ * node is finished.  Backends can then write out a whole batch of fixed-width
+ * records in a tight loop.
+ *
+ * Property and variable names are usually drawn from a small set, so rather
+ * than repeating them on every edge, each stream interns them in a hash table
+ * that assigns each distinct name a small integer id.  The backend is told
+ * about each name once (with pxb_edgename) and edges refer to the name by id.
+ * The edge buffer, the table, and the names are all allocated from the
+ * stream's arena.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/* Initial number of slots in the name table (must be a power of 2). */
+#define	PMX_NAMES_INITCAP	256
+
+static const char *pmx_name_intern(pmx_stream_t *, const char *, uint64_t *);
+static int pmx_names_grow(pmx_stream_t *);
+static uint64_t pmx_name_hash(const char *);
+
+int
+pmx_edges_init(pmx_stream_t *pmxp)
+{
+	pmxp->pxs_edges = pmx_arena_alloc(pmxp->pxs_arena,
+	    PMX_EDGEBATCH * sizeof (pmx_edge_t));
+	pmxp->pxs_names = pmx_arena_zalloc(pmxp->pxs_arena,
+	    PMX_NAMES_INITCAP * sizeof (pmx_name_t));
+	if (pmxp->pxs_edges == NULL || pmxp->pxs_names == NULL) {
+		return (-1);
+	}
+
+	pmxp->pxs_namecap = PMX_NAMES_INITCAP;
+	return (0);
+}
+
+/*
+ * Appends an edge from "source" to "target" to the edge buffer.  "index" is
+ * used for array elements, and "name" for properties and variables.  Callers
+ * are responsible for validating the edge against the current node; this is
+ * also used to replay edges from an existing export.
+ */
+void
+pmx_edge_add(pmx_stream_t *pmxp, pmx_value_t source, pmx_edgetype_t kind,
+    pmx_value_t target, uint64_t index, const char *name)
+{
+	pmx_edge_t *edge;
+	uint64_t nameid;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP || pmxp->pxs_state == PMXS_NODE);
+	VERIFY(kind != PMXEG_NONE);
+
+	/* Counted even if it fails, since the caller has emitted it. */
+	pmxp->pxs_nodeedges++;
+	if (pmxp->pxs_nbuffered > 0 && (pmxp->pxs_edgesource != source ||
+	    pmxp->pxs_nbuffered == PMX_EDGEBATCH)) {
+		pmx_edges_flush(pmxp);
+	}
+
+	edge = &pmxp->pxs_edges[pmxp->pxs_nbuffered];
+	edge->pxe_kind = kind;
+	edge->pxe_target = target;
+	if (kind == PMXEG_PROPERTY || kind == PMXEG_VARIABLE) {
+		VERIFY(name != NULL);
+		edge->pxe_name = pmx_name_intern(pmxp, name, &nameid);
+		if (edge->pxe_name == NULL) {
+			return;
+		}
+		edge->pxe_key = nameid;
+	} else {
+		edge->pxe_name = NULL;
+		edge->pxe_key = index;
+	}
+
+	pmxp->pxs_edgesource = source;
+	pmxp->pxs_nbuffered++;
+	pmxp->pxs_nedges++;
+}
+
+/*
+ * Hands any buffered edges to the backend.
+ */
+void
+pmx_edges_flush(pmx_stream_t *pmxp)
+{
+	uint64_t start;
+
+	if (pmxp->pxs_nbuffered == 0) {
+		return;
+	}
+
+	if (pmxp->pxs_validator != NULL) {
+		pmx_validate_edges(pmxp, pmxp->pxs_edges, pmxp->pxs_nbuffered);
+	}
+
+	if (pmxp->pxs_indexer != NULL) {
+		pmx_index_edges(pmxp, pmxp->pxs_edgesource);
+	}
+
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_edges(pmxp, pmxp->pxs_edgesource,
+	    pmxp->pxs_edges, pmxp->pxs_nbuffered);
+	pmx_stats_record(pmxp, PMXR_EDGES, pmxp->pxs_nbuffered, start);
+	pmxp->pxs_nbuffered = 0;
+}
+
+/*
+ * Name table.  This is an open-addressing hash table with linear probing whose
+ * capacity is always a power of 2 and which is kept at most half full.  Names
+ * are never removed.  Returns the interned copy of "name" (which remains valid
+ * until the stream is freed) and stores its id into "idp", or returns NULL on
+ * allocation failure.
+ */
+static const char *
+pmx_name_intern(pmx_stream_t *pmxp, const char *name, uint64_t *idp)
+{
+	pmx_name_t *slot;
+	size_t mask, i;
+	uint64_t start;
+	char *copy;
+	size_t len;
+
+	if (2 * (pmxp->pxs_nnames + 1) > pmxp->pxs_namecap &&
+	    pmx_names_grow(pmxp) != 0) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (NULL);
+	}
+
+	mask = pmxp->pxs_namecap - 1;
+	for (i = pmx_name_hash(name) & mask; ; i = (i + 1) & mask) {
+		slot = &pmxp->pxs_names[i];
+		if (slot->pnm_name == NULL) {
+			break;
+		}
+
+		if (strcmp(slot->pnm_name, name) == 0) {
+			*idp = slot->pnm_id;
+			return (slot->pnm_name);
+		}
+	}
+
+	len = strlen(name) + 1;
+	copy = pmx_arena_alloc(pmxp->pxs_arena, len);
+	if (copy == NULL) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (NULL);
+	}
+
+	(void) memcpy(copy, name, len);
+
+	slot->pnm_name = copy;
+	slot->pnm_id = pmxp->pxs_nnames++;
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_edgename(pmxp, slot->pnm_id, copy);
+	pmx_stats_record(pmxp, PMXR_NAME, 1, start);
+	*idp = slot->pnm_id;
+	return (copy);
+}
+
+static int
+pmx_names_grow(pmx_stream_t *pmxp)
+{
+	pmx_name_t *newnames, *oldnames;
+	size_t newcap, oldcap, mask, i, j;
+
+	oldnames = pmxp->pxs_names;
+	oldcap = pmxp->pxs_namecap;
+	newcap = 2 * oldcap;
+	newnames = pmx_arena_zalloc(pmxp->pxs_arena,
+	    newcap * sizeof (pmx_name_t));
+	if (newnames == NULL) {
+		return (-1);
+	}
+
+	mask = newcap - 1;
+	for (i = 0; i < oldcap; i++) {
+		if (oldnames[i].pnm_name == NULL) {
+			continue;
+		}
+
+		j = pmx_name_hash(oldnames[i].pnm_name) & mask;
+		while (newnames[j].pnm_name != NULL) {
+			j = (j + 1) & mask;
+		}
+
+		newnames[j] = oldnames[i];
+	}
+
+	pmx_arena_free(pmxp->pxs_arena, oldnames, oldcap * sizeof (pmx_name_t));
+	pmxp->pxs_names = newnames;
+	pmxp->pxs_namecap = newcap;
+	return (0);
+}
+
+/*
+ * FNV-1a
+ */
+static uint64_t
+pmx_name_hash(const char *name)
+{
+	const unsigned char *p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (p = (const unsigned char *)name; *p != '\0'; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+
+	return (h);
+}
+
+/*
+ * Public interfaces.  Properties and closure variables may be emitted at any
+ * point between the corresponding pmx_object_start() or pmx_closure_start()
+ * and the matching "done" call.  Array elements are emitted after pmx_array(),
+ * in order, and the array is finished automatically after the last element.
+ */
+
+void
+pmx_object_property(pmx_stream_t *pmxp, pmx_value_t object, pmx_value_t value,
+    const char *name)
+{
+	VERIFY(pmxp->pxs_state == PMXS_NODE);
+	VERIFY(pmxp->pxs_subtype == PMXN_OBJECT);
+	VERIFY(pmxp->pxs_ident == object);
+	pmx_edge_add(pmxp, object, PMXEG_PROPERTY, value, 0, name);
+}
+
+void
+pmx_closure_variable(pmx_stream_t *pmxp, pmx_value_t value, const char *name)
+{
+	VERIFY(pmxp->pxs_state == PMXS_NODE);
+	VERIFY(pmxp->pxs_subtype == PMXN_CLOSURE);
+	pmx_edge_add(pmxp, pmxp->pxs_ident, PMXEG_VARIABLE, value, 0, name);
+}
+
+void
+pmx_array_element(pmx_stream_t *pmxp, pmx_value_t array, pmx_value_t value,
+    int issmi, size_t index)
+{
+	VERIFY(pmxp->pxs_state == PMXS_NODE);
+	VERIFY(pmxp->pxs_subtype == PMXN_ARRAY);
+	VERIFY(pmxp->pxs_ident == array);
+	VERIFY(index == pmxp->pxs_nodeedges);
+	VERIFY(index < pmxp->pxs_nelements);
+
+	pmx_edge_add(pmxp, array, issmi ? PMXEG_SMI_ELEMENT : PMXEG_ELEMENT,
+	    value, index, NULL);
+	if (pmxp->pxs_nodeedges == pmxp->pxs_nelements) {
+		pmx_node_end(pmxp);
+	}
+}
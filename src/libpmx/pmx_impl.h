@@ -33,6 +33,32 @@ typedef enum {
 	PMXS_FINI,	/* no more output accepted */
 } pmx_state_t;
 
+/*
+ * Oddballs, each of which should be emitted at most once per export.
+ */
+typedef enum {
+	PMXO_HOLE,
+	PMXO_NULL,
+	PMXO_UNDEFINED,
+	PMXO_TRUE,
+	PMXO_FALSE,
+} pmx_oddball_t;
+
+#define	PMXO_NTYPES		(PMXO_FALSE + 1)
+
+/*
+ * Oddballs emitted by a stream or any of its shards.  The first stream to
+ * claim an oddball sets poc_claimed atomically.  Once the stream has shards,
+ * whichever stream claims an oddball records it here, and the parent emits it
+ * when it's finished.
+ */
+typedef struct {
+	int		poc_claimed;
+	pmx_boolean_t	poc_pending;
+	pmx_value_t	poc_ident;
+	pmx_value_t	poc_label;
+} pmx_oddclaim_t;
+
 /*
  * These values are defined in the specification.
  * XXX Not yet, but they should be.
@@ -50,6 +76,173 @@ typedef enum {
 	PMXN_CLOSURE		= 9,
 } pmx_nodetype_t;
 
+/* This must match PMX_NODE_NTYPES in pmx.h. */
+#define	PMXN_NTYPES		(PMXN_CLOSURE + 1)
+
+/*
+ * Each node type has a fixed list of fields, described by a pmx_nodeschema_t in
+ * pmx_node_schemas[] (indexed by pmx_nodetype_t).  Emitters record each field
+ * by its index in that list.  Output backends use the schema to label fields
+ * (in the JSON backend) or to lay out fixed-format records (in the binary
+ * backend).  The field indexes for each node type are defined below, and they
+ * must match the order of pmx_node_schemas[].
+ */
+#define	PMX_MAXFIELDS	3
+
+typedef enum {
+	PMXFK_REF,		/* reference to another node or string */
+	PMXFK_UINT,		/* unsigned integer */
+	PMXFK_DOUBLE,		/* double-precision floating-point value */
+} pmx_fieldkind_t;
+
+typedef struct {
+	const char	*pxf_label;	/* field name in JSON output */
+	pmx_fieldkind_t	pxf_kind;	/* type of value */
+} pmx_fielddesc_t;
+
+typedef struct {
+	const char	*pxn_name;	/* human-readable name of node type */
+	unsigned int	pxn_nfields;	/* number of valid pxn_fields */
+	pmx_fielddesc_t	pxn_fields[PMX_MAXFIELDS];
+} pmx_nodeschema_t;
+
+extern const pmx_nodeschema_t pmx_node_schemas[PMXN_NTYPES];
+
+#define	PMXFD_ODDBALL_NAME		0
+#define	PMXFD_HEAPNUMBER_VALUE		0
+#define	PMXFD_DATE_TIMESTAMP		0
+#define	PMXFD_STRING_FLAT_LENGTH	0
+#define	PMXFD_STRING_FLAT_DATA		1
+#define	PMXFD_STRING_CONS_LENGTH	0
+#define	PMXFD_STRING_CONS_S1		1
+#define	PMXFD_STRING_CONS_S2		2
+#define	PMXFD_OBJECT_CONSTRUCTOR	0
+#define	PMXFD_ARRAY_LENGTH		0
+#define	PMXFD_FUNCINFO_NAME		0
+#define	PMXFD_FUNCINFO_SCRIPT_NAME	1
+#define	PMXFD_FUNCINFO_POSITION		2
+#define	PMXFD_CLOSURE_METADATA		0
+#define	PMXFD_CLOSURE_PARENT		1
+
+/*
+ * Edges describe references from one node (the "source") to another (the
+ * "target").  Edges are emitted while the source node is being emitted, and
+ * they're buffered by the front-end and handed to the backend in batches of up
+ * to PMX_EDGEBATCH edges, all with the same source.  All of the edges for a
+ * node are handed to the backend before the node itself.
+ *
+ * Properties and closure variables are identified by name.  Names are interned
+ * in a per-stream table that assigns each distinct name an integer id, and the
+ * backend is told about each name (with pxb_edgename) before it's first used.
+ * Array elements are identified by index.
+ */
+typedef enum {
+	PMXEG_NONE		= 0,
+	PMXEG_PROPERTY		= 1,	/* object property (by name) */
+	PMXEG_ELEMENT		= 2,	/* array element (by index) */
+	PMXEG_VARIABLE		= 3,	/* closure variable (by name) */
+	PMXEG_SMI_ELEMENT	= 4,	/* array element that's a small int */
+} pmx_edgetype_t;
+
+typedef struct {
+	pmx_edgetype_t	pxe_kind;
+	pmx_value_t	pxe_target;	/* referenced node (or value) */
+	uint64_t	pxe_key;	/* element index or name id */
+	const char	*pxe_name;	/* name (properties and variables) */
+} pmx_edge_t;
+
+#define	PMX_EDGEBATCH	4096
+
+typedef struct {
+	char		*pnm_name;
+	uint64_t	pnm_id;
+} pmx_name_t;
+
+/*
+ * Size of the output buffers used by the binary and JSON backends.  Each full
+ * buffer is handed to pmx_output_write().
+ */
+#define	PMX_BINBUFSZ	(1024 * 1024)
+#define	PMX_JSONBUFSZ	(64 * 1024)
+
+/*
+ * The largest file offset, for checking offsets before converting them to
+ * off_t.  The build uses 64-bit file offsets everywhere (see the Makefile),
+ * but there's no standard macro for this.
+ */
+#define	PMX_OFF_MAX	(((uint64_t)1 << (sizeof (off_t) * 8 - 1)) - 1)
+
+/*
+ * Output backends.  The front-end (pmx_subr.c) validates the sequence of calls
+ * made by the consumer and collects the contents of each record.  It then
+ * hands each record to the stream's backend, which serializes it.  Backends
+ * provide:
+ *
+ *     pxb_init		set up backend state on the stream; returns 0 on
+ *     			success.  Failures other than allocation failures
+ *     			should be reported with pmx_warn().
+ *
+ *     pxb_fini		release backend state (which may be only partially
+ *     			initialized if pxb_init failed)
+ *
+ *     pxb_done		complete the output, emitting any trailer and writing
+ *     			out buffered output
+ *
+ *     pxb_check	optional: report errors that the backend records
+ *     			lazily (see pmx_errno())
+ *
+ *     pxb_metadata	emit a metadata record
+ *
+ *     pxb_node		emit the node described by pxs_subtype, pxs_ident,
+ *     			pxs_fields, and pxs_fieldmask
+ *
+ *     pxb_string	emit string data
+ *
+ *     pxb_edgename	record a newly-interned property or variable name
+ *
+ *     pxb_content	emit interned string contents with the given content id
+ *     			(see pmx_strtab.c)
+ *
+ *     pxb_stringref	emit string data that refers to interned contents
+ *
+ *     pxb_edges	emit a batch of edges from one source node
+ *
+ * Backends report errors with pmx_error().
+ */
+typedef struct {
+	const char	*pxb_name;
+	int		(*pxb_init)(pmx_stream_t *);
+	void		(*pxb_fini)(pmx_stream_t *);
+	void		(*pxb_done)(pmx_stream_t *);
+	void		(*pxb_check)(pmx_stream_t *);
+	void		(*pxb_metadata)(pmx_stream_t *, const char *,
+			    const char *);
+	void		(*pxb_node)(pmx_stream_t *);
+	void		(*pxb_string)(pmx_stream_t *, pmx_value_t, size_t,
+			    const uint8_t *);
+	void		(*pxb_edgename)(pmx_stream_t *, uint64_t, const char *);
+	void		(*pxb_content)(pmx_stream_t *, uint64_t, size_t,
+			    const uint8_t *);
+	void		(*pxb_stringref)(pmx_stream_t *, pmx_value_t,
+			    uint64_t);
+	void		(*pxb_edges)(pmx_stream_t *, pmx_value_t,
+			    const pmx_edge_t *, size_t);
+} pmx_backend_t;
+
+extern const pmx_backend_t pmx_backend_json;
+extern const pmx_backend_t pmx_backend_binary;
+extern const pmx_backend_t pmx_backend_sqlite;
+extern const pmx_backend_t pmx_backend_null;
+
+typedef struct pmx_sqlite pmx_sqlite_t;
+typedef struct pmx_gzip pmx_gzip_t;
+typedef struct pmx_async pmx_async_t;
+typedef struct pmx_map pmx_map_t;
+typedef struct pmx_strtab pmx_strtab_t;
+typedef struct pmx_arena pmx_arena_t;
+typedef struct pmx_validator pmx_validator_t;
+typedef struct pmx_indexer pmx_indexer_t;
+
 /*
  * A pmx_stream_t represents an export operation.  The stream progresses through
  * the states above, and the end result is a representation of JavaScript state
@@ -60,29 +253,110 @@ struct pmx_stream {
 	pmx_state_t	pxs_state;
 	pmx_nodetype_t	pxs_subtype;
 
-	/* output and error streams */
+	/* memory for the stream's state (see pmx_arena.c) */
+	pmx_arena_t	*pxs_arena;
+
+	/*
+	 * For shards (see pmx_create_shard()), the stream whose export this
+	 * is part of.  pxs_oddballs and pxs_sharded are only used on streams
+	 * that aren't shards.
+	 */
+	pmx_stream_t	*pxs_parent;
+	pmx_oddclaim_t	pxs_oddballs[PMXO_NTYPES];
+	pmx_boolean_t	pxs_sharded;	/* shards have been created */
+
+	/* output format and backend, output and error streams */
+	pmx_format_t	pxs_format;
+	const pmx_backend_t *pxs_backend;
 	FILE		*pxs_outstream;
+	const char	*pxs_outpath;		/* only during pxb_init */
 	FILE		*pxs_errstream;
-	json_emit_t	*pxs_jsonout;
+	json_emit_t	*pxs_jsonout;		/* PMXF_JSON only */
+	uint8_t		*pxs_binbuf;		/* PMXF_BINARY only */
+	size_t		pxs_binbufused;		/* PMXF_BINARY only */
+	pmx_sqlite_t	*pxs_sqlite;		/* PMXF_SQLITE only */
+
+	/*
+	 * Output stage (see pmx_output.c): compression, the writer thread,
+	 * the mapped output file or file descriptor (either of which replaces
+	 * pxs_outstream), and counts
+	 * of bytes handed to pmx_output_write() and bytes written out.
+	 */
+	pmx_compress_t	pxs_compress;
+	FILE		*pxs_indexstream;	/* PMXC_GZIP only */
+	pmx_gzip_t	*pxs_gzip;		/* PMXC_GZIP only */
+	pmx_async_t	*pxs_async;		/* pipelined output only */
+	pmx_map_t	*pxs_map;		/* mapped output file only */
+	pmx_boolean_t	pxs_static;		/* no malloc() or stdio */
+	int		pxs_outfd;		/* static streams, else -1 */
+	unsigned int	pxs_mapflags;		/* pmx_mmap_flag_t */
+	uint64_t	pxs_nbytesraw;
+	uint64_t	pxs_nbytesout;
+
+	/*
+	 * The node currently being emitted.  Fields are collected here as the
+	 * caller supplies them and the whole node is handed to the backend
+	 * when the node is finished.  pxs_fieldmask has bit "i" set if field
+	 * "i" of the node's schema has been supplied.
+	 */
+	pmx_value_t	pxs_ident;
+	uint64_t	pxs_fields[PMX_MAXFIELDS];
+	unsigned int	pxs_fieldmask;
+
+	/*
+	 * Edges not yet handed to the backend, all from pxs_edgesource.
+	 * pxs_nodeedges counts all edges emitted for the current node, and
+	 * for arrays, pxs_nelements is the number of elements expected.
+	 */
+	pmx_edge_t	*pxs_edges;
+	size_t		pxs_nbuffered;
+	pmx_value_t	pxs_edgesource;
+	size_t		pxs_nodeedges;
+	size_t		pxs_nelements;
+
+	/* interned names (open-addressing hash table) */
+	pmx_name_t	*pxs_names;
+	size_t		pxs_namecap;
+	size_t		pxs_nnames;
+
+	/* interned string contents (see pmx_strtab.c) */
+	pmx_strtab_t	*pxs_strtab;
+
+	/* references checked so far (see pmx_validate.c) */
+	pmx_validator_t	*pxs_validator;
+
+	/* where values have been written (see pmx_index.c) */
+	pmx_indexer_t	*pxs_indexer;
 
 	/* most recent error code and message */
 	pmx_error_t	pxs_error;
 	char		pxs_errmsg[PMX_ERRMSGLEN];
 
 	/* booleans and counters used to help validate output */
-	pmx_boolean_t	pxs_emitted_hole;
-	pmx_boolean_t	pxs_emitted_null;
-	pmx_boolean_t	pxs_emitted_undefined;
-	pmx_boolean_t	pxs_emitted_true;
-	pmx_boolean_t	pxs_emitted_false;
+	pmx_boolean_t	pxs_emitted[PMXO_NTYPES];	/* by this stream */
 	unsigned long	pxs_nwarnings;
 	unsigned long	pxs_nfields;
-	/* XXX need way for callers to check for warnings */
 
 	/* counters (primarily for debugging) */
 	unsigned long	pxs_nmetadata;
 	unsigned long	pxs_nnodes;
 	unsigned long	pxs_nedges;
+
+	/*
+	 * Statistics reported by pmx_stats() (see pmx_stats.c).  pxs_statpos
+	 * is the position in the output just after the last record counted.
+	 * With pmx_stats_timing(), pxs_timebase and pxs_tickbase record when
+	 * timing started (on the clock and the cycle counter), and the tick
+	 * counts accumulate the time spent in the backend (which includes the
+	 * output stage) and in the output stage.
+	 */
+	pmx_stats_t	pxs_stats;
+	uint64_t	pxs_statpos;
+	pmx_boolean_t	pxs_timed;
+	uint64_t	pxs_timebase;
+	uint64_t	pxs_tickbase;
+	uint64_t	pxs_backendticks;
+	uint64_t	pxs_outputticks;
 };
 
 /*
@@ -109,6 +383,109 @@ PMX_NORETURN extern void pmx_vpanic(const char *, va_list);
 
 pmx_boolean_t pmx_cstr_printable(const char *);
 
+/*
+ * Emitter front-end functions used by importers to replay records directly.
+ */
+extern void pmx_node_begin(pmx_stream_t *, pmx_value_t, pmx_nodetype_t);
+extern void pmx_node_field(pmx_stream_t *, unsigned int, uint64_t);
+extern void pmx_node_field_double(pmx_stream_t *, unsigned int, double);
+extern void pmx_node_end(pmx_stream_t *);
+extern void pmx_edge_add(pmx_stream_t *, pmx_value_t, pmx_edgetype_t,
+    pmx_value_t, uint64_t, const char *);
+extern void pmx_edges_flush(pmx_stream_t *);
+
+extern int pmx_edges_init(pmx_stream_t *);
+
+extern int pmx_output_init(pmx_stream_t *);
+extern void pmx_output_fini(pmx_stream_t *);
+extern int pmx_output_write(pmx_stream_t *, const void *, size_t);
+extern void pmx_output_flush(pmx_stream_t *);
+extern int pmx_output_async(pmx_stream_t *, unsigned int);
+extern void pmx_output_check(pmx_stream_t *);
+
+extern pmx_arena_t *pmx_arena_create(void *, size_t);
+extern void pmx_arena_destroy(pmx_arena_t *);
+extern void *pmx_arena_alloc(pmx_arena_t *, size_t);
+extern void *pmx_arena_zalloc(pmx_arena_t *, size_t);
+extern void pmx_arena_free(pmx_arena_t *, void *, size_t);
+extern void pmx_arena_usage(pmx_arena_t *, size_t *, size_t *);
+
+extern int pmx_strtab_emit(pmx_stream_t *, pmx_value_t, size_t,
+    const uint8_t *);
+
+extern void pmx_stats_init(pmx_stream_t *);
+extern void pmx_stats_record(pmx_stream_t *, pmx_rectype_t, uint64_t,
+    uint64_t);
+extern uint64_t pmx_stats_ticks(void);
+
+/*
+ * Backend calls are bracketed by PMX_STATS_START(), which reads the cycle
+ * counter only if the stream is being timed, and pmx_stats_record().
+ */
+#define	PMX_STATS_START(pmxp)	((pmxp)->pxs_timed ? pmx_stats_ticks() : 0)
+
+/*
+ * Static tracepoints.  Where the systemtap-compatible <sys/sdt.h> is available
+ * (as it is on most Linux systems, and can be disabled by defining PMX_NOSDT),
+ * each of these is a USDT probe in the "pmx" provider, which compiles to a
+ * single nop that tools like perf and bpftrace can enable in a running
+ * process.  Elsewhere they compile to nothing.  Arguments should be cheap to
+ * compute and free of side effects, since they're evaluated (into registers
+ * or memory operands) whether or not the probe is enabled.
+ *
+ *     node_begin	subtype, ident	pmx_node_begin() and batched nodes
+ *     node_end		subtype, ident	node handed to the backend
+ *     string		ident, length	pmx_emit_string_data()
+ *     write_start	nbytes		output handed to the output stage
+ *     write_done	nbytes, rv	... done (rv is 0 or -1)
+ *     flush_start			output stage flushed at end of export
+ *     flush_done	nbytesout	... done, with the total bytes written
+ *     error		code, message	error recorded on the stream
+ *     warn		format		warning reported on the stream
+ *
+ * Latency is measured by tracing the time between the matching "begin" (or
+ * "start") and "end" (or "done") probes on the same thread.  See the examples
+ * in tools/bpftrace.
+ */
+#if !defined(PMX_NOSDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef STAP_PROBE
+#define	PMX_PROBE0(name)		STAP_PROBE(pmx, name)
+#define	PMX_PROBE1(name, a1)		STAP_PROBE1(pmx, name, a1)
+#define	PMX_PROBE2(name, a1, a2)	STAP_PROBE2(pmx, name, a1, a2)
+#else
+#define	PMX_PROBE0(name)
+#define	PMX_PROBE1(name, a1)		((void) (a1))
+#define	PMX_PROBE2(name, a1, a2)	((void) (a1), (void) (a2))
+#endif
+
+extern void pmx_validate_node(pmx_stream_t *);
+extern void pmx_validate_edges(pmx_stream_t *, const pmx_edge_t *, size_t);
+extern void pmx_validate_string(pmx_stream_t *, pmx_value_t);
+extern void pmx_validate_report(pmx_stream_t *);
+
+extern void pmx_index_edges(pmx_stream_t *, pmx_value_t);
+extern void pmx_index_mark(pmx_stream_t *, pmx_value_t);
+extern void pmx_index_add(pmx_stream_t *, pmx_value_t);
+extern void pmx_index_finish(pmx_stream_t *);
+extern void pmx_index_fini(pmx_stream_t *);
+
+extern void pmx_reader_reset(pmx_reader_t *, const char *, size_t,
+    uint64_t);
+
+extern int pmx_map_init(pmx_stream_t *, const char *, unsigned int);
+extern void pmx_map_fini(pmx_stream_t *);
+extern int pmx_map_write(pmx_map_t *, const void *, size_t);
+extern int pmx_map_finish(pmx_map_t *);
+
+extern uint8_t *pmx_varint_encode(uint8_t *, uint64_t);
+extern uint8_t *pmx_u64_encode(uint8_t *, uint64_t);
+extern uint64_t pmx_u64_decode(const uint8_t *);
+
 #define	VERIFY(X) ((void)((X) || pmx_assfail(#X, __FILE__, __LINE__)))
 
 #endif /* not defined _PMX_IMPL_H */
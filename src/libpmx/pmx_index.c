@@ -0,0 +1,826 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_index.c: indexing JSON exports by value
+ *
+ * Tools that examine an export tend to jump from value to value by ident,
+ * following references, and scanning a multi-gigabyte export for each one is
+ * far too slow.  After pmx_index_values(), the stream writes a separate index
+ * that maps each value (node or string data) to the range of the export that
+ * holds its records.  For a node, that range starts with the edge records for
+ * the node, since the front-end always hands those to the backend just before
+ * the node itself, so a single read returns the node and everything it refers
+ * to.  The index looks like:
+ *
+ *     header	"PMXV" (4 bytes), version (1 byte), 3 reserved bytes,
+ *     		number of entries (8 bytes), number of names (8 bytes),
+ *     		size of the export (8 bytes)
+ *
+ *     entries	one per value, sorted by ident and then by offset: ident
+ *     		(8 bytes), offset of the value's records in the export
+ *     		(8 bytes), length of the value's records (8 bytes)
+ *
+ *     names	one per property or variable name, in order of id: length
+ *     		(8 bytes), followed by the name itself
+ *
+ * All integers are unsigned, least significant byte first (as in the gzip
+ * index described in pmx_output.c).  The names are included so that the edges
+ * returned by a lookup can be interpreted without reading the rest of the
+ * export.  pmx_index_open() maps the index, and pmx_index_lookup() finds a
+ * value with a binary search of the entries and reads its records with one
+ * pread(2).
+ *
+ * Building the index
+ *
+ * Values are emitted in whatever order the caller walks the heap, so the
+ * entries must be sorted, and there may be far too many to keep in memory.
+ * They're collected in a buffer of PMX_INDEX_RUNCAP entries, and whenever that
+ * fills up, it's sorted and appended to a temporary file as a "run".  When the
+ * stream is finished, if no runs were written, the buffer is sorted and written
+ * straight to the index.  Otherwise, the last run is written out too, and the
+ * runs are merged: the buffer is divided among them, each part is refilled
+ * from its run as it's consumed, and a heap of the runs ordered by their next
+ * entries picks each entry in turn.  So building the index takes a fixed amount
+ * of memory (allocated from the stream's arena) however large the export is,
+ * plus temporary disk space for the entries.
+ *
+ * The offset of each record is the number of bytes the JSON backend has handed
+ * to the output stage (pxs_nbytesraw) plus the number still buffered in the
+ * emitter.  That's why indexing requires uncompressed JSON output.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+#include <libjsonemitter/jsonemitter.h>
+#include "pmx_impl.h"
+
+#define	PMX_INDEX_MAGIC		"PMXV"
+#define	PMX_INDEX_MAGICLEN	4
+#define	PMX_INDEX_VERSION	1
+#define	PMX_INDEX_HEADERLEN	32
+#define	PMX_INDEX_ENTRYLEN	24
+
+/* Entries sorted in memory at once (see "Building the index" above). */
+#define	PMX_INDEX_RUNCAP	(512 * 1024)
+
+typedef struct {
+	uint64_t	pie_ident;
+	uint64_t	pie_offset;
+	uint64_t	pie_length;
+} pmx_ixent_t;
+
+/*
+ * A run being merged.  pir_buf holds entries read from the run that haven't
+ * been written out yet, starting at pir_next.
+ */
+typedef struct {
+	pmx_ixent_t	*pir_buf;
+	size_t		pir_bufcap;
+	size_t		pir_nbuf;		/* entries in pir_buf */
+	size_t		pir_next;		/* next entry in pir_buf */
+	uint64_t	pir_pos;		/* next entry in the file */
+	uint64_t	pir_end;		/* end of the run in the file */
+} pmx_ixrun_t;
+
+#define	PMX_IXRUN_NEXT(run)	(&(run)->pir_buf[(run)->pir_next])
+
+struct pmx_indexer {
+	FILE		*pi_outstream;		/* the index */
+	FILE		*pi_runstream;		/* sorted runs, if any */
+	pmx_ixent_t	*pi_entries;		/* entries not yet in a run */
+	size_t		pi_nentries;
+	uint64_t	pi_nruns;
+	uint64_t	pi_total;		/* all entries so far */
+	uint64_t	pi_start;		/* start of the current value */
+	pmx_value_t	pi_esource;		/* source of the latest edges */
+	uint64_t	pi_estart;		/* where those edges start */
+};
+
+struct pmx_index {
+	int		pix_fd;			/* the export */
+	uint64_t	pix_size;		/* size of the export */
+	void		*pix_map;		/* the index */
+	size_t		pix_maplen;
+	const uint8_t	*pix_entries;
+	uint64_t	pix_nentries;
+	char		**pix_names;		/* names, indexed by id */
+	char		*pix_namebuf;		/* storage for pix_names */
+	uint64_t	pix_nnames;
+	char		*pix_buf;		/* records from last lookup */
+	size_t		pix_bufsz;
+	pmx_reader_t	*pix_reader;		/* reads pix_buf */
+};
+
+static uint64_t pmx_index_offset(pmx_stream_t *);
+static int pmx_index_spill(pmx_stream_t *);
+static int pmx_index_merge(pmx_stream_t *);
+static int pmx_index_names(pmx_stream_t *);
+static int pmx_index_put(pmx_indexer_t *, const pmx_ixent_t *);
+static int pmx_ixrun_fill(pmx_indexer_t *, pmx_ixrun_t *);
+static void pmx_ixrun_sift(pmx_ixrun_t **, size_t, size_t);
+static int pmx_ixent_compare(const void *, const void *);
+static int pmx_index_pread(int, void *, size_t, uint64_t);
+static int pmx_index_load(pmx_index_t *, const char *, const char *);
+
+/*
+ * Public interfaces.  See pmx_index_values() in pmx.h.
+ */
+
+int
+pmx_index_values(pmx_stream_t *pmxp, FILE *indexfp)
+{
+	pmx_indexer_t *pi;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	VERIFY(pmxp->pxs_parent == NULL);
+	VERIFY(pmxp->pxs_indexer == NULL);
+	VERIFY(pmxp->pxs_strtab == NULL);
+	VERIFY(pmxp->pxs_format == PMXF_JSON);
+	VERIFY(pmxp->pxs_compress == PMXC_NONE);
+	VERIFY(!pmxp->pxs_static);
+	VERIFY(pmxp->pxs_nnodes == 0 && pmxp->pxs_nedges == 0);
+	VERIFY(indexfp != NULL);
+
+	pi = pmx_arena_zalloc(pmxp->pxs_arena, sizeof (*pi));
+	if (pi == NULL) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	pi->pi_entries = pmx_arena_alloc(pmxp->pxs_arena,
+	    PMX_INDEX_RUNCAP * sizeof (pmx_ixent_t));
+	if (pi->pi_entries == NULL) {
+		pmx_arena_free(pmxp->pxs_arena, pi, sizeof (*pi));
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	pi->pi_outstream = indexfp;
+	pmxp->pxs_indexer = pi;
+	return (0);
+}
+
+/*
+ * Front-end hooks.  Edges are handed to pmx_index_edges() as they're flushed.
+ * Each value is bracketed by pmx_index_mark() and pmx_index_add(), which
+ * records everything written in between, together with any edges from the
+ * same value written just before.
+ */
+
+void
+pmx_index_edges(pmx_stream_t *pmxp, pmx_value_t source)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+
+	if (pi->pi_esource != source) {
+		pi->pi_esource = source;
+		pi->pi_estart = pmx_index_offset(pmxp);
+	}
+}
+
+void
+pmx_index_mark(pmx_stream_t *pmxp, pmx_value_t ident)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+
+	if (ident != 0 && pi->pi_esource == ident) {
+		pi->pi_start = pi->pi_estart;
+	} else {
+		pi->pi_start = pmx_index_offset(pmxp);
+	}
+}
+
+void
+pmx_index_add(pmx_stream_t *pmxp, pmx_value_t ident)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+	pmx_ixent_t *pie;
+
+	pi->pi_esource = 0;
+	if (pmxp->pxs_error != PMXE_OK) {
+		return;
+	}
+
+	if (pi->pi_nentries == PMX_INDEX_RUNCAP && pmx_index_spill(pmxp) != 0) {
+		return;
+	}
+
+	pie = &pi->pi_entries[pi->pi_nentries++];
+	pie->pie_ident = ident;
+	pie->pie_offset = pi->pi_start;
+	pie->pie_length = pmx_index_offset(pmxp) - pi->pi_start;
+	pi->pi_total++;
+}
+
+/*
+ * Writes out the index.  This is called once the backend has finished the
+ * export.
+ */
+void
+pmx_index_finish(pmx_stream_t *pmxp)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+	uint8_t header[PMX_INDEX_HEADERLEN];
+	size_t i;
+
+	if (pmxp->pxs_error != PMXE_OK) {
+		return;
+	}
+
+	(void) memset(header, 0, sizeof (header));
+	(void) memcpy(header, PMX_INDEX_MAGIC, PMX_INDEX_MAGICLEN);
+	header[PMX_INDEX_MAGICLEN] = PMX_INDEX_VERSION;
+	(void) pmx_u64_encode(pmx_u64_encode(pmx_u64_encode(header + 8,
+	    pi->pi_total), pmxp->pxs_nnames), pmx_index_offset(pmxp));
+	if (fwrite(header, 1, sizeof (header), pi->pi_outstream) !=
+	    sizeof (header)) {
+		goto fail;
+	}
+
+	if (pi->pi_nruns == 0) {
+		qsort(pi->pi_entries, pi->pi_nentries, sizeof (pmx_ixent_t),
+		    pmx_ixent_compare);
+		for (i = 0; i < pi->pi_nentries; i++) {
+			if (pmx_index_put(pi, &pi->pi_entries[i]) != 0) {
+				goto fail;
+			}
+		}
+	} else if ((pi->pi_nentries > 0 && pmx_index_spill(pmxp) != 0) ||
+	    pmx_index_merge(pmxp) != 0) {
+		return;
+	}
+
+	if (pmx_index_names(pmxp) != 0) {
+		return;
+	}
+
+	if (fflush(pi->pi_outstream) == 0) {
+		return;
+	}
+
+fail:
+	pmx_error(pmxp, PMXE_EIO, "index: write: %s", strerror(errno));
+}
+
+void
+pmx_index_fini(pmx_stream_t *pmxp)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+
+	if (pi->pi_runstream != NULL) {
+		(void) fclose(pi->pi_runstream);
+		pi->pi_runstream = NULL;
+	}
+}
+
+/*
+ * Returns the offset in the export of the next byte to be emitted.
+ */
+static uint64_t
+pmx_index_offset(pmx_stream_t *pmxp)
+{
+	return (pmxp->pxs_nbytesraw + json_nbuffered(pmxp->pxs_jsonout));
+}
+
+/*
+ * Sorts the buffered entries and appends them to the file of runs.
+ */
+static int
+pmx_index_spill(pmx_stream_t *pmxp)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+
+	if (pi->pi_runstream == NULL &&
+	    (pi->pi_runstream = tmpfile()) == NULL) {
+		pmx_error(pmxp, PMXE_EIO, "index: create temporary file: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	qsort(pi->pi_entries, pi->pi_nentries, sizeof (pmx_ixent_t),
+	    pmx_ixent_compare);
+	if (fwrite(pi->pi_entries, sizeof (pmx_ixent_t), pi->pi_nentries,
+	    pi->pi_runstream) != pi->pi_nentries) {
+		pmx_error(pmxp, PMXE_EIO, "index: write temporary file: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	pi->pi_nentries = 0;
+	pi->pi_nruns++;
+	return (0);
+}
+
+/*
+ * Merges the runs (all of which are full-sized except possibly the last) into
+ * the index.
+ */
+static int
+pmx_index_merge(pmx_stream_t *pmxp)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+	pmx_ixrun_t *runs, *run, **heap;
+	size_t nruns, nheap, per, i;
+	int rv = -1;
+
+	if (pi->pi_nruns > PMX_INDEX_RUNCAP) {
+		pmx_error(pmxp, PMXE_ENOMEM, "index: too many values");
+		return (-1);
+	}
+
+	if (fflush(pi->pi_runstream) != 0) {
+		pmx_error(pmxp, PMXE_EIO, "index: write temporary file: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	nruns = (size_t)pi->pi_nruns;
+	runs = pmx_arena_alloc(pmxp->pxs_arena, nruns * sizeof (*runs));
+	heap = pmx_arena_alloc(pmxp->pxs_arena, nruns * sizeof (*heap));
+	if (runs == NULL || heap == NULL) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		goto out;
+	}
+
+	per = PMX_INDEX_RUNCAP / nruns;
+	for (i = 0; i < nruns; i++) {
+		run = &runs[i];
+		run->pir_buf = pi->pi_entries + i * per;
+		run->pir_bufcap = per;
+		run->pir_pos = (uint64_t)i * PMX_INDEX_RUNCAP;
+		run->pir_end = run->pir_pos + PMX_INDEX_RUNCAP;
+		if (run->pir_end > pi->pi_total) {
+			run->pir_end = pi->pi_total;
+		}
+
+		if (pmx_ixrun_fill(pi, run) <= 0) {
+			goto ioerr;
+		}
+
+		heap[i] = run;
+	}
+
+	nheap = nruns;
+	for (i = nheap / 2; i > 0; i--) {
+		pmx_ixrun_sift(heap, nheap, i - 1);
+	}
+
+	while (nheap > 0) {
+		run = heap[0];
+		if (pmx_index_put(pi, PMX_IXRUN_NEXT(run)) != 0) {
+			pmx_error(pmxp, PMXE_EIO, "index: write: %s",
+			    strerror(errno));
+			goto out;
+		}
+
+		if (++run->pir_next == run->pir_nbuf) {
+			switch (pmx_ixrun_fill(pi, run)) {
+			case -1:
+				goto ioerr;
+			case 0:
+				heap[0] = heap[--nheap];
+				break;
+			}
+		}
+
+		pmx_ixrun_sift(heap, nheap, 0);
+	}
+
+	rv = 0;
+	goto out;
+
+ioerr:
+	pmx_error(pmxp, PMXE_EIO, "index: read temporary file: %s",
+	    strerror(errno));
+out:
+	if (heap != NULL) {
+		pmx_arena_free(pmxp->pxs_arena, heap, nruns * sizeof (*heap));
+	}
+	if (runs != NULL) {
+		pmx_arena_free(pmxp->pxs_arena, runs, nruns * sizeof (*runs));
+	}
+	return (rv);
+}
+
+/*
+ * Writes the interned names to the index in order of id.
+ */
+static int
+pmx_index_names(pmx_stream_t *pmxp)
+{
+	pmx_indexer_t *pi = pmxp->pxs_indexer;
+	const char **names;
+	uint8_t len[8];
+	size_t i, n;
+	int rv = 0;
+
+	if (pmxp->pxs_nnames == 0) {
+		return (0);
+	}
+
+	names = pmx_arena_alloc(pmxp->pxs_arena,
+	    pmxp->pxs_nnames * sizeof (*names));
+	if (names == NULL) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	for (i = 0; i < pmxp->pxs_namecap; i++) {
+		if (pmxp->pxs_names[i].pnm_name != NULL) {
+			names[pmxp->pxs_names[i].pnm_id] =
+			    pmxp->pxs_names[i].pnm_name;
+		}
+	}
+
+	for (i = 0; i < pmxp->pxs_nnames; i++) {
+		n = strlen(names[i]);
+		(void) pmx_u64_encode(len, n);
+		if (fwrite(len, 1, sizeof (len), pi->pi_outstream) !=
+		    sizeof (len) ||
+		    fwrite(names[i], 1, n, pi->pi_outstream) != n) {
+			pmx_error(pmxp, PMXE_EIO, "index: write: %s",
+			    strerror(errno));
+			rv = -1;
+			break;
+		}
+	}
+
+	pmx_arena_free(pmxp->pxs_arena, names,
+	    pmxp->pxs_nnames * sizeof (*names));
+	return (rv);
+}
+
+static int
+pmx_index_put(pmx_indexer_t *pi, const pmx_ixent_t *pie)
+{
+	uint8_t entry[PMX_INDEX_ENTRYLEN];
+
+	(void) pmx_u64_encode(pmx_u64_encode(pmx_u64_encode(entry,
+	    pie->pie_ident), pie->pie_offset), pie->pie_length);
+	return (fwrite(entry, 1, sizeof (entry), pi->pi_outstream) ==
+	    sizeof (entry) ? 0 : -1);
+}
+
+/*
+ * Reads the next entries of "run" into its buffer.  Returns the number of
+ * entries read (0 at the end of the run) or -1 on error.
+ */
+static int
+pmx_ixrun_fill(pmx_indexer_t *pi, pmx_ixrun_t *run)
+{
+	size_t n;
+
+	n = run->pir_bufcap;
+	if (n > run->pir_end - run->pir_pos) {
+		n = (size_t)(run->pir_end - run->pir_pos);
+	}
+
+	if (n > 0 && pmx_index_pread(fileno(pi->pi_runstream), run->pir_buf,
+	    n * sizeof (pmx_ixent_t), run->pir_pos * sizeof (pmx_ixent_t)) !=
+	    0) {
+		return (-1);
+	}
+
+	run->pir_pos += n;
+	run->pir_nbuf = n;
+	run->pir_next = 0;
+	return (n > 0);
+}
+
+/*
+ * Restores the heap property of the "nheap" runs in "heap" (ordered by each
+ * run's next entry) below position "i".
+ */
+static void
+pmx_ixrun_sift(pmx_ixrun_t **heap, size_t nheap, size_t i)
+{
+	pmx_ixrun_t *tmp;
+	size_t child;
+
+	while ((child = 2 * i + 1) < nheap) {
+		if (child + 1 < nheap &&
+		    pmx_ixent_compare(PMX_IXRUN_NEXT(heap[child + 1]),
+		    PMX_IXRUN_NEXT(heap[child])) < 0) {
+			child++;
+		}
+
+		if (pmx_ixent_compare(PMX_IXRUN_NEXT(heap[child]),
+		    PMX_IXRUN_NEXT(heap[i])) >= 0) {
+			break;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static int
+pmx_ixent_compare(const void *l, const void *r)
+{
+	const pmx_ixent_t *lp = l, *rp = r;
+
+	if (lp->pie_ident != rp->pie_ident) {
+		return (lp->pie_ident < rp->pie_ident ? -1 : 1);
+	}
+
+	if (lp->pie_offset != rp->pie_offset) {
+		return (lp->pie_offset < rp->pie_offset ? -1 : 1);
+	}
+
+	return (0);
+}
+
+/*
+ * Reads exactly "len" bytes at offset "off".  Returns 0 on success or -1 (with
+ * errno set) on failure.  Reading past the end of the file is an EIO error.
+ */
+static int
+pmx_index_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	uint8_t *p = buf;
+	ssize_t rv;
+
+	if (off > PMX_OFF_MAX || len > PMX_OFF_MAX - off) {
+		errno = EFBIG;
+		return (-1);
+	}
+
+	while (len > 0) {
+		rv = pread(fd, p, len, (off_t)off);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+
+		if (rv == 0) {
+			errno = EIO;
+			return (-1);
+		}
+
+		p += rv;
+		len -= (size_t)rv;
+		off += (uint64_t)rv;
+	}
+
+	return (0);
+}
+
+
+/*
+ * Reading indexed exports
+ */
+
+pmx_index_t *
+pmx_index_open(const char *indexpath, const char *exportpath)
+{
+	pmx_index_t *pix;
+	int err;
+
+	if ((pix = calloc(1, sizeof (*pix))) == NULL) {
+		return (NULL);
+	}
+
+	pix->pix_fd = -1;
+	if (pmx_index_load(pix, indexpath, exportpath) != 0) {
+		err = errno;
+		pmx_index_close(pix);
+		errno = err;
+		return (NULL);
+	}
+
+	return (pix);
+}
+
+void
+pmx_index_close(pmx_index_t *pix)
+{
+	if (pix == NULL) {
+		return;
+	}
+
+	if (pix->pix_map != NULL) {
+		(void) munmap(pix->pix_map, pix->pix_maplen);
+	}
+
+	if (pix->pix_fd != -1) {
+		(void) close(pix->pix_fd);
+	}
+
+	pmx_reader_close(pix->pix_reader);
+	free(pix->pix_names);
+	free(pix->pix_namebuf);
+	free(pix->pix_buf);
+	free(pix);
+}
+
+pmx_reader_t *
+pmx_index_lookup(pmx_index_t *pix, uint64_t ident)
+{
+	const uint8_t *entry;
+	uint64_t lo, hi, mid, off, len;
+	char *buf;
+
+	lo = 0;
+	hi = pix->pix_nentries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		entry = pix->pix_entries + mid * PMX_INDEX_ENTRYLEN;
+		if (pmx_u64_decode(entry) < ident) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	entry = pix->pix_entries + lo * PMX_INDEX_ENTRYLEN;
+	if (lo == pix->pix_nentries || pmx_u64_decode(entry) != ident) {
+		errno = ENOENT;
+		return (NULL);
+	}
+
+	off = pmx_u64_decode(entry + 8);
+	len = pmx_u64_decode(entry + 16);
+	if (off > pix->pix_size || len > pix->pix_size - off) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	if (len > SIZE_MAX) {
+		errno = EFBIG;
+		return (NULL);
+	}
+
+	if (len > pix->pix_bufsz) {
+		if ((buf = realloc(pix->pix_buf, (size_t)len)) == NULL) {
+			return (NULL);
+		}
+
+		pix->pix_buf = buf;
+		pix->pix_bufsz = (size_t)len;
+	}
+
+	if (pmx_index_pread(pix->pix_fd, pix->pix_buf, (size_t)len, off) != 0) {
+		return (NULL);
+	}
+
+	pmx_reader_reset(pix->pix_reader, pix->pix_buf, (size_t)len, off);
+	return (pix->pix_reader);
+}
+
+const char *
+pmx_index_name(pmx_index_t *pix, uint64_t id)
+{
+	return (id < pix->pix_nnames ? pix->pix_names[id] : NULL);
+}
+
+uint64_t
+pmx_index_nvalues(pmx_index_t *pix)
+{
+	return (pix->pix_nentries);
+}
+
+/*
+ * Maps the index at "indexpath", checks it against the export at "exportpath",
+ * and opens the export.  Returns 0 on success or -1 (with errno set) on
+ * failure, in which case the caller cleans up.
+ */
+static int
+pmx_index_load(pmx_index_t *pix, const char *indexpath,
+    const char *exportpath)
+{
+	const uint8_t *p, *end;
+	struct stat st;
+	uint64_t i, len;
+	char *q;
+	int fd, err;
+
+	if ((fd = open(indexpath, O_RDONLY)) < 0) {
+		return (-1);
+	}
+
+	if (fstat(fd, &st) != 0) {
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		return (-1);
+	}
+
+	if (st.st_size < PMX_INDEX_HEADERLEN ||
+	    (uint64_t)st.st_size > SIZE_MAX) {
+		(void) close(fd);
+		errno = st.st_size < PMX_INDEX_HEADERLEN ? EINVAL : EFBIG;
+		return (-1);
+	}
+
+	pix->pix_maplen = (size_t)st.st_size;
+	pix->pix_map = mmap(NULL, pix->pix_maplen, PROT_READ, MAP_PRIVATE,
+	    fd, 0);
+	err = errno;
+	(void) close(fd);
+	if (pix->pix_map == MAP_FAILED) {
+		pix->pix_map = NULL;
+		errno = err;
+		return (-1);
+	}
+
+	(void) posix_madvise(pix->pix_map, pix->pix_maplen, POSIX_MADV_RANDOM);
+
+	/* Check the header, then copy out the names. */
+	p = pix->pix_map;
+	end = p + pix->pix_maplen;
+	if (memcmp(p, PMX_INDEX_MAGIC, PMX_INDEX_MAGICLEN) != 0 ||
+	    p[PMX_INDEX_MAGICLEN] != PMX_INDEX_VERSION) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	pix->pix_nentries = pmx_u64_decode(p + 8);
+	pix->pix_nnames = pmx_u64_decode(p + 16);
+	pix->pix_size = pmx_u64_decode(p + 24);
+	p += PMX_INDEX_HEADERLEN;
+	if (pix->pix_nentries > (uint64_t)(end - p) / PMX_INDEX_ENTRYLEN) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	pix->pix_entries = p;
+	p += pix->pix_nentries * PMX_INDEX_ENTRYLEN;
+	if (pix->pix_nnames > (uint64_t)(end - p) / 8) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/*
+	 * Each name is stored with an 8-byte length, so the names section is
+	 * more than enough to hold them all with NUL terminators.
+	 */
+	pix->pix_names = malloc((size_t)pix->pix_nnames * sizeof (char *) + 1);
+	pix->pix_namebuf = malloc((size_t)(end - p) + 1);
+	if (pix->pix_names == NULL || pix->pix_namebuf == NULL) {
+		return (-1);
+	}
+
+	q = pix->pix_namebuf;
+	for (i = 0; i < pix->pix_nnames; i++) {
+		if (end - p < 8) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		len = pmx_u64_decode(p);
+		p += 8;
+		if (len > (uint64_t)(end - p)) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		(void) memcpy(q, p, (size_t)len);
+		q[len] = '\0';
+		pix->pix_names[i] = q;
+		q += len + 1;
+		p += len;
+	}
+
+	if (p != end) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* Open the export and make sure it's the one that was indexed. */
+	if ((pix->pix_fd = open(exportpath, O_RDONLY)) < 0 ||
+	    fstat(pix->pix_fd, &st) != 0) {
+		return (-1);
+	}
+
+	if ((uint64_t)st.st_size != pix->pix_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((pix->pix_reader = pmx_reader_open_buf("", 0)) == NULL) {
+		return (-1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,317 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_json.c: JSON output backend
+ *
+ * Each record is emitted as a single-line JSON object.  Nodes look like:
+ *
+ *     {"type":"node","subtype":4,"ident":32768,"length":12,"data":1536}
+ *
+ * where "subtype" is the pmx_nodetype_t and the remaining properties are the
+ * fields from the node's schema (see pmx_node_schemas) that were supplied.
+ *
+ * Edges are emitted in batches, each a single record with the source node and
+ * an array of compact [ kind, target, key ] triples rather than one object per
+ * edge:
+ *
+ *     {"type":"edges","source":45056,"edges":[[1,4096,0],[1,40960,1]]}
+ *
+ * where "kind" is the pmx_edgetype_t and "key" is the element index for array
+ * elements or the id of the name for properties and closure variables.  Names
+ * are defined by a "name" record before they're first used:
+ *
+ *     {"type":"name","id":0,"name":"length"}
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <pmx/pmx.h>
+#include <libjsonemitter/jsonemitter.h>
+#include "pmx_impl.h"
+
+static int pmx_json_init(pmx_stream_t *);
+static void pmx_json_fini(pmx_stream_t *);
+static void pmx_json_done(pmx_stream_t *);
+static void pmx_json_check(pmx_stream_t *);
+static int pmx_json_write(void *, const char *, size_t);
+static void pmx_json_metadata(pmx_stream_t *, const char *, const char *);
+static void pmx_json_node(pmx_stream_t *);
+static void pmx_json_string(pmx_stream_t *, pmx_value_t, size_t,
+    const uint8_t *);
+static void pmx_json_name(pmx_stream_t *, uint64_t, const char *);
+static void pmx_json_content(pmx_stream_t *, uint64_t, size_t,
+    const uint8_t *);
+static void pmx_json_stringref(pmx_stream_t *, pmx_value_t, uint64_t);
+static void pmx_json_edges(pmx_stream_t *, pmx_value_t, const pmx_edge_t *,
+    size_t);
+
+const pmx_backend_t pmx_backend_json = {
+	.pxb_name = "json",
+	.pxb_init = pmx_json_init,
+	.pxb_fini = pmx_json_fini,
+	.pxb_done = pmx_json_done,
+	.pxb_check = pmx_json_check,
+	.pxb_metadata = pmx_json_metadata,
+	.pxb_node = pmx_json_node,
+	.pxb_string = pmx_json_string,
+	.pxb_edgename = pmx_json_name,
+	.pxb_content = pmx_json_content,
+	.pxb_stringref = pmx_json_stringref,
+	.pxb_edges = pmx_json_edges,
+};
+
+/*
+ * The emitter buffers its output and hands each full buffer to
+ * pmx_json_write(), which passes it to the output stage.  The emitter's state
+ * and buffer are allocated from the stream's arena.
+ */
+static int
+pmx_json_init(pmx_stream_t *pmxp)
+{
+	size_t memsz;
+	void *mem;
+
+	if (pmx_output_init(pmxp) != 0) {
+		return (-1);
+	}
+
+	memsz = json_mem_size(PMX_JSONBUFSZ);
+	mem = pmx_arena_alloc(pmxp->pxs_arena, memsz);
+	if (mem == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	pmxp->pxs_jsonout = json_create_cb_mem(pmx_json_write, pmxp, mem,
+	    memsz);
+	return (pmxp->pxs_jsonout == NULL ? -1 : 0);
+}
+
+static void
+pmx_json_fini(pmx_stream_t *pmxp)
+{
+	if (pmxp->pxs_jsonout != NULL) {
+		json_fini(pmxp->pxs_jsonout);
+		pmxp->pxs_jsonout = NULL;
+	}
+
+	pmx_output_fini(pmxp);
+}
+
+static void
+pmx_json_done(pmx_stream_t *pmxp)
+{
+	json_flush(pmxp->pxs_jsonout);
+	if (pmxp->pxs_error == PMXE_OK) {
+		pmx_json_check(pmxp);
+	}
+
+	pmx_output_flush(pmxp);
+}
+
+static int
+pmx_json_write(void *arg, const char *buf, size_t len)
+{
+	return (pmx_output_write(arg, buf, len) == 0 ? 0 : EIO);
+}
+
+/*
+ * Translates any error recorded by the JSON emitter into a pmx error.
+ */
+static void
+pmx_json_check(pmx_stream_t *pmxp)
+{
+	char buf[PMX_ERRMSGLEN];
+
+	if (pmxp->pxs_static) {
+		/* Don't format a message (see pmx_create_stream_static()). */
+		if (json_get_error(pmxp->pxs_jsonout, NULL, 0) != JSE_NONE) {
+			pmx_set_errno(pmxp, PMXE_EIO);
+		}
+	} else if (json_get_error(pmxp->pxs_jsonout, buf, sizeof (buf)) !=
+	    JSE_NONE) {
+		pmx_error(pmxp, PMXE_EIO, "json: %s", buf);
+	}
+}
+
+static void
+pmx_json_metadata(pmx_stream_t *pmxp, const char *key, const char *value)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "metadata");
+	json_utf8string(jse, "key", key);
+	json_utf8string(jse, "value", value);
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+static void
+pmx_json_node(pmx_stream_t *pmxp)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+	const pmx_nodeschema_t *schema;
+	const pmx_fielddesc_t *field;
+	unsigned int i;
+	double d;
+
+	schema = &pmx_node_schemas[pmxp->pxs_subtype];
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "node");
+	json_uint64(jse, "subtype", pmxp->pxs_subtype);
+	json_uint64(jse, "ident", pmxp->pxs_ident);
+	for (i = 0; i < schema->pxn_nfields; i++) {
+		if ((pmxp->pxs_fieldmask & (1U << i)) == 0) {
+			continue;
+		}
+
+		field = &schema->pxn_fields[i];
+		if (field->pxf_kind == PMXFK_DOUBLE) {
+			(void) memcpy(&d, &pmxp->pxs_fields[i], sizeof (d));
+			json_double(jse, field->pxf_label, d);
+		} else {
+			json_uint64(jse, field->pxf_label, pmxp->pxs_fields[i]);
+		}
+	}
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+static void
+pmx_json_string(pmx_stream_t *pmxp, pmx_value_t jsv, size_t sz,
+    const uint8_t *bytes)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+	size_t validsz;
+
+	/*
+	 * The string contents are emitted directly from the caller's buffer
+	 * (which may well be a mapping of the core file), without copying them
+	 * or scanning them for a terminator.  They may contain NUL bytes.
+	 *
+	 * XXX We need to decide if the exporter should faithfully represent the
+	 * core file (e.g., so that an N-byte ASCII string is represented
+	 * precisely with those N bytes, even if they're non-ASCII, and the
+	 * consumer is expected to validate and detect this), or if the exporter
+	 * should attempt to sanitize it (e.g., report a substring, and mark the
+	 * string as potentially invalid).  It's a tough call: we don't want to
+	 * sanitize too much, since it's important for consumers to understand
+	 * details like in-memory representation in order to understand memory
+	 * usage, but we don't want every consumer to have to handle every edge
+	 * case.
+	 *
+	 * If the answer is that this is a faithful representation, then this
+	 * interface should just emit a bunch of bytes, and we should consider
+	 * base64-encoding it (in the spec).  (The binary backend does record
+	 * the bytes faithfully.)  For now, we emit the longest prefix that's
+	 * valid UTF-8 and warn if that's not the whole string.
+	 *
+	 * XXX This needs to be better-specified in the spec.
+	 */
+	validsz = json_utf8_validlen((const char *)bytes, sz);
+	if (validsz != sz) {
+		pmx_warn(pmxp, "pmx_emit_string_data for 0x%" PRIx64
+		    ": truncating string with invalid UTF-8 at byte %zu\n",
+		    (uint64_t)jsv, validsz);
+	}
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "string");
+	json_uint64(jse, "ident", jsv);
+	json_utf8string_len(jse, "contents", (const char *)bytes, validsz);
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+static void
+pmx_json_name(pmx_stream_t *pmxp, uint64_t id, const char *name)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+	size_t len, validsz;
+
+	len = strlen(name);
+	validsz = json_utf8_validlen(name, len);
+	if (validsz != len) {
+		pmx_warn(pmxp, "name %" PRIu64 ": truncating name with invalid "
+		    "UTF-8 at byte %zu\n", id, validsz);
+	}
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "name");
+	json_uint64(jse, "id", id);
+	json_utf8string_len(jse, "name", name, validsz);
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+/*
+ * Interned string contents are subject to the same UTF-8 truncation as
+ * ordinary string data (see pmx_json_string()).
+ */
+static void
+pmx_json_content(pmx_stream_t *pmxp, uint64_t id, size_t sz,
+    const uint8_t *bytes)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+	size_t validsz;
+
+	validsz = json_utf8_validlen((const char *)bytes, sz);
+	if (validsz != sz) {
+		pmx_warn(pmxp, "content %" PRIu64 ": truncating string with "
+		    "invalid UTF-8 at byte %zu\n", id, validsz);
+	}
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "content");
+	json_uint64(jse, "id", id);
+	json_utf8string_len(jse, "contents", (const char *)bytes, validsz);
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+static void
+pmx_json_stringref(pmx_stream_t *pmxp, pmx_value_t jsv, uint64_t id)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "string");
+	json_uint64(jse, "ident", jsv);
+	json_uint64(jse, "content", id);
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+static void
+pmx_json_edges(pmx_stream_t *pmxp, pmx_value_t source,
+    const pmx_edge_t *edges, size_t nedges)
+{
+	json_emit_t *jse = pmxp->pxs_jsonout;
+	size_t i;
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "type", "edges");
+	json_uint64(jse, "source", source);
+	json_array_begin(jse, "edges");
+	for (i = 0; i < nedges; i++) {
+		json_array_begin(jse, NULL);
+		json_uint64(jse, NULL, edges[i].pxe_kind);
+		json_uint64(jse, NULL, edges[i].pxe_target);
+		json_uint64(jse, NULL, edges[i].pxe_key);
+		json_array_end(jse);
+	}
+	json_array_end(jse);
+	json_object_end(jse);
+	json_newline(jse);
+}
@@ -0,0 +1,267 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_mmap.c: memory-mapped output files
+ *
+ * Streams created with pmx_create_stream_mmap() write their output by copying
+ * it into a shared mapping of the output file rather than through stdio.  The
+ * file is grown PMX_MAP_EXTENT bytes at a time, and only the extent currently
+ * being written is mapped: when it fills up, it's unmapped, the file is
+ * extended, and the next extent is mapped.  Extents are allocated with
+ * posix_fallocate() where the filesystem supports it, which also means that
+ * running out of space is reported as an error when the extent is allocated,
+ * rather than as SIGBUS when a page of the mapping is first written.  When the
+ * stream is finished, the file is truncated to the amount actually written.
+ *
+ * Flags (see pmx_mmap_flag_t) control how we advise the VM system:
+ *
+ *     PMXM_SEQUENTIAL	advise that each extent will be accessed sequentially
+ *
+ *     PMXM_WRITEBACK	start asynchronous writeback of each extent as soon
+ *     			as it's full, rather than leaving it to the system
+ *
+ *     PMXM_SYNC	when the stream is finished, wait for the output to be
+ *     			written to stable storage
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/* Size of each extent (must be a multiple of the page size). */
+#define	PMX_MAP_EXTENT		(64 * 1024 * 1024)
+
+struct pmx_map {
+	int		pm_fd;
+	unsigned int	pm_flags;		/* pmx_mmap_flag_t */
+	uint8_t		*pm_win;		/* current extent, or NULL */
+	uint64_t	pm_winoff;		/* file offset of pm_win */
+	uint64_t	pm_size;		/* bytes written */
+};
+
+static int pmx_map_advance(pmx_map_t *);
+static int pmx_map_retire(pmx_map_t *, int);
+static int pmx_map_allocate(pmx_map_t *, uint64_t);
+
+/*
+ * Creates (or truncates) the output file "path".  Returns 0 on success, or -1
+ * (with errno set) on failure.
+ */
+int
+pmx_map_init(pmx_stream_t *pmxp, const char *path, unsigned int flags)
+{
+	pmx_map_t *pm;
+
+	VERIFY(PMX_MAP_EXTENT % sysconf(_SC_PAGESIZE) == 0);
+	pm = calloc(1, sizeof (*pm));
+	if (pm == NULL) {
+		return (-1);
+	}
+
+	pm->pm_flags = flags;
+	pm->pm_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (pm->pm_fd < 0) {
+		free(pm);
+		return (-1);
+	}
+
+	pmxp->pxs_map = pm;
+	return (0);
+}
+
+/*
+ * Releases the mapping and closes the file.  If the stream wasn't finished,
+ * the file is still truncated to what was written so that it doesn't end
+ * with zero-filled extents.
+ */
+void
+pmx_map_fini(pmx_stream_t *pmxp)
+{
+	pmx_map_t *pm = pmxp->pxs_map;
+
+	if (pm == NULL) {
+		return;
+	}
+
+	(void) pmx_map_finish(pm);
+	(void) close(pm->pm_fd);
+	free(pm);
+	pmxp->pxs_map = NULL;
+}
+
+/*
+ * Copies "len" bytes into the file.  Returns 0 on success, or -1 (with errno
+ * set) on failure.
+ */
+int
+pmx_map_write(pmx_map_t *pm, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t used, n;
+
+	while (len > 0) {
+		used = (size_t)(pm->pm_size - pm->pm_winoff);
+		if (pm->pm_win == NULL || used == PMX_MAP_EXTENT) {
+			if (pmx_map_advance(pm) != 0) {
+				return (-1);
+			}
+
+			used = (size_t)(pm->pm_size - pm->pm_winoff);
+		}
+
+		n = PMX_MAP_EXTENT - used;
+		if (n > len) {
+			n = len;
+		}
+
+		(void) memcpy(pm->pm_win + used, p, n);
+		pm->pm_size += n;
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+/*
+ * Unmaps the current extent and truncates the file to the size actually
+ * written (and waits for it to reach stable storage, if requested).  More
+ * output may still be written afterwards.  Returns 0 on success, or -1 (with
+ * errno set) on failure.
+ */
+int
+pmx_map_finish(pmx_map_t *pm)
+{
+	int how = 0;
+
+	if ((pm->pm_flags & PMXM_SYNC) != 0) {
+		how = MS_SYNC;
+	} else if ((pm->pm_flags & PMXM_WRITEBACK) != 0) {
+		how = MS_ASYNC;
+	}
+
+	if (pmx_map_retire(pm, how) != 0) {
+		return (-1);
+	}
+
+	if (pm->pm_size > PMX_OFF_MAX) {
+		errno = EFBIG;
+		return (-1);
+	}
+
+	if (ftruncate(pm->pm_fd, (off_t)pm->pm_size) != 0) {
+		return (-1);
+	}
+
+	if ((pm->pm_flags & PMXM_SYNC) != 0 && fsync(pm->pm_fd) != 0) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Maps the extent containing the next byte to be written, allocating it in
+ * the file first.
+ */
+static int
+pmx_map_advance(pmx_map_t *pm)
+{
+	uint64_t off;
+	void *win;
+
+	if (pmx_map_retire(pm,
+	    (pm->pm_flags & PMXM_WRITEBACK) != 0 ? MS_ASYNC : 0) != 0) {
+		return (-1);
+	}
+
+	off = pm->pm_size - pm->pm_size % PMX_MAP_EXTENT;
+	if (pmx_map_allocate(pm, off) != 0) {
+		return (-1);
+	}
+
+	win = mmap(NULL, PMX_MAP_EXTENT, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    pm->pm_fd, (off_t)off);
+	if (win == MAP_FAILED) {
+		return (-1);
+	}
+
+	if ((pm->pm_flags & PMXM_SEQUENTIAL) != 0) {
+		(void) posix_madvise(win, PMX_MAP_EXTENT,
+		    POSIX_MADV_SEQUENTIAL);
+	}
+
+	pm->pm_win = win;
+	pm->pm_winoff = off;
+	return (0);
+}
+
+/*
+ * Unmaps the current extent, if any.  If "how" is not zero, the extent is
+ * first passed to msync() with those flags.
+ */
+static int
+pmx_map_retire(pmx_map_t *pm, int how)
+{
+	size_t used;
+
+	if (pm->pm_win == NULL) {
+		return (0);
+	}
+
+	used = (size_t)(pm->pm_size - pm->pm_winoff);
+	if (how != 0 && used > 0 && msync(pm->pm_win, used, how) != 0) {
+		return (-1);
+	}
+
+	if (munmap(pm->pm_win, PMX_MAP_EXTENT) != 0) {
+		return (-1);
+	}
+
+	pm->pm_win = NULL;
+	return (0);
+}
+
+/*
+ * Extends the file to include the extent starting at "off".  Filesystems that
+ * can't preallocate space get a sparse file instead.  This fails with EFBIG if
+ * the extent would end past the largest offset that off_t can represent, which
+ * also keeps the offset that pmx_map_advance() passes to mmap() in range.
+ */
+static int
+pmx_map_allocate(pmx_map_t *pm, uint64_t off)
+{
+	int rv;
+
+	if (off > PMX_OFF_MAX - PMX_MAP_EXTENT) {
+		errno = EFBIG;
+		return (-1);
+	}
+
+	rv = posix_fallocate(pm->pm_fd, (off_t)off, PMX_MAP_EXTENT);
+	if (rv == 0) {
+		return (0);
+	}
+
+	if (rv != EINVAL && rv != EOPNOTSUPP) {
+		errno = rv;
+		return (-1);
+	}
+
+	return (ftruncate(pm->pm_fd, (off_t)(off + PMX_MAP_EXTENT)));
+}
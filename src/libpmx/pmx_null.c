@@ -0,0 +1,93 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_null.c: null output backend
+ *
+ * This backend discards every record (though the front-end still validates and
+ * counts them).  It's useful for measuring the cost of walking a heap and of
+ * the front-end separately from the cost of serializing the output.
+ */
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+static int pmx_null_init(pmx_stream_t *);
+static void pmx_null_stream(pmx_stream_t *);
+static void pmx_null_metadata(pmx_stream_t *, const char *, const char *);
+static void pmx_null_string(pmx_stream_t *, pmx_value_t, size_t,
+    const uint8_t *);
+static void pmx_null_name(pmx_stream_t *, uint64_t, const char *);
+static void pmx_null_content(pmx_stream_t *, uint64_t, size_t,
+    const uint8_t *);
+static void pmx_null_stringref(pmx_stream_t *, pmx_value_t, uint64_t);
+static void pmx_null_edges(pmx_stream_t *, pmx_value_t, const pmx_edge_t *,
+    size_t);
+
+const pmx_backend_t pmx_backend_null = {
+	.pxb_name = "null",
+	.pxb_init = pmx_null_init,
+	.pxb_fini = pmx_null_stream,
+	.pxb_done = pmx_null_stream,
+	.pxb_metadata = pmx_null_metadata,
+	.pxb_node = pmx_null_stream,
+	.pxb_string = pmx_null_string,
+	.pxb_edgename = pmx_null_name,
+	.pxb_content = pmx_null_content,
+	.pxb_stringref = pmx_null_stringref,
+	.pxb_edges = pmx_null_edges,
+};
+
+static int
+pmx_null_init(pmx_stream_t *pmxp PMX_UNUSED)
+{
+	return (0);
+}
+
+static void
+pmx_null_stream(pmx_stream_t *pmxp PMX_UNUSED)
+{
+}
+
+static void
+pmx_null_metadata(pmx_stream_t *pmxp PMX_UNUSED, const char *key PMX_UNUSED,
+    const char *value PMX_UNUSED)
+{
+}
+
+static void
+pmx_null_string(pmx_stream_t *pmxp PMX_UNUSED, pmx_value_t jsv PMX_UNUSED,
+    size_t sz PMX_UNUSED, const uint8_t *bytes PMX_UNUSED)
+{
+}
+
+static void
+pmx_null_name(pmx_stream_t *pmxp PMX_UNUSED, uint64_t id PMX_UNUSED,
+    const char *name PMX_UNUSED)
+{
+}
+
+static void
+pmx_null_content(pmx_stream_t *pmxp PMX_UNUSED, uint64_t id PMX_UNUSED,
+    size_t sz PMX_UNUSED, const uint8_t *bytes PMX_UNUSED)
+{
+}
+
+static void
+pmx_null_stringref(pmx_stream_t *pmxp PMX_UNUSED, pmx_value_t jsv PMX_UNUSED,
+    uint64_t id PMX_UNUSED)
+{
+}
+
+static void
+pmx_null_edges(pmx_stream_t *pmxp PMX_UNUSED, pmx_value_t source PMX_UNUSED,
+    const pmx_edge_t *edges PMX_UNUSED, size_t nedges PMX_UNUSED)
+{
+}
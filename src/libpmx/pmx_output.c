@@ -0,0 +1,694 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_output.c: output stage shared by the stream-based backends
+ *
+ * The JSON and binary backends buffer their own output and hand each full
+ * buffer to pmx_output_write() rather than writing to the output stream
+ * directly.  This stage counts the bytes and, if the stream was created with
+ * compression, compresses them on the way out.  The result is written to the
+ * output stream or, for streams created with pmx_create_stream_mmap(), copied
+ * into the mapped output file (see pmx_mmap.c).  Streams created with
+ * pmx_create_stream_static() write directly to a file descriptor with write(2)
+ * instead, since they mustn't use stdio.
+ *
+ * With PMXC_GZIP, the output is a sequence of gzip members, each containing
+ * PMX_GZ_CHUNKSZ bytes of uncompressed output (except possibly the last).  The
+ * concatenation of gzip members is itself a valid gzip file, so the whole
+ * output can be read with gzip(1) or zcat(1), but since each member is
+ * compressed independently, a reader can also start decompressing at the
+ * beginning of any member.  If the caller supplies an index stream, we record
+ * where each member starts:
+ *
+ *     header	"PMXZ" (4 bytes), version (1 byte), 3 reserved bytes,
+ *     		uncompressed chunk size (8 bytes)
+ *
+ *     entries	one per member: offset of the member in the compressed
+ *     		output (8 bytes), offset of its contents in the uncompressed
+ *     		output (8 bytes)
+ *
+ *     trailer	total compressed size (8 bytes), total uncompressed size
+ *     		(8 bytes)
+ *
+ * All integers are unsigned, least significant byte first.  The trailer has
+ * the same form as an entry, so entry "i" and the one after it (or the
+ * trailer) bound member "i" in both the compressed and uncompressed output.
+ *
+ * Pipelined output
+ *
+ * By default, all of this happens on the caller's thread, so the caller stops
+ * emitting whenever compression or a write is slow.  After pmx_async_output(),
+ * pmx_output_write() instead copies output into a ring of PMX_ASYNC_BUFSZ-byte
+ * buffers, and a dedicated writer thread compresses and writes each buffer as
+ * it fills.  The ring is single-producer, single-consumer: the caller only
+ * advances pas_head (the number of buffers filled) and the writer only
+ * advances pas_tail (the number of buffers written), so each side reads the
+ * other's counter atomically and needs no lock to make progress.  The lock
+ * and condition variable are used only to sleep: the caller waits when every
+ * buffer is full (which is how a slow output stream pushes back on the
+ * caller), and the writer waits when there's nothing to write.
+ *
+ * While the writer thread is running, it owns everything below
+ * pmx_output_write(): the compression state, the output and index streams,
+ * and pxs_nbytesout.  It can't record errors on the stream directly because
+ * the caller may be using the stream at the same time, so it records them in
+ * the pmx_async_t, and the caller picks them up (see pmx_output_check()) the
+ * next time it writes output, checks for errors, or finishes the stream.
+ * Once the writer has failed, it discards any remaining buffers so that the
+ * caller never blocks waiting for it.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+#define	PMX_GZ_MAGIC		"PMXZ"
+#define	PMX_GZ_MAGICLEN		4
+#define	PMX_GZ_VERSION		1
+
+/* Uncompressed bytes in each gzip member. */
+#define	PMX_GZ_CHUNKSZ		(4 * 1024 * 1024)
+/* Size of the buffer for compressed output. */
+#define	PMX_GZ_OUTBUFSZ		(256 * 1024)
+/* zlib compression level.  Favor speed: these exports are large. */
+#define	PMX_GZ_LEVEL		Z_BEST_SPEED
+/* zlib "windowBits" for a 32K window with a gzip (rather than zlib) wrapper */
+#define	PMX_GZ_WBITS		(15 + 16)
+
+/* Size of each buffer handed to the writer thread. */
+#define	PMX_ASYNC_BUFSZ		(1024 * 1024)
+/* Default number of buffers in the ring. */
+#define	PMX_ASYNC_NBUFS		4
+
+struct pmx_gzip {
+	z_stream	pgz_zs;
+	int		pgz_zsinit;		/* pgz_zs is initialized */
+	uint8_t		*pgz_outbuf;		/* compressed output */
+	uint64_t	pgz_nbytesin;		/* total uncompressed input */
+	size_t		pgz_chunkused;		/* input to current member */
+	int		pgz_inmember;		/* current member started */
+};
+
+struct pmx_async {
+	pthread_t	pas_thread;
+	pthread_mutex_t	pas_lock;
+	pthread_cond_t	pas_cv;
+	int		pas_lockinit;		/* pas_lock, pas_cv are valid */
+	int		pas_stop;		/* protected by pas_lock */
+
+	uint8_t		*pas_bufs;		/* the buffers, back to back */
+	size_t		*pas_lens;		/* bytes used in each buffer */
+	unsigned int	pas_nbufs;
+	uint64_t	pas_head;		/* buffers filled (caller) */
+	uint64_t	pas_tail;		/* buffers written (writer) */
+	size_t		pas_used;		/* bytes in current buffer */
+
+	int		pas_failed;		/* writer has failed */
+	char		pas_errmsg[PMX_ERRMSGLEN];
+};
+
+static int pmx_output_sink(pmx_stream_t *, const uint8_t *, size_t);
+static int pmx_output_raw(pmx_stream_t *, const void *, size_t);
+static int pmx_output_fd(int, const uint8_t *, size_t);
+static int pmx_output_deflate(pmx_stream_t *, const uint8_t *, size_t, int);
+static void pmx_output_index(pmx_stream_t *, uint64_t, uint64_t);
+PMX_PRINTFLIKE2 static void pmx_output_error(pmx_stream_t *,
+    const char *, ...);
+
+static int pmx_async_enqueue(pmx_stream_t *, const uint8_t *, size_t);
+static void pmx_async_publish(pmx_async_t *);
+static void pmx_async_drain(pmx_async_t *);
+static void *pmx_async_writer(void *);
+static void pmx_async_free(pmx_async_t *);
+
+int
+pmx_output_init(pmx_stream_t *pmxp)
+{
+	pmx_gzip_t *pgz;
+	uint8_t header[16];
+	int rv;
+
+	if (pmxp->pxs_static) {
+		VERIFY(pmxp->pxs_compress == PMXC_NONE);
+		return (0);
+	}
+
+	if (pmxp->pxs_outstream == NULL) {
+		VERIFY(pmxp->pxs_outpath != NULL);
+		if (pmx_map_init(pmxp, pmxp->pxs_outpath,
+		    pmxp->pxs_mapflags) != 0) {
+			return (-1);
+		}
+	}
+
+	if (pmxp->pxs_compress == PMXC_NONE) {
+		return (0);
+	}
+
+	VERIFY(pmxp->pxs_compress == PMXC_GZIP);
+	pgz = calloc(1, sizeof (*pgz));
+	if (pgz == NULL) {
+		return (-1);
+	}
+
+	pmxp->pxs_gzip = pgz;
+	pgz->pgz_outbuf = malloc(PMX_GZ_OUTBUFSZ);
+	if (pgz->pgz_outbuf == NULL) {
+		return (-1);
+	}
+
+	rv = deflateInit2(&pgz->pgz_zs, PMX_GZ_LEVEL, Z_DEFLATED, PMX_GZ_WBITS,
+	    8, Z_DEFAULT_STRATEGY);
+	if (rv != Z_OK) {
+		/* zlib doesn't set errno, and callers report it. */
+		errno = rv == Z_MEM_ERROR ? ENOMEM : EINVAL;
+		return (-1);
+	}
+
+	pgz->pgz_zsinit = 1;
+	if (pmxp->pxs_indexstream != NULL) {
+		(void) memset(header, 0, sizeof (header));
+		(void) memcpy(header, PMX_GZ_MAGIC, PMX_GZ_MAGICLEN);
+		header[PMX_GZ_MAGICLEN] = PMX_GZ_VERSION;
+		(void) pmx_u64_encode(header + 8, PMX_GZ_CHUNKSZ);
+		if (fwrite(header, 1, sizeof (header),
+		    pmxp->pxs_indexstream) != sizeof (header)) {
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Starts a writer thread with a ring of "nbufs" buffers (or the default, if
+ * "nbufs" is zero).  Returns 0 on success.  On failure, returns -1 and the
+ * stream continues to write output synchronously.
+ */
+int
+pmx_output_async(pmx_stream_t *pmxp, unsigned int nbufs)
+{
+	pmx_async_t *pas;
+
+	VERIFY(pmxp->pxs_async == NULL);
+	if (nbufs == 0) {
+		nbufs = PMX_ASYNC_NBUFS;
+	}
+
+	pas = calloc(1, sizeof (*pas));
+	if (pas == NULL) {
+		return (-1);
+	}
+
+	pas->pas_nbufs = nbufs;
+	pas->pas_bufs = malloc((size_t)nbufs * PMX_ASYNC_BUFSZ);
+	pas->pas_lens = calloc(nbufs, sizeof (size_t));
+	if (pas->pas_bufs == NULL || pas->pas_lens == NULL) {
+		pmx_async_free(pas);
+		return (-1);
+	}
+
+	if (pthread_mutex_init(&pas->pas_lock, NULL) != 0) {
+		pmx_async_free(pas);
+		return (-1);
+	}
+
+	if (pthread_cond_init(&pas->pas_cv, NULL) != 0) {
+		(void) pthread_mutex_destroy(&pas->pas_lock);
+		pmx_async_free(pas);
+		return (-1);
+	}
+
+	pas->pas_lockinit = 1;
+	pmxp->pxs_async = pas;
+	if (pthread_create(&pas->pas_thread, NULL, pmx_async_writer,
+	    pmxp) != 0) {
+		pmxp->pxs_async = NULL;
+		pmx_async_free(pas);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+pmx_output_fini(pmx_stream_t *pmxp)
+{
+	pmx_async_t *pas = pmxp->pxs_async;
+	pmx_gzip_t *pgz = pmxp->pxs_gzip;
+
+	/*
+	 * Write out anything the backend handed us since the last flush (which
+	 * only happens if the stream was abandoned) and stop the writer.
+	 */
+	if (pas != NULL) {
+		pmx_async_drain(pas);
+		VERIFY(pthread_mutex_lock(&pas->pas_lock) == 0);
+		pas->pas_stop = 1;
+		VERIFY(pthread_cond_broadcast(&pas->pas_cv) == 0);
+		VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+		VERIFY(pthread_join(pas->pas_thread, NULL) == 0);
+		pmxp->pxs_async = NULL;
+		pmx_async_free(pas);
+	}
+
+	pmx_map_fini(pmxp);
+	if (pgz == NULL) {
+		return;
+	}
+
+	if (pgz->pgz_zsinit) {
+		(void) deflateEnd(&pgz->pgz_zs);
+	}
+
+	free(pgz->pgz_outbuf);
+	free(pgz);
+	pmxp->pxs_gzip = NULL;
+}
+
+/*
+ * Writes "len" bytes of output, compressing them first if requested.  Returns
+ * 0 on success.  On failure, records an error on the stream and returns -1.
+ * Once an error has been recorded, nothing more is written.  If the stream is
+ * being timed, the time spent here is accounted to the output stage (see
+ * pmx_stats.c).
+ */
+int
+pmx_output_write(pmx_stream_t *pmxp, const void *buf, size_t len)
+{
+	uint64_t start;
+	int rv;
+
+	if (pmxp->pxs_async != NULL) {
+		pmx_output_check(pmxp);
+	}
+
+	if (pmxp->pxs_error != PMXE_OK) {
+		return (-1);
+	}
+
+	pmxp->pxs_nbytesraw += len;
+	start = PMX_STATS_START(pmxp);
+	PMX_PROBE1(write_start, len);
+	if (pmxp->pxs_async != NULL) {
+		rv = pmx_async_enqueue(pmxp, buf, len);
+	} else {
+		rv = pmx_output_sink(pmxp, buf, len);
+	}
+
+	PMX_PROBE2(write_done, len, rv);
+	if (start != 0) {
+		pmxp->pxs_outputticks += pmx_stats_ticks() - start;
+	}
+
+	return (rv);
+}
+
+/*
+ * Finishes the current gzip member (if any), completes the index, and flushes
+ * the underlying streams.  With a writer thread, this first waits for the
+ * writer to finish with everything written so far.
+ */
+void
+pmx_output_flush(pmx_stream_t *pmxp)
+{
+	pmx_gzip_t *pgz = pmxp->pxs_gzip;
+	uint64_t start = PMX_STATS_START(pmxp);
+
+	PMX_PROBE0(flush_start);
+	if (pmxp->pxs_async != NULL) {
+		pmx_async_drain(pmxp->pxs_async);
+		pmx_output_check(pmxp);
+	}
+
+	if (pgz != NULL && pmxp->pxs_error == PMXE_OK) {
+		if (pgz->pgz_inmember) {
+			(void) pmx_output_deflate(pmxp, NULL, 0, Z_FINISH);
+		}
+
+		pmx_output_index(pmxp, pmxp->pxs_nbytesout, pgz->pgz_nbytesin);
+		if (pmxp->pxs_indexstream != NULL &&
+		    fflush(pmxp->pxs_indexstream) != 0) {
+			pmx_output_error(pmxp, "index: flush: %s",
+			    strerror(errno));
+		}
+	}
+
+	if (pmxp->pxs_static) {
+		/* Output is written directly, so there's nothing to flush. */
+	} else if (pmxp->pxs_map != NULL) {
+		if (pmx_map_finish(pmxp->pxs_map) != 0) {
+			pmx_output_error(pmxp, "flush: %s", strerror(errno));
+		}
+	} else if (fflush(pmxp->pxs_outstream) != 0) {
+		pmx_output_error(pmxp, "flush: %s", strerror(errno));
+	}
+
+	if (pmxp->pxs_async != NULL) {
+		pmx_output_check(pmxp);
+	}
+
+	PMX_PROBE1(flush_done, pmxp->pxs_nbytesout);
+	if (start != 0) {
+		pmxp->pxs_outputticks += pmx_stats_ticks() - start;
+	}
+}
+
+/*
+ * Picks up any error recorded by the writer thread.  This is only called from
+ * the caller's thread.
+ */
+void
+pmx_output_check(pmx_stream_t *pmxp)
+{
+	pmx_async_t *pas = pmxp->pxs_async;
+
+	if (pas != NULL && pmxp->pxs_error == PMXE_OK &&
+	    __atomic_load_n(&pas->pas_failed, __ATOMIC_ACQUIRE)) {
+		pmx_error(pmxp, PMXE_EIO, "%s", pas->pas_errmsg);
+	}
+}
+
+/*
+ * Compresses (if requested) and writes "len" bytes to the output stream.  This
+ * runs on the writer thread, if there is one.
+ */
+static int
+pmx_output_sink(pmx_stream_t *pmxp, const uint8_t *p, size_t len)
+{
+	pmx_gzip_t *pgz = pmxp->pxs_gzip;
+	size_t n;
+
+	if (pgz == NULL) {
+		return (pmx_output_raw(pmxp, p, len));
+	}
+
+	while (len > 0) {
+		if (!pgz->pgz_inmember) {
+			pmx_output_index(pmxp, pmxp->pxs_nbytesout,
+			    pgz->pgz_nbytesin);
+			pgz->pgz_inmember = 1;
+		}
+
+		n = PMX_GZ_CHUNKSZ - pgz->pgz_chunkused;
+		if (n > len) {
+			n = len;
+		}
+
+		pgz->pgz_chunkused += n;
+		pgz->pgz_nbytesin += n;
+		if (pmx_output_deflate(pmxp, p, n,
+		    pgz->pgz_chunkused == PMX_GZ_CHUNKSZ ?
+		    Z_FINISH : Z_NO_FLUSH) != 0) {
+			return (-1);
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+static int
+pmx_output_raw(pmx_stream_t *pmxp, const void *buf, size_t len)
+{
+	if (pmxp->pxs_static) {
+		if (pmx_output_fd(pmxp->pxs_outfd, buf, len) != 0) {
+			pmx_set_errno(pmxp, PMXE_EIO);
+			return (-1);
+		}
+	} else if (pmxp->pxs_map != NULL) {
+		if (pmx_map_write(pmxp->pxs_map, buf, len) != 0) {
+			pmx_output_error(pmxp, "write: %s", strerror(errno));
+			return (-1);
+		}
+	} else if (fwrite(buf, 1, len, pmxp->pxs_outstream) != len) {
+		pmx_output_error(pmxp, "write: %s", strerror(errno));
+		return (-1);
+	}
+
+	/* pmx_byte_counts() may read this while the writer is running. */
+	(void) __atomic_add_fetch(&pmxp->pxs_nbytesout, len, __ATOMIC_RELAXED);
+	return (0);
+}
+
+/*
+ * Writes all "len" bytes to "fd" using only write(2), for static streams.
+ */
+static int
+pmx_output_fd(int fd, const uint8_t *p, size_t len)
+{
+	ssize_t rv;
+
+	while (len > 0) {
+		rv = write(fd, p, len);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return (-1);
+		}
+
+		if (rv == 0) {
+			/* No progress: fail rather than retry forever. */
+			errno = EIO;
+			return (-1);
+		}
+
+		p += rv;
+		len -= (size_t)rv;
+	}
+
+	return (0);
+}
+
+/*
+ * Compresses "len" bytes, writing out compressed data as the output buffer
+ * fills.  With Z_FINISH, this also completes the current gzip member and
+ * prepares to start another.
+ */
+static int
+pmx_output_deflate(pmx_stream_t *pmxp, const uint8_t *buf, size_t len,
+    int flush)
+{
+	pmx_gzip_t *pgz = pmxp->pxs_gzip;
+	z_stream *zs = &pgz->pgz_zs;
+	int rv;
+
+	/* zlib doesn't modify the input, but its interface isn't const. */
+	zs->next_in = (Bytef *)(uintptr_t)buf;
+	zs->avail_in = (uInt)len;
+	do {
+		zs->next_out = pgz->pgz_outbuf;
+		zs->avail_out = PMX_GZ_OUTBUFSZ;
+		rv = deflate(zs, flush);
+		VERIFY(rv == Z_OK || rv == Z_STREAM_END || rv == Z_BUF_ERROR);
+		if (zs->avail_out < PMX_GZ_OUTBUFSZ &&
+		    pmx_output_raw(pmxp, pgz->pgz_outbuf,
+		    PMX_GZ_OUTBUFSZ - zs->avail_out) != 0) {
+			return (-1);
+		}
+	} while (zs->avail_in > 0 || zs->avail_out == 0 ||
+	    (flush == Z_FINISH && rv != Z_STREAM_END));
+
+	if (flush == Z_FINISH) {
+		VERIFY(deflateReset(zs) == Z_OK);
+		pgz->pgz_chunkused = 0;
+		pgz->pgz_inmember = 0;
+	}
+
+	return (0);
+}
+
+static void
+pmx_output_index(pmx_stream_t *pmxp, uint64_t zoff, uint64_t off)
+{
+	uint8_t entry[16];
+
+	if (pmxp->pxs_indexstream == NULL) {
+		return;
+	}
+
+	(void) pmx_u64_encode(pmx_u64_encode(entry, zoff), off);
+	if (fwrite(entry, 1, sizeof (entry), pmxp->pxs_indexstream) !=
+	    sizeof (entry)) {
+		pmx_output_error(pmxp, "index: write: %s", strerror(errno));
+	}
+}
+
+/*
+ * Records an I/O error.  With a writer thread, the error is recorded for the
+ * caller to pick up later.  Only the first error is kept.
+ */
+static void
+pmx_output_error(pmx_stream_t *pmxp, const char *fmt, ...)
+{
+	pmx_async_t *pas = pmxp->pxs_async;
+	va_list args;
+
+	va_start(args, fmt);
+	if (pas == NULL) {
+		if (pmxp->pxs_error == PMXE_OK) {
+			pmx_verror(pmxp, PMXE_EIO, fmt, args);
+		}
+	} else if (!__atomic_load_n(&pas->pas_failed, __ATOMIC_RELAXED)) {
+		(void) vsnprintf(pas->pas_errmsg, sizeof (pas->pas_errmsg),
+		    fmt, args);
+		__atomic_store_n(&pas->pas_failed, 1, __ATOMIC_RELEASE);
+	}
+	va_end(args);
+}
+
+/*
+ * Writer thread and ring buffer
+ */
+
+/*
+ * Copies "len" bytes into the ring, handing each buffer to the writer as it
+ * fills up and waiting for the writer whenever the ring is full.
+ */
+static int
+pmx_async_enqueue(pmx_stream_t *pmxp, const uint8_t *p, size_t len)
+{
+	pmx_async_t *pas = pmxp->pxs_async;
+	uint8_t *buf;
+	size_t n;
+
+	while (len > 0) {
+		if (pas->pas_used == 0 && pas->pas_head -
+		    __atomic_load_n(&pas->pas_tail, __ATOMIC_ACQUIRE) ==
+		    pas->pas_nbufs) {
+			VERIFY(pthread_mutex_lock(&pas->pas_lock) == 0);
+			while (pas->pas_head - __atomic_load_n(&pas->pas_tail,
+			    __ATOMIC_ACQUIRE) == pas->pas_nbufs) {
+				VERIFY(pthread_cond_wait(&pas->pas_cv,
+				    &pas->pas_lock) == 0);
+			}
+			VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+		}
+
+		n = PMX_ASYNC_BUFSZ - pas->pas_used;
+		if (n > len) {
+			n = len;
+		}
+
+		buf = pas->pas_bufs +
+		    (size_t)(pas->pas_head % pas->pas_nbufs) * PMX_ASYNC_BUFSZ;
+		(void) memcpy(buf + pas->pas_used, p, n);
+		pas->pas_used += n;
+		if (pas->pas_used == PMX_ASYNC_BUFSZ) {
+			pmx_async_publish(pas);
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	pmx_output_check(pmxp);
+	return (pmxp->pxs_error == PMXE_OK ? 0 : -1);
+}
+
+/*
+ * Hands the current buffer to the writer.
+ */
+static void
+pmx_async_publish(pmx_async_t *pas)
+{
+	pas->pas_lens[pas->pas_head % pas->pas_nbufs] = pas->pas_used;
+	pas->pas_used = 0;
+	__atomic_store_n(&pas->pas_head, pas->pas_head + 1, __ATOMIC_RELEASE);
+
+	VERIFY(pthread_mutex_lock(&pas->pas_lock) == 0);
+	VERIFY(pthread_cond_broadcast(&pas->pas_cv) == 0);
+	VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+}
+
+/*
+ * Hands any partially-filled buffer to the writer and waits for the writer to
+ * write everything.  When this returns, the writer is idle, so the caller may
+ * use the output stage directly until it next enqueues output.
+ */
+static void
+pmx_async_drain(pmx_async_t *pas)
+{
+	if (pas->pas_used > 0) {
+		pmx_async_publish(pas);
+	}
+
+	VERIFY(pthread_mutex_lock(&pas->pas_lock) == 0);
+	while (__atomic_load_n(&pas->pas_tail, __ATOMIC_ACQUIRE) !=
+	    pas->pas_head) {
+		VERIFY(pthread_cond_wait(&pas->pas_cv, &pas->pas_lock) == 0);
+	}
+	VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+}
+
+static void *
+pmx_async_writer(void *arg)
+{
+	pmx_stream_t *pmxp = arg;
+	pmx_async_t *pas = pmxp->pxs_async;
+	uint64_t tail = pas->pas_tail;
+	size_t which;
+
+	for (;;) {
+		VERIFY(pthread_mutex_lock(&pas->pas_lock) == 0);
+		while (tail == __atomic_load_n(&pas->pas_head,
+		    __ATOMIC_ACQUIRE) && !pas->pas_stop) {
+			VERIFY(pthread_cond_wait(&pas->pas_cv,
+			    &pas->pas_lock) == 0);
+		}
+
+		if (tail == __atomic_load_n(&pas->pas_head, __ATOMIC_ACQUIRE)) {
+			VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+			break;
+		}
+		VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+
+		which = (size_t)(tail % pas->pas_nbufs);
+		if (!__atomic_load_n(&pas->pas_failed, __ATOMIC_RELAXED)) {
+			(void) pmx_output_sink(pmxp,
+			    pas->pas_bufs + which * PMX_ASYNC_BUFSZ,
+			    pas->pas_lens[which]);
+		}
+
+		tail++;
+		__atomic_store_n(&pas->pas_tail, tail, __ATOMIC_RELEASE);
+		VERIFY(pthread_mutex_lock(&pas->pas_lock) == 0);
+		VERIFY(pthread_cond_broadcast(&pas->pas_cv) == 0);
+		VERIFY(pthread_mutex_unlock(&pas->pas_lock) == 0);
+	}
+
+	return (NULL);
+}
+
+static void
+pmx_async_free(pmx_async_t *pas)
+{
+	if (pas->pas_lockinit) {
+		(void) pthread_cond_destroy(&pas->pas_cv);
+		(void) pthread_mutex_destroy(&pas->pas_lock);
+	}
+
+	free(pas->pas_lens);
+	free(pas->pas_bufs);
+	free(pas);
+}
@@ -0,0 +1,921 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_reader.c: reading JSON exports
+ *
+ * A pmx_reader_t parses an export written by the JSON backend and hands back
+ * one record at a time, either to a caller pulling records with
+ * pmx_reader_next() or to a callback with pmx_reader_walk().  The input is
+ * mapped into memory (or supplied by the caller as a buffer), and strings in
+ * records are returned as views of the input rather than copies, so reading a
+ * record doesn't allocate anything.  A view covers the string as it appears in
+ * the JSON, between the quotation marks.  Views of strings containing escape
+ * sequences are marked as such, and pmx_strview_decode() decodes them.
+ *
+ * This is not a general JSON parser.  Each line of the input must be a single
+ * record in the form the JSON backend writes it:
+ *
+ *     - no whitespace between tokens
+ *     - "type" is the first member of each record
+ *     - for nodes, "subtype" comes before any of the node's fields, which are
+ *       identified by the labels in pmx_node_schemas[]
+ *     - integers are unsigned and fit in 64 bits
+ *
+ * Members are otherwise recognized in any order, and records with missing or
+ * unknown members are rejected.  Knowing what each record looks like means the
+ * tokenizer can dispatch on a key as soon as it's read and parse each value as
+ * the type it must have, without building any intermediate representation.
+ * Strings are found with memchr(), which examines many bytes per step.
+ *
+ * Each record's edges are parsed into an array owned by the reader, which is
+ * only valid until the next record is read.  Everything else in a record
+ * (including views) remains valid until the reader is closed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/* Initial size of the edge array (grown as needed). */
+#define	PMX_READER_EDGES	PMX_EDGEBATCH
+/* Longest double-precision number we'll parse. */
+#define	PMX_READER_NUMMAX	64
+
+#define	PMX_READER_TYPEPREFIX	"{\"type\":"
+#define	PMX_KEYIS(key, len, lit)	\
+	((len) == sizeof (lit) - 1 && memcmp((key), (lit), (len)) == 0)
+
+/* Bits in the mask of members seen in a record. */
+#define	PMXR_M_IDENT		0x01	/* "ident" or "source" */
+#define	PMXR_M_ID		0x02	/* "id" or "content" */
+#define	PMXR_M_STR		0x04	/* "contents", "name", or "value" */
+#define	PMXR_M_KEY		0x08	/* "key" */
+#define	PMXR_M_SUBTYPE		0x10	/* "subtype" */
+#define	PMXR_M_EDGES		0x20	/* "edges" */
+
+struct pmx_reader {
+	const char	*pr_base;		/* input */
+	const char	*pr_end;		/* end of input */
+	const char	*pr_pos;		/* start of next record */
+	uint64_t	pr_baseoff;		/* offset of input in export */
+	void		*pr_map;		/* our mapping, if any */
+	size_t		pr_maplen;
+	uint64_t	pr_line;		/* line of current record */
+	pmx_redge_t	*pr_edges;
+	size_t		pr_edgecap;
+	pmx_error_t	pr_error;
+	char		pr_errmsg[PMX_ERRMSGLEN];
+};
+
+static pmx_reader_t *pmx_reader_alloc(void);
+static int pmx_reader_record(pmx_reader_t *, const char *, pmx_record_t *);
+static int pmx_reader_member(pmx_reader_t *, const char **, pmx_record_t *,
+    unsigned int *);
+static int pmx_reader_field(pmx_reader_t *, const char **, pmx_record_t *,
+    const char *, size_t);
+static int pmx_reader_key(pmx_reader_t *, const char **, pmx_strview_t *);
+static int pmx_reader_string(pmx_reader_t *, const char **,
+    pmx_strview_t *);
+static int pmx_reader_uint(pmx_reader_t *, const char **, uint64_t *);
+static int pmx_reader_double(pmx_reader_t *, const char **, uint64_t *);
+static int pmx_reader_edges(pmx_reader_t *, const char **, pmx_record_t *);
+static int pmx_reader_expect(pmx_reader_t *, const char **, char);
+static char *pmx_utf8_encode(char *, uint32_t);
+static int pmx_hex4(const char *, uint32_t *);
+
+PMX_PRINTFLIKE2
+static int pmx_reader_error(pmx_reader_t *, const char *, ...);
+
+/*
+ * Opens the export at "path" for reading.  Returns NULL (with errno set) on
+ * failure.  The whole file is mapped, so this fails with EFBIG if the file is
+ * larger than the address space (as on a 32-bit system).
+ */
+pmx_reader_t *
+pmx_reader_open(const char *path)
+{
+	pmx_reader_t *pr;
+	struct stat st;
+	void *map = NULL;
+	int fd, err;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return (NULL);
+	}
+
+	if (fstat(fd, &st) != 0) {
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		return (NULL);
+	}
+
+	if ((uint64_t)st.st_size > SIZE_MAX) {
+		(void) close(fd);
+		errno = EFBIG;
+		return (NULL);
+	}
+
+	if (st.st_size > 0) {
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+		    fd, 0);
+		if (map == MAP_FAILED) {
+			err = errno;
+			(void) close(fd);
+			errno = err;
+			return (NULL);
+		}
+
+		(void) posix_madvise(map, (size_t)st.st_size,
+		    POSIX_MADV_SEQUENTIAL);
+	}
+
+	(void) close(fd);
+	if ((pr = pmx_reader_alloc()) == NULL) {
+		if (map != NULL) {
+			(void) munmap(map, (size_t)st.st_size);
+		}
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	pr->pr_map = map;
+	pr->pr_maplen = (size_t)st.st_size;
+	pr->pr_base = pr->pr_pos = map;
+	pr->pr_end = pr->pr_base + pr->pr_maplen;
+	return (pr);
+}
+
+/*
+ * Like pmx_reader_open(), but reads the "len" bytes at "buf", which must remain
+ * valid until the reader is closed.
+ */
+pmx_reader_t *
+pmx_reader_open_buf(const void *buf, size_t len)
+{
+	pmx_reader_t *pr;
+
+	if ((pr = pmx_reader_alloc()) == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	pr->pr_base = pr->pr_pos = buf;
+	pr->pr_end = pr->pr_base + len;
+	return (pr);
+}
+
+/*
+ * Points a reader created with pmx_reader_open_buf() at a new buffer holding
+ * the "len" bytes at offset "off" of an export and clears any error, so that
+ * one reader can be reused for many small pieces of the same export (see
+ * pmx_index_lookup()).
+ */
+void
+pmx_reader_reset(pmx_reader_t *pr, const char *buf, size_t len, uint64_t off)
+{
+	VERIFY(pr->pr_map == NULL);
+	pr->pr_baseoff = off;
+	pr->pr_base = pr->pr_pos = buf;
+	pr->pr_end = pr->pr_base + len;
+	pr->pr_line = 0;
+	pr->pr_error = PMXE_OK;
+}
+
+void
+pmx_reader_close(pmx_reader_t *pr)
+{
+	if (pr == NULL) {
+		return;
+	}
+
+	if (pr->pr_map != NULL) {
+		(void) munmap(pr->pr_map, pr->pr_maplen);
+	}
+
+	free(pr->pr_edges);
+	free(pr);
+}
+
+/*
+ * Reads the next record into "rp".  Returns 1 if a record was read, 0 at the
+ * end of the input, or -1 on error (see pmx_reader_errno()).  After an error,
+ * every call fails the same way.
+ */
+int
+pmx_reader_next(pmx_reader_t *pr, pmx_record_t *rp)
+{
+	const char *p;
+
+	if (pr->pr_error != PMXE_OK) {
+		return (-1);
+	}
+
+	for (p = pr->pr_pos; p < pr->pr_end && *p == '\n'; p++) {
+		pr->pr_line++;
+	}
+
+	if (p == pr->pr_end) {
+		pr->pr_pos = p;
+		return (0);
+	}
+
+	pr->pr_line++;
+	rp->pxr_offset = pr->pr_baseoff + (uint64_t)(p - pr->pr_base);
+	if (pmx_reader_record(pr, p, rp) != 0) {
+		return (-1);
+	}
+
+	return (1);
+}
+
+/*
+ * Calls "func" with each remaining record and "arg".  Returns 0 after the last
+ * record, -1 on error, or whatever non-zero value "func" returns to stop early.
+ */
+int
+pmx_reader_walk(pmx_reader_t *pr, pmx_reader_f *func, void *arg)
+{
+	pmx_record_t rec;
+	int rv;
+
+	while ((rv = pmx_reader_next(pr, &rec)) == 1) {
+		if ((rv = func(&rec, arg)) != 0) {
+			return (rv);
+		}
+	}
+
+	return (rv);
+}
+
+pmx_error_t
+pmx_reader_errno(pmx_reader_t *pr)
+{
+	return (pr->pr_error);
+}
+
+const char *
+pmx_reader_errmsg(pmx_reader_t *pr)
+{
+	return (pr->pr_error == PMXE_OK ? "no error" : pr->pr_errmsg);
+}
+
+/*
+ * Decodes the string "svp" (which has escape sequences) into "buf", which must
+ * have room for at least svp->pxsv_len bytes, and stores the length of the
+ * result into "lenp".  Returns 0 on success or -1 if the string contains an
+ * invalid escape sequence.  The result is not NUL-terminated.
+ */
+int
+pmx_strview_decode(const pmx_strview_t *svp, char *buf, size_t *lenp)
+{
+	const char *p = svp->pxsv_ptr, *end = p + svp->pxsv_len;
+	const char *bs;
+	char *q = buf;
+	uint32_t c, lo;
+
+	while (p < end) {
+		if ((bs = memchr(p, '\\', (size_t)(end - p))) == NULL) {
+			bs = end;
+		}
+
+		(void) memcpy(q, p, (size_t)(bs - p));
+		q += bs - p;
+		p = bs;
+		if (p == end) {
+			break;
+		}
+
+		if (end - p < 2) {
+			return (-1);
+		}
+
+		switch (p[1]) {
+		case '"':
+		case '\\':
+		case '/':
+			*q++ = p[1];
+			break;
+		case 'b':
+			*q++ = '\b';
+			break;
+		case 'f':
+			*q++ = '\f';
+			break;
+		case 'n':
+			*q++ = '\n';
+			break;
+		case 'r':
+			*q++ = '\r';
+			break;
+		case 't':
+			*q++ = '\t';
+			break;
+		case 'u':
+			if (end - p < 6 || pmx_hex4(p + 2, &c) != 0) {
+				return (-1);
+			}
+
+			p += 4;
+			if (c >= 0xd800 && c < 0xdc00) {
+				/* The first half of a surrogate pair. */
+				if (end - p < 8 || p[2] != '\\' ||
+				    p[3] != 'u' || pmx_hex4(p + 4, &lo) != 0 ||
+				    lo < 0xdc00 || lo >= 0xe000) {
+					return (-1);
+				}
+
+				c = 0x10000 + ((c - 0xd800) << 10) +
+				    (lo - 0xdc00);
+				p += 6;
+			} else if (c >= 0xdc00 && c < 0xe000) {
+				return (-1);
+			}
+
+			q = pmx_utf8_encode(q, c);
+			break;
+		default:
+			return (-1);
+		}
+
+		p += 2;
+	}
+
+	*lenp = (size_t)(q - buf);
+	return (0);
+}
+
+/*
+ * Node schemas, for interpreting node records.
+ */
+const char *
+pmx_node_typename(unsigned int subtype)
+{
+	if (subtype == PMXN_NONE || subtype >= PMXN_NTYPES) {
+		return (NULL);
+	}
+
+	return (pmx_node_schemas[subtype].pxn_name);
+}
+
+const char *
+pmx_node_fieldname(unsigned int subtype, unsigned int which)
+{
+	if (pmx_node_typename(subtype) == NULL ||
+	    which >= pmx_node_schemas[subtype].pxn_nfields) {
+		return (NULL);
+	}
+
+	return (pmx_node_schemas[subtype].pxn_fields[which].pxf_label);
+}
+
+pmx_boolean_t
+pmx_node_fieldisref(unsigned int subtype, unsigned int which)
+{
+	if (pmx_node_fieldname(subtype, which) == NULL) {
+		return (PB_FALSE);
+	}
+
+	return (pmx_node_schemas[subtype].pxn_fields[which].pxf_kind ==
+	    PMXFK_REF ? PB_TRUE : PB_FALSE);
+}
+
+static pmx_reader_t *
+pmx_reader_alloc(void)
+{
+	pmx_reader_t *pr;
+
+	VERIFY(PMXR_MAXFIELDS == PMX_MAXFIELDS);
+	if ((pr = calloc(1, sizeof (*pr))) == NULL) {
+		return (NULL);
+	}
+
+	pr->pr_edges = malloc(PMX_READER_EDGES * sizeof (pmx_redge_t));
+	if (pr->pr_edges == NULL) {
+		free(pr);
+		return (NULL);
+	}
+
+	pr->pr_edgecap = PMX_READER_EDGES;
+	return (pr);
+}
+
+/*
+ * Parses the record starting at "p" (which is not at the end of the input) and
+ * advances pr_pos past it.
+ */
+static int
+pmx_reader_record(pmx_reader_t *pr, const char *p, pmx_record_t *rp)
+{
+	static const unsigned int required[] = {
+		[PMXR_METADATA] = PMXR_M_KEY | PMXR_M_STR,
+		[PMXR_STRING] = PMXR_M_IDENT,
+		[PMXR_CONTENT] = PMXR_M_ID | PMXR_M_STR,
+		[PMXR_NAME] = PMXR_M_ID | PMXR_M_STR,
+		[PMXR_NODE] = PMXR_M_SUBTYPE | PMXR_M_IDENT,
+		[PMXR_EDGES] = PMXR_M_IDENT | PMXR_M_EDGES,
+	};
+	pmx_strview_t type;
+	unsigned int seen = 0;
+
+	if ((size_t)(pr->pr_end - p) < sizeof (PMX_READER_TYPEPREFIX) - 1 ||
+	    memcmp(p, PMX_READER_TYPEPREFIX,
+	    sizeof (PMX_READER_TYPEPREFIX) - 1) != 0) {
+		return (pmx_reader_error(pr, "expected record type"));
+	}
+
+	p += sizeof (PMX_READER_TYPEPREFIX) - 1;
+	if (pmx_reader_key(pr, &p, &type) != 0) {
+		return (-1);
+	}
+
+	if (PMX_KEYIS(type.pxsv_ptr, type.pxsv_len, "node")) {
+		rp->pxr_type = PMXR_NODE;
+		rp->pxr_fieldmask = 0;
+	} else if (PMX_KEYIS(type.pxsv_ptr, type.pxsv_len, "edges")) {
+		rp->pxr_type = PMXR_EDGES;
+	} else if (PMX_KEYIS(type.pxsv_ptr, type.pxsv_len, "string")) {
+		rp->pxr_type = PMXR_STRING;
+	} else if (PMX_KEYIS(type.pxsv_ptr, type.pxsv_len, "name")) {
+		rp->pxr_type = PMXR_NAME;
+	} else if (PMX_KEYIS(type.pxsv_ptr, type.pxsv_len, "content")) {
+		rp->pxr_type = PMXR_CONTENT;
+	} else if (PMX_KEYIS(type.pxsv_ptr, type.pxsv_len, "metadata")) {
+		rp->pxr_type = PMXR_METADATA;
+	} else {
+		return (pmx_reader_error(pr, "unknown record type \"%.*s\"",
+		    (int)type.pxsv_len, type.pxsv_ptr));
+	}
+
+	while (p < pr->pr_end && *p == ',') {
+		p++;
+		if (pmx_reader_member(pr, &p, rp, &seen) != 0) {
+			return (-1);
+		}
+	}
+
+	if (pmx_reader_expect(pr, &p, '}') != 0) {
+		return (-1);
+	}
+
+	if (p < pr->pr_end && *p++ != '\n') {
+		return (pmx_reader_error(pr, "expected end of line"));
+	}
+
+	if ((seen & required[rp->pxr_type]) != required[rp->pxr_type]) {
+		return (pmx_reader_error(pr, "%.*s record is missing members",
+		    (int)type.pxsv_len, type.pxsv_ptr));
+	}
+
+	/* String data records have either contents or a content id. */
+	if (rp->pxr_type == PMXR_STRING) {
+		if ((seen & (PMXR_M_ID | PMXR_M_STR)) == 0 ||
+		    (seen & (PMXR_M_ID | PMXR_M_STR)) ==
+		    (PMXR_M_ID | PMXR_M_STR)) {
+			return (pmx_reader_error(pr, "string record needs "
+			    "exactly one of \"contents\" and \"content\""));
+		}
+
+		rp->pxr_hascontent = (seen & PMXR_M_ID) != 0 ? PB_TRUE :
+		    PB_FALSE;
+	}
+
+	pr->pr_pos = p;
+	return (0);
+}
+
+/*
+ * Parses one member ("key":value) of a record whose type is already known.
+ */
+static int
+pmx_reader_member(pmx_reader_t *pr, const char **pp, pmx_record_t *rp,
+    unsigned int *seenp)
+{
+	const char *p = *pp, *key;
+	pmx_strview_t view;
+	unsigned int bit = 0;
+	uint64_t subtype;
+	size_t len;
+	int rv;
+
+	if (pmx_reader_key(pr, &p, &view) != 0 ||
+	    pmx_reader_expect(pr, &p, ':') != 0) {
+		return (-1);
+	}
+
+	key = view.pxsv_ptr;
+	len = view.pxsv_len;
+	switch (rp->pxr_type) {
+	case PMXR_NODE:
+		if (PMX_KEYIS(key, len, "subtype")) {
+			bit = PMXR_M_SUBTYPE;
+			rv = pmx_reader_uint(pr, &p, &subtype);
+			if (rv == 0 && (subtype >= PMXN_NTYPES ||
+			    pmx_node_typename((unsigned int)subtype) == NULL)) {
+				rv = pmx_reader_error(pr, "bad subtype");
+			}
+			rp->pxr_subtype = (unsigned int)subtype;
+		} else if (PMX_KEYIS(key, len, "ident")) {
+			bit = PMXR_M_IDENT;
+			rv = pmx_reader_uint(pr, &p, &rp->pxr_ident);
+		} else if ((*seenp & PMXR_M_SUBTYPE) != 0) {
+			rv = pmx_reader_field(pr, &p, rp, key, len);
+		} else {
+			rv = pmx_reader_error(pr, "node field before subtype");
+		}
+		break;
+
+	case PMXR_EDGES:
+		if (PMX_KEYIS(key, len, "source")) {
+			bit = PMXR_M_IDENT;
+			rv = pmx_reader_uint(pr, &p, &rp->pxr_ident);
+		} else if (PMX_KEYIS(key, len, "edges")) {
+			bit = PMXR_M_EDGES;
+			rv = pmx_reader_edges(pr, &p, rp);
+		} else {
+			rv = pmx_reader_error(pr, "unknown member");
+		}
+		break;
+
+	case PMXR_STRING:
+		if (PMX_KEYIS(key, len, "ident")) {
+			bit = PMXR_M_IDENT;
+			rv = pmx_reader_uint(pr, &p, &rp->pxr_ident);
+		} else if (PMX_KEYIS(key, len, "contents")) {
+			bit = PMXR_M_STR;
+			rv = pmx_reader_string(pr, &p, &rp->pxr_str);
+		} else if (PMX_KEYIS(key, len, "content")) {
+			bit = PMXR_M_ID;
+			rv = pmx_reader_uint(pr, &p, &rp->pxr_id);
+		} else {
+			rv = pmx_reader_error(pr, "unknown member");
+		}
+		break;
+
+	case PMXR_CONTENT:
+	case PMXR_NAME:
+		if (PMX_KEYIS(key, len, "id")) {
+			bit = PMXR_M_ID;
+			rv = pmx_reader_uint(pr, &p, &rp->pxr_id);
+		} else if (rp->pxr_type == PMXR_CONTENT ?
+		    PMX_KEYIS(key, len, "contents") :
+		    PMX_KEYIS(key, len, "name")) {
+			bit = PMXR_M_STR;
+			rv = pmx_reader_string(pr, &p, &rp->pxr_str);
+		} else {
+			rv = pmx_reader_error(pr, "unknown member");
+		}
+		break;
+
+	default:
+		VERIFY(rp->pxr_type == PMXR_METADATA);
+		if (PMX_KEYIS(key, len, "key")) {
+			bit = PMXR_M_KEY;
+			rv = pmx_reader_string(pr, &p, &rp->pxr_key);
+		} else if (PMX_KEYIS(key, len, "value")) {
+			bit = PMXR_M_STR;
+			rv = pmx_reader_string(pr, &p, &rp->pxr_str);
+		} else {
+			rv = pmx_reader_error(pr, "unknown member");
+		}
+		break;
+	}
+
+	if (rv != 0) {
+		return (-1);
+	}
+
+	if ((*seenp & bit) != 0) {
+		return (pmx_reader_error(pr, "duplicate member \"%.*s\"",
+		    (int)len, key));
+	}
+
+	*seenp |= bit;
+	*pp = p;
+	return (0);
+}
+
+/*
+ * Parses the value of the node field labeled "key".
+ */
+static int
+pmx_reader_field(pmx_reader_t *pr, const char **pp, pmx_record_t *rp,
+    const char *key, size_t len)
+{
+	const pmx_nodeschema_t *pxn = &pmx_node_schemas[rp->pxr_subtype];
+	const pmx_fielddesc_t *field;
+	unsigned int i;
+
+	for (i = 0; i < pxn->pxn_nfields; i++) {
+		field = &pxn->pxn_fields[i];
+		if (strncmp(field->pxf_label, key, len) == 0 &&
+		    field->pxf_label[len] == '\0') {
+			break;
+		}
+	}
+
+	if (i == pxn->pxn_nfields) {
+		return (pmx_reader_error(pr, "unknown %s field \"%.*s\"",
+		    pxn->pxn_name, (int)len, key));
+	}
+
+	if ((rp->pxr_fieldmask & (1U << i)) != 0) {
+		return (pmx_reader_error(pr, "duplicate field \"%.*s\"",
+		    (int)len, key));
+	}
+
+	rp->pxr_fieldmask |= 1U << i;
+	if (field->pxf_kind == PMXFK_DOUBLE) {
+		return (pmx_reader_double(pr, pp, &rp->pxr_fields[i]));
+	}
+
+	return (pmx_reader_uint(pr, pp, &rp->pxr_fields[i]));
+}
+
+/*
+ * Parses a key or record type.  These are short and never contain escape
+ * sequences, so it's faster to look for the end one byte at a time.
+ */
+static int
+pmx_reader_key(pmx_reader_t *pr, const char **pp, pmx_strview_t *svp)
+{
+	const char *p = *pp, *start;
+
+	if (pmx_reader_expect(pr, &p, '"') != 0) {
+		return (-1);
+	}
+
+	for (start = p; p < pr->pr_end && *p != '"'; p++) {
+		if (*p == '\\' || *p == '\n') {
+			return (pmx_reader_error(pr, "bad key"));
+		}
+	}
+
+	if (p == pr->pr_end) {
+		return (pmx_reader_error(pr, "unterminated string"));
+	}
+
+	svp->pxsv_ptr = start;
+	svp->pxsv_len = (size_t)(p - start);
+	svp->pxsv_escaped = PB_FALSE;
+	*pp = p + 1;
+	return (0);
+}
+
+/*
+ * Parses a string, returning a view of its contents.  The closing quotation
+ * mark is the first one that isn't preceded by an odd number of backslashes.
+ */
+static int
+pmx_reader_string(pmx_reader_t *pr, const char **pp, pmx_strview_t *svp)
+{
+	const char *p = *pp, *start, *q, *b;
+
+	if (pmx_reader_expect(pr, &p, '"') != 0) {
+		return (-1);
+	}
+
+	start = p;
+	for (;;) {
+		q = memchr(p, '"', (size_t)(pr->pr_end - p));
+		if (q == NULL) {
+			return (pmx_reader_error(pr, "unterminated string"));
+		}
+
+		for (b = q; b > start && b[-1] == '\\'; b--) {
+			continue;
+		}
+
+		if ((q - b) % 2 == 0) {
+			break;
+		}
+
+		p = q + 1;
+	}
+
+	svp->pxsv_ptr = start;
+	svp->pxsv_len = (size_t)(q - start);
+	svp->pxsv_escaped = memchr(start, '\\', svp->pxsv_len) != NULL ?
+	    PB_TRUE : PB_FALSE;
+	*pp = q + 1;
+	return (0);
+}
+
+/*
+ * Parses an unsigned integer.  Up to 19 digits can't overflow, so only longer
+ * numbers are checked.
+ */
+static int
+pmx_reader_uint(pmx_reader_t *pr, const char **pp, uint64_t *valp)
+{
+	const char *p = *pp, *end = pr->pr_end;
+	unsigned int d, ndigits = 0;
+	uint64_t val = 0;
+
+	for (; p < end && (d = (unsigned int)(*p - '0')) <= 9; p++) {
+		if (++ndigits >= 20 && val > (UINT64_MAX - d) / 10) {
+			return (pmx_reader_error(pr, "integer too large"));
+		}
+
+		val = val * 10 + d;
+	}
+
+	if (ndigits == 0) {
+		return (pmx_reader_error(pr, "expected unsigned integer"));
+	}
+
+	*valp = val;
+	*pp = p;
+	return (0);
+}
+
+/*
+ * Parses a number into the bits of an IEEE 754 double (which is how double
+ * fields are stored in a record).  The number is copied out first since the
+ * input isn't NUL-terminated.
+ */
+static int
+pmx_reader_double(pmx_reader_t *pr, const char **pp, uint64_t *bitsp)
+{
+	const char *p = *pp;
+	char buf[PMX_READER_NUMMAX], *endp;
+	size_t len;
+	double d;
+
+	for (len = 0; p + len < pr->pr_end && len < sizeof (buf) - 1; len++) {
+		if (strchr("0123456789+-.eE", p[len]) == NULL ||
+		    p[len] == '\0') {
+			break;
+		}
+	}
+
+	(void) memcpy(buf, p, len);
+	buf[len] = '\0';
+	errno = 0;
+	d = strtod(buf, &endp);
+	if (len == 0 || *endp != '\0' || errno != 0) {
+		return (pmx_reader_error(pr, "expected number"));
+	}
+
+	(void) memcpy(bitsp, &d, sizeof (d));
+	*pp = p + len;
+	return (0);
+}
+
+/*
+ * Parses an array of edges, each an array of kind, target, and key.
+ */
+static int
+pmx_reader_edges(pmx_reader_t *pr, const char **pp, pmx_record_t *rp)
+{
+	const char *p = *pp;
+	pmx_redge_t *edge, *newedges;
+	uint64_t kind;
+	size_t n = 0;
+
+	if (pmx_reader_expect(pr, &p, '[') != 0) {
+		return (-1);
+	}
+
+	if (p < pr->pr_end && *p == ']') {
+		p++;
+		goto out;
+	}
+
+	for (;;) {
+		if (n == pr->pr_edgecap) {
+			newedges = realloc(pr->pr_edges,
+			    2 * pr->pr_edgecap * sizeof (pmx_redge_t));
+			if (newedges == NULL) {
+				pr->pr_error = PMXE_ENOMEM;
+				(void) snprintf(pr->pr_errmsg,
+				    sizeof (pr->pr_errmsg), "out of memory");
+				return (-1);
+			}
+
+			pr->pr_edges = newedges;
+			pr->pr_edgecap *= 2;
+		}
+
+		edge = &pr->pr_edges[n++];
+		if (pmx_reader_expect(pr, &p, '[') != 0 ||
+		    pmx_reader_uint(pr, &p, &kind) != 0 ||
+		    pmx_reader_expect(pr, &p, ',') != 0 ||
+		    pmx_reader_uint(pr, &p, &edge->pxre_target) != 0 ||
+		    pmx_reader_expect(pr, &p, ',') != 0 ||
+		    pmx_reader_uint(pr, &p, &edge->pxre_key) != 0 ||
+		    pmx_reader_expect(pr, &p, ']') != 0) {
+			return (-1);
+		}
+
+		if (kind == PMXEG_NONE || kind > PMXEG_SMI_ELEMENT) {
+			return (pmx_reader_error(pr, "bad edge kind"));
+		}
+
+		edge->pxre_kind = (unsigned int)kind;
+		if (p < pr->pr_end && *p == ']') {
+			p++;
+			break;
+		}
+
+		if (pmx_reader_expect(pr, &p, ',') != 0) {
+			return (-1);
+		}
+	}
+
+out:
+	rp->pxr_edges = pr->pr_edges;
+	rp->pxr_nedges = n;
+	*pp = p;
+	return (0);
+}
+
+static int
+pmx_reader_expect(pmx_reader_t *pr, const char **pp, char c)
+{
+	if (*pp == pr->pr_end || **pp != c) {
+		return (pmx_reader_error(pr, "expected '%c'", c));
+	}
+
+	(*pp)++;
+	return (0);
+}
+
+static int
+pmx_reader_error(pmx_reader_t *pr, const char *fmt, ...)
+{
+	/* Leave room for the line number. */
+	char buf[PMX_ERRMSGLEN - 32];
+	va_list args;
+
+	va_start(args, fmt);
+	(void) vsnprintf(buf, sizeof (buf), fmt, args);
+	va_end(args);
+
+	pr->pr_error = PMXE_EFORMAT;
+	(void) snprintf(pr->pr_errmsg, sizeof (pr->pr_errmsg),
+	    "at line %" PRIu64 ": %s", pr->pr_line, buf);
+	return (-1);
+}
+
+static int
+pmx_hex4(const char *p, uint32_t *cp)
+{
+	uint32_t c = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		c <<= 4;
+		if (p[i] >= '0' && p[i] <= '9') {
+			c |= (uint32_t)(p[i] - '0');
+		} else if (p[i] >= 'a' && p[i] <= 'f') {
+			c |= (uint32_t)(p[i] - 'a' + 10);
+		} else if (p[i] >= 'A' && p[i] <= 'F') {
+			c |= (uint32_t)(p[i] - 'A' + 10);
+		} else {
+			return (-1);
+		}
+	}
+
+	*cp = c;
+	return (0);
+}
+
+static char *
+pmx_utf8_encode(char *q, uint32_t c)
+{
+	if (c < 0x80) {
+		*q++ = (char)c;
+	} else if (c < 0x800) {
+		*q++ = (char)(0xc0 | (c >> 6));
+		*q++ = (char)(0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		*q++ = (char)(0xe0 | (c >> 12));
+		*q++ = (char)(0x80 | ((c >> 6) & 0x3f));
+		*q++ = (char)(0x80 | (c & 0x3f));
+	} else {
+		*q++ = (char)(0xf0 | (c >> 18));
+		*q++ = (char)(0x80 | ((c >> 12) & 0x3f));
+		*q++ = (char)(0x80 | ((c >> 6) & 0x3f));
+		*q++ = (char)(0x80 | (c & 0x3f));
+	}
+
+	return (q);
+}
@@ -0,0 +1,414 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_sqlite.c: sqlite output backend
+ *
+ * This backend records an export in a sqlite database so that it can be
+ * queried directly.  The database contains:
+ *
+ *     metadata (key, value)		one row per metadata record
+ *
+ *     nodetypes (subtype, name)	one row per pmx_nodetype_t
+ *
+ *     one table per node type		named for the node type (e.g.,
+ *     (ident, <fields>...)		"string_cons"), with one column per
+ *     					field in the node's schema (see
+ *     					pmx_node_schemas).  Fields that the
+ *     					exporter did not supply are NULL.
+ *
+ *     strings (ident, contents)	string data, recorded as a BLOB with
+ *     					exactly the bytes provided
+ *
+ *     nodes (ident, subtype)		a view over all of the node tables
+ *
+ *     names (id, name)			property and closure variable names
+ *
+ *     edges (source, kind, target, key)
+ *     					one row per edge, where "kind" is
+ *     					the pmx_edgetype_t and "key" is the
+ *     					element index for array elements or
+ *     					the id of the name for properties
+ *     					and closure variables
+ *
+ * Idents and other integers are stored as signed 64-bit integers, which is how
+ * sqlite stores integers.  (Values above INT64_MAX therefore appear negative.)
+ *
+ * Exports can contain hundreds of millions of records, so this is organized to
+ * load data quickly: each kind of record is inserted using a statement that's
+ * prepared once when the stream is created, rows are inserted in large
+ * transactions, the database is configured without a rollback journal or
+ * synchronous writes (an interrupted export is not useful anyway), and indexes
+ * are created only when the export is complete.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/*
+ * Number of rows inserted in each transaction.
+ */
+#define	PMX_SQLITE_TXNROWS	(1024 * 1024)
+
+/*
+ * Maximum length of generated SQL statements.
+ */
+#define	PMX_SQLITE_MAXSQL	1024
+
+struct pmx_sqlite {
+	sqlite3		*pxq_db;
+	sqlite3_stmt	*pxq_metadata;			/* insert metadata */
+	sqlite3_stmt	*pxq_string;			/* insert string */
+	sqlite3_stmt	*pxq_name;			/* insert name */
+	sqlite3_stmt	*pxq_edge;			/* insert edge */
+	sqlite3_stmt	*pxq_nodes[PMXN_NTYPES];	/* insert nodes */
+	unsigned long	pxq_txnrows;			/* rows in this txn */
+};
+
+static int pmx_sqlite_init(pmx_stream_t *);
+static void pmx_sqlite_fini(pmx_stream_t *);
+static void pmx_sqlite_done(pmx_stream_t *);
+static void pmx_sqlite_metadata(pmx_stream_t *, const char *, const char *);
+static void pmx_sqlite_node(pmx_stream_t *);
+static void pmx_sqlite_string(pmx_stream_t *, pmx_value_t, size_t,
+    const uint8_t *);
+static void pmx_sqlite_name(pmx_stream_t *, uint64_t, const char *);
+static void pmx_sqlite_edges(pmx_stream_t *, pmx_value_t, const pmx_edge_t *,
+    size_t);
+
+const pmx_backend_t pmx_backend_sqlite = {
+	.pxb_name = "sqlite",
+	.pxb_init = pmx_sqlite_init,
+	.pxb_fini = pmx_sqlite_fini,
+	.pxb_done = pmx_sqlite_done,
+	.pxb_metadata = pmx_sqlite_metadata,
+	.pxb_node = pmx_sqlite_node,
+	.pxb_string = pmx_sqlite_string,
+	.pxb_edgename = pmx_sqlite_name,
+	.pxb_edges = pmx_sqlite_edges,
+};
+
+static int pmx_sqlite_exec(pmx_stream_t *, const char *);
+static int pmx_sqlite_prepare(pmx_stream_t *, const char *, sqlite3_stmt **);
+static void pmx_sqlite_step(pmx_stream_t *, sqlite3_stmt *);
+static void pmx_sqlite_fail(pmx_stream_t *, const char *);
+
+static int
+pmx_sqlite_init(pmx_stream_t *pmxp)
+{
+	pmx_sqlite_t *pxq;
+	const pmx_nodeschema_t *schema;
+	char sql[PMX_SQLITE_MAXSQL];
+	size_t off;
+	unsigned int i, j;
+
+	pxq = calloc(1, sizeof (*pxq));
+	if (pxq == NULL) {
+		return (-1);
+	}
+
+	pmxp->pxs_sqlite = pxq;
+	if (sqlite3_open_v2(pmxp->pxs_outpath, &pxq->pxq_db,
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+		pmx_sqlite_fail(pmxp, "open");
+		return (-1);
+	}
+
+	if (pmx_sqlite_exec(pmxp, "PRAGMA journal_mode = OFF") != 0 ||
+	    pmx_sqlite_exec(pmxp, "PRAGMA synchronous = OFF") != 0 ||
+	    pmx_sqlite_exec(pmxp, "BEGIN") != 0 ||
+	    pmx_sqlite_exec(pmxp, "CREATE TABLE metadata "
+	    "(key TEXT NOT NULL, value TEXT NOT NULL)") != 0 ||
+	    pmx_sqlite_exec(pmxp, "CREATE TABLE nodetypes "
+	    "(subtype INTEGER PRIMARY KEY, name TEXT NOT NULL)") != 0 ||
+	    pmx_sqlite_exec(pmxp, "CREATE TABLE strings "
+	    "(ident INTEGER NOT NULL, contents BLOB NOT NULL)") != 0 ||
+	    pmx_sqlite_exec(pmxp, "CREATE TABLE names "
+	    "(id INTEGER PRIMARY KEY, name TEXT NOT NULL)") != 0 ||
+	    pmx_sqlite_exec(pmxp, "CREATE TABLE edges "
+	    "(source INTEGER NOT NULL, kind INTEGER NOT NULL, "
+	    "target INTEGER NOT NULL, key INTEGER NOT NULL)") != 0 ||
+	    pmx_sqlite_prepare(pmxp, "INSERT INTO metadata VALUES (?, ?)",
+	    &pxq->pxq_metadata) != 0 ||
+	    pmx_sqlite_prepare(pmxp, "INSERT INTO strings VALUES (?, ?)",
+	    &pxq->pxq_string) != 0 ||
+	    pmx_sqlite_prepare(pmxp, "INSERT INTO names VALUES (?, ?)",
+	    &pxq->pxq_name) != 0 ||
+	    pmx_sqlite_prepare(pmxp, "INSERT INTO edges VALUES (?, ?, ?, ?)",
+	    &pxq->pxq_edge) != 0) {
+		return (-1);
+	}
+
+	/*
+	 * Create a table for each node type, a statement to insert into it,
+	 * and a row describing it in "nodetypes".  All of the generated SQL
+	 * comes from pmx_node_schemas, which is known to fit in "sql".
+	 */
+	for (i = PMXN_NONE + 1; i < PMXN_NTYPES; i++) {
+		schema = &pmx_node_schemas[i];
+		off = snprintf(sql, sizeof (sql),
+		    "CREATE TABLE %s (ident INTEGER NOT NULL",
+		    schema->pxn_name);
+		for (j = 0; j < schema->pxn_nfields; j++) {
+			off += snprintf(sql + off, sizeof (sql) - off,
+			    ", %s %s", schema->pxn_fields[j].pxf_label,
+			    schema->pxn_fields[j].pxf_kind == PMXFK_DOUBLE ?
+			    "REAL" : "INTEGER");
+		}
+		off += snprintf(sql + off, sizeof (sql) - off, ")");
+		VERIFY(off < sizeof (sql));
+		if (pmx_sqlite_exec(pmxp, sql) != 0) {
+			return (-1);
+		}
+
+		off = snprintf(sql, sizeof (sql),
+		    "INSERT INTO %s VALUES (?", schema->pxn_name);
+		for (j = 0; j < schema->pxn_nfields; j++) {
+			off += snprintf(sql + off, sizeof (sql) - off, ", ?");
+		}
+		off += snprintf(sql + off, sizeof (sql) - off, ")");
+		VERIFY(off < sizeof (sql));
+		if (pmx_sqlite_prepare(pmxp, sql, &pxq->pxq_nodes[i]) != 0) {
+			return (-1);
+		}
+
+		off = snprintf(sql, sizeof (sql),
+		    "INSERT INTO nodetypes VALUES (%u, '%s')", i,
+		    schema->pxn_name);
+		VERIFY(off < sizeof (sql));
+		if (pmx_sqlite_exec(pmxp, sql) != 0) {
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+static void
+pmx_sqlite_fini(pmx_stream_t *pmxp)
+{
+	pmx_sqlite_t *pxq = pmxp->pxs_sqlite;
+	unsigned int i;
+
+	if (pxq == NULL) {
+		return;
+	}
+
+	(void) sqlite3_finalize(pxq->pxq_metadata);
+	(void) sqlite3_finalize(pxq->pxq_string);
+	(void) sqlite3_finalize(pxq->pxq_name);
+	(void) sqlite3_finalize(pxq->pxq_edge);
+	for (i = 0; i < PMXN_NTYPES; i++) {
+		(void) sqlite3_finalize(pxq->pxq_nodes[i]);
+	}
+
+	(void) sqlite3_close(pxq->pxq_db);
+	free(pxq);
+	pmxp->pxs_sqlite = NULL;
+}
+
+/*
+ * Commits the last transaction, then builds the indexes and the "nodes" view.
+ */
+static void
+pmx_sqlite_done(pmx_stream_t *pmxp)
+{
+	const pmx_nodeschema_t *schema;
+	char sql[PMX_SQLITE_MAXSQL];
+	unsigned int i;
+	size_t off;
+
+	if (pmxp->pxs_error != PMXE_OK ||
+	    pmx_sqlite_exec(pmxp, "COMMIT") != 0 ||
+	    pmx_sqlite_exec(pmxp, "BEGIN") != 0 ||
+	    pmx_sqlite_exec(pmxp,
+	    "CREATE INDEX strings_ident ON strings (ident)") != 0 ||
+	    pmx_sqlite_exec(pmxp,
+	    "CREATE INDEX edges_source ON edges (source)") != 0) {
+		return;
+	}
+
+	for (i = PMXN_NONE + 1; i < PMXN_NTYPES; i++) {
+		schema = &pmx_node_schemas[i];
+		off = snprintf(sql, sizeof (sql),
+		    "CREATE INDEX %s_ident ON %s (ident)",
+		    schema->pxn_name, schema->pxn_name);
+		VERIFY(off < sizeof (sql));
+		if (pmx_sqlite_exec(pmxp, sql) != 0) {
+			return;
+		}
+	}
+
+	off = snprintf(sql, sizeof (sql), "CREATE VIEW nodes AS ");
+	for (i = PMXN_NONE + 1; i < PMXN_NTYPES; i++) {
+		off += snprintf(sql + off, sizeof (sql) - off,
+		    "%sSELECT ident, %u AS subtype FROM %s",
+		    i == PMXN_NONE + 1 ? "" : " UNION ALL ", i,
+		    pmx_node_schemas[i].pxn_name);
+	}
+	VERIFY(off < sizeof (sql));
+	if (pmx_sqlite_exec(pmxp, sql) != 0) {
+		return;
+	}
+
+	(void) pmx_sqlite_exec(pmxp, "COMMIT");
+}
+
+static void
+pmx_sqlite_metadata(pmx_stream_t *pmxp, const char *key, const char *value)
+{
+	sqlite3_stmt *stmt = pmxp->pxs_sqlite->pxq_metadata;
+
+	(void) sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	(void) sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC);
+	pmx_sqlite_step(pmxp, stmt);
+}
+
+static void
+pmx_sqlite_node(pmx_stream_t *pmxp)
+{
+	const pmx_nodeschema_t *schema;
+	sqlite3_stmt *stmt;
+	unsigned int i;
+	double d;
+
+	schema = &pmx_node_schemas[pmxp->pxs_subtype];
+	stmt = pmxp->pxs_sqlite->pxq_nodes[pmxp->pxs_subtype];
+	(void) sqlite3_bind_int64(stmt, 1, (sqlite3_int64)pmxp->pxs_ident);
+	for (i = 0; i < schema->pxn_nfields; i++) {
+		if ((pmxp->pxs_fieldmask & (1U << i)) == 0) {
+			(void) sqlite3_bind_null(stmt, i + 2);
+		} else if (schema->pxn_fields[i].pxf_kind == PMXFK_DOUBLE) {
+			(void) memcpy(&d, &pmxp->pxs_fields[i], sizeof (d));
+			(void) sqlite3_bind_double(stmt, i + 2, d);
+		} else {
+			(void) sqlite3_bind_int64(stmt, i + 2,
+			    (sqlite3_int64)pmxp->pxs_fields[i]);
+		}
+	}
+
+	pmx_sqlite_step(pmxp, stmt);
+}
+
+static void
+pmx_sqlite_string(pmx_stream_t *pmxp, pmx_value_t jsv, size_t sz,
+    const uint8_t *bytes)
+{
+	sqlite3_stmt *stmt = pmxp->pxs_sqlite->pxq_string;
+
+	(void) sqlite3_bind_int64(stmt, 1, (sqlite3_int64)jsv);
+	/* A NULL pointer would be stored as NULL rather than an empty BLOB. */
+	(void) sqlite3_bind_blob64(stmt, 2, bytes != NULL ? bytes :
+	    (const uint8_t *)"", sz, SQLITE_STATIC);
+	pmx_sqlite_step(pmxp, stmt);
+}
+
+static void
+pmx_sqlite_name(pmx_stream_t *pmxp, uint64_t id, const char *name)
+{
+	sqlite3_stmt *stmt = pmxp->pxs_sqlite->pxq_name;
+
+	(void) sqlite3_bind_int64(stmt, 1, (sqlite3_int64)id);
+	(void) sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+	pmx_sqlite_step(pmxp, stmt);
+}
+
+static void
+pmx_sqlite_edges(pmx_stream_t *pmxp, pmx_value_t source,
+    const pmx_edge_t *edges, size_t nedges)
+{
+	sqlite3_stmt *stmt = pmxp->pxs_sqlite->pxq_edge;
+	size_t i;
+
+	for (i = 0; i < nedges; i++) {
+		(void) sqlite3_bind_int64(stmt, 1, (sqlite3_int64)source);
+		(void) sqlite3_bind_int64(stmt, 2, edges[i].pxe_kind);
+		(void) sqlite3_bind_int64(stmt, 3,
+		    (sqlite3_int64)edges[i].pxe_target);
+		(void) sqlite3_bind_int64(stmt, 4,
+		    (sqlite3_int64)edges[i].pxe_key);
+		pmx_sqlite_step(pmxp, stmt);
+	}
+}
+
+/*
+ * Executes a prepared insert statement whose parameters have been bound,
+ * starting a new transaction every PMX_SQLITE_TXNROWS rows.  Once an error has
+ * been reported, nothing more is inserted.
+ */
+static void
+pmx_sqlite_step(pmx_stream_t *pmxp, sqlite3_stmt *stmt)
+{
+	pmx_sqlite_t *pxq = pmxp->pxs_sqlite;
+
+	if (pmxp->pxs_error != PMXE_OK) {
+		return;
+	}
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		pmx_sqlite_fail(pmxp, "insert");
+	}
+
+	(void) sqlite3_reset(stmt);
+	(void) sqlite3_clear_bindings(stmt);
+
+	if (++pxq->pxq_txnrows == PMX_SQLITE_TXNROWS) {
+		pxq->pxq_txnrows = 0;
+		if (pmx_sqlite_exec(pmxp, "COMMIT") == 0) {
+			(void) pmx_sqlite_exec(pmxp, "BEGIN");
+		}
+	}
+}
+
+static int
+pmx_sqlite_exec(pmx_stream_t *pmxp, const char *sql)
+{
+	if (sqlite3_exec(pmxp->pxs_sqlite->pxq_db, sql, NULL, NULL,
+	    NULL) != SQLITE_OK) {
+		pmx_sqlite_fail(pmxp, sql);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+pmx_sqlite_prepare(pmx_stream_t *pmxp, const char *sql, sqlite3_stmt **stmtp)
+{
+	if (sqlite3_prepare_v2(pmxp->pxs_sqlite->pxq_db, sql, -1, stmtp,
+	    NULL) != SQLITE_OK) {
+		pmx_sqlite_fail(pmxp, sql);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Records the most recent sqlite error.  Errors during initialization are also
+ * reported to the error stream, since the caller won't get a stream back to
+ * ask about them.
+ */
+static void
+pmx_sqlite_fail(pmx_stream_t *pmxp, const char *what)
+{
+	sqlite3 *db = pmxp->pxs_sqlite->pxq_db;
+
+	pmx_error(pmxp, PMXE_EIO, "sqlite: %s: %s", what,
+	    db == NULL ? "out of memory" : sqlite3_errmsg(db));
+	if (pmxp->pxs_state == PMXS_INIT && pmxp->pxs_errstream != NULL) {
+		pmx_warn(pmxp, "%s\n", pmxp->pxs_errmsg);
+	}
+}
@@ -0,0 +1,168 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_stats.c: per-stream statistics and timing
+ *
+ * The front-end hands every record to the backend at one of a few places (see
+ * pmx_backend_t), and each of those calls is followed by pmx_stats_record(),
+ * which counts the record.  The size of a record in the output is found
+ * without any help from the backend: the position in the output (bytes handed
+ * to the output stage so far, plus bytes still sitting in the backend's
+ * buffer) is noted after each record, and the growth since the previous
+ * record is charged to this one.  Output that isn't part of any record (the
+ * binary header and trailer) is never charged to anything, since the position
+ * is first noted after the backend is initialized and no record follows the
+ * trailer.
+ *
+ * With pmx_stats_timing(), each backend call is also bracketed by readings of
+ * the cycle counter (see PMX_STATS_START()), as is each write to the output
+ * stage (in pmx_output.c).  Writes happen from within backend calls when the
+ * backend's buffer fills up, so the serialization time reported is the time
+ * spent in backend calls less the time spent writing output.  Ticks of the
+ * cycle counter are converted to nanoseconds using the ratio of the elapsed
+ * time on the clock to the elapsed ticks since timing started, so the counter
+ * doesn't need to be calibrated, but it does need to run at a constant rate
+ * (as it does on all recent x86 processors).  On other systems, the clock
+ * itself is used.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+#define	NANOSEC	1000000000ULL
+
+static uint64_t pmx_stats_pos(pmx_stream_t *);
+static uint64_t pmx_stats_clock(void);
+
+/*
+ * Called once the backend has been initialized.
+ */
+void
+pmx_stats_init(pmx_stream_t *pmxp)
+{
+	pmxp->pxs_statpos = pmx_stats_pos(pmxp);
+}
+
+void
+pmx_stats_timing(pmx_stream_t *pmxp)
+{
+	if (pmxp->pxs_timed) {
+		return;
+	}
+
+	pmxp->pxs_timebase = pmx_stats_clock();
+	pmxp->pxs_tickbase = pmx_stats_ticks();
+	pmxp->pxs_timed = PB_TRUE;
+}
+
+void
+pmx_stats(pmx_stream_t *pmxp, pmx_stats_t *statsp)
+{
+	pmx_intern_stats_t istats;
+	uint64_t elapsed, ticks, serialize;
+	double nspertick;
+
+	*statsp = pmxp->pxs_stats;
+	statsp->pxst_nwarnings = pmxp->pxs_nwarnings;
+	pmx_byte_counts(pmxp, &statsp->pxst_nbytesraw, &statsp->pxst_nbytesout);
+
+	pmx_intern_stats(pmxp, &istats);
+	statsp->pxst_ninternhits = istats.pxis_nhits;
+	statsp->pxst_ninternsaved = istats.pxis_nbytessaved;
+
+	statsp->pxst_timed = pmxp->pxs_timed;
+	if (!pmxp->pxs_timed) {
+		return;
+	}
+
+	elapsed = pmx_stats_clock() - pmxp->pxs_timebase;
+	ticks = pmx_stats_ticks() - pmxp->pxs_tickbase;
+	nspertick = ticks == 0 ? 0 : (double)elapsed / (double)ticks;
+	serialize = pmxp->pxs_backendticks > pmxp->pxs_outputticks ?
+	    pmxp->pxs_backendticks - pmxp->pxs_outputticks : 0;
+
+	statsp->pxst_elapsed_ns = elapsed;
+	statsp->pxst_serialize_ns = (uint64_t)(serialize * nspertick);
+	statsp->pxst_output_ns = (uint64_t)(pmxp->pxs_outputticks * nspertick);
+}
+
+/*
+ * Counts "count" records of type "type" that were just handed to the backend
+ * by a call that started at "start" (as returned by PMX_STATS_START()).  For
+ * nodes, the node's type is pxs_subtype.
+ */
+void
+pmx_stats_record(pmx_stream_t *pmxp, pmx_rectype_t type, uint64_t count,
+    uint64_t start)
+{
+	pmx_stats_t *st = &pmxp->pxs_stats;
+	uint64_t pos, nbytes;
+
+	/*
+	 * If writing output failed, the backend's buffer may have been
+	 * discarded without being counted as written.
+	 */
+	pos = pmx_stats_pos(pmxp);
+	nbytes = pos > pmxp->pxs_statpos ? pos - pmxp->pxs_statpos : 0;
+	pmxp->pxs_statpos = pos;
+
+	st->pxst_nrecords[type] += count;
+	st->pxst_nbytes[type] += nbytes;
+	if (type == PMXR_NODE) {
+		st->pxst_nnodes[pmxp->pxs_subtype]++;
+		st->pxst_nnodebytes[pmxp->pxs_subtype] += nbytes;
+	}
+
+	if (pmxp->pxs_timed && start != 0) {
+		pmxp->pxs_backendticks += pmx_stats_ticks() - start;
+	}
+}
+
+/*
+ * Returns the current position in the (uncompressed) output.
+ */
+static uint64_t
+pmx_stats_pos(pmx_stream_t *pmxp)
+{
+	switch (pmxp->pxs_format) {
+	case PMXF_JSON:
+		return (pmxp->pxs_nbytesraw + (pmxp->pxs_jsonout == NULL ? 0 :
+		    json_nbuffered(pmxp->pxs_jsonout)));
+
+	case PMXF_BINARY:
+		return (pmxp->pxs_nbytesraw + pmxp->pxs_binbufused);
+
+	default:
+		return (0);
+	}
+}
+
+uint64_t
+pmx_stats_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__builtin_ia32_rdtsc());
+#else
+	return (pmx_stats_clock());
+#endif
+}
+
+static uint64_t
+pmx_stats_clock(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * NANOSEC + (uint64_t)ts.tv_nsec);
+}
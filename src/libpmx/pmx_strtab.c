@@ -0,0 +1,387 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_strtab.c: interning of string contents
+ *
+ * Heaps contain many strings with the same contents (property names, keys of
+ * repeated JSON payloads, module paths, and so on), and by default the
+ * contents of every one are written out in full.  After pmx_intern_strings(),
+ * the contents of each string passed to pmx_emit_string_data() are looked up
+ * in a table.  The first time a given sequence of bytes is seen, it's assigned
+ * a content id and written once (with pxb_content), and every string with
+ * those contents (including the first) is written as a reference to the
+ * content id (with pxb_stringref).  Content ids are assigned sequentially from
+ * 0 and are never reused, so a consumer can resolve references with a simple
+ * array.
+ *
+ * The table is an open-addressing hash table with linear probing, like the
+ * name table in pmx_edges.c, except that entries can be removed.  (Removal
+ * shifts later entries in the same run back rather than leaving tombstones.)
+ * Each entry holds a copy of the contents so that hash collisions can be
+ * detected.  The table and the copies are allocated from the stream's arena,
+ * and the memory of evicted entries is reused for new ones.  The memory used
+ * by entries is bounded by the caller, and what happens when the table is full
+ * depends on the policy:
+ *
+ *     PMXI_EVICT_NONE	strings not already in the table are written inline,
+ *     			as though interning were disabled.  This is cheapest
+ *     			and works well when most duplicates appear early.
+ *
+ *     PMXI_EVICT_CLOCK	entries are evicted to make room, using the CLOCK
+ *     			approximation of least-recently-used: each entry has
+ *     			a bit that's set when it's used, and a "hand" sweeps
+ *     			the table clearing set bits and evicting entries whose
+ *     			bit is already clear.
+ *
+ * Evicting an entry only means that the next string with those contents gets
+ * a new content id; references already written remain valid.  Strings shorter
+ * than PMX_INTERN_MINLEN bytes are always written inline, since a reference
+ * wouldn't be meaningfully smaller.
+ */
+
+#include <string.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/* Strings shorter than this are never interned. */
+#define	PMX_INTERN_MINLEN	8
+/* Initial number of slots in the table (must be a power of 2). */
+#define	PMX_INTERN_INITCAP	1024
+/*
+ * Memory charged to each entry in addition to its contents.  The table is kept
+ * at most half full, so this covers two slots.
+ */
+#define	PMX_INTERN_OVERHEAD	(2 * sizeof (pmx_strent_t))
+
+typedef struct {
+	uint8_t		*pse_data;		/* copy of contents, or NULL */
+	size_t		pse_len;
+	uint64_t	pse_hash;
+	uint64_t	pse_id;			/* content id */
+	int		pse_used;		/* used since the hand passed */
+} pmx_strent_t;
+
+struct pmx_strtab {
+	pmx_arena_t	*pst_arena;		/* the stream's arena */
+	pmx_intern_policy_t pst_policy;
+	pmx_strent_t	*pst_slots;
+	size_t		pst_nslots;		/* always a power of 2 */
+	size_t		pst_nentries;
+	size_t		pst_nbytes;		/* memory charged to entries */
+	size_t		pst_maxbytes;		/* bound on pst_nbytes */
+	size_t		pst_hand;		/* clock hand (slot index) */
+	uint64_t	pst_nextid;		/* next content id */
+	pmx_intern_stats_t pst_stats;
+};
+
+static pmx_strent_t *pmx_strtab_lookup(pmx_strtab_t *, uint64_t,
+    const uint8_t *, size_t);
+static int pmx_strtab_insert(pmx_strtab_t *, uint64_t, const uint8_t *,
+    size_t);
+static int pmx_strtab_grow(pmx_strtab_t *);
+static void pmx_strtab_evict(pmx_strtab_t *, size_t);
+static void pmx_strtab_remove(pmx_strtab_t *, size_t);
+static uint64_t pmx_strtab_hash(const uint8_t *, size_t);
+
+/*
+ * Public interfaces.  See pmx_intern_strings() in pmx.h.
+ */
+
+int
+pmx_intern_strings(pmx_stream_t *pmxp, size_t maxbytes,
+    pmx_intern_policy_t policy)
+{
+	pmx_strtab_t *pst;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	VERIFY(pmxp->pxs_format != PMXF_SQLITE);
+	VERIFY(pmxp->pxs_strtab == NULL);
+	VERIFY(pmxp->pxs_indexer == NULL);
+	VERIFY(policy == PMXI_EVICT_NONE || policy == PMXI_EVICT_CLOCK);
+
+	pst = pmx_arena_zalloc(pmxp->pxs_arena, sizeof (*pst));
+	if (pst == NULL) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	pst->pst_slots = pmx_arena_zalloc(pmxp->pxs_arena,
+	    PMX_INTERN_INITCAP * sizeof (pmx_strent_t));
+	if (pst->pst_slots == NULL) {
+		pmx_arena_free(pmxp->pxs_arena, pst, sizeof (*pst));
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	pst->pst_arena = pmxp->pxs_arena;
+	pst->pst_nslots = PMX_INTERN_INITCAP;
+	pst->pst_maxbytes = maxbytes;
+	pst->pst_policy = policy;
+	pmxp->pxs_strtab = pst;
+	return (0);
+}
+
+void
+pmx_intern_stats(pmx_stream_t *pmxp, pmx_intern_stats_t *statsp)
+{
+	pmx_strtab_t *pst = pmxp->pxs_strtab;
+
+	if (pst == NULL) {
+		(void) memset(statsp, 0, sizeof (*statsp));
+		return;
+	}
+
+	*statsp = pst->pst_stats;
+	statsp->pxis_nentries = pst->pst_nentries;
+	statsp->pxis_nbytes = pst->pst_nbytes;
+}
+
+/*
+ * Emits string data for "jsv" through the table.  Returns 0 if the string was
+ * emitted, or -1 if the caller should emit it inline instead (because it's too
+ * short, or it's new and there's no room for it).
+ */
+int
+pmx_strtab_emit(pmx_stream_t *pmxp, pmx_value_t jsv, size_t sz,
+    const uint8_t *bytes)
+{
+	pmx_strtab_t *pst = pmxp->pxs_strtab;
+	pmx_strent_t *pse;
+	uint64_t hash, start;
+
+	if (sz < PMX_INTERN_MINLEN) {
+		return (-1);
+	}
+
+	pst->pst_stats.pxis_nlookups++;
+	hash = pmx_strtab_hash(bytes, sz);
+	pse = pmx_strtab_lookup(pst, hash, bytes, sz);
+	if (pse != NULL) {
+		pse->pse_used = 1;
+		pst->pst_stats.pxis_nhits++;
+		pst->pst_stats.pxis_nbytessaved += sz;
+		start = PMX_STATS_START(pmxp);
+		pmxp->pxs_backend->pxb_stringref(pmxp, jsv, pse->pse_id);
+		pmx_stats_record(pmxp, PMXR_STRING, 1, start);
+		return (0);
+	}
+
+	if (pmx_strtab_insert(pst, hash, bytes, sz) != 0) {
+		return (-1);
+	}
+
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_content(pmxp, pst->pst_nextid - 1, sz, bytes);
+	pmx_stats_record(pmxp, PMXR_CONTENT, 1, start);
+
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_stringref(pmxp, jsv, pst->pst_nextid - 1);
+	pmx_stats_record(pmxp, PMXR_STRING, 1, start);
+	return (0);
+}
+
+static pmx_strent_t *
+pmx_strtab_lookup(pmx_strtab_t *pst, uint64_t hash, const uint8_t *bytes,
+    size_t sz)
+{
+	pmx_strent_t *pse;
+	size_t mask, i;
+
+	mask = pst->pst_nslots - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		pse = &pst->pst_slots[i];
+		if (pse->pse_data == NULL) {
+			return (NULL);
+		}
+
+		if (pse->pse_hash == hash && pse->pse_len == sz &&
+		    memcmp(pse->pse_data, bytes, sz) == 0) {
+			return (pse);
+		}
+	}
+}
+
+/*
+ * Adds a new entry (assigning it the next content id), evicting others first
+ * if necessary and allowed.  Returns -1 if there's no room.
+ */
+static int
+pmx_strtab_insert(pmx_strtab_t *pst, uint64_t hash, const uint8_t *bytes,
+    size_t sz)
+{
+	pmx_strent_t *pse;
+	size_t cost, mask, i;
+	uint8_t *copy;
+
+	cost = sz + PMX_INTERN_OVERHEAD;
+	if (cost > pst->pst_maxbytes) {
+		return (-1);
+	}
+
+	if (pst->pst_maxbytes - pst->pst_nbytes < cost) {
+		if (pst->pst_policy == PMXI_EVICT_NONE) {
+			return (-1);
+		}
+
+		pmx_strtab_evict(pst, cost);
+	}
+
+	if (2 * (pst->pst_nentries + 1) > pst->pst_nslots &&
+	    pmx_strtab_grow(pst) != 0) {
+		return (-1);
+	}
+
+	copy = pmx_arena_alloc(pst->pst_arena, sz);
+	if (copy == NULL) {
+		return (-1);
+	}
+
+	(void) memcpy(copy, bytes, sz);
+	mask = pst->pst_nslots - 1;
+	for (i = hash & mask; pst->pst_slots[i].pse_data != NULL;
+	    i = (i + 1) & mask) {
+		continue;
+	}
+
+	pse = &pst->pst_slots[i];
+	pse->pse_data = copy;
+	pse->pse_len = sz;
+	pse->pse_hash = hash;
+	pse->pse_id = pst->pst_nextid++;
+	pse->pse_used = 0;
+	pst->pst_nentries++;
+	pst->pst_nbytes += cost;
+	return (0);
+}
+
+static int
+pmx_strtab_grow(pmx_strtab_t *pst)
+{
+	pmx_strent_t *newslots, *oldslots;
+	size_t newcap, oldcap, mask, i, j;
+
+	oldslots = pst->pst_slots;
+	oldcap = pst->pst_nslots;
+	newcap = 2 * oldcap;
+	newslots = pmx_arena_zalloc(pst->pst_arena,
+	    newcap * sizeof (pmx_strent_t));
+	if (newslots == NULL) {
+		return (-1);
+	}
+
+	mask = newcap - 1;
+	for (i = 0; i < oldcap; i++) {
+		if (oldslots[i].pse_data == NULL) {
+			continue;
+		}
+
+		j = oldslots[i].pse_hash & mask;
+		while (newslots[j].pse_data != NULL) {
+			j = (j + 1) & mask;
+		}
+
+		newslots[j] = oldslots[i];
+	}
+
+	pmx_arena_free(pst->pst_arena, oldslots,
+	    oldcap * sizeof (pmx_strent_t));
+	pst->pst_slots = newslots;
+	pst->pst_nslots = newcap;
+	pst->pst_hand &= mask;
+	return (0);
+}
+
+/*
+ * Advances the clock hand, evicting entries until "cost" bytes are available.
+ * Every entry's bit is cleared on the first pass, so this terminates within
+ * two trips around the table.
+ */
+static void
+pmx_strtab_evict(pmx_strtab_t *pst, size_t cost)
+{
+	pmx_strent_t *pse;
+
+	while (pst->pst_maxbytes - pst->pst_nbytes < cost) {
+		VERIFY(pst->pst_nentries > 0);
+		pse = &pst->pst_slots[pst->pst_hand];
+		if (pse->pse_data != NULL && !pse->pse_used) {
+			/*
+			 * Removal may shift another entry into this slot, so
+			 * leave the hand where it is.
+			 */
+			pmx_strtab_remove(pst, pst->pst_hand);
+			pst->pst_stats.pxis_nevicted++;
+			continue;
+		}
+
+		pse->pse_used = 0;
+		pst->pst_hand = (pst->pst_hand + 1) & (pst->pst_nslots - 1);
+	}
+}
+
+/*
+ * Removes the entry in slot "i".  With linear probing, an entry can only be
+ * found if there's no empty slot between its home slot and where it's stored,
+ * so later entries in the same run are shifted back to fill the hole.
+ */
+static void
+pmx_strtab_remove(pmx_strtab_t *pst, size_t i)
+{
+	pmx_strent_t *slots = pst->pst_slots;
+	size_t mask, j, home;
+
+	mask = pst->pst_nslots - 1;
+	pst->pst_nbytes -= slots[i].pse_len + PMX_INTERN_OVERHEAD;
+	pst->pst_nentries--;
+	pmx_arena_free(pst->pst_arena, slots[i].pse_data, slots[i].pse_len);
+	slots[i].pse_data = NULL;
+
+	for (j = (i + 1) & mask; slots[j].pse_data != NULL;
+	    j = (j + 1) & mask) {
+		/*
+		 * The entry in slot "j" can move to the hole at "i" unless its
+		 * home slot lies cyclically in (i, j].
+		 */
+		home = slots[j].pse_hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask)) {
+			continue;
+		}
+
+		slots[i] = slots[j];
+		slots[j].pse_data = NULL;
+		i = j;
+	}
+}
+
+/*
+ * A simple multiplicative hash that consumes 8 bytes at a time, since string
+ * contents can be long.  Collisions only cost a memcmp().
+ */
+static uint64_t
+pmx_strtab_hash(const uint8_t *bytes, size_t sz)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ sz;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + 8 <= sz; i += 8) {
+		(void) memcpy(&w, bytes + i, sizeof (w));
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+
+	w = 0;
+	(void) memcpy(&w, bytes + i, sz - i);
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 32;
+	return (h);
+}
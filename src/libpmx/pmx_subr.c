@@ -13,6 +13,7 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,11 +33,81 @@
 const char *pmx_panichdr = "\npmx_panic:\n";
 char pmx_panicstr[512];
 
-static void pmx_node_begin(pmx_stream_t *, pmx_value_t, pmx_nodetype_t);
-static void pmx_node_field_jsv(pmx_stream_t *, const char *, pmx_value_t);
-static void pmx_node_end(pmx_stream_t *);
-static void pmx_emit_oddball(pmx_stream_t *, pmx_value_t, pmx_boolean_t *,
+/*
+ * Parameters of a new stream (see pmx_create_common()).  Fields that don't
+ * apply are zero.
+ */
+typedef struct {
+	pmx_format_t	pso_format;
+	FILE		*pso_outstream;
+	const char	*pso_outpath;		/* sqlite and mapped output */
+	FILE		*pso_errstream;
+	pmx_compress_t	pso_compress;
+	FILE		*pso_indexstream;
+	unsigned int	pso_mapflags;
+	void		*pso_mem;		/* memory for the arena */
+	size_t		pso_memsz;
+	pmx_boolean_t	pso_static;		/* pmx_create_stream_static() */
+	int		pso_outfd;		/* static streams only */
+} pmx_streamopts_t;
+
+static pmx_stream_t *pmx_create_common(const pmx_streamopts_t *);
+static void pmx_check_backend(pmx_stream_t *);
+static void pmx_emit_oddball(pmx_stream_t *, pmx_value_t, pmx_oddball_t,
     const char *, pmx_value_t);
+static void pmx_node_emit(pmx_stream_t *);
+static void pmx_batch_begin(pmx_stream_t *, pmx_nodetype_t, unsigned int);
+static void pmx_batch_end(pmx_stream_t *, size_t);
+
+/*
+ * Output backends, indexed by pmx_format_t.
+ */
+static const pmx_backend_t *pmx_backends[] = {
+	[PMXF_JSON] = &pmx_backend_json,
+	[PMXF_BINARY] = &pmx_backend_binary,
+	[PMXF_SQLITE] = &pmx_backend_sqlite,
+	[PMXF_NULL] = &pmx_backend_null,
+};
+
+/*
+ * Fields of each node type.  See pmx_nodeschema_t.
+ */
+const pmx_nodeschema_t pmx_node_schemas[PMXN_NTYPES] = {
+	[PMXN_NONE] = { "none", 0 },
+	[PMXN_ODDBALL] = { "oddball", 1, {
+		{ "name", PMXFK_REF },
+	} },
+	[PMXN_HEAPNUMBER] = { "heapnumber", 1, {
+		{ "value", PMXFK_DOUBLE },
+	} },
+	[PMXN_DATE] = { "date", 1, {
+		{ "timestamp", PMXFK_UINT },
+	} },
+	[PMXN_STRING_FLAT] = { "string_flat", 2, {
+		{ "length", PMXFK_UINT },
+		{ "data", PMXFK_REF },
+	} },
+	[PMXN_STRING_CONS] = { "string_cons", 3, {
+		{ "length", PMXFK_UINT },
+		{ "s1", PMXFK_REF },
+		{ "s2", PMXFK_REF },
+	} },
+	[PMXN_OBJECT] = { "object", 1, {
+		{ "constructor", PMXFK_REF },
+	} },
+	[PMXN_ARRAY] = { "array", 1, {
+		{ "length", PMXFK_UINT },
+	} },
+	[PMXN_FUNCINFO] = { "funcinfo", 3, {
+		{ "name", PMXFK_REF },
+		{ "script_name", PMXFK_REF },
+		{ "position", PMXFK_UINT },
+	} },
+	[PMXN_CLOSURE] = { "closure", 2, {
+		{ "metadata", PMXFK_REF },
+		{ "parent", PMXFK_REF },
+	} },
+};
 
 /*
  * Lifecycle of a pmx_stream_t
@@ -44,23 +115,293 @@ static void pmx_emit_oddball(pmx_stream_t *, pmx_value_t, pmx_boolean_t *,
 pmx_stream_t *
 pmx_create_stream(FILE *outfp, FILE *errfp)
 {
-	pmx_stream_t *pmxp;
+	return (pmx_create_stream_format(outfp, errfp, PMXF_JSON));
+}
+
+pmx_stream_t *
+pmx_create_stream_format(FILE *outfp, FILE *errfp, pmx_format_t format)
+{
+	pmx_streamopts_t pso = { 0 };
+
+	VERIFY(format == PMXF_JSON || format == PMXF_BINARY ||
+	    format == PMXF_NULL);
+	VERIFY(outfp != NULL || format == PMXF_NULL);
+	pso.pso_format = format;
+	pso.pso_outstream = outfp;
+	pso.pso_errstream = errfp;
+	return (pmx_create_common(&pso));
+}
 
+pmx_stream_t *
+pmx_create_stream_sqlite(const char *path, FILE *errfp)
+{
+	pmx_streamopts_t pso = { 0 };
+
+	VERIFY(path != NULL);
+	pso.pso_format = PMXF_SQLITE;
+	pso.pso_outpath = path;
+	pso.pso_errstream = errfp;
+	return (pmx_create_common(&pso));
+}
+
+/*
+ * Creates a stream whose JSON or binary output is compressed as it's written.
+ * If "indexfp" is not NULL, an index of the compressed output is written to it
+ * (see pmx_output.c).
+ */
+pmx_stream_t *
+pmx_create_stream_compressed(FILE *outfp, FILE *errfp, pmx_format_t format,
+    pmx_compress_t compress, FILE *indexfp)
+{
+	pmx_streamopts_t pso = { 0 };
+
+	VERIFY(format == PMXF_JSON || format == PMXF_BINARY);
+	VERIFY(compress == PMXC_NONE || compress == PMXC_GZIP);
 	VERIFY(outfp != NULL);
+	VERIFY(indexfp == NULL || compress != PMXC_NONE);
+	pso.pso_format = format;
+	pso.pso_outstream = outfp;
+	pso.pso_errstream = errfp;
+	pso.pso_compress = compress;
+	pso.pso_indexstream = indexfp;
+	return (pmx_create_common(&pso));
+}
+
+/*
+ * Creates a stream whose JSON or binary output is written to the file "path"
+ * through a memory mapping rather than a stdio stream.  "flags" is a bitwise
+ * OR of pmx_mmap_flag_t values (or zero).  See pmx_mmap.c.
+ */
+pmx_stream_t *
+pmx_create_stream_mmap(const char *path, FILE *errfp, pmx_format_t format,
+    unsigned int flags)
+{
+	pmx_streamopts_t pso = { 0 };
+
+	VERIFY(path != NULL);
+	VERIFY(format == PMXF_JSON || format == PMXF_BINARY);
+	VERIFY((flags & ~(PMXM_SEQUENTIAL | PMXM_WRITEBACK | PMXM_SYNC)) == 0);
+	pso.pso_format = format;
+	pso.pso_outpath = path;
+	pso.pso_errstream = errfp;
+	pso.pso_mapflags = flags;
+	return (pmx_create_common(&pso));
+}
 
-	pmxp = calloc(1, sizeof (*pmxp));
+/*
+ * Creates a stream whose state is allocated entirely from the "memsz" bytes at
+ * "mem" (which must be suitably aligned for any type) rather than with
+ * malloc().  If the export needs more memory than that, it fails with
+ * PMXE_ENOMEM.  pmx_memory_usage() reports how much has been used.  Returns
+ * NULL (with errno set to ENOMEM) if the block isn't big enough to create the
+ * stream at all.  The memory must remain valid until pmx_free().
+ */
+pmx_stream_t *
+pmx_create_stream_arena(FILE *outfp, FILE *errfp, pmx_format_t format,
+    void *mem, size_t memsz)
+{
+	pmx_streamopts_t pso = { 0 };
+
+	VERIFY(format == PMXF_JSON || format == PMXF_BINARY ||
+	    format == PMXF_NULL);
+	VERIFY(outfp != NULL || format == PMXF_NULL);
+	VERIFY(mem != NULL);
+	pso.pso_format = format;
+	pso.pso_outstream = outfp;
+	pso.pso_errstream = errfp;
+	pso.pso_mem = mem;
+	pso.pso_memsz = memsz;
+	return (pmx_create_common(&pso));
+}
+
+/*
+ * Creates a stream for use where malloc() and stdio can't be: from a signal
+ * handler, or when the process has run out of memory.  The stream's state is
+ * allocated entirely from the "memsz" bytes at "mem" (as with
+ * pmx_create_stream_arena()), and output is written to "fd" with write(2) as
+ * each buffer fills up.  Warnings are counted but not printed, and errors are
+ * recorded without a detailed message.  Creating, emitting to, finishing, and
+ * freeing the stream never call malloc() or any stdio function, and the
+ * stream never uses more memory than the caller's block (and a bounded amount
+ * of stack).  Binary output needs a block of at least 2MB and JSON output
+ * somewhat less.  The writer thread and shards aren't available on these
+ * streams, but pmx_intern_strings() is (its table is allocated from the block
+ * too).
+ *
+ * Returns NULL (with errno set) if the stream couldn't be created.
+ */
+pmx_stream_t *
+pmx_create_stream_static(int fd, pmx_format_t format, void *mem,
+    size_t memsz)
+{
+	pmx_streamopts_t pso = { 0 };
+
+	VERIFY(fd >= 0);
+	VERIFY(format == PMXF_JSON || format == PMXF_BINARY);
+	VERIFY(mem != NULL);
+	pso.pso_format = format;
+	pso.pso_mem = mem;
+	pso.pso_memsz = memsz;
+	pso.pso_static = PB_TRUE;
+	pso.pso_outfd = fd;
+	return (pmx_create_common(&pso));
+}
+
+/*
+ * Moves compression and writing of a JSON or binary stream's output onto a
+ * separate thread, so that the caller can keep emitting while output is
+ * written.  "nbuffers" is the number of 1MB buffers of output that may be
+ * waiting to be written before the caller blocks (zero selects a default).
+ * This must be called before anything is emitted.  Returns 0 on success, or
+ * -1 (with the stream's error set) if the thread couldn't be started, in which
+ * case output is written synchronously as usual.  Errors encountered by the
+ * writer thread are reported through pmx_errno() and pmx_errmsg() like any
+ * other error, though possibly some time after the output that caused them
+ * was emitted.
+ */
+int
+pmx_async_output(pmx_stream_t *pmxp, unsigned int nbuffers)
+{
+	VERIFY(pmxp->pxs_format == PMXF_JSON ||
+	    pmxp->pxs_format == PMXF_BINARY);
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	VERIFY(pmxp->pxs_nnodes == 0 && pmxp->pxs_nmetadata == 0);
+	VERIFY(pmxp->pxs_async == NULL);
+	VERIFY(!pmxp->pxs_static);
+
+	if (pmx_output_async(pmxp, nbuffers) != 0) {
+		pmx_error(pmxp, PMXE_ENOMEM, "failed to start writer thread");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Sharded exports.  A single stream can only be driven from one thread, so to
+ * export a large heap in parallel, the caller creates a shard of the main
+ * ("parent") stream for each thread.  Each shard writes the nodes, edges, and
+ * string data emitted through it to its own segment file in the binary format.
+ * Metadata is only emitted through the parent, and each oddball is emitted only
+ * once for the whole export (see pmx_emit_oddball()), so the shards can emit
+ * whatever they find without coordinating with each other.
+ *
+ * When a shard is finished (with pmx_done()), the parent's thread merges its
+ * segment into the parent with pmx_merge_shard().  If all shards are finished
+ * before the parent, and they're merged in a fixed order, the export is the
+ * same regardless of how the threads were scheduled.  All shards must be
+ * freed before the parent.
+ *
+ * "segfp" must be open for both writing and reading (e.g., from tmpfile()),
+ * and remains owned by the caller.
+ */
+pmx_stream_t *
+pmx_create_shard(pmx_stream_t *parent, FILE *segfp)
+{
+	pmx_streamopts_t pso = { 0 };
+	pmx_stream_t *pmxp;
+
+	VERIFY(parent->pxs_parent == NULL);
+	VERIFY(!parent->pxs_static);
+	VERIFY(parent->pxs_state == PMXS_TOP);
+	VERIFY(segfp != NULL);
+
+	pso.pso_format = PMXF_BINARY;
+	pso.pso_outstream = segfp;
+	pso.pso_errstream = parent->pxs_errstream;
+	pmxp = pmx_create_common(&pso);
+	if (pmxp != NULL) {
+		pmxp->pxs_parent = parent;
+		parent->pxs_sharded = PB_TRUE;
+	}
+
+	return (pmxp);
+}
+
+/*
+ * Replays the finished shard "shard" into its parent.  Errors (including any
+ * error recorded on the shard itself) are reported on the parent.
+ */
+void
+pmx_merge_shard(pmx_stream_t *parent, pmx_stream_t *shard)
+{
+	FILE *segfp = shard->pxs_outstream;
+
+	VERIFY(shard->pxs_parent == parent);
+	VERIFY(shard->pxs_state == PMXS_FINI);
+	VERIFY(parent->pxs_state == PMXS_TOP);
+
+	if (parent->pxs_error != PMXE_OK) {
+		return;
+	}
+
+	if (pmx_errno(shard) != PMXE_OK) {
+		pmx_error(parent, pmx_errno(shard), "shard: %s",
+		    pmx_errmsg(shard));
+		return;
+	}
+
+	if (fseek(segfp, 0, SEEK_SET) != 0) {
+		pmx_error(parent, PMXE_EIO, "shard: seek: %s",
+		    strerror(errno));
+		return;
+	}
+
+	pmx_import_binary(parent, segfp);
+}
+
+/*
+ * The stream itself is the first thing allocated from its arena, and it's
+ * freed along with everything else when the arena is destroyed.
+ */
+static pmx_stream_t *
+pmx_create_common(const pmx_streamopts_t *pso)
+{
+	pmx_arena_t *arena;
+	pmx_stream_t *pmxp;
+	int rv;
+
+	arena = pmx_arena_create(pso->pso_mem, pso->pso_memsz);
+	if (arena == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	pmxp = pmx_arena_zalloc(arena, sizeof (*pmxp));
 	if (pmxp == NULL) {
+		pmx_arena_destroy(arena);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	pmxp->pxs_arena = arena;
+	pmxp->pxs_format = pso->pso_format;
+	pmxp->pxs_backend = pmx_backends[pso->pso_format];
+	pmxp->pxs_outstream = pso->pso_outstream;
+	pmxp->pxs_outpath = pso->pso_outpath;
+	pmxp->pxs_errstream = pso->pso_errstream;
+	pmxp->pxs_compress = pso->pso_compress;
+	pmxp->pxs_indexstream = pso->pso_indexstream;
+	pmxp->pxs_mapflags = pso->pso_mapflags;
+	pmxp->pxs_static = pso->pso_static;
+	pmxp->pxs_outfd = pso->pso_static ? pso->pso_outfd : -1;
+	if (pmx_edges_init(pmxp) != 0) {
+		pmx_free(pmxp);
+		errno = ENOMEM;
 		return (NULL);
 	}
 
-	pmxp->pxs_outstream = outfp;
-	pmxp->pxs_errstream = errfp;
-	pmxp->pxs_jsonout = json_create_stdio(outfp);
-	if (pmxp->pxs_jsonout == NULL) {
+	rv = pmxp->pxs_backend->pxb_init(pmxp);
+	pmxp->pxs_outpath = NULL;
+	if (rv != 0) {
+		rv = errno;
 		pmx_free(pmxp);
+		errno = rv;
 		return (NULL);
 	}
 
+	pmx_stats_init(pmxp);
+
 	/*
 	 * XXX This is where we should emit the nodetypes and edgetypes that we
 	 * know about (mapping string values to numeric identifiers).
@@ -69,12 +410,65 @@ pmx_create_stream(FILE *outfp, FILE *errfp)
 	return (pmxp);
 }
 
+/*
+ * Completes the export: any trailing records are emitted and buffered output is
+ * written out.  No more output may be emitted afterwards.  Callers should check
+ * pmx_errno() after this to find out whether the whole export succeeded.
+ */
+void
+pmx_done(pmx_stream_t *pmxp)
+{
+	pmx_oddclaim_t *poc;
+	uint64_t start;
+	size_t i;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	for (i = 0; i < PMXO_NTYPES; i++) {
+		poc = &pmxp->pxs_oddballs[i];
+		if (poc->poc_pending) {
+			pmx_node_begin(pmxp, poc->poc_ident, PMXN_ODDBALL);
+			pmx_node_field(pmxp, PMXFD_ODDBALL_NAME,
+			    poc->poc_label);
+			pmx_node_end(pmxp);
+			poc->poc_pending = PB_FALSE;
+		}
+	}
+
+	pmx_edges_flush(pmxp);
+	if (pmxp->pxs_validator != NULL) {
+		pmx_validate_report(pmxp);
+	}
+
+	/*
+	 * The trailer isn't a record, so this only accounts for the time.
+	 */
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_done(pmxp);
+	if (start != 0) {
+		pmxp->pxs_backendticks += pmx_stats_ticks() - start;
+	}
+
+	if (pmxp->pxs_indexer != NULL) {
+		pmx_index_finish(pmxp);
+	}
+
+	pmxp->pxs_state = PMXS_FINI;
+}
+
 void
 pmx_free(pmx_stream_t *pmxp)
 {
 	if (pmxp != NULL) {
-		json_fini(pmxp->pxs_jsonout);
-		free(pmxp);
+		if (pmxp->pxs_state == PMXS_TOP) {
+			pmx_done(pmxp);
+		}
+
+		pmxp->pxs_backend->pxb_fini(pmxp);
+		if (pmxp->pxs_indexer != NULL) {
+			pmx_index_fini(pmxp);
+		}
+
+		pmx_arena_destroy(pmxp->pxs_arena);
 	}
 }
 
@@ -86,12 +480,14 @@ pmx_free(pmx_stream_t *pmxp)
 pmx_error_t
 pmx_errno(pmx_stream_t *pmxp)
 {
+	pmx_check_backend(pmxp);
 	return (pmxp->pxs_error);
 }
 
 const char *
 pmx_errmsg(pmx_stream_t *pmxp)
 {
+	pmx_check_backend(pmxp);
 	if (pmxp->pxs_errmsg[0] != '\0') {
 		return (pmxp->pxs_errmsg);
 	}
@@ -100,21 +496,65 @@ pmx_errmsg(pmx_stream_t *pmxp)
 	case PMXE_OK:		return ("no error");
 	case PMXE_ENOMEM:	return ("not enough space");
 	case PMXE_EIO:		return ("i/o error");
+	case PMXE_EFORMAT:	return ("malformed input");
 	default:		break;
 	}
 
 	pmx_panic("unrecognized pmx_error_t: %d\n", pmxp->pxs_error);
 }
 
+/*
+ * Reports the number of bytes of output produced so far ("rawp") and the number
+ * actually written to the output stream after compression ("outp").  These are
+ * the same for uncompressed streams.  Neither is maintained for the sqlite and
+ * null formats, for which both are always zero.  Output is buffered, so these
+ * are only complete after pmx_done().
+ */
+void
+pmx_byte_counts(pmx_stream_t *pmxp, uint64_t *rawp, uint64_t *outp)
+{
+	*rawp = pmxp->pxs_nbytesraw;
+	*outp = __atomic_load_n(&pmxp->pxs_nbytesout, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reports the memory currently allocated for the stream's state ("usedp") and
+ * the total size of the memory its arena has obtained ("reservedp").  For
+ * streams created with pmx_create_stream_arena(), the latter is the size of
+ * the caller's block.  Memory used for compression, the writer thread, mapped
+ * output, and sqlite output is not included.
+ */
+void
+pmx_memory_usage(pmx_stream_t *pmxp, size_t *usedp, size_t *reservedp)
+{
+	pmx_arena_usage(pmxp->pxs_arena, usedp, reservedp);
+}
+
 /*
  * Error management: internal interfaces
  */
 
+/*
+ * Some backends (notably JSON) and the output writer thread record their own
+ * errors rather than reporting them as they happen.  Pick them up here if we
+ * haven't already seen an error.
+ */
+static void
+pmx_check_backend(pmx_stream_t *pmxp)
+{
+	pmx_output_check(pmxp);
+	if (pmxp->pxs_error == PMXE_OK &&
+	    pmxp->pxs_backend->pxb_check != NULL) {
+		pmxp->pxs_backend->pxb_check(pmxp);
+	}
+}
+
 void
 pmx_set_errno(pmx_stream_t *pmxp, pmx_error_t pmxerr)
 {
 	pmxp->pxs_error = pmxerr;
 	pmxp->pxs_errmsg[0] = '\0';
+	PMX_PROBE2(error, pmxerr, pmxp->pxs_errmsg);
 }
 
 void
@@ -132,8 +572,15 @@ pmx_verror(pmx_stream_t *pmxp, pmx_error_t pmxerr, const char *fmt,
     va_list args)
 {
 	pmxp->pxs_error = pmxerr;
+	if (pmxp->pxs_static) {
+		pmxp->pxs_errmsg[0] = '\0';
+		PMX_PROBE2(error, pmxerr, pmxp->pxs_errmsg);
+		return;
+	}
+
 	(void) vsnprintf(pmxp->pxs_errmsg, sizeof (pmxp->pxs_errmsg), fmt,
 	    args);
+	PMX_PROBE2(error, pmxerr, pmxp->pxs_errmsg);
 }
 
 void
@@ -149,7 +596,11 @@ pmx_warn(pmx_stream_t *pmxp, const char *fmt, ...)
 void
 pmx_vwarn(pmx_stream_t *pmxp, const char *fmt, va_list args)
 {
-	(void) vfprintf(pmxp->pxs_errstream, fmt, args);
+	PMX_PROBE1(warn, fmt);
+	if (!pmxp->pxs_static) {
+		(void) vfprintf(pmxp->pxs_errstream, fmt, args);
+	}
+
 	pmxp->pxs_nwarnings++;
 }
 
@@ -204,80 +655,151 @@ pmx_cstr_printable(const char *str)
 }
 
 /*
- * Emitter helper functions
+ * Emitter front-end functions.  These validate the sequence of calls made by
+ * the consumer and collect the fields of each node.  The node is handed to the
+ * output backend by pmx_node_end(), right after any of its edges that are still
+ * buffered.  (See pmx_backend_t and pmx_edges.c.)
  */
 
-static void
+void
 pmx_node_begin(pmx_stream_t *pmxp, pmx_value_t ident, pmx_nodetype_t subtype)
 {
 	VERIFY(pmxp->pxs_state == PMXS_TOP);
 	VERIFY(pmxp->pxs_nfields == 0);
-	VERIFY(subtype != PMXN_NONE);
+	VERIFY(subtype != PMXN_NONE && subtype < PMXN_NTYPES);
 	pmxp->pxs_state = PMXS_NODE;
 	pmxp->pxs_subtype = subtype;
+	pmxp->pxs_ident = ident;
+	pmxp->pxs_fieldmask = 0;
+	PMX_PROBE2(node_begin, subtype, ident);
+}
+
+void
+pmx_node_field(pmx_stream_t *pmxp, unsigned int which, uint64_t val)
+{
+	VERIFY(pmxp->pxs_state == PMXS_NODE);
+	VERIFY(which < pmx_node_schemas[pmxp->pxs_subtype].pxn_nfields);
+	VERIFY((pmxp->pxs_fieldmask & (1U << which)) == 0);
+	pmxp->pxs_fields[which] = val;
+	pmxp->pxs_fieldmask |= 1U << which;
+	pmxp->pxs_nfields++;
+}
+
+void
+pmx_node_field_double(pmx_stream_t *pmxp, unsigned int which, double d)
+{
+	uint64_t bits;
 
-	json_object_begin(pmxp->pxs_jsonout, NULL);
-	json_utf8string(pmxp->pxs_jsonout, "type", "node");
-	json_uint64(pmxp->pxs_jsonout, "subtype", subtype);
-	json_uint64(pmxp->pxs_jsonout, "ident", ident);
+	VERIFY(pmxp->pxs_state == PMXS_NODE);
+	VERIFY(which < PMX_MAXFIELDS);
+	VERIFY(pmx_node_schemas[pmxp->pxs_subtype].pxn_fields[which].pxf_kind ==
+	    PMXFK_DOUBLE);
+	(void) memcpy(&bits, &d, sizeof (bits));
+	pmx_node_field(pmxp, which, bits);
 }
 
-static void
+void
 pmx_node_end(pmx_stream_t *pmxp)
 {
 	VERIFY(pmxp->pxs_state == PMXS_NODE);
-	json_object_end(pmxp->pxs_jsonout);
-	json_newline(pmxp->pxs_jsonout);
+	pmx_edges_flush(pmxp);
+	pmx_node_emit(pmxp);
+
 	pmxp->pxs_state = PMXS_TOP;
 	pmxp->pxs_subtype = PMXN_NONE;
 	pmxp->pxs_nfields = 0;
+	pmxp->pxs_nodeedges = 0;
+	pmxp->pxs_nelements = 0;
+	pmxp->pxs_nnodes++;
 }
 
+/*
+ * Hands the current node to the backend.  If requested, the node's references
+ * are checked first (see pmx_validate.c) and where it was written is recorded
+ * (see pmx_index.c).
+ */
 static void
-pmx_node_field_jsv(pmx_stream_t *pmxp, const char *label, pmx_value_t val)
+pmx_node_emit(pmx_stream_t *pmxp)
 {
-	VERIFY(pmxp->pxs_state == PMXS_NODE);
-	VERIFY(strchr(label, '"') == NULL);
-	pmxp->pxs_nfields++;
-	json_uint64(pmxp->pxs_jsonout, label, val);
+	uint64_t start;
+
+	if (pmxp->pxs_validator != NULL) {
+		pmx_validate_node(pmxp);
+	}
+
+	if (pmxp->pxs_indexer != NULL) {
+		pmx_index_mark(pmxp, pmxp->pxs_ident);
+	}
+
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_node(pmxp);
+	pmx_stats_record(pmxp, PMXR_NODE, 1, start);
+	PMX_PROBE2(node_end, pmxp->pxs_subtype, pmxp->pxs_ident);
+
+	if (pmxp->pxs_indexer != NULL) {
+		pmx_index_add(pmxp, pmxp->pxs_ident);
+	}
 }
 
+/*
+ * Shards of the same export walk disjoint parts of the heap, but they all find
+ * the same oddballs.  Only the first stream to find each one (among the parent
+ * and all of its shards) claims it, and the others silently drop it.  Once the
+ * parent has shards, a claimed oddball is emitted by pmx_done() on the parent,
+ * whichever stream claimed it, so that the merged export doesn't depend on
+ * which thread happened to get there first.  Before that, the parent is the
+ * only stream that can claim an oddball, so it emits it right away.  Emitting
+ * the same oddball twice from the same stream is still a warning.
+ */
 static void
-pmx_emit_oddball(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_boolean_t *emitted,
+pmx_emit_oddball(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_oddball_t which,
     const char *internal_label, pmx_value_t label)
 {
-	if (*emitted) {
+	pmx_stream_t *root;
+	pmx_oddclaim_t *poc;
+
+	root = pmxp->pxs_parent != NULL ? pmxp->pxs_parent : pmxp;
+	poc = &root->pxs_oddballs[which];
+	if (pmxp->pxs_emitted[which]) {
 		pmx_warn(pmxp, "already emitted value for oddball \"%s\"",
 		    internal_label);
+	} else if (__atomic_exchange_n(&poc->poc_claimed, 1,
+	    __ATOMIC_ACQ_REL) != 0) {
+		return;
+	} else if (root != pmxp || pmxp->pxs_sharded) {
+		poc->poc_ident = jsv;
+		poc->poc_label = label;
+		poc->poc_pending = PB_TRUE;
+		pmxp->pxs_emitted[which] = PB_TRUE;
+		return;
 	}
 
 	pmx_node_begin(pmxp, jsv, PMXN_ODDBALL);
-	pmx_node_field_jsv(pmxp, "name", label);
+	pmx_node_field(pmxp, PMXFD_ODDBALL_NAME, label);
 	pmx_node_end(pmxp);
-	*emitted = PB_TRUE;
+	pmxp->pxs_emitted[which] = PB_TRUE;
 }
 
 /*
  * Emitters.
- *
- * These will likely be refactored once we add support for multiple backend
- * types.
  */
 
 void
 pmx_emit_metadata(pmx_stream_t *pmxp, const char *key, const char *value)
 {
+	uint64_t start;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	VERIFY(pmxp->pxs_parent == NULL);
 	VERIFY(pmx_cstr_printable(key));
 	VERIFY(strchr(key, '"') == NULL);
 	VERIFY(pmx_cstr_printable(value));
 	VERIFY(strchr(value, '"') == NULL);
 
-	json_object_begin(pmxp->pxs_jsonout, NULL);
-	json_utf8string(pmxp->pxs_jsonout, "type", "metadata");
-	json_utf8string(pmxp->pxs_jsonout, "key", key);
-	json_utf8string(pmxp->pxs_jsonout, "value", value);
-	json_object_end(pmxp->pxs_jsonout);
-	json_newline(pmxp->pxs_jsonout);
+	start = PMX_STATS_START(pmxp);
+	pmxp->pxs_backend->pxb_metadata(pmxp, key, value);
+	pmx_stats_record(pmxp, PMXR_METADATA, 1, start);
+
 	pmxp->pxs_nmetadata++;
 }
 
@@ -286,40 +808,35 @@ pmx_emit_node_boolean(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_boolean_t val,
     pmx_value_t label)
 {
 	if (val) {
-		pmx_emit_oddball(pmxp, jsv, &pmxp->pxs_emitted_true,
-		    "true", label);
+		pmx_emit_oddball(pmxp, jsv, PMXO_TRUE, "true", label);
 	} else {
-		pmx_emit_oddball(pmxp, jsv, &pmxp->pxs_emitted_false,
-		    "false", label);
+		pmx_emit_oddball(pmxp, jsv, PMXO_FALSE, "false", label);
 	}
 }
 
 void
 pmx_emit_node_hole(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_value_t label)
 {
-	pmx_emit_oddball(pmxp, jsv, &pmxp->pxs_emitted_hole, "the_hole", label);
+	pmx_emit_oddball(pmxp, jsv, PMXO_HOLE, "the_hole", label);
 }
 
 void
 pmx_emit_node_null(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_value_t label)
 {
-	pmx_emit_oddball(pmxp, jsv, &pmxp->pxs_emitted_null, "null", label);
+	pmx_emit_oddball(pmxp, jsv, PMXO_NULL, "null", label);
 }
 
 void
 pmx_emit_node_undefined(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_value_t label)
 {
-	pmx_emit_oddball(pmxp, jsv, &pmxp->pxs_emitted_undefined, "undefined",
-	    label);
+	pmx_emit_oddball(pmxp, jsv, PMXO_UNDEFINED, "undefined", label);
 }
 
 void
 pmx_emit_node_heapnumber(pmx_stream_t *pmxp, pmx_value_t jsv, double d)
 {
-	json_emit_t *jse = pmxp->pxs_jsonout;
-
 	pmx_node_begin(pmxp, jsv, PMXN_HEAPNUMBER);
-	json_double(jse, "value", d);
+	pmx_node_field_double(pmxp, PMXFD_HEAPNUMBER_VALUE, d);
 	pmx_node_end(pmxp);
 }
 
@@ -331,7 +848,7 @@ pmx_emit_node_date(pmx_stream_t *pmxp, pmx_value_t jsv, struct timespec *ts)
 	millis = (uint64_t)ts->tv_sec * MILLISEC +
 	    (uint64_t)ts->tv_nsec / MICROSEC;
 	pmx_node_begin(pmxp, jsv, PMXN_DATE);
-	json_uint64(pmxp->pxs_jsonout, "timestamp", millis);
+	pmx_node_field(pmxp, PMXFD_DATE_TIMESTAMP, millis);
 	pmx_node_end(pmxp);
 }
 
@@ -340,8 +857,8 @@ pmx_emit_node_string_flat(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_value_t len,
     pmx_value_t bytes)
 {
 	pmx_node_begin(pmxp, jsv, PMXN_STRING_FLAT);
-	json_uint64(pmxp->pxs_jsonout, "length", len);
-	json_uint64(pmxp->pxs_jsonout, "data", bytes);
+	pmx_node_field(pmxp, PMXFD_STRING_FLAT_LENGTH, len);
+	pmx_node_field(pmxp, PMXFD_STRING_FLAT_DATA, bytes);
 	pmx_node_end(pmxp);
 }
 
@@ -350,9 +867,9 @@ pmx_emit_node_string_cons(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_value_t len,
     pmx_value_t s1, pmx_value_t s2)
 {
 	pmx_node_begin(pmxp, jsv, PMXN_STRING_CONS);
-	json_uint64(pmxp->pxs_jsonout, "length", len);
-	json_uint64(pmxp->pxs_jsonout, "s1", s1);
-	json_uint64(pmxp->pxs_jsonout, "s1", s2);
+	pmx_node_field(pmxp, PMXFD_STRING_CONS_LENGTH, len);
+	pmx_node_field(pmxp, PMXFD_STRING_CONS_S1, s1);
+	pmx_node_field(pmxp, PMXFD_STRING_CONS_S2, s2);
 	pmx_node_end(pmxp);
 }
 
@@ -366,21 +883,21 @@ void
 pmx_function_label(pmx_stream_t *pmxp, pmx_value_t jsv)
 {
 	VERIFY(pmxp->pxs_subtype == PMXN_FUNCINFO);
-	json_uint64(pmxp->pxs_jsonout, "name", jsv);
+	pmx_node_field(pmxp, PMXFD_FUNCINFO_NAME, jsv);
 }
 
 void
 pmx_function_script_name(pmx_stream_t *pmxp, pmx_value_t jsv)
 {
 	VERIFY(pmxp->pxs_subtype == PMXN_FUNCINFO);
-	json_uint64(pmxp->pxs_jsonout, "script_name", jsv);
+	pmx_node_field(pmxp, PMXFD_FUNCINFO_SCRIPT_NAME, jsv);
 }
 
 void
 pmx_function_position(pmx_stream_t *pmxp, pmx_value_t jsv)
 {
 	VERIFY(pmxp->pxs_subtype == PMXN_FUNCINFO);
-	json_uint64(pmxp->pxs_jsonout, "position", jsv);
+	pmx_node_field(pmxp, PMXFD_FUNCINFO_POSITION, jsv);
 }
 
 void
@@ -395,14 +912,14 @@ void
 pmx_closure_start(pmx_stream_t *pmxp, pmx_value_t jsv, pmx_value_t funcinfo)
 {
 	pmx_node_begin(pmxp, jsv, PMXN_CLOSURE);
-	json_uint64(pmxp->pxs_jsonout, "metadata", funcinfo);
+	pmx_node_field(pmxp, PMXFD_CLOSURE_METADATA, funcinfo);
 }
 
 void
 pmx_closure_parent(pmx_stream_t *pmxp, pmx_value_t parent)
 {
 	VERIFY(pmxp->pxs_subtype == PMXN_CLOSURE);
-	json_uint64(pmxp->pxs_jsonout, "parent", parent);
+	pmx_node_field(pmxp, PMXFD_CLOSURE_PARENT, parent);
 }
 
 void
@@ -423,78 +940,181 @@ void
 pmx_object_constructor(pmx_stream_t *pmxp, pmx_value_t cons)
 {
 	VERIFY(pmxp->pxs_subtype == PMXN_OBJECT);
-	json_uint64(pmxp->pxs_jsonout, "constructor", cons);
+	pmx_node_field(pmxp, PMXFD_OBJECT_CONSTRUCTOR, cons);
 }
 
+/*
+ * Finishes emitting an object.  "nprops" is the number of properties the
+ * caller emitted with pmx_object_property(), and it must match the number
+ * recorded by the stream.  (Unlike an array's length, this isn't part of the
+ * node, so it's only known for certain once the properties are done.)
+ */
 void
-pmx_object_done(pmx_stream_t *pmxp)
+pmx_object_done(pmx_stream_t *pmxp, size_t nprops)
 {
 	VERIFY(pmxp->pxs_subtype == PMXN_OBJECT);
+	VERIFY(pmxp->pxs_nodeedges == nprops);
 	pmx_node_end(pmxp);
 }
 
-/* XXX should length here be a value (so it can be a heap number?) */
+/*
+ * Begins emitting an array of "len" elements.  The caller must follow this with
+ * exactly "len" calls to pmx_array_element(), and the array is finished after
+ * the last of these.
+ *
+ * XXX should length here be a value (so it can be a heap number?)
+ */
 void
 pmx_array(pmx_stream_t *pmxp, pmx_value_t jsv, size_t len)
 {
 	pmx_node_begin(pmxp, jsv, PMXN_ARRAY);
-	json_uint64(pmxp->pxs_jsonout, "length", len);
-	pmx_node_end(pmxp);
+	pmx_node_field(pmxp, PMXFD_ARRAY_LENGTH, len);
+	pmxp->pxs_nelements = len;
+	if (len == 0) {
+		pmx_node_end(pmxp);
+	}
+}
+
+/*
+ * Batch emitters.  Each node in the batch has the same type and set of fields,
+ * so the state checks and bookkeeping done by pmx_node_begin() and
+ * pmx_node_end() are done once for the whole batch, and each node is handed
+ * straight to the backend as soon as its fields are filled in.
+ */
+
+static void
+pmx_batch_begin(pmx_stream_t *pmxp, pmx_nodetype_t subtype,
+    unsigned int fieldmask)
+{
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	VERIFY(pmxp->pxs_nfields == 0);
+	pmx_edges_flush(pmxp);
+	pmxp->pxs_state = PMXS_NODE;
+	pmxp->pxs_subtype = subtype;
+	pmxp->pxs_fieldmask = fieldmask;
+}
+
+static void
+pmx_batch_end(pmx_stream_t *pmxp, size_t nnodes)
+{
+	pmxp->pxs_state = PMXS_TOP;
+	pmxp->pxs_subtype = PMXN_NONE;
+	pmxp->pxs_nodeedges = 0;
+	pmxp->pxs_nnodes += nnodes;
 }
 
 void
-pmx_emit_string_data(pmx_stream_t *pmxp, pmx_value_t jsv, size_t sz,
-    const uint8_t *bytes)
+pmx_emit_heapnumbers(pmx_stream_t *pmxp, const pmx_heapnumber_t *nums,
+    size_t n)
 {
 	size_t i;
 
-	/*
-	 * XXX This is absolutely awful, on levels:
-	 * - one character at a time
-	 * - hardcoding the things we need to escape here
-	 * - not handling non-ascii
-	 * - not handling ASCII control characters
-	 *
-	 * XXX We need to decide if the exporter should faithfully represent the
-	 * core file (e.g., so that an N-byte ASCII string is represented
-	 * precisely with those N bytes, even if they're non-ASCII, and the
-	 * consumer is expected to validate and detect this), or if the exporter
-	 * should attempt to sanitize it (e.g., report a substring, and mark the
-	 * string as potentially invalid).  It's a tough call: we don't want to
-	 * sanitize too much, since it's important for consumers to understand
-	 * details like in-memory representation in order to understand memory
-	 * usage, but we don't want every consumer to have to handle every edge
-	 * case.
-	 *
-	 * If the answer is that this is a faithful representation, then this
-	 * interface should just emit a bunch of bytes, and we should consider
-	 * base64-encoding it (in the spec).  Otherwise, maybe we produce the
-	 * best UTF-8 encoding we can and mark the string suspect if that does
-	 * not go well.
-	 *
-	 * XXX JSON appears to have a way to represent strings with arbitrary
-	 * unicode characters.  Is it possible to have invalid input, or is
-	 * every byte sequence valid?
-	 *
-	 * XXX This needs to be better-specified in the spec.
-	 */
-	(void) fprintf(pmxp->pxs_outstream,
-	    "{\"type\":\"string\",\"ident\":%" PRIu64 ",\"contents\":\"",
-	    (uint64_t)jsv);
-	for (i = 0; i < sz; i++) {
-		if (!isascii(bytes[i])) {
-			pmx_warn(pmxp, "pmx_emit_string_data for 0x%" PRIx64
-			    ": skipping unsupported string", (uint64_t)jsv);
-			pmxp->pxs_nwarnings++;
-			break;
-		}
+	pmx_batch_begin(pmxp, PMXN_HEAPNUMBER, 1U << PMXFD_HEAPNUMBER_VALUE);
+	for (i = 0; i < n; i++) {
+		pmxp->pxs_ident = nums[i].pxh_ident;
+		PMX_PROBE2(node_begin, pmxp->pxs_subtype, pmxp->pxs_ident);
+		(void) memcpy(&pmxp->pxs_fields[PMXFD_HEAPNUMBER_VALUE],
+		    &nums[i].pxh_value, sizeof (double));
+		pmx_node_emit(pmxp);
+	}
+	pmx_batch_end(pmxp, n);
+}
+
+void
+pmx_emit_strings_flat(pmx_stream_t *pmxp, const pmx_string_flat_t *strs,
+    size_t n)
+{
+	size_t i;
+
+	pmx_batch_begin(pmxp, PMXN_STRING_FLAT,
+	    (1U << PMXFD_STRING_FLAT_LENGTH) | (1U << PMXFD_STRING_FLAT_DATA));
+	for (i = 0; i < n; i++) {
+		pmxp->pxs_ident = strs[i].pxsf_ident;
+		PMX_PROBE2(node_begin, pmxp->pxs_subtype, pmxp->pxs_ident);
+		pmxp->pxs_fields[PMXFD_STRING_FLAT_LENGTH] =
+		    strs[i].pxsf_length;
+		pmxp->pxs_fields[PMXFD_STRING_FLAT_DATA] = strs[i].pxsf_data;
+		pmx_node_emit(pmxp);
+	}
+	pmx_batch_end(pmxp, n);
+}
 
-		if (bytes[i] == '"') {
-			fputc('\\', pmxp->pxs_outstream);
+void
+pmx_emit_strings_cons(pmx_stream_t *pmxp, const pmx_string_cons_t *strs,
+    size_t n)
+{
+	size_t i;
+
+	pmx_batch_begin(pmxp, PMXN_STRING_CONS,
+	    (1U << PMXFD_STRING_CONS_LENGTH) | (1U << PMXFD_STRING_CONS_S1) |
+	    (1U << PMXFD_STRING_CONS_S2));
+	for (i = 0; i < n; i++) {
+		pmxp->pxs_ident = strs[i].pxsc_ident;
+		PMX_PROBE2(node_begin, pmxp->pxs_subtype, pmxp->pxs_ident);
+		pmxp->pxs_fields[PMXFD_STRING_CONS_LENGTH] =
+		    strs[i].pxsc_length;
+		pmxp->pxs_fields[PMXFD_STRING_CONS_S1] = strs[i].pxsc_s1;
+		pmxp->pxs_fields[PMXFD_STRING_CONS_S2] = strs[i].pxsc_s2;
+		pmx_node_emit(pmxp);
+	}
+	pmx_batch_end(pmxp, n);
+}
+
+/*
+ * Each array's elements are handed to the backend (in batches, as with
+ * pmx_array_element()) before the array itself.
+ */
+void
+pmx_emit_arrays(pmx_stream_t *pmxp, const pmx_array_t *arrays, size_t n)
+{
+	const pmx_array_t *ap;
+	pmx_edgetype_t kind;
+	size_t i, j;
+
+	pmx_batch_begin(pmxp, PMXN_ARRAY, 1U << PMXFD_ARRAY_LENGTH);
+	for (i = 0; i < n; i++) {
+		ap = &arrays[i];
+		VERIFY(ap->pxa_length == 0 || ap->pxa_elements != NULL);
+		pmxp->pxs_ident = ap->pxa_ident;
+		PMX_PROBE2(node_begin, pmxp->pxs_subtype, pmxp->pxs_ident);
+		pmxp->pxs_fields[PMXFD_ARRAY_LENGTH] = ap->pxa_length;
+		for (j = 0; j < ap->pxa_length; j++) {
+			kind = ap->pxa_smi != NULL && ap->pxa_smi[j] != 0 ?
+			    PMXEG_SMI_ELEMENT : PMXEG_ELEMENT;
+			pmx_edge_add(pmxp, ap->pxa_ident, kind,
+			    ap->pxa_elements[j], j, NULL);
 		}
+		pmx_edges_flush(pmxp);
+		pmx_node_emit(pmxp);
+	}
+	pmx_batch_end(pmxp, n);
+}
 
-		(void) fputc(bytes[i], pmxp->pxs_outstream);
+void
+pmx_emit_string_data(pmx_stream_t *pmxp, pmx_value_t jsv, size_t sz,
+    const uint8_t *bytes)
+{
+	uint64_t start;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	PMX_PROBE2(string, jsv, sz);
+	if (pmxp->pxs_validator != NULL) {
+		pmx_validate_string(pmxp, jsv);
+	}
+
+	if (pmxp->pxs_indexer != NULL) {
+		pmx_index_mark(pmxp, jsv);
 	}
 
-	(void) fprintf(pmxp->pxs_outstream, "\"}\n");
+	pmxp->pxs_stats.pxst_nstringbytes += sz;
+	if (pmxp->pxs_strtab == NULL ||
+	    pmx_strtab_emit(pmxp, jsv, sz, bytes) != 0) {
+		start = PMX_STATS_START(pmxp);
+		pmxp->pxs_backend->pxb_string(pmxp, jsv, sz, bytes);
+		pmx_stats_record(pmxp, PMXR_STRING, 1, start);
+	}
+
+	if (pmxp->pxs_indexer != NULL) {
+		pmx_index_add(pmxp, jsv);
+	}
 }
@@ -0,0 +1,496 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmx_validate.c: checking references between emitted values
+ *
+ * The front-end only checks that each call is valid for the current node.  It
+ * can't tell whether the values that a node refers to (in reference fields,
+ * like the two halves of a cons string, or in edges) are ever emitted
+ * themselves.  After pmx_validate_refs(), the stream checks this as the export
+ * proceeds, using two tables:
+ *
+ *     defined	the set of values emitted so far (as nodes or string data)
+ *
+ *     pending	values that have been referenced but not yet emitted, with
+ *     		the number of references to each and the types of the
+ *     		nodes that referred to it
+ *
+ * Each reference is looked up in the defined set and added to the pending
+ * table if it's not there.  When a value is emitted, it's added to the defined
+ * set and removed from the pending table.  Values are usually emitted shortly
+ * after they're first referenced (or before), so the pending table stays small
+ * and whatever's left in it when the stream is finished is exactly the set of
+ * unresolved references.  These are reported with pmx_warn() from pmx_done()
+ * (which pmx_free() calls for streams that weren't finished).
+ *
+ * Both tables are open-addressing hash tables with linear probing that are
+ * kept at most 3/4 full.  The defined set holds nothing but the values
+ * themselves, so it costs between 10 and 22 bytes per value emitted.  Value 0
+ * is never tracked (it's used for empty slots, and it's what callers pass for
+ * references that aren't present).  Both tables are allocated from the
+ * stream's arena.  If that runs out of memory, validation stops (the export
+ * itself continues) and the report says so.
+ *
+ * Array elements that are small integers aren't references.  The interface
+ * doesn't distinguish small integers in properties and closure variables, so
+ * those are always treated as references.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <pmx/pmx.h>
+#include "pmx_impl.h"
+
+/* Initial number of slots in each table (must be a power of 2). */
+#define	PMX_VALIDATE_INITCAP	1024
+
+typedef struct {
+	uint64_t	pvp_ident;
+	uint32_t	pvp_nrefs;		/* references so far */
+	uint32_t	pvp_types;		/* types of referring nodes */
+} pmx_pending_t;
+
+struct pmx_validator {
+	pmx_arena_t	*pv_arena;
+	uint64_t	*pv_defined;
+	size_t		pv_ndefslots;		/* always a power of 2 */
+	size_t		pv_ndefined;
+	pmx_pending_t	*pv_pending;
+	size_t		pv_npendslots;		/* always a power of 2 */
+	size_t		pv_npending;
+	uint64_t	pv_nreferences;		/* references checked */
+	uint64_t	pv_nunresolved;		/* references in pv_pending */
+	uint64_t	pv_nduplicates;		/* values emitted again */
+	pmx_boolean_t	pv_incomplete;		/* ran out of memory */
+};
+
+static void pmx_validate_define(pmx_validator_t *, uint64_t);
+static void pmx_validate_ref(pmx_validator_t *, uint64_t, pmx_nodetype_t);
+static pmx_boolean_t pmx_defined_contains(pmx_validator_t *, uint64_t);
+static int pmx_defined_grow(pmx_validator_t *);
+static int pmx_pending_grow(pmx_validator_t *);
+static void pmx_pending_remove(pmx_validator_t *, size_t);
+static void pmx_validate_abandon(pmx_validator_t *);
+static size_t pmx_validate_hash(uint64_t);
+
+/*
+ * Public interfaces.  See pmx_validate_refs() in pmx.h.
+ */
+
+int
+pmx_validate_refs(pmx_stream_t *pmxp)
+{
+	pmx_validator_t *pv;
+
+	VERIFY(pmxp->pxs_state == PMXS_TOP);
+	VERIFY(pmxp->pxs_parent == NULL);
+	VERIFY(pmxp->pxs_validator == NULL);
+	VERIFY(pmxp->pxs_nnodes == 0 && pmxp->pxs_nedges == 0);
+
+	pv = pmx_arena_zalloc(pmxp->pxs_arena, sizeof (*pv));
+	if (pv == NULL) {
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	pv->pv_arena = pmxp->pxs_arena;
+	pv->pv_defined = pmx_arena_zalloc(pv->pv_arena,
+	    PMX_VALIDATE_INITCAP * sizeof (uint64_t));
+	pv->pv_pending = pmx_arena_zalloc(pv->pv_arena,
+	    PMX_VALIDATE_INITCAP * sizeof (pmx_pending_t));
+	pv->pv_ndefslots = PMX_VALIDATE_INITCAP;
+	pv->pv_npendslots = PMX_VALIDATE_INITCAP;
+	if (pv->pv_defined == NULL || pv->pv_pending == NULL) {
+		pmx_validate_abandon(pv);
+		pmx_arena_free(pv->pv_arena, pv, sizeof (*pv));
+		pmx_set_errno(pmxp, PMXE_ENOMEM);
+		return (-1);
+	}
+
+	pmxp->pxs_validator = pv;
+	return (0);
+}
+
+void
+pmx_validate_stats(pmx_stream_t *pmxp, pmx_validate_stats_t *statsp)
+{
+	pmx_validator_t *pv = pmxp->pxs_validator;
+
+	(void) memset(statsp, 0, sizeof (*statsp));
+	if (pv == NULL) {
+		return;
+	}
+
+	statsp->pxvs_ndefined = pv->pv_ndefined;
+	statsp->pxvs_nreferences = pv->pv_nreferences;
+	statsp->pxvs_nduplicates = pv->pv_nduplicates;
+	statsp->pxvs_nunresolved = pv->pv_nunresolved;
+	statsp->pxvs_nmissing = pv->pv_npending;
+	statsp->pxvs_nbytes = sizeof (*pv) +
+	    pv->pv_ndefslots * sizeof (uint64_t) +
+	    pv->pv_npendslots * sizeof (pmx_pending_t);
+	statsp->pxvs_incomplete = pv->pv_incomplete;
+}
+
+/*
+ * Records the node that's about to be handed to the backend, along with the
+ * references in its fields.
+ */
+void
+pmx_validate_node(pmx_stream_t *pmxp)
+{
+	pmx_validator_t *pv = pmxp->pxs_validator;
+	const pmx_nodeschema_t *pxn = &pmx_node_schemas[pmxp->pxs_subtype];
+	unsigned int i;
+
+	for (i = 0; i < pxn->pxn_nfields; i++) {
+		if (pxn->pxn_fields[i].pxf_kind == PMXFK_REF &&
+		    (pmxp->pxs_fieldmask & (1U << i)) != 0) {
+			pmx_validate_ref(pv, pmxp->pxs_fields[i],
+			    pmxp->pxs_subtype);
+		}
+	}
+
+	pmx_validate_define(pv, (uint64_t)pmxp->pxs_ident);
+}
+
+/*
+ * Records the references in a batch of edges that's about to be handed to the
+ * backend.  The type of the referring node is implied by the kind of edge.
+ */
+void
+pmx_validate_edges(pmx_stream_t *pmxp, const pmx_edge_t *edges, size_t n)
+{
+	pmx_validator_t *pv = pmxp->pxs_validator;
+	pmx_nodetype_t type;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		switch (edges[i].pxe_kind) {
+		case PMXEG_PROPERTY:
+			type = PMXN_OBJECT;
+			break;
+		case PMXEG_ELEMENT:
+			type = PMXN_ARRAY;
+			break;
+		case PMXEG_VARIABLE:
+			type = PMXN_CLOSURE;
+			break;
+		default:
+			continue;
+		}
+
+		pmx_validate_ref(pv, edges[i].pxe_target, type);
+	}
+}
+
+void
+pmx_validate_string(pmx_stream_t *pmxp, pmx_value_t jsv)
+{
+	pmx_validate_define(pmxp->pxs_validator, (uint64_t)jsv);
+}
+
+/*
+ * Reports anything found wrong with the export.  This is called when the
+ * stream is finished, so anything still pending will never be resolved.
+ */
+void
+pmx_validate_report(pmx_stream_t *pmxp)
+{
+	pmx_validator_t *pv = pmxp->pxs_validator;
+	uint64_t nvalues[PMXN_NTYPES], example[PMXN_NTYPES];
+	pmx_pending_t *pvp;
+	size_t i;
+	unsigned int t;
+
+	if (pv->pv_incomplete) {
+		pmx_warn(pmxp, "reference validation stopped after %zu values: "
+		    "out of memory\n", pv->pv_ndefined);
+		return;
+	}
+
+	if (pv->pv_nduplicates > 0) {
+		pmx_warn(pmxp, "%" PRIu64 " values were emitted more than "
+		    "once\n", pv->pv_nduplicates);
+	}
+
+	if (pv->pv_npending == 0) {
+		return;
+	}
+
+	pmx_warn(pmxp, "%" PRIu64 " unresolved references to %zu values "
+	    "that were never emitted\n", pv->pv_nunresolved, pv->pv_npending);
+
+	(void) memset(nvalues, 0, sizeof (nvalues));
+	(void) memset(example, 0, sizeof (example));
+	for (i = 0; i < pv->pv_npendslots; i++) {
+		pvp = &pv->pv_pending[i];
+		if (pvp->pvp_ident == 0) {
+			continue;
+		}
+
+		for (t = 0; t < PMXN_NTYPES; t++) {
+			if ((pvp->pvp_types & (1U << t)) == 0) {
+				continue;
+			}
+
+			if (nvalues[t]++ == 0 || pvp->pvp_ident < example[t]) {
+				example[t] = pvp->pvp_ident;
+			}
+		}
+	}
+
+	for (t = 0; t < PMXN_NTYPES; t++) {
+		if (nvalues[t] > 0) {
+			pmx_warn(pmxp, "    %" PRIu64 " referenced by %s nodes "
+			    "(e.g., 0x%" PRIx64 ")\n", nvalues[t],
+			    pmx_node_schemas[t].pxn_name, example[t]);
+		}
+	}
+}
+
+static void
+pmx_validate_define(pmx_validator_t *pv, uint64_t ident)
+{
+	pmx_pending_t *pvp;
+	size_t mask, i;
+
+	if (ident == 0 || pv->pv_incomplete) {
+		return;
+	}
+
+	if (4 * (pv->pv_ndefined + 1) > 3 * pv->pv_ndefslots &&
+	    pmx_defined_grow(pv) != 0) {
+		pmx_validate_abandon(pv);
+		return;
+	}
+
+	mask = pv->pv_ndefslots - 1;
+	for (i = pmx_validate_hash(ident) & mask; ; i = (i + 1) & mask) {
+		if (pv->pv_defined[i] == ident) {
+			pv->pv_nduplicates++;
+			return;
+		}
+
+		if (pv->pv_defined[i] == 0) {
+			break;
+		}
+	}
+
+	pv->pv_defined[i] = ident;
+	pv->pv_ndefined++;
+
+	if (pv->pv_npending == 0) {
+		return;
+	}
+
+	mask = pv->pv_npendslots - 1;
+	for (i = pmx_validate_hash(ident) & mask; ; i = (i + 1) & mask) {
+		pvp = &pv->pv_pending[i];
+		if (pvp->pvp_ident == 0) {
+			return;
+		}
+
+		if (pvp->pvp_ident == ident) {
+			pv->pv_nunresolved -= pvp->pvp_nrefs;
+			pmx_pending_remove(pv, i);
+			return;
+		}
+	}
+}
+
+static void
+pmx_validate_ref(pmx_validator_t *pv, uint64_t ident, pmx_nodetype_t type)
+{
+	pmx_pending_t *pvp;
+	size_t mask, i;
+
+	if (ident == 0 || pv->pv_incomplete) {
+		return;
+	}
+
+	pv->pv_nreferences++;
+	if (pmx_defined_contains(pv, ident)) {
+		return;
+	}
+
+	if (4 * (pv->pv_npending + 1) > 3 * pv->pv_npendslots &&
+	    pmx_pending_grow(pv) != 0) {
+		pmx_validate_abandon(pv);
+		return;
+	}
+
+	mask = pv->pv_npendslots - 1;
+	for (i = pmx_validate_hash(ident) & mask; ; i = (i + 1) & mask) {
+		pvp = &pv->pv_pending[i];
+		if (pvp->pvp_ident == ident) {
+			break;
+		}
+
+		if (pvp->pvp_ident == 0) {
+			pvp->pvp_ident = ident;
+			pv->pv_npending++;
+			break;
+		}
+	}
+
+	if (pvp->pvp_nrefs < UINT32_MAX) {
+		pvp->pvp_nrefs++;
+		pv->pv_nunresolved++;
+	}
+
+	pvp->pvp_types |= 1U << type;
+}
+
+static pmx_boolean_t
+pmx_defined_contains(pmx_validator_t *pv, uint64_t ident)
+{
+	size_t mask, i;
+
+	mask = pv->pv_ndefslots - 1;
+	for (i = pmx_validate_hash(ident) & mask; ; i = (i + 1) & mask) {
+		if (pv->pv_defined[i] == ident) {
+			return (PB_TRUE);
+		}
+
+		if (pv->pv_defined[i] == 0) {
+			return (PB_FALSE);
+		}
+	}
+}
+
+static int
+pmx_defined_grow(pmx_validator_t *pv)
+{
+	uint64_t *newslots, *oldslots;
+	size_t newcap, oldcap, mask, i, j;
+
+	oldslots = pv->pv_defined;
+	oldcap = pv->pv_ndefslots;
+	newcap = 2 * oldcap;
+	newslots = pmx_arena_zalloc(pv->pv_arena, newcap * sizeof (uint64_t));
+	if (newslots == NULL) {
+		return (-1);
+	}
+
+	mask = newcap - 1;
+	for (i = 0; i < oldcap; i++) {
+		if (oldslots[i] == 0) {
+			continue;
+		}
+
+		j = pmx_validate_hash(oldslots[i]) & mask;
+		while (newslots[j] != 0) {
+			j = (j + 1) & mask;
+		}
+
+		newslots[j] = oldslots[i];
+	}
+
+	pmx_arena_free(pv->pv_arena, oldslots, oldcap * sizeof (uint64_t));
+	pv->pv_defined = newslots;
+	pv->pv_ndefslots = newcap;
+	return (0);
+}
+
+static int
+pmx_pending_grow(pmx_validator_t *pv)
+{
+	pmx_pending_t *newslots, *oldslots;
+	size_t newcap, oldcap, mask, i, j;
+
+	oldslots = pv->pv_pending;
+	oldcap = pv->pv_npendslots;
+	newcap = 2 * oldcap;
+	newslots = pmx_arena_zalloc(pv->pv_arena,
+	    newcap * sizeof (pmx_pending_t));
+	if (newslots == NULL) {
+		return (-1);
+	}
+
+	mask = newcap - 1;
+	for (i = 0; i < oldcap; i++) {
+		if (oldslots[i].pvp_ident == 0) {
+			continue;
+		}
+
+		j = pmx_validate_hash(oldslots[i].pvp_ident) & mask;
+		while (newslots[j].pvp_ident != 0) {
+			j = (j + 1) & mask;
+		}
+
+		newslots[j] = oldslots[i];
+	}
+
+	pmx_arena_free(pv->pv_arena, oldslots,
+	    oldcap * sizeof (pmx_pending_t));
+	pv->pv_pending = newslots;
+	pv->pv_npendslots = newcap;
+	return (0);
+}
+
+/*
+ * Removes the pending entry in slot "i", moving back later entries in the same
+ * run that would otherwise become unreachable (as in pmx_strtab.c).
+ */
+static void
+pmx_pending_remove(pmx_validator_t *pv, size_t i)
+{
+	size_t mask, j, home;
+
+	mask = pv->pv_npendslots - 1;
+	pv->pv_pending[i].pvp_ident = 0;
+	pv->pv_npending--;
+
+	for (j = (i + 1) & mask; pv->pv_pending[j].pvp_ident != 0;
+	    j = (j + 1) & mask) {
+		home = pmx_validate_hash(pv->pv_pending[j].pvp_ident) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			pv->pv_pending[i] = pv->pv_pending[j];
+			pv->pv_pending[j].pvp_ident = 0;
+			i = j;
+		}
+	}
+
+	(void) memset(&pv->pv_pending[i], 0, sizeof (pmx_pending_t));
+}
+
+/*
+ * Gives up on validation (after running out of memory) and returns the
+ * tables' memory to the arena, since the export itself may still need it.
+ */
+static void
+pmx_validate_abandon(pmx_validator_t *pv)
+{
+	pmx_arena_free(pv->pv_arena, pv->pv_defined,
+	    pv->pv_ndefslots * sizeof (uint64_t));
+	pmx_arena_free(pv->pv_arena, pv->pv_pending,
+	    pv->pv_npendslots * sizeof (pmx_pending_t));
+	pv->pv_defined = NULL;
+	pv->pv_pending = NULL;
+	pv->pv_ndefslots = 0;
+	pv->pv_npendslots = 0;
+	pv->pv_incomplete = PB_TRUE;
+}
+
+/*
+ * Values are usually pointers, whose low bits are all the same, so the bits
+ * are mixed (Fibonacci hashing) before the table's mask is applied.
+ */
+static size_t
+pmx_validate_hash(uint64_t ident)
+{
+	uint64_t h;
+
+	h = ident * 0x9e3779b97f4a7c15ULL;
+	return ((size_t)(h ^ (h >> 32)));
+}
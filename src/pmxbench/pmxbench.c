@@ -0,0 +1,1176 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxbench.c: measure the throughput of libjsonemitter and libpmx
+ *
+ * This program should not use private libpmx functions.
+ *
+ * Each benchmark performs some operation (an "op") a given number of times:
+ * emitting one JSON value, emitting one node through a pmx stream, or (for the
+ * "export" benchmarks) generating and exporting one value of a synthetic heap
+ * (see pmxgen.c).  A benchmark is run with increasing numbers of ops until a
+ * run takes at least the minimum time (-t), and that run is reported: the time
+ * per op, the rate at which output was produced, and the number of calls to
+ * malloc(), calloc(), and realloc() per op.  The "validate" export benchmarks
+ * use pmx_validate_refs(), and for those, the memory used by the validator's
+ * tables (pxvs_nbytes) is also reported, in bytes per op.
+ *
+ * Output goes to /dev/null, except for the "file" export benchmarks, which
+ * write a file in the scratch directory (-d) and remove it afterwards.  The
+ * time for those includes writing the file out of stdio (or for sqlite, out of
+ * sqlite's page cache), but not syncing it to disk.  The "mmap" ones write the
+ * same file through pmx_create_stream_mmap() instead of stdio.  The "slow" and
+ * "async" export benchmarks instead write to a pipe that a separate thread
+ * drains at a fixed rate (-r, in megabytes per second), standing in for a slow
+ * disk, so that exports whose output is smaller (such as compressed ones) can
+ * be compared where I/O rather than CPU is the bottleneck.  Like a disk that
+ * takes writes into a cache and then stalls while they're written back, the
+ * sink accepts a burst of output and then stops reading for as long as that
+ * output would take at its rate.  A synchronous export waits out each stall,
+ * while one using pmx_async_output() keeps emitting into its buffers.
+ *
+ * pmx_emit_node_external(), pmx_emit_node_regexp(), and
+ * pmx_emit_node_string_slice() are declared but not yet implemented, so there
+ * are no benchmarks for them.
+ *
+ * Results are printed as a table and, with -o, also written to a file as
+ * newline-separated JSON: one object describing the run, followed by one
+ * object for each benchmark (see bn_report()), so that the results of
+ * different runs can be compared.
+ *
+ * Allocations are counted by defining malloc() and friends in this program and
+ * forwarding them to the next definitions (normally the C library's), found
+ * with dlsym(RTLD_NEXT).  That relies on the dynamic linker resolving libpmx's
+ * calls to this program's definitions, as it does on ELF systems.  Elsewhere,
+ * allocations aren't counted, and they're reported as "-" (or null).
+ */
+
+/* RTLD_NEXT is an extension. */
+#define	_GNU_SOURCE
+
+#include <dlfcn.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+#include <libjsonemitter/jsonemitter.h>
+#include <pmxemit/pmxgen.h>
+
+#define	EXIT_USAGE 2
+
+#if defined(RTLD_NEXT) && !defined(__APPLE__)
+#define	BN_COUNTALLOCS	1
+#else
+#define	BN_COUNTALLOCS	0
+#endif
+
+#define	NANOSEC		1000000000ULL
+#define	MILLISEC	1000ULL
+
+/* Default minimum time for each benchmark, in milliseconds. */
+#define	BN_MINTIME	500
+/* Default rate of the slow sink, in megabytes per second. */
+#define	BN_SLOWRATE	50
+/* Size of each read from the slow sink's pipe. */
+#define	BN_SLOWBUFSZ	(64 * 1024)
+/* Bytes the slow sink accepts before stalling to catch up with its rate. */
+#define	BN_SLOWBURST	(1024 * 1024)
+/* Size of the output buffer for JSON emitters. */
+#define	BN_BUFSZ	(64 * 1024)
+/* Levels of nesting in the "json_object/nested" benchmark. */
+#define	BN_DEPTH	8
+/* Size of strings emitted with pmx_emit_string_data(). */
+#define	BN_STRSZ	32
+/* Words of memory for allocations made while finding malloc(). */
+#define	BN_NBOOTSTRAP	512
+/* Idents of emitted nodes, spaced out as they would be in a real heap. */
+#define	BN_IDENT(i)	(0x100000 + (pmx_value_t)(i) * 0x20)
+
+typedef struct bench bench_t;
+typedef struct bn_bench bn_bench_t;
+
+/* Where the export benchmarks write their output. */
+typedef enum {
+	BN_NULL,		/* /dev/null */
+	BN_FILE,		/* a file in the scratch directory */
+	BN_MMAP,		/* the same, with pmx_create_stream_mmap() */
+	BN_SLOW			/* a pipe drained at bn_slowrate */
+} bn_sink_t;
+
+/* Options for the export benchmarks. */
+#define	BN_ASYNC	0x1		/* use pmx_async_output() */
+#define	BN_VALIDATE	0x2		/* use pmx_validate_refs() */
+
+struct bn_bench {
+	const char	*bnb_name;
+	uint64_t	(*bnb_func)(bench_t *, const bn_bench_t *, uint64_t);
+	void		(*bnb_node)(pmx_stream_t *, uint64_t);
+	pmx_format_t	bnb_format;
+	pmx_compress_t	bnb_compress;
+	bn_sink_t	bnb_sink;
+	unsigned int	bnb_flags;
+	const char	*bnb_arg;
+};
+
+struct bench {
+	const char	*bn_scratch;		/* directory for output files */
+	uint64_t	bn_mintime;		/* in nanoseconds */
+	uint64_t	bn_slowrate;		/* in bytes per second */
+	int		bn_nullfd;		/* /dev/null */
+	uint64_t	bn_nbytes;		/* JSON output so far */
+	uint64_t	bn_valbytes;		/* validator memory, last run */
+	FILE		*bn_resultsfp;		/* -o, or NULL */
+	json_emit_t	*bn_results;
+};
+
+/* State of the slow sink's draining thread.  See bn_slow_start(). */
+typedef struct {
+	int		bns_fd;			/* read end of the pipe */
+	uint64_t	bns_rate;		/* in bytes per second */
+	pthread_t	bns_thread;
+} bn_slow_t;
+
+static uint64_t bn_now(void);
+static void bn_run(bench_t *, const bn_bench_t *);
+static void bn_report(bench_t *, const bn_bench_t *, uint64_t, uint64_t,
+    uint64_t, uint64_t, uint64_t);
+static void bn_report_start(bench_t *);
+static FILE *bn_slow_start(bench_t *, bn_slow_t *);
+static void bn_slow_finish(bn_slow_t *);
+static void *bn_slow_drain(void *);
+
+static uint64_t bn_json_string(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_json_uint64(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_json_double(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_printf_uint64(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_printf_double(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_json_nested(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_nodes(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_oddballs(bench_t *, const bn_bench_t *, uint64_t);
+static uint64_t bn_export(bench_t *, const bn_bench_t *, uint64_t);
+
+static void bn_node_heapnumber(pmx_stream_t *, uint64_t);
+static void bn_node_date(pmx_stream_t *, uint64_t);
+static void bn_node_string_flat(pmx_stream_t *, uint64_t);
+static void bn_node_string_cons(pmx_stream_t *, uint64_t);
+static void bn_string_data(pmx_stream_t *, uint64_t);
+
+static const char bn_str_ascii[] =
+    "the quick brown fox jumps over the lazy dog, pack my box with jugs";
+static const char bn_str_escapes[] =
+    "line one\nline \"two\"\ttabbed\r\nC:\\path\\to\\file \x01\x1f\\\\ end";
+static const char bn_str_multibyte[] =
+    "caf\xc3\xa9 na\xc3\xafve \xe2\x82\xac" "12 \xe6\x97\xa5\xe6\x9c\xac"
+    "\xe8\xaa\x9e \xf0\x9f\x98\x80 r\xc3\xa9sum\xc3\xa9 \xce\xb1\xce\xb2";
+
+/*
+ * For the libjsonemitter benchmarks, bnb_arg is the string emitted (if any).
+ * For most libpmx benchmarks, bnb_node emits each node, and for the export
+ * benchmarks, bnb_sink says where the export is written and bnb_flags holds
+ * other options (BN_*).
+ */
+#define	BN_JSON(name, func, arg)	\
+	{ name, func, NULL, PMXF_JSON, PMXC_NONE, BN_NULL, 0, arg }
+#define	BN_NODE(name, func, format)	\
+	{ name, bn_nodes, func, format, PMXC_NONE, BN_NULL, 0, NULL }
+#define	BN_STREAM(name, func, format)	\
+	{ name, func, NULL, format, PMXC_NONE, BN_NULL, 0, NULL }
+#define	BN_EXPORT(name, format, compress, sink, flags)	\
+	{ name, bn_export, NULL, format, compress, sink, flags, NULL }
+
+static const bn_bench_t bn_benchmarks[] = {
+	BN_JSON("json_utf8string/ascii", bn_json_string, bn_str_ascii),
+	BN_JSON("json_utf8string/escapes", bn_json_string, bn_str_escapes),
+	BN_JSON("json_utf8string/multibyte", bn_json_string, bn_str_multibyte),
+	BN_JSON("json_uint64", bn_json_uint64, NULL),
+	BN_JSON("json_uint64/printf", bn_printf_uint64, NULL),
+	BN_JSON("json_double", bn_json_double, NULL),
+	BN_JSON("json_double/printf", bn_printf_double, NULL),
+	BN_JSON("json_object/nested", bn_json_nested, NULL),
+
+	BN_STREAM("node_oddballs/json", bn_oddballs, PMXF_JSON),
+	BN_STREAM("node_oddballs/binary", bn_oddballs, PMXF_BINARY),
+	BN_NODE("node_heapnumber/json", bn_node_heapnumber, PMXF_JSON),
+	BN_NODE("node_heapnumber/binary", bn_node_heapnumber, PMXF_BINARY),
+	BN_NODE("node_date/json", bn_node_date, PMXF_JSON),
+	BN_NODE("node_date/binary", bn_node_date, PMXF_BINARY),
+	BN_NODE("node_string_flat/json", bn_node_string_flat, PMXF_JSON),
+	BN_NODE("node_string_flat/binary", bn_node_string_flat, PMXF_BINARY),
+	BN_NODE("node_string_cons/json", bn_node_string_cons, PMXF_JSON),
+	BN_NODE("node_string_cons/binary", bn_node_string_cons, PMXF_BINARY),
+	BN_NODE("string_data/json", bn_string_data, PMXF_JSON),
+	BN_NODE("string_data/binary", bn_string_data, PMXF_BINARY),
+
+	BN_EXPORT("export/json/null", PMXF_JSON, PMXC_NONE, BN_NULL, 0),
+	BN_EXPORT("export/json/validate", PMXF_JSON, PMXC_NONE, BN_NULL,
+	    BN_VALIDATE),
+	BN_EXPORT("export/json/file", PMXF_JSON, PMXC_NONE, BN_FILE, 0),
+	BN_EXPORT("export/json/mmap", PMXF_JSON, PMXC_NONE, BN_MMAP, 0),
+	BN_EXPORT("export/json-gzip/file", PMXF_JSON, PMXC_GZIP, BN_FILE, 0),
+	BN_EXPORT("export/json/slow", PMXF_JSON, PMXC_NONE, BN_SLOW, 0),
+	BN_EXPORT("export/json-gzip/slow", PMXF_JSON, PMXC_GZIP, BN_SLOW, 0),
+	BN_EXPORT("export/json/async", PMXF_JSON, PMXC_NONE, BN_SLOW, BN_ASYNC),
+	BN_EXPORT("export/json-gzip/async", PMXF_JSON, PMXC_GZIP, BN_SLOW,
+	    BN_ASYNC),
+	BN_EXPORT("export/binary/null", PMXF_BINARY, PMXC_NONE, BN_NULL, 0),
+	BN_EXPORT("export/binary/validate", PMXF_BINARY, PMXC_NONE, BN_NULL,
+	    BN_VALIDATE),
+	BN_EXPORT("export/binary/file", PMXF_BINARY, PMXC_NONE, BN_FILE, 0),
+	BN_EXPORT("export/binary/mmap", PMXF_BINARY, PMXC_NONE, BN_MMAP, 0),
+	BN_EXPORT("export/binary/slow", PMXF_BINARY, PMXC_NONE, BN_SLOW, 0),
+	BN_EXPORT("export/binary/async", PMXF_BINARY, PMXC_NONE, BN_SLOW,
+	    BN_ASYNC),
+	BN_EXPORT("export/sqlite/file", PMXF_SQLITE, PMXC_NONE, BN_FILE, 0),
+};
+
+#define	BN_NBENCHMARKS	(sizeof (bn_benchmarks) / sizeof (bn_benchmarks[0]))
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: pmxbench [-l] [-d DIR] [-o RESULTS] "
+	    "[-r MBPS] [-t MSEC] [BENCHMARK...]\n");
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bench_t bn;
+	const char *outpath = NULL;
+	const bn_bench_t *bnb;
+	unsigned long msec, mbps;
+	char *endp;
+	size_t i;
+	int c, j, list = 0;
+
+	(void) memset(&bn, 0, sizeof (bn));
+	bn.bn_scratch = ".";
+	bn.bn_mintime = BN_MINTIME * (NANOSEC / MILLISEC);
+	bn.bn_slowrate = BN_SLOWRATE * 1000000ULL;
+	while ((c = getopt(argc, argv, "d:lo:r:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			bn.bn_scratch = optarg;
+			break;
+
+		case 'l':
+			list = 1;
+			break;
+
+		case 'o':
+			outpath = optarg;
+			break;
+
+		case 'r':
+			mbps = strtoul(optarg, &endp, 10);
+			if (*optarg == '\0' || *endp != '\0' || mbps == 0) {
+				warnx("invalid rate: \"%s\"", optarg);
+				usage();
+			}
+
+			bn.bn_slowrate = mbps * 1000000ULL;
+			break;
+
+		case 't':
+			msec = strtoul(optarg, &endp, 10);
+			if (*optarg == '\0' || *endp != '\0' || msec == 0) {
+				warnx("invalid minimum time: \"%s\"", optarg);
+				usage();
+			}
+
+			bn.bn_mintime = msec * (NANOSEC / MILLISEC);
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	/*
+	 * Remaining arguments select the benchmarks to run: each one runs the
+	 * benchmarks whose names start with it.
+	 */
+	for (j = optind; j < argc; j++) {
+		for (i = 0; i < BN_NBENCHMARKS; i++) {
+			if (strncmp(bn_benchmarks[i].bnb_name, argv[j],
+			    strlen(argv[j])) == 0) {
+				break;
+			}
+		}
+
+		if (i == BN_NBENCHMARKS) {
+			warnx("no benchmarks match \"%s\"", argv[j]);
+			usage();
+		}
+	}
+
+	if (list) {
+		for (i = 0; i < BN_NBENCHMARKS; i++) {
+			(void) printf("%s\n", bn_benchmarks[i].bnb_name);
+		}
+
+		return (0);
+	}
+
+	if ((bn.bn_nullfd = open("/dev/null", O_WRONLY)) < 0) {
+		err(EXIT_FAILURE, "open \"/dev/null\"");
+	}
+
+	if (outpath != NULL) {
+		if ((bn.bn_resultsfp = fopen(outpath, "w")) == NULL) {
+			err(EXIT_FAILURE, "open \"%s\"", outpath);
+		}
+
+		if ((bn.bn_results = json_create_stdio(bn.bn_resultsfp)) ==
+		    NULL) {
+			err(EXIT_FAILURE, "json_create_stdio");
+		}
+
+		bn_report_start(&bn);
+	}
+
+	(void) printf("%-28s %12s %10s %10s %10s %10s\n", "BENCHMARK", "OPS",
+	    "NS/OP", "MB/S", "ALLOCS/OP", "VMEM/OP");
+	for (i = 0; i < BN_NBENCHMARKS; i++) {
+		bnb = &bn_benchmarks[i];
+		for (j = optind; j < argc; j++) {
+			if (strncmp(bnb->bnb_name, argv[j],
+			    strlen(argv[j])) == 0) {
+				break;
+			}
+		}
+
+		if (optind == argc || j < argc) {
+			bn_run(&bn, bnb);
+		}
+	}
+
+	if (bn.bn_results != NULL) {
+		json_flush(bn.bn_results);
+		if (json_get_error(bn.bn_results, NULL, 0) != JSE_NONE ||
+		    fflush(bn.bn_resultsfp) != 0 ||
+		    ferror(bn.bn_resultsfp)) {
+			errx(EXIT_FAILURE, "error writing \"%s\"", outpath);
+		}
+
+		json_fini(bn.bn_results);
+		(void) fclose(bn.bn_resultsfp);
+	}
+
+	(void) close(bn.bn_nullfd);
+	return (0);
+}
+
+/*
+ * Allocation counting.  See the comment at the top of this file.
+ */
+static uint64_t bn_nallocs;
+static uint64_t bn_nallocbytes;
+
+#if BN_COUNTALLOCS
+
+static void *(*bn_malloc)(size_t);
+static void *(*bn_calloc)(size_t, size_t);
+static void *(*bn_realloc)(void *, size_t);
+static void (*bn_free)(void *);
+
+/*
+ * dlsym() may itself allocate memory while we're looking up the functions
+ * above.  That's satisfied from here, and never freed.  The union makes each
+ * allocation suitably aligned for any type.
+ */
+typedef union {
+	long double	bnw_ld;
+	uint64_t	bnw_u64;
+	void		*bnw_ptr;
+} bn_word_t;
+
+static int bn_resolving;
+static bn_word_t bn_bootstrap[BN_NBOOTSTRAP];
+static size_t bn_bootstrapused;
+
+static void
+bn_resolve(void)
+{
+	bn_resolving = 1;
+	bn_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	bn_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	bn_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+	bn_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+	bn_resolving = 0;
+
+	if (bn_malloc == NULL || bn_calloc == NULL || bn_realloc == NULL ||
+	    bn_free == NULL) {
+		abort();
+	}
+}
+
+static void *
+bn_bootstrap_alloc(size_t sz)
+{
+	size_t nwords = (sz + sizeof (bn_word_t) - 1) / sizeof (bn_word_t);
+	void *p;
+
+	if (nwords > BN_NBOOTSTRAP - bn_bootstrapused) {
+		return (NULL);
+	}
+
+	p = &bn_bootstrap[bn_bootstrapused];
+	bn_bootstrapused += nwords;
+	return (p);
+}
+
+static int
+bn_bootstrap_owns(void *p)
+{
+	return ((bn_word_t *)p >= &bn_bootstrap[0] &&
+	    (bn_word_t *)p < &bn_bootstrap[BN_NBOOTSTRAP]);
+}
+
+static void
+bn_count(size_t sz)
+{
+	(void) __atomic_add_fetch(&bn_nallocs, 1, __ATOMIC_RELAXED);
+	(void) __atomic_add_fetch(&bn_nallocbytes, sz, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t sz)
+{
+	if (bn_malloc == NULL) {
+		if (bn_resolving) {
+			return (bn_bootstrap_alloc(sz));
+		}
+
+		bn_resolve();
+	}
+
+	bn_count(sz);
+	return (bn_malloc(sz));
+}
+
+void *
+calloc(size_t nelem, size_t elsize)
+{
+	if (bn_calloc == NULL) {
+		if (bn_resolving) {
+			/* The bootstrap area is never reused, so it's zero. */
+			if (elsize != 0 && nelem > SIZE_MAX / elsize) {
+				return (NULL);
+			}
+
+			return (bn_bootstrap_alloc(nelem * elsize));
+		}
+
+		bn_resolve();
+	}
+
+	bn_count(nelem * elsize);
+	return (bn_calloc(nelem, elsize));
+}
+
+void *
+realloc(void *p, size_t sz)
+{
+	void *newp;
+	size_t avail;
+
+	if (bn_realloc == NULL) {
+		bn_resolve();
+	}
+
+	if (p != NULL && bn_bootstrap_owns(p)) {
+		/* We don't know the old size, but it's all in the area. */
+		avail = (size_t)((char *)&bn_bootstrap[BN_NBOOTSTRAP] -
+		    (char *)p);
+		if ((newp = malloc(sz)) != NULL) {
+			(void) memcpy(newp, p, sz < avail ? sz : avail);
+		}
+
+		return (newp);
+	}
+
+	bn_count(sz);
+	return (bn_realloc(p, sz));
+}
+
+void
+free(void *p)
+{
+	if (p == NULL || bn_bootstrap_owns(p)) {
+		return;
+	}
+
+	if (bn_free == NULL) {
+		bn_resolve();
+	}
+
+	bn_free(p);
+}
+
+#endif /* BN_COUNTALLOCS */
+
+static uint64_t
+bn_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(EXIT_FAILURE, "clock_gettime");
+	}
+
+	return ((uint64_t)ts.tv_sec * NANOSEC + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Runs benchmark "bnb" with increasing numbers of ops until a run takes at
+ * least the minimum time, and reports that run.  Each number is predicted from
+ * the rate of the previous run, with some margin, but grows by at most 100
+ * times at once so that a noisy short run doesn't lead to a very long one.
+ */
+static void
+bn_run(bench_t *bn, const bn_bench_t *bnb)
+{
+	uint64_t nops, next, start, elapsed, nbytes, nallocs, nallocbytes;
+
+	for (nops = 1; ; nops = next) {
+		nallocs = __atomic_load_n(&bn_nallocs, __ATOMIC_RELAXED);
+		nallocbytes = __atomic_load_n(&bn_nallocbytes,
+		    __ATOMIC_RELAXED);
+		start = bn_now();
+		nbytes = bnb->bnb_func(bn, bnb, nops);
+		elapsed = bn_now() - start;
+		nallocs = __atomic_load_n(&bn_nallocs, __ATOMIC_RELAXED) -
+		    nallocs;
+		nallocbytes = __atomic_load_n(&bn_nallocbytes,
+		    __ATOMIC_RELAXED) - nallocbytes;
+
+		if (elapsed >= bn->bn_mintime) {
+			break;
+		}
+
+		next = (uint64_t)((double)nops * 1.2 *
+		    (double)bn->bn_mintime / (double)(elapsed + 1));
+		if (next > nops * 100) {
+			next = nops * 100;
+		}
+
+		if (next <= nops) {
+			next = nops + 1;
+		}
+	}
+
+	bn_report(bn, bnb, nops, elapsed, nbytes, nallocs, nallocbytes);
+}
+
+/*
+ * Prints the results of a benchmark run and, with -o, writes an object to the
+ * results file with these properties:
+ *
+ *	name		name of the benchmark
+ *	ops		number of ops performed
+ *	nsec		total elapsed time, in nanoseconds
+ *	nsec_per_op	average time per op, in nanoseconds
+ *	bytes		bytes of output produced
+ *	mb_per_sec	output produced per second, in megabytes (10^6 bytes)
+ *	allocs		calls to malloc(), calloc(), and realloc()
+ *	allocs_per_op	average number of those per op
+ *	alloc_bytes	total bytes requested from them
+ *	validate_bytes	memory used by pmx_validate_refs(), in bytes
+ *
+ * The allocation properties are null if allocations weren't counted, and
+ * validate_bytes is null except for the "validate" benchmarks.
+ */
+static void
+bn_report(bench_t *bn, const bn_bench_t *bnb, uint64_t nops,
+    uint64_t elapsed, uint64_t nbytes, uint64_t nallocs, uint64_t nallocbytes)
+{
+	double nsperop, mbps, allocsperop;
+	json_emit_t *jse = bn->bn_results;
+	int validated = (bnb->bnb_flags & BN_VALIDATE) != 0;
+
+	nsperop = (double)elapsed / (double)nops;
+	mbps = (double)nbytes * ((double)NANOSEC / 1e6) / (double)elapsed;
+	allocsperop = (double)nallocs / (double)nops;
+
+	(void) printf("%-28s %12" PRIu64 " %10.1f %10.1f ", bnb->bnb_name,
+	    nops, nsperop, mbps);
+	if (BN_COUNTALLOCS) {
+		(void) printf("%10.3f ", allocsperop);
+	} else {
+		(void) printf("%10s ", "-");
+	}
+
+	if (validated) {
+		(void) printf("%10.1f\n", (double)bn->bn_valbytes /
+		    (double)nops);
+	} else {
+		(void) printf("%10s\n", "-");
+	}
+
+	(void) fflush(stdout);
+
+	if (jse == NULL) {
+		return;
+	}
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "name", bnb->bnb_name);
+	json_uint64(jse, "ops", nops);
+	json_uint64(jse, "nsec", elapsed);
+	json_double(jse, "nsec_per_op", nsperop);
+	json_uint64(jse, "bytes", nbytes);
+	json_double(jse, "mb_per_sec", mbps);
+	if (BN_COUNTALLOCS) {
+		json_uint64(jse, "allocs", nallocs);
+		json_double(jse, "allocs_per_op", allocsperop);
+		json_uint64(jse, "alloc_bytes", nallocbytes);
+	} else {
+		json_null(jse, "allocs");
+		json_null(jse, "allocs_per_op");
+		json_null(jse, "alloc_bytes");
+	}
+	if (validated) {
+		json_uint64(jse, "validate_bytes", bn->bn_valbytes);
+	} else {
+		json_null(jse, "validate_bytes");
+	}
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+/*
+ * Writes the first object of the results file, which describes the run:
+ *
+ *	started_at	time the run started, in ISO 8601 form
+ *	hostname	name of the system, and its operating system name,
+ *	system		release, and hardware type (see uname(2))
+ *	release
+ *	machine
+ *	min_msec	minimum time for each benchmark (-t)
+ *	slow_mb_per_sec	rate of the slow sink (-r), in megabytes (10^6 bytes)
+ *	count_allocs	whether allocations are counted
+ */
+static void
+bn_report_start(bench_t *bn)
+{
+	json_emit_t *jse = bn->bn_results;
+	struct utsname uts;
+	time_t nowt;
+	struct tm nowtm;
+	char nowstr[sizeof ("2016-08-29T00:00:00Z")];
+
+	(void) time(&nowt);
+	(void) gmtime_r(&nowt, &nowtm);
+	(void) strftime(nowstr, sizeof (nowstr), "%Y-%m-%dT%H:%M:%SZ",
+	    &nowtm);
+
+	if (uname(&uts) < 0) {
+		err(EXIT_FAILURE, "uname");
+	}
+
+	json_object_begin(jse, NULL);
+	json_utf8string(jse, "started_at", nowstr);
+	json_utf8string(jse, "hostname", uts.nodename);
+	json_utf8string(jse, "system", uts.sysname);
+	json_utf8string(jse, "release", uts.release);
+	json_utf8string(jse, "machine", uts.machine);
+	json_uint64(jse, "min_msec", bn->bn_mintime / (NANOSEC / MILLISEC));
+	json_uint64(jse, "slow_mb_per_sec", bn->bn_slowrate / 1000000);
+	json_boolean(jse, "count_allocs",
+	    BN_COUNTALLOCS ? JSON_B_TRUE : JSON_B_FALSE);
+	json_object_end(jse);
+	json_newline(jse);
+}
+
+/*
+ * libjsonemitter benchmarks.  These write through a buffered emitter, as
+ * libpmx does, and each op emits one value into a top-level array.
+ */
+
+static int
+bn_json_write(void *arg, const char *buf, size_t len)
+{
+	bench_t *bn = arg;
+	ssize_t rv;
+
+	bn->bn_nbytes += len;
+	while (len > 0) {
+		if ((rv = write(bn->bn_nullfd, buf, len)) < 0) {
+			return (errno);
+		}
+
+		buf += rv;
+		len -= (size_t)rv;
+	}
+
+	return (0);
+}
+
+static json_emit_t *
+bn_json_create(bench_t *bn)
+{
+	json_emit_t *jse;
+
+	bn->bn_nbytes = 0;
+	if ((jse = json_create_cb(bn_json_write, bn, BN_BUFSZ)) == NULL) {
+		err(EXIT_FAILURE, "json_create_cb");
+	}
+
+	json_array_begin(jse, NULL);
+	return (jse);
+}
+
+static uint64_t
+bn_json_done(bench_t *bn, const bn_bench_t *bnb, json_emit_t *jse)
+{
+	char errbuf[256];
+
+	json_array_end(jse);
+	json_flush(jse);
+	if (json_get_error(jse, errbuf, sizeof (errbuf)) != JSE_NONE) {
+		errx(EXIT_FAILURE, "%s: %s", bnb->bnb_name, errbuf);
+	}
+
+	json_fini(jse);
+	return (bn->bn_nbytes);
+}
+
+static uint64_t
+bn_json_string(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	json_emit_t *jse;
+	uint64_t i;
+
+	jse = bn_json_create(bn);
+	for (i = 0; i < nops; i++) {
+		json_utf8string(jse, NULL, bnb->bnb_arg);
+	}
+
+	return (bn_json_done(bn, bnb, jse));
+}
+
+/*
+ * The numbers emitted range over all magnitudes (for json_uint64()) or look
+ * like typical heap numbers, with a few decimal places (for json_double()).
+ * The "printf" variants format the same numbers with snprintf() into a buffer
+ * written out the same way, for comparison: "%.17g" is the shortest printf()
+ * format that reads back as the same double for every value.
+ */
+static uint64_t
+bn_json_uint64(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	json_emit_t *jse;
+	uint64_t i;
+
+	jse = bn_json_create(bn);
+	for (i = 0; i < nops; i++) {
+		json_uint64(jse, NULL,
+		    (i * 0x9e3779b97f4a7c15ULL) >> (i % 64));
+	}
+
+	return (bn_json_done(bn, bnb, jse));
+}
+
+static uint64_t
+bn_json_double(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	json_emit_t *jse;
+	uint64_t i;
+
+	jse = bn_json_create(bn);
+	for (i = 0; i < nops; i++) {
+		json_double(jse, NULL, (double)((i * 0x9e3779b97f4a7c15ULL) %
+		    10000000) / 1000.0);
+	}
+
+	return (bn_json_done(bn, bnb, jse));
+}
+
+static uint64_t
+bn_printf_uint64(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	char buf[BN_BUFSZ];
+	size_t used = 0;
+	uint64_t i;
+
+	bn->bn_nbytes = 0;
+	for (i = 0; i < nops; i++) {
+		if (sizeof (buf) - used < 32) {
+			if (bn_json_write(bn, buf, used) != 0) {
+				err(EXIT_FAILURE, "%s: write", bnb->bnb_name);
+			}
+
+			used = 0;
+		}
+
+		used += (size_t)snprintf(buf + used, sizeof (buf) - used,
+		    "%" PRIu64 ",",
+		    (uint64_t)((i * 0x9e3779b97f4a7c15ULL) >> (i % 64)));
+	}
+
+	if (bn_json_write(bn, buf, used) != 0) {
+		err(EXIT_FAILURE, "%s: write", bnb->bnb_name);
+	}
+
+	return (bn->bn_nbytes);
+}
+
+static uint64_t
+bn_printf_double(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	char buf[BN_BUFSZ];
+	size_t used = 0;
+	uint64_t i;
+
+	bn->bn_nbytes = 0;
+	for (i = 0; i < nops; i++) {
+		if (sizeof (buf) - used < 32) {
+			if (bn_json_write(bn, buf, used) != 0) {
+				err(EXIT_FAILURE, "%s: write", bnb->bnb_name);
+			}
+
+			used = 0;
+		}
+
+		used += (size_t)snprintf(buf + used, sizeof (buf) - used,
+		    "%.17g,", (double)((i * 0x9e3779b97f4a7c15ULL) %
+		    10000000) / 1000.0);
+	}
+
+	if (bn_json_write(bn, buf, used) != 0) {
+		err(EXIT_FAILURE, "%s: write", bnb->bnb_name);
+	}
+
+	return (bn->bn_nbytes);
+}
+
+static uint64_t
+bn_json_nested(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	json_emit_t *jse;
+	uint64_t i;
+	int d;
+
+	jse = bn_json_create(bn);
+	for (i = 0; i < nops; i++) {
+		json_object_begin(jse, NULL);
+		for (d = 1; d < BN_DEPTH; d++) {
+			json_int64(jse, "depth", d);
+			json_object_begin(jse, "child");
+		}
+
+		for (d = 0; d < BN_DEPTH; d++) {
+			json_object_end(jse);
+		}
+	}
+
+	return (bn_json_done(bn, bnb, jse));
+}
+
+/*
+ * libpmx benchmarks.  Each op emits one node (or string) with bnb_node through
+ * a stream of the benchmark's format.
+ */
+static uint64_t
+bn_nodes(bench_t *bn __attribute__((__unused__)), const bn_bench_t *bnb,
+    uint64_t nops)
+{
+	pmx_stream_t *pmxp;
+	FILE *fp;
+	uint64_t i, nbytesraw, nbytesout;
+
+	if ((fp = fopen("/dev/null", "w")) == NULL) {
+		err(EXIT_FAILURE, "open \"/dev/null\"");
+	}
+
+	if ((pmxp = pmx_create_stream_format(fp, stderr,
+	    bnb->bnb_format)) == NULL) {
+		err(EXIT_FAILURE, "pmx_create_stream");
+	}
+
+	for (i = 0; i < nops; i++) {
+		bnb->bnb_node(pmxp, i);
+	}
+
+	pmx_done(pmxp);
+	if (pmx_errno(pmxp) != PMXE_OK) {
+		errx(EXIT_FAILURE, "%s: %s", bnb->bnb_name, pmx_errmsg(pmxp));
+	}
+
+	pmx_byte_counts(pmxp, &nbytesraw, &nbytesout);
+	pmx_free(pmxp);
+	(void) fclose(fp);
+	return (nbytesraw);
+}
+
+/*
+ * Each oddball may only be emitted once in a stream, so each op of this
+ * benchmark creates a stream, emits all five oddballs with
+ * pmx_emit_node_boolean(), pmx_emit_node_null(), pmx_emit_node_undefined(),
+ * and pmx_emit_node_hole(), and finishes the stream.
+ */
+static uint64_t
+bn_oddballs(bench_t *bn __attribute__((__unused__)), const bn_bench_t *bnb,
+    uint64_t nops)
+{
+	pmx_stream_t *pmxp;
+	FILE *fp;
+	uint64_t i, nbytes, nbytesraw, nbytesout;
+
+	if ((fp = fopen("/dev/null", "w")) == NULL) {
+		err(EXIT_FAILURE, "open \"/dev/null\"");
+	}
+
+	nbytes = 0;
+	for (i = 0; i < nops; i++) {
+		if ((pmxp = pmx_create_stream_format(fp, stderr,
+		    bnb->bnb_format)) == NULL) {
+			err(EXIT_FAILURE, "pmx_create_stream");
+		}
+
+		pmx_emit_node_boolean(pmxp, BN_IDENT(0), PB_FALSE, BN_IDENT(5));
+		pmx_emit_node_boolean(pmxp, BN_IDENT(1), PB_TRUE, BN_IDENT(6));
+		pmx_emit_node_null(pmxp, BN_IDENT(2), BN_IDENT(7));
+		pmx_emit_node_undefined(pmxp, BN_IDENT(3), BN_IDENT(8));
+		pmx_emit_node_hole(pmxp, BN_IDENT(4), BN_IDENT(9));
+		pmx_done(pmxp);
+		if (pmx_errno(pmxp) != PMXE_OK) {
+			errx(EXIT_FAILURE, "%s: %s", bnb->bnb_name,
+			    pmx_errmsg(pmxp));
+		}
+
+		pmx_byte_counts(pmxp, &nbytesraw, &nbytesout);
+		nbytes += nbytesraw;
+		pmx_free(pmxp);
+	}
+
+	(void) fclose(fp);
+	return (nbytes);
+}
+
+static void
+bn_node_heapnumber(pmx_stream_t *pmxp, uint64_t i)
+{
+	pmx_emit_node_heapnumber(pmxp, BN_IDENT(i),
+	    (double)((i * 0x9e3779b97f4a7c15ULL) % 10000000) / 1000.0);
+}
+
+static void
+bn_node_date(pmx_stream_t *pmxp, uint64_t i)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 1500000000 + (time_t)(i % 100000000);
+	ts.tv_nsec = (long)(i % 1000) * 1000000;
+	pmx_emit_node_date(pmxp, BN_IDENT(i), &ts);
+}
+
+static void
+bn_node_string_flat(pmx_stream_t *pmxp, uint64_t i)
+{
+	pmx_emit_node_string_flat(pmxp, BN_IDENT(i), BN_STRSZ,
+	    BN_IDENT(i + 1));
+}
+
+static void
+bn_node_string_cons(pmx_stream_t *pmxp, uint64_t i)
+{
+	pmx_emit_node_string_cons(pmxp, BN_IDENT(i), 2 * BN_STRSZ,
+	    BN_IDENT(i / 2), BN_IDENT(i / 2 + 1));
+}
+
+static void
+bn_string_data(pmx_stream_t *pmxp, uint64_t i)
+{
+	pmx_emit_string_data(pmxp, BN_IDENT(i), BN_STRSZ,
+	    (const uint8_t *)bn_str_ascii + i % 16);
+}
+
+/*
+ * End-to-end benchmarks.  Each op generates and exports one value of a
+ * synthetic heap with the default parameters (see pmxgen.c), writing the
+ * export to /dev/null, to a file in the scratch directory, or to the slow sink,
+ * according to bnb_sink.  The output rate counts the bytes written, after
+ * compression.  sqlite streams write the database file themselves, so for
+ * those it's the size of the file when the stream is done.
+ */
+static uint64_t
+bn_export(bench_t *bn, const bn_bench_t *bnb, uint64_t nops)
+{
+	pmxgen_params_t params;
+	pmx_stream_t *pmxp;
+	char path[PATH_MAX];
+	struct stat st;
+	FILE *fp = NULL;
+	bn_slow_t slow;
+	pmx_validate_stats_t vstats;
+	uint64_t nbytesraw, nbytesout;
+
+	pmxgen_defaults(&params);
+	params.pgp_nodes = nops;
+
+	if (bnb->bnb_sink == BN_NULL) {
+		(void) strcpy(path, "/dev/null");
+	} else if (bnb->bnb_sink == BN_SLOW) {
+		(void) strcpy(path, "slow sink");
+	} else if (snprintf(path, sizeof (path), "%s/pmxbench.%ld.tmp",
+	    bn->bn_scratch, (long)getpid()) >= (int)sizeof (path)) {
+		errx(EXIT_FAILURE, "scratch directory name too long");
+	}
+
+	if (bnb->bnb_format == PMXF_SQLITE) {
+		/* The database must not exist already. */
+		(void) unlink(path);
+		pmxp = pmx_create_stream_sqlite(path, stderr);
+	} else if (bnb->bnb_sink == BN_MMAP) {
+		pmxp = pmx_create_stream_mmap(path, stderr, bnb->bnb_format,
+		    PMXM_SEQUENTIAL);
+	} else if (bnb->bnb_sink == BN_SLOW &&
+	    (fp = bn_slow_start(bn, &slow)) == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	} else if (fp == NULL && (fp = fopen(path, "w")) == NULL) {
+		err(EXIT_FAILURE, "open \"%s\"", path);
+	} else if (bnb->bnb_compress != PMXC_NONE) {
+		pmxp = pmx_create_stream_compressed(fp, stderr,
+		    bnb->bnb_format, bnb->bnb_compress, NULL);
+	} else {
+		pmxp = pmx_create_stream_format(fp, stderr, bnb->bnb_format);
+	}
+
+	if (pmxp == NULL) {
+		err(EXIT_FAILURE, "pmx_create_stream");
+	}
+
+	if (((bnb->bnb_flags & BN_ASYNC) != 0 &&
+	    pmx_async_output(pmxp, 0) != 0) ||
+	    ((bnb->bnb_flags & BN_VALIDATE) != 0 &&
+	    pmx_validate_refs(pmxp) != 0)) {
+		errx(EXIT_FAILURE, "%s: %s", bnb->bnb_name, pmx_errmsg(pmxp));
+	}
+
+	pmxgen_emit(pmxp, &params);
+	pmx_done(pmxp);
+	if (pmx_errno(pmxp) != PMXE_OK) {
+		errx(EXIT_FAILURE, "%s: %s", bnb->bnb_name, pmx_errmsg(pmxp));
+	}
+
+	pmx_byte_counts(pmxp, &nbytesraw, &nbytesout);
+	if ((bnb->bnb_flags & BN_VALIDATE) != 0) {
+		pmx_validate_stats(pmxp, &vstats);
+		bn->bn_valbytes = vstats.pxvs_nbytes;
+	}
+
+	pmx_free(pmxp);
+	if (fp != NULL && fclose(fp) != 0) {
+		err(EXIT_FAILURE, "close \"%s\"", path);
+	}
+
+	if (bnb->bnb_sink == BN_SLOW) {
+		bn_slow_finish(&slow);
+	}
+
+	if (bnb->bnb_format == PMXF_SQLITE) {
+		if (stat(path, &st) != 0) {
+			err(EXIT_FAILURE, "stat \"%s\"", path);
+		}
+
+		nbytesout = (uint64_t)st.st_size;
+	}
+
+	if (bnb->bnb_sink == BN_FILE || bnb->bnb_sink == BN_MMAP) {
+		(void) unlink(path);
+	}
+
+	return (nbytesout);
+}
+
+/*
+ * The slow sink is a pipe, drained by a separate thread that reads from it no
+ * faster than bn_slowrate: after reading each BN_SLOWBURST bytes, it sleeps
+ * for as long as those would take at that rate (see the comment at the top of
+ * this file).
+ * bn_slow_start() starts the thread and returns a
+ * stream for writing to the pipe.  Once that's closed, bn_slow_finish() waits
+ * for the thread to read the rest.
+ */
+static FILE *
+bn_slow_start(bench_t *bn, bn_slow_t *slow)
+{
+	int fds[2];
+	int rv;
+
+	if (pipe(fds) != 0) {
+		err(EXIT_FAILURE, "pipe");
+	}
+
+	slow->bns_fd = fds[0];
+	slow->bns_rate = bn->bn_slowrate;
+	if ((rv = pthread_create(&slow->bns_thread, NULL, bn_slow_drain,
+	    slow)) != 0) {
+		errno = rv;
+		err(EXIT_FAILURE, "pthread_create");
+	}
+
+	return (fdopen(fds[1], "w"));
+}
+
+static void
+bn_slow_finish(bn_slow_t *slow)
+{
+	(void) pthread_join(slow->bns_thread, NULL);
+	(void) close(slow->bns_fd);
+}
+
+static void *
+bn_slow_drain(void *arg)
+{
+	bn_slow_t *slow = arg;
+	static char buf[BN_SLOWBUFSZ];
+	struct timespec ts;
+	uint64_t stall, burst;
+	ssize_t rv;
+
+	stall = (uint64_t)((double)BN_SLOWBURST * (double)NANOSEC /
+	    (double)slow->bns_rate);
+	ts.tv_sec = (time_t)(stall / NANOSEC);
+	ts.tv_nsec = (long)(stall % NANOSEC);
+	burst = 0;
+	while ((rv = read(slow->bns_fd, buf, sizeof (buf))) != 0) {
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			err(EXIT_FAILURE, "read from slow sink");
+		}
+
+		burst += (uint64_t)rv;
+		if (burst >= BN_SLOWBURST) {
+			burst -= BN_SLOWBURST;
+			(void) nanosleep(&ts, NULL);
+		}
+	}
+
+	return (NULL);
+}
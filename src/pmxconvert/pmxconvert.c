@@ -0,0 +1,252 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxconvert.c: convert a binary postmortem export to another format (JSON,
+ * by default).
+ *
+ * This program should not use private libpmx functions.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+
+#define	EXIT_USAGE 2
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: pmxconvert "
+	    "[-f json|binary|sqlite|null] [-o OUTPUT [-m]] [-t] "
+	    "[-z [-i INDEX]] [-d MAXBYTES] [-v] [-x VALUEINDEX] [FILE]\n");
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pmx_stream_t *pmxp;
+	pmx_format_t format = PMXF_JSON;
+	pmx_compress_t compress = PMXC_NONE;
+	pmx_intern_stats_t stats;
+	pmx_validate_stats_t vstats;
+	unsigned long long internmax = 0;
+	char *endp;
+	int async = 0;
+	int mapped = 0;
+	int validate = 0;
+	const char *outpath = NULL;
+	const char *indexpath = NULL;
+	const char *vindexpath = NULL;
+	FILE *outfp = stdout;
+	FILE *indexfp = NULL;
+	FILE *vindexfp = NULL;
+	FILE *infp;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:f:i:mo:tvx:z")) != -1) {
+		switch (c) {
+		case 'd':
+			errno = 0;
+			internmax = strtoull(optarg, &endp, 0);
+			if (errno != 0 || *endp != '\0' || internmax == 0) {
+				warnx("invalid size: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'f':
+			if (strcmp(optarg, "json") == 0) {
+				format = PMXF_JSON;
+			} else if (strcmp(optarg, "binary") == 0) {
+				format = PMXF_BINARY;
+			} else if (strcmp(optarg, "sqlite") == 0) {
+				format = PMXF_SQLITE;
+			} else if (strcmp(optarg, "null") == 0) {
+				format = PMXF_NULL;
+			} else {
+				warnx("unsupported format: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'i':
+			indexpath = optarg;
+			break;
+
+		case 'm':
+			mapped = 1;
+			break;
+
+		case 'o':
+			outpath = optarg;
+			break;
+
+		case 't':
+			async = 1;
+			break;
+
+		case 'v':
+			validate = 1;
+			break;
+
+		case 'x':
+			vindexpath = optarg;
+			break;
+
+		case 'z':
+			compress = PMXC_GZIP;
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc > 1) {
+		usage();
+	}
+
+	if (argc == 0) {
+		infp = stdin;
+	} else if ((infp = fopen(argv[0], "r")) == NULL) {
+		err(EXIT_FAILURE, "open \"%s\"", argv[0]);
+	}
+
+	if (indexpath != NULL && compress == PMXC_NONE) {
+		warnx("-i requires -z");
+		usage();
+	}
+
+	if (compress != PMXC_NONE &&
+	    format != PMXF_JSON && format != PMXF_BINARY) {
+		warnx("-z is only supported for json and binary output");
+		usage();
+	}
+
+	if (async && format != PMXF_JSON && format != PMXF_BINARY) {
+		warnx("-t is only supported for json and binary output");
+		usage();
+	}
+
+	if (mapped && (outpath == NULL || compress != PMXC_NONE ||
+	    (format != PMXF_JSON && format != PMXF_BINARY))) {
+		warnx("-m requires -o and uncompressed json or binary output");
+		usage();
+	}
+
+	if (internmax != 0 && format == PMXF_SQLITE) {
+		warnx("-d is not supported for sqlite output");
+		usage();
+	}
+
+	if (vindexpath != NULL && (format != PMXF_JSON ||
+	    compress != PMXC_NONE || internmax != 0)) {
+		warnx("-x requires uncompressed json output without -d");
+		usage();
+	}
+
+	if (vindexpath != NULL &&
+	    (vindexfp = fopen(vindexpath, "w")) == NULL) {
+		err(EXIT_FAILURE, "open \"%s\"", vindexpath);
+	}
+
+	if (format == PMXF_SQLITE) {
+		if (outpath == NULL) {
+			warnx("-o is required for sqlite output");
+			usage();
+		}
+
+		pmxp = pmx_create_stream_sqlite(outpath, stderr);
+	} else if (mapped) {
+		pmxp = pmx_create_stream_mmap(outpath, stderr, format,
+		    PMXM_SEQUENTIAL);
+	} else {
+		if (outpath != NULL &&
+		    (outfp = fopen(outpath, "w")) == NULL) {
+			err(EXIT_FAILURE, "open \"%s\"", outpath);
+		}
+
+		if (indexpath != NULL &&
+		    (indexfp = fopen(indexpath, "w")) == NULL) {
+			err(EXIT_FAILURE, "open \"%s\"", indexpath);
+		}
+
+		if (compress != PMXC_NONE) {
+			pmxp = pmx_create_stream_compressed(outfp, stderr,
+			    format, compress, indexfp);
+		} else {
+			pmxp = pmx_create_stream_format(outfp, stderr, format);
+		}
+	}
+
+	if (pmxp == NULL) {
+		err(EXIT_FAILURE, "pmx_create_stream");
+	}
+
+	if (async && pmx_async_output(pmxp, 0) != 0) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	if (internmax != 0 && pmx_intern_strings(pmxp, (size_t)internmax,
+	    PMXI_EVICT_CLOCK) != 0) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	if (validate && pmx_validate_refs(pmxp) != 0) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	if (vindexfp != NULL && pmx_index_values(pmxp, vindexfp) != 0) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	pmx_import_binary(pmxp, infp);
+	if (pmx_errno(pmxp) == PMXE_OK) {
+		pmx_done(pmxp);
+	}
+
+	if (pmx_errno(pmxp) != PMXE_OK) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	if (internmax != 0) {
+		pmx_intern_stats(pmxp, &stats);
+		(void) fprintf(stderr, "pmxconvert: interned strings: "
+		    "%llu/%llu hits (%.1f%%), %llu bytes saved, %llu evicted\n",
+		    (unsigned long long)stats.pxis_nhits,
+		    (unsigned long long)stats.pxis_nlookups,
+		    stats.pxis_nlookups == 0 ? 0.0 :
+		    100.0 * stats.pxis_nhits / stats.pxis_nlookups,
+		    (unsigned long long)stats.pxis_nbytessaved,
+		    (unsigned long long)stats.pxis_nevicted);
+	}
+
+	if (validate) {
+		pmx_validate_stats(pmxp, &vstats);
+		(void) fprintf(stderr, "pmxconvert: checked %llu references "
+		    "to %llu values: %llu unresolved\n",
+		    (unsigned long long)vstats.pxvs_nreferences,
+		    (unsigned long long)vstats.pxvs_ndefined,
+		    (unsigned long long)vstats.pxvs_nunresolved);
+	}
+
+	pmx_free(pmxp);
+	return (validate && vstats.pxvs_nunresolved > 0 ?
+	    EXIT_FAILURE : 0);
+}
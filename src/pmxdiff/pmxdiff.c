@@ -0,0 +1,1386 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxdiff.c: compare two JSON postmortem exports and report what grew between
+ * them.
+ *
+ * This program should not use private libpmx functions.
+ *
+ * Values are grouped by type, and objects and closures are also grouped by
+ * the name of their constructor (for objects) or their function (for
+ * closures).  For each group, the report shows how many values each export
+ * has, their total size (estimated as in pmxretain), and the differences.
+ * These totals don't depend on idents, which are addresses that change when
+ * the garbage collector moves values.  Individual values are also matched up
+ * by ident and by their structural signature: their type, their constructor or
+ * function name, and for objects, the names of their properties (in order).
+ * A value in the second export is "new" unless the first export has a value
+ * with the same ident and signature, and a value in the first export is
+ * "freed" unless the second export has one.  (So a value that was moved is
+ * counted as both.)
+ *
+ * Exports may be much larger than memory, so neither is kept in memory.  Each
+ * is read once, and what's needed is sorted with an external merge sort (see
+ * xs_add()) using a bounded amount of memory (see -m):
+ *
+ *     - A summary of each value (a dvalue_t), sorted by ident.  Once both
+ *       exports have been read, the two sorted streams are merged to match
+ *       values by ident.
+ *
+ *     - A "dictionary" (of dentry_t) describing each closure, function,
+ *       string, and string contents, sorted by ident (or content id).  This is
+ *       written to a temporary file and searched with pread(2) to resolve the
+ *       constructors and functions that values refer to: a closure refers to
+ *       its function, which refers to the string holding its name, which may
+ *       refer to its contents (if strings were interned).  The name is then
+ *       read back from the export itself.
+ *
+ * Besides the sort buffers, memory is used for the names of edges, the
+ * distinct constructors and functions referred to, and the groups reported,
+ * which are all far fewer than values.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+
+#define	EXIT_USAGE 2
+
+/* Number of constructors reported by default. */
+#define	DF_NTOP		20
+/* Default memory for sorting, in megabytes. */
+#define	DF_MEMDEFAULT	256
+/* Type recorded for values that are string records rather than nodes. */
+#define	DF_STRING	0
+/* Number of possible types. */
+#define	DF_NTYPES	256
+/* Estimated size of a word (see pmxretain). */
+#define	DF_WORD		8
+/* Longest chain of references followed to find a name. */
+#define	DF_MAXHOPS	8
+/* Initial number of slots in each hash table (must be a power of 2). */
+#define	DF_HTINITCAP	256
+
+/*
+ * Constructor and function names that aren't read from the export.
+ */
+#define	DF_NONAME	"(none)"
+#define	DF_ANONYMOUS	"(anonymous)"
+#define	DF_UNKNOWN	"(unknown)"
+
+/*
+ * External merge sort of fixed-size records, each of which begins with three
+ * 64-bit integers that are compared in order.  Records are collected in a
+ * buffer, and if it fills, it's sorted and appended to a temporary file as a
+ * "run".  At the end, the runs are merged (with a heap), each refilled from
+ * the file into its own part of the same buffer.  If nothing was ever written
+ * out, the buffer is simply sorted.
+ */
+typedef struct {
+	uint64_t	xr_next;		/* next record in the file */
+	uint64_t	xr_end;			/* end of the run */
+	uint8_t		*xr_buf;
+	size_t		xr_cap;			/* records that fit in xr_buf */
+	size_t		xr_nbuf;		/* records in xr_buf */
+	size_t		xr_pos;			/* next record in xr_buf */
+} xrun_t;
+
+typedef struct {
+	size_t		xs_recsize;
+	uint8_t		*xs_buf;
+	size_t		xs_cap;			/* capacity of xs_buf */
+	size_t		xs_n;			/* records in xs_buf */
+	size_t		xs_pos;			/* next, if not spilled */
+	uint64_t	xs_nrecs;		/* records added */
+	FILE		*xs_fp;			/* runs, if any */
+	uint64_t	*xs_runstart;		/* first record of each run */
+	size_t		xs_nruns;
+	xrun_t		*xs_runs;		/* merge state */
+	size_t		*xs_heap;
+	size_t		xs_nheap;
+} xsort_t;
+
+/*
+ * Hash table with pairs of 64-bit keys and fixed-size values.
+ */
+typedef struct {
+	size_t		ht_valsize;
+	size_t		ht_nslots;		/* always a power of 2 */
+	size_t		ht_nused;
+	uint64_t	*ht_keys;		/* two per slot */
+	uint8_t		*ht_used;
+	uint8_t		*ht_vals;
+} htab_t;
+
+/*
+ * What each type of node is used for.  See df_initroles().
+ */
+typedef enum {
+    DF_ROLENONE = 0,
+    DF_ROLEOBJECT,	/* grouped by constructor */
+    DF_ROLECLOSURE,	/* grouped by function */
+    DF_ROLEFUNCINFO,	/* refers to its name */
+    DF_ROLEFLAT		/* refers to its data */
+} dfrole_t;
+
+static uint8_t df_roles[DF_NTYPES];
+
+/*
+ * Summary of each value.
+ */
+typedef struct {
+	uint64_t	dv_ident;
+	uint64_t	dv_ctor;	/* constructor or function, or 0 */
+	uint64_t	dv_shape;	/* hash of property names */
+	uint32_t	dv_size;	/* estimated size */
+	uint32_t	dv_type;	/* node type, or DF_STRING */
+} dvalue_t;
+
+/*
+ * Dictionary entries.  de_key is an ident, except for DK_CONTENT, where it's a
+ * content id.
+ */
+typedef enum {
+    DK_CLOSURE = 1,	/* de_value is the function's ident */
+    DK_FUNCINFO,	/* de_value is the name's ident */
+    DK_FLAT,		/* de_value is the data's ident */
+    DK_STRING,		/* de_value is the record's offset in the export */
+    DK_STRINGREF,	/* de_value is the content id */
+    DK_CONTENT		/* de_value is the record's offset in the export */
+} dkind_t;
+
+typedef struct {
+	uint64_t	de_key;
+	uint64_t	de_kind;
+	uint64_t	de_value;
+} dentry_t;
+
+/*
+ * Totals for each group of values.  Index 0 is for the first export and index
+ * 1 for the second.
+ */
+typedef struct {
+	uint64_t	dg_count[2];
+	uint64_t	dg_size[2];
+	uint64_t	dg_new;
+	uint64_t	dg_freed;
+} dgroup_t;
+
+typedef struct {
+	uint32_t	dr_type;
+	uint64_t	dr_name;	/* name hash */
+	dgroup_t	dr_group;
+} dreport_t;
+
+/*
+ * State for each export.
+ */
+typedef struct {
+	const char	*dx_path;
+	int		dx_fd;		/* for reading names back */
+	xsort_t		dx_values;
+	xsort_t		dx_dict;
+	FILE		*dx_dictfp;	/* sorted dictionary */
+	uint64_t	dx_ndict;
+	uint64_t	*dx_names;	/* hash of each edge name, by id */
+	uint64_t	dx_nnames;
+	uint32_t	*dx_contents;	/* length of contents, by id */
+	uint64_t	dx_ncontents;
+	htab_t		dx_ctors;	/* constructor ident -> name hash */
+	uint64_t	dx_nunknown;	/* constructors without names */
+} dexport_t;
+
+static void df_initroles(void);
+static void *df_alloc(size_t, size_t);
+static void *df_grow(void *, uint64_t *, uint64_t, size_t);
+static uint64_t df_hash(const void *, size_t);
+static uint64_t df_mix(uint64_t, uint64_t);
+static uint64_t df_name(htab_t *, const char *, size_t);
+static void df_read(dexport_t *, htab_t *, size_t);
+static void df_resolve(dexport_t *, htab_t *, char **, size_t *);
+static int df_lookup(dexport_t *, uint64_t, int, dentry_t *);
+static int df_readstr(dexport_t *, uint64_t, char **, size_t *, size_t *);
+static void df_join(dexport_t *, htab_t *, dgroup_t *, htab_t *);
+static void df_account(dexport_t *, int, const dvalue_t *, int, htab_t *,
+    dgroup_t *, htab_t *, uint64_t *);
+static void df_report(htab_t *, dgroup_t *, htab_t *, size_t);
+static void df_print(const dgroup_t *, const char *, const char *);
+static int df_cmpreport(const void *, const void *);
+static const char *df_typename(uint32_t);
+static void df_fini(dexport_t *);
+
+static void xs_init(xsort_t *, size_t, size_t);
+static void xs_add(xsort_t *, const void *);
+static void xs_spill(xsort_t *);
+static void xs_sort(xsort_t *);
+static int xs_next(xsort_t *, void *);
+static void xs_fill(xsort_t *, xrun_t *);
+static void xs_siftdown(xsort_t *, size_t);
+static const uint8_t *xs_head(xsort_t *, size_t);
+static int xs_cmp(const void *, const void *);
+static void xs_fini(xsort_t *);
+
+static void ht_init(htab_t *, size_t);
+static void *ht_lookup(htab_t *, uint64_t, uint64_t, int);
+static void ht_fini(htab_t *);
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr,
+	    "usage: pmxdiff [-v] [-m MBYTES] [-n COUNT] FILE1 FILE2\n");
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	dexport_t dx[2];
+	htab_t names, groups;
+	dgroup_t types[DF_NTYPES];
+	unsigned long long ntop = DF_NTOP;
+	unsigned long long mbytes = DF_MEMDEFAULT;
+	size_t memsz;
+	char *endp;
+	int verbose = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "m:n:v")) != -1) {
+		switch (c) {
+		case 'm':
+			mbytes = strtoull(optarg, &endp, 0);
+			if (*endp != '\0' || mbytes == 0 ||
+			    mbytes > SIZE_MAX / (1024 * 1024)) {
+				warnx("invalid size: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'n':
+			ntop = strtoull(optarg, &endp, 0);
+			if (*endp != '\0' || ntop == 0 || ntop > SIZE_MAX) {
+				warnx("invalid count: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+		usage();
+	}
+
+	/*
+	 * Each export has two sorts, and both exports' value sorts are in use
+	 * at the same time, so each sort gets a quarter of the memory.
+	 */
+	memsz = (size_t)mbytes * 1024 * 1024 / 4;
+	df_initroles();
+	ht_init(&names, sizeof (char *));
+	ht_init(&groups, sizeof (dgroup_t));
+	(void) memset(types, 0, sizeof (types));
+
+	for (i = 0; i < 2; i++) {
+		(void) memset(&dx[i], 0, sizeof (dx[i]));
+		dx[i].dx_path = argv[i];
+		df_read(&dx[i], &names, memsz);
+
+		if (verbose) {
+			warnx("%s: %" PRIu64 " values (%zu runs), %" PRIu64
+			    " dictionary entries, %zu constructors and "
+			    "functions (%" PRIu64 " unnamed)", dx[i].dx_path,
+			    dx[i].dx_values.xs_nrecs,
+			    dx[i].dx_values.xs_nruns, dx[i].dx_ndict,
+			    dx[i].dx_ctors.ht_nused, dx[i].dx_nunknown);
+		}
+	}
+
+	df_join(dx, &names, types, &groups);
+	df_report(&names, types, &groups,
+	    ntop > groups.ht_nused ? groups.ht_nused : (size_t)ntop);
+
+	for (i = 0; i < 2; i++) {
+		df_fini(&dx[i]);
+	}
+
+	ht_fini(&groups);
+	for (memsz = 0; memsz < names.ht_nslots; memsz++) {
+		if (names.ht_used[memsz]) {
+			free(*(char **)(names.ht_vals +
+			    memsz * names.ht_valsize));
+		}
+	}
+	ht_fini(&names);
+	return (0);
+}
+
+static void
+df_initroles(void)
+{
+	const char *name;
+	unsigned int i;
+
+	for (i = 0; i < DF_NTYPES; i++) {
+		if ((name = pmx_node_typename(i)) == NULL) {
+			continue;
+		}
+
+		if (strcmp(name, "object") == 0) {
+			df_roles[i] = DF_ROLEOBJECT;
+		} else if (strcmp(name, "closure") == 0) {
+			df_roles[i] = DF_ROLECLOSURE;
+		} else if (strcmp(name, "funcinfo") == 0) {
+			df_roles[i] = DF_ROLEFUNCINFO;
+		} else if (strcmp(name, "string_flat") == 0) {
+			df_roles[i] = DF_ROLEFLAT;
+		}
+	}
+}
+
+static void *
+df_alloc(size_t nelem, size_t elsize)
+{
+	void *rv;
+
+	if ((rv = calloc(nelem == 0 ? 1 : nelem, elsize)) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	return (rv);
+}
+
+/*
+ * Grows an array indexed by id (*nelemp elements of "elsize" bytes each) so
+ * that it includes "id", zeroing the new elements.
+ */
+static void *
+df_grow(void *buf, uint64_t *nelemp, uint64_t id, size_t elsize)
+{
+	uint64_t len;
+
+	if (id < *nelemp) {
+		return (buf);
+	}
+
+	len = *nelemp == 0 ? 64 : 2 * *nelemp;
+	while (len <= id) {
+		len *= 2;
+	}
+
+	if (len > SIZE_MAX / elsize ||
+	    (buf = realloc(buf, (size_t)len * elsize)) == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	(void) memset((uint8_t *)buf + *nelemp * elsize, 0,
+	    (size_t)(len - *nelemp) * elsize);
+	*nelemp = len;
+	return (buf);
+}
+
+/*
+ * 64-bit FNV-1a hash.
+ */
+static uint64_t
+df_hash(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return (h);
+}
+
+static uint64_t
+df_mix(uint64_t h, uint64_t v)
+{
+	h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return (h ^ (h >> 29));
+}
+
+/*
+ * Returns the hash of a constructor or function name, saving the name in
+ * "names" so that it can be reported.
+ */
+static uint64_t
+df_name(htab_t *names, const char *name, size_t len)
+{
+	uint64_t h = df_hash(name, len);
+	char **namep;
+
+	namep = ht_lookup(names, h, 0, 1);
+	if (*namep == NULL) {
+		*namep = df_alloc(len + 1, 1);
+		(void) memcpy(*namep, name, len);
+	}
+
+	return (h);
+}
+
+/*
+ * Reads an export, sorting summaries of its values and building its
+ * dictionary, and resolves the names of the constructors and functions that
+ * its values refer to.
+ */
+static void
+df_read(dexport_t *dx, htab_t *names, size_t memsz)
+{
+	pmx_reader_t *pr;
+	pmx_record_t rec;
+	dvalue_t dv;
+	dentry_t de;
+	uint64_t edgesrc = 0, shape = 0, nedges = 0, len;
+	char *buf = NULL;
+	size_t bufsz = 0;
+	size_t e;
+	unsigned int i;
+	int rv;
+
+	if ((pr = pmx_reader_open(dx->dx_path)) == NULL) {
+		if (errno == EFBIG) {
+			errx(EXIT_FAILURE, "\"%s\" is too large to map into "
+			    "this process's address space", dx->dx_path);
+		}
+
+		err(EXIT_FAILURE, "open \"%s\"", dx->dx_path);
+	}
+
+	if ((dx->dx_fd = open(dx->dx_path, O_RDONLY)) < 0) {
+		err(EXIT_FAILURE, "open \"%s\"", dx->dx_path);
+	}
+
+	xs_init(&dx->dx_values, sizeof (dvalue_t), memsz);
+	xs_init(&dx->dx_dict, sizeof (dentry_t), memsz);
+	ht_init(&dx->dx_ctors, sizeof (uint64_t));
+
+	while ((rv = pmx_reader_next(pr, &rec)) == 1) {
+		(void) memset(&dv, 0, sizeof (dv));
+		(void) memset(&de, 0, sizeof (de));
+		switch (rec.pxr_type) {
+		case PMXR_NAME:
+			dx->dx_names = df_grow(dx->dx_names, &dx->dx_nnames,
+			    rec.pxr_id, sizeof (uint64_t));
+			dx->dx_names[rec.pxr_id] = df_hash(
+			    rec.pxr_str.pxsv_ptr, rec.pxr_str.pxsv_len);
+			break;
+
+		case PMXR_CONTENT:
+			dx->dx_contents = df_grow(dx->dx_contents,
+			    &dx->dx_ncontents, rec.pxr_id, sizeof (uint32_t));
+			dx->dx_contents[rec.pxr_id] =
+			    rec.pxr_str.pxsv_len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)rec.pxr_str.pxsv_len;
+			de.de_key = rec.pxr_id;
+			de.de_kind = DK_CONTENT;
+			de.de_value = rec.pxr_offset;
+			xs_add(&dx->dx_dict, &de);
+			break;
+
+		case PMXR_STRING:
+			len = 0;
+			de.de_key = rec.pxr_ident;
+			if (rec.pxr_hascontent) {
+				de.de_kind = DK_STRINGREF;
+				de.de_value = rec.pxr_id;
+				if (rec.pxr_id < dx->dx_ncontents) {
+					len = dx->dx_contents[rec.pxr_id];
+				}
+			} else {
+				len = rec.pxr_str.pxsv_len;
+				de.de_kind = DK_STRING;
+				de.de_value = rec.pxr_offset;
+			}
+
+			xs_add(&dx->dx_dict, &de);
+			len = 2 * DF_WORD + (len + DF_WORD - 1) /
+			    DF_WORD * DF_WORD;
+			dv.dv_ident = rec.pxr_ident;
+			dv.dv_type = DF_STRING;
+			dv.dv_size = len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)len;
+			xs_add(&dx->dx_values, &dv);
+			break;
+
+		case PMXR_EDGES:
+			/*
+			 * A node's edges are written just before it, possibly
+			 * in several records.
+			 */
+			if (rec.pxr_ident != edgesrc || nedges == 0) {
+				edgesrc = rec.pxr_ident;
+				shape = 0;
+				nedges = 0;
+			}
+
+			for (e = 0; e < rec.pxr_nedges; e++) {
+				if (rec.pxr_edges[e].pxre_kind == 1 &&
+				    rec.pxr_edges[e].pxre_key <
+				    dx->dx_nnames) {
+					shape = df_mix(shape, dx->dx_names[
+					    rec.pxr_edges[e].pxre_key]);
+				}
+			}
+
+			nedges += rec.pxr_nedges;
+			break;
+
+		case PMXR_NODE:
+			len = DF_WORD;
+			for (i = 0; i < PMXR_MAXFIELDS; i++) {
+				if ((rec.pxr_fieldmask & (1U << i)) != 0) {
+					len += DF_WORD;
+				}
+			}
+
+			dv.dv_ident = rec.pxr_ident;
+			dv.dv_type = rec.pxr_subtype;
+			if (nedges != 0 && edgesrc == rec.pxr_ident) {
+				len += nedges * DF_WORD;
+				dv.dv_shape = shape;
+			}
+
+			nedges = 0;
+			dv.dv_size = len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)len;
+
+			/*
+			 * Objects are grouped by constructor and closures by
+			 * function.  Closures, functions, and flat strings are
+			 * also needed to find their names.
+			 */
+			de.de_key = rec.pxr_ident;
+			switch (rec.pxr_subtype < DF_NTYPES ?
+			    df_roles[rec.pxr_subtype] : DF_ROLENONE) {
+			case DF_ROLEOBJECT:
+				if (rec.pxr_fieldmask & 0x1) {
+					dv.dv_ctor = rec.pxr_fields[0];
+				}
+				break;
+
+			case DF_ROLECLOSURE:
+				if (rec.pxr_fieldmask & 0x1) {
+					dv.dv_ctor = rec.pxr_fields[0];
+					de.de_kind = DK_CLOSURE;
+					de.de_value = rec.pxr_fields[0];
+				}
+				break;
+
+			case DF_ROLEFUNCINFO:
+				if (rec.pxr_fieldmask & 0x1) {
+					de.de_kind = DK_FUNCINFO;
+					de.de_value = rec.pxr_fields[0];
+				}
+				break;
+
+			case DF_ROLEFLAT:
+				if (rec.pxr_fieldmask & 0x2) {
+					de.de_kind = DK_FLAT;
+					de.de_value = rec.pxr_fields[1];
+				}
+				break;
+
+			default:
+				break;
+			}
+
+			if (de.de_kind != 0) {
+				xs_add(&dx->dx_dict, &de);
+			}
+
+			if (dv.dv_ctor != 0) {
+				(void) ht_lookup(&dx->dx_ctors, dv.dv_ctor, 0,
+				    1);
+			}
+
+			xs_add(&dx->dx_values, &dv);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (rv != 0) {
+		errx(EXIT_FAILURE, "read \"%s\": %s", dx->dx_path,
+		    pmx_reader_errmsg(pr));
+	}
+
+	pmx_reader_close(pr);
+
+	/*
+	 * Write out the sorted dictionary so that it can be searched, and
+	 * then resolve the names.
+	 */
+	xs_sort(&dx->dx_dict);
+	if ((dx->dx_dictfp = tmpfile()) == NULL) {
+		err(EXIT_FAILURE, "create temporary file");
+	}
+
+	while (xs_next(&dx->dx_dict, &de)) {
+		if (fwrite(&de, sizeof (de), 1, dx->dx_dictfp) != 1) {
+			err(EXIT_FAILURE, "write temporary file");
+		}
+
+		dx->dx_ndict++;
+	}
+
+	xs_fini(&dx->dx_dict);
+	if (fflush(dx->dx_dictfp) != 0) {
+		err(EXIT_FAILURE, "write temporary file");
+	}
+
+	df_resolve(dx, names, &buf, &bufsz);
+	(void) fclose(dx->dx_dictfp);
+	dx->dx_dictfp = NULL;
+	free(buf);
+
+	xs_sort(&dx->dx_values);
+}
+
+/*
+ * Finds the name of each constructor and function referred to by this
+ * export's values.
+ */
+static void
+df_resolve(dexport_t *dx, htab_t *names, char **bufp, size_t *bufszp)
+{
+	htab_t *ctors = &dx->dx_ctors;
+	dentry_t de;
+	uint64_t key, *hashp;
+	size_t slot, len;
+	int hop, found;
+
+	for (slot = 0; slot < ctors->ht_nslots; slot++) {
+		if (!ctors->ht_used[slot]) {
+			continue;
+		}
+
+		key = ctors->ht_keys[2 * slot];
+		hashp = (uint64_t *)(ctors->ht_vals +
+		    slot * ctors->ht_valsize);
+		found = 0;
+		for (hop = 0; hop < DF_MAXHOPS && !found; hop++) {
+			if (df_lookup(dx, key, 0, &de) != 0) {
+				break;
+			}
+
+			switch (de.de_kind) {
+			case DK_CLOSURE:
+			case DK_FUNCINFO:
+			case DK_FLAT:
+				key = de.de_value;
+				continue;
+
+			case DK_STRINGREF:
+				if (df_lookup(dx, de.de_value, DK_CONTENT,
+				    &de) != 0) {
+					break;
+				}
+				/*FALLTHROUGH*/
+			case DK_STRING:
+				if (df_readstr(dx, de.de_value, bufp, bufszp,
+				    &len) == 0) {
+					found = 1;
+				}
+				break;
+
+			default:
+				break;
+			}
+
+			break;
+		}
+
+		if (!found) {
+			dx->dx_nunknown++;
+			*hashp = df_name(names, DF_UNKNOWN,
+			    strlen(DF_UNKNOWN));
+		} else if (len == 0) {
+			*hashp = df_name(names, DF_ANONYMOUS,
+			    strlen(DF_ANONYMOUS));
+		} else {
+			*hashp = df_name(names, *bufp, len);
+		}
+	}
+}
+
+/*
+ * Searches the dictionary for an entry with the given key.  If "kind" is
+ * zero, this finds an entry for a value (any kind other than DK_CONTENT).
+ */
+static int
+df_lookup(dexport_t *dx, uint64_t key, int kind, dentry_t *dep)
+{
+	uint64_t lo = 0, hi = dx->dx_ndict, mid;
+	int fd = fileno(dx->dx_dictfp);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pread(fd, dep, sizeof (*dep), (off_t)(mid *
+		    sizeof (*dep))) != sizeof (*dep)) {
+			err(EXIT_FAILURE, "read temporary file");
+		}
+
+		if (dep->de_key < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < dx->dx_ndict; lo++) {
+		if (pread(fd, dep, sizeof (*dep), (off_t)(lo *
+		    sizeof (*dep))) != sizeof (*dep)) {
+			err(EXIT_FAILURE, "read temporary file");
+		}
+
+		if (dep->de_key != key) {
+			break;
+		}
+
+		if (kind == 0 ? dep->de_kind != DK_CONTENT :
+		    dep->de_kind == (uint64_t)kind) {
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * Reads the string or content record at offset "off" of the export, and
+ * stores its (decoded) contents in *bufp and their length in *lenp.
+ */
+static int
+df_readstr(dexport_t *dx, uint64_t off, char **bufp, size_t *bufszp,
+    size_t *lenp)
+{
+	pmx_reader_t *pr;
+	pmx_record_t rec;
+	char *nl = NULL;
+	ssize_t rv;
+	size_t n = 0;
+	int status = -1;
+
+	/*
+	 * Read until the end of the line.  The buffer is twice as large as
+	 * what's read so that the decoded string fits after it.
+	 */
+	for (;;) {
+		if (2 * (n + 256) > *bufszp) {
+			*bufszp = *bufszp == 0 ? 1024 : 2 * *bufszp;
+			if ((*bufp = realloc(*bufp, *bufszp)) == NULL) {
+				err(EXIT_FAILURE, "realloc");
+			}
+			continue;
+		}
+
+		rv = pread(dx->dx_fd, *bufp + n, 256, (off_t)(off + n));
+		if (rv < 0) {
+			err(EXIT_FAILURE, "read \"%s\"", dx->dx_path);
+		}
+
+		if (rv == 0 ||
+		    (nl = memchr(*bufp + n, '\n', (size_t)rv)) != NULL) {
+			n += (size_t)rv;
+			break;
+		}
+
+		n += (size_t)rv;
+	}
+
+	if (nl != NULL) {
+		n = (size_t)(nl - *bufp) + 1;
+	}
+
+	if ((pr = pmx_reader_open_buf(*bufp, n)) == NULL) {
+		err(EXIT_FAILURE, "pmx_reader_open_buf");
+	}
+
+	if (pmx_reader_next(pr, &rec) == 1 &&
+	    (rec.pxr_type == PMXR_CONTENT ||
+	    (rec.pxr_type == PMXR_STRING && !rec.pxr_hascontent))) {
+		*lenp = rec.pxr_str.pxsv_len;
+		if (pmx_strview_decode(&rec.pxr_str, *bufp + n, lenp) == 0) {
+			(void) memmove(*bufp, *bufp + n, *lenp);
+			status = 0;
+		}
+	}
+
+	pmx_reader_close(pr);
+	return (status);
+}
+
+/*
+ * Merges the sorted summaries of the two exports' values, matching values by
+ * ident and signature, and totals them by type and by constructor.
+ */
+static void
+df_join(dexport_t *dx, htab_t *names, dgroup_t *types, htab_t *groups)
+{
+	dvalue_t dv[2];
+	uint64_t sig[2];
+	int have[2], matched;
+
+	have[0] = xs_next(&dx[0].dx_values, &dv[0]);
+	have[1] = xs_next(&dx[1].dx_values, &dv[1]);
+	while (have[0] || have[1]) {
+		if (have[0] && (!have[1] ||
+		    dv[0].dv_ident < dv[1].dv_ident)) {
+			df_account(dx, 0, &dv[0], 0, names, types, groups,
+			    &sig[0]);
+			have[0] = xs_next(&dx[0].dx_values, &dv[0]);
+		} else if (have[1] && (!have[0] ||
+		    dv[1].dv_ident < dv[0].dv_ident)) {
+			df_account(dx, 1, &dv[1], 0, names, types, groups,
+			    &sig[1]);
+			have[1] = xs_next(&dx[1].dx_values, &dv[1]);
+		} else {
+			/*
+			 * The same ident appears in both exports, so the
+			 * values match if their signatures do.
+			 */
+			df_account(dx, 0, &dv[0], -1, names, NULL, NULL,
+			    &sig[0]);
+			df_account(dx, 1, &dv[1], -1, names, NULL, NULL,
+			    &sig[1]);
+			matched = sig[0] == sig[1];
+			df_account(dx, 0, &dv[0], matched, names, types,
+			    groups, &sig[0]);
+			df_account(dx, 1, &dv[1], matched, names, types,
+			    groups, &sig[1]);
+			have[0] = xs_next(&dx[0].dx_values, &dv[0]);
+			have[1] = xs_next(&dx[1].dx_values, &dv[1]);
+		}
+	}
+}
+
+/*
+ * Computes the signature of value "dv" from export "which", and unless
+ * "matched" is -1, adds it to the totals for its type and its constructor.
+ * "matched" says whether it matched a value in the other export.
+ */
+static void
+df_account(dexport_t *dx, int which, const dvalue_t *dv, int matched,
+    htab_t *names, dgroup_t *types, htab_t *groups, uint64_t *sigp)
+{
+	uint64_t name = 0, *namep;
+	dgroup_t *groupps[2];
+	int i;
+
+	if (dv->dv_ctor != 0) {
+		namep = ht_lookup(&dx[which].dx_ctors, dv->dv_ctor, 0, 0);
+		name = namep == NULL ? 0 : *namep;
+	} else if (df_roles[dv->dv_type] == DF_ROLEOBJECT ||
+	    df_roles[dv->dv_type] == DF_ROLECLOSURE) {
+		name = df_name(names, DF_NONAME, strlen(DF_NONAME));
+	}
+
+	*sigp = df_mix(df_mix(dv->dv_type, name), dv->dv_shape);
+	if (matched == -1) {
+		return;
+	}
+
+	groupps[0] = &types[dv->dv_type & (DF_NTYPES - 1)];
+	groupps[1] = name == 0 ? NULL :
+	    ht_lookup(groups, dv->dv_type, name, 1);
+	for (i = 0; i < 2; i++) {
+		if (groupps[i] == NULL) {
+			continue;
+		}
+
+		groupps[i]->dg_count[which]++;
+		groupps[i]->dg_size[which] += dv->dv_size;
+		if (!matched) {
+			if (which == 0) {
+				groupps[i]->dg_freed++;
+			} else {
+				groupps[i]->dg_new++;
+			}
+		}
+	}
+}
+
+/*
+ * Prints the totals for each type, and for the "ntop" constructors and
+ * functions whose values grew the most.
+ */
+static void
+df_report(htab_t *names, dgroup_t *types, htab_t *groups, size_t ntop)
+{
+	dreport_t *reps;
+	dgroup_t total;
+	size_t slot, n, i;
+	char **namep;
+
+	reps = df_alloc(DF_NTYPES, sizeof (dreport_t));
+	(void) memset(&total, 0, sizeof (total));
+	for (i = 0, n = 0; i < DF_NTYPES; i++) {
+		if (types[i].dg_count[0] == 0 && types[i].dg_count[1] == 0) {
+			continue;
+		}
+
+		reps[n].dr_type = (uint32_t)i;
+		reps[n++].dr_group = types[i];
+		total.dg_count[0] += types[i].dg_count[0];
+		total.dg_count[1] += types[i].dg_count[1];
+		total.dg_size[0] += types[i].dg_size[0];
+		total.dg_size[1] += types[i].dg_size[1];
+		total.dg_new += types[i].dg_new;
+		total.dg_freed += types[i].dg_freed;
+	}
+
+	qsort(reps, n, sizeof (dreport_t), df_cmpreport);
+	df_print(NULL, "TYPE", NULL);
+	for (i = 0; i < n; i++) {
+		df_print(&reps[i].dr_group, df_typename(reps[i].dr_type),
+		    NULL);
+	}
+
+	df_print(&total, "total", NULL);
+	free(reps);
+
+	reps = df_alloc(groups->ht_nused, sizeof (dreport_t));
+	for (slot = 0, n = 0; slot < groups->ht_nslots; slot++) {
+		if (!groups->ht_used[slot]) {
+			continue;
+		}
+
+		reps[n].dr_type = (uint32_t)groups->ht_keys[2 * slot];
+		reps[n].dr_name = groups->ht_keys[2 * slot + 1];
+		(void) memcpy(&reps[n++].dr_group, groups->ht_vals +
+		    slot * groups->ht_valsize, sizeof (dgroup_t));
+	}
+
+	qsort(reps, n, sizeof (dreport_t), df_cmpreport);
+	(void) printf("\n");
+	df_print(NULL, "TYPE", "CONSTRUCTOR OR FUNCTION");
+	for (i = 0; i < ntop && i < n; i++) {
+		namep = ht_lookup(names, reps[i].dr_name, 0, 0);
+		df_print(&reps[i].dr_group, df_typename(reps[i].dr_type),
+		    namep == NULL ? DF_UNKNOWN : *namep);
+	}
+
+	free(reps);
+}
+
+static void
+df_print(const dgroup_t *dg, const char *label, const char *name)
+{
+	if (dg == NULL) {
+		(void) printf("%10s %10s %10s %12s %12s %12s %10s %10s",
+		    "COUNT1", "COUNT2", "DELTA", "SIZE1", "SIZE2", "DELTA",
+		    "NEW", "FREED");
+	} else {
+		(void) printf("%10" PRIu64 " %10" PRIu64 " %+10" PRId64
+		    " %12" PRIu64 " %12" PRIu64 " %+12" PRId64 " %10" PRIu64
+		    " %10" PRIu64, dg->dg_count[0], dg->dg_count[1],
+		    (int64_t)(dg->dg_count[1] - dg->dg_count[0]),
+		    dg->dg_size[0], dg->dg_size[1],
+		    (int64_t)(dg->dg_size[1] - dg->dg_size[0]),
+		    dg->dg_new, dg->dg_freed);
+	}
+
+	if (name != NULL) {
+		(void) printf(" %-11s %s\n", label, name);
+	} else {
+		(void) printf(" %s\n", label);
+	}
+}
+
+/*
+ * Orders groups by how much they grew, then by how many values were added,
+ * and then by type and name (so that the output is stable).
+ */
+static int
+df_cmpreport(const void *a, const void *b)
+{
+	const dreport_t *ra = a, *rb = b;
+	int64_t da, db;
+
+	da = (int64_t)(ra->dr_group.dg_size[1] - ra->dr_group.dg_size[0]);
+	db = (int64_t)(rb->dr_group.dg_size[1] - rb->dr_group.dg_size[0]);
+	if (da != db) {
+		return (da > db ? -1 : 1);
+	}
+
+	da = (int64_t)(ra->dr_group.dg_count[1] - ra->dr_group.dg_count[0]);
+	db = (int64_t)(rb->dr_group.dg_count[1] - rb->dr_group.dg_count[0]);
+	if (da != db) {
+		return (da > db ? -1 : 1);
+	}
+
+	if (ra->dr_type != rb->dr_type) {
+		return (ra->dr_type < rb->dr_type ? -1 : 1);
+	}
+
+	if (ra->dr_name != rb->dr_name) {
+		return (ra->dr_name < rb->dr_name ? -1 : 1);
+	}
+
+	return (0);
+}
+
+static const char *
+df_typename(uint32_t type)
+{
+	const char *name;
+
+	if (type == DF_STRING) {
+		return ("string");
+	}
+
+	name = pmx_node_typename(type);
+	return (name == NULL ? "unknown" : name);
+}
+
+static void
+df_fini(dexport_t *dx)
+{
+	xs_fini(&dx->dx_values);
+	ht_fini(&dx->dx_ctors);
+	free(dx->dx_names);
+	free(dx->dx_contents);
+	(void) close(dx->dx_fd);
+}
+
+static void
+xs_init(xsort_t *xs, size_t recsize, size_t memsz)
+{
+	(void) memset(xs, 0, sizeof (*xs));
+	xs->xs_recsize = recsize;
+	xs->xs_cap = memsz / recsize;
+	if (xs->xs_cap == 0) {
+		xs->xs_cap = 1;
+	}
+
+	xs->xs_buf = df_alloc(xs->xs_cap, recsize);
+}
+
+static void
+xs_add(xsort_t *xs, const void *rec)
+{
+	if (xs->xs_n == xs->xs_cap) {
+		xs_spill(xs);
+	}
+
+	(void) memcpy(xs->xs_buf + xs->xs_n * xs->xs_recsize, rec,
+	    xs->xs_recsize);
+	xs->xs_n++;
+	xs->xs_nrecs++;
+}
+
+/*
+ * Sorts the buffered records and appends them to the file as a new run.
+ */
+static void
+xs_spill(xsort_t *xs)
+{
+	if (xs->xs_fp == NULL && (xs->xs_fp = tmpfile()) == NULL) {
+		err(EXIT_FAILURE, "create temporary file");
+	}
+
+	xs->xs_runstart = realloc(xs->xs_runstart,
+	    (xs->xs_nruns + 1) * sizeof (uint64_t));
+	if (xs->xs_runstart == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	xs->xs_runstart[xs->xs_nruns++] = xs->xs_nrecs - xs->xs_n;
+	qsort(xs->xs_buf, xs->xs_n, xs->xs_recsize, xs_cmp);
+	if (fwrite(xs->xs_buf, xs->xs_recsize, xs->xs_n, xs->xs_fp) !=
+	    xs->xs_n) {
+		err(EXIT_FAILURE, "write temporary file");
+	}
+
+	xs->xs_n = 0;
+}
+
+/*
+ * Finishes adding records, and prepares to return them in order with
+ * xs_next().
+ */
+static void
+xs_sort(xsort_t *xs)
+{
+	size_t i, per;
+
+	if (xs->xs_fp == NULL) {
+		qsort(xs->xs_buf, xs->xs_n, xs->xs_recsize, xs_cmp);
+		xs->xs_pos = 0;
+		return;
+	}
+
+	if (xs->xs_n > 0) {
+		xs_spill(xs);
+	}
+
+	if (fflush(xs->xs_fp) != 0) {
+		err(EXIT_FAILURE, "write temporary file");
+	}
+
+	/*
+	 * The buffer is divided evenly among the runs.
+	 */
+	per = xs->xs_cap / xs->xs_nruns;
+	if (per == 0) {
+		errx(EXIT_FAILURE, "too many values to sort with this much "
+		    "memory (use -m)");
+	}
+
+	xs->xs_runs = df_alloc(xs->xs_nruns, sizeof (xrun_t));
+	xs->xs_heap = df_alloc(xs->xs_nruns, sizeof (size_t));
+	for (i = 0; i < xs->xs_nruns; i++) {
+		xs->xs_runs[i].xr_next = xs->xs_runstart[i];
+		xs->xs_runs[i].xr_end = i + 1 < xs->xs_nruns ?
+		    xs->xs_runstart[i + 1] : xs->xs_nrecs;
+		xs->xs_runs[i].xr_buf = xs->xs_buf + i * per * xs->xs_recsize;
+		xs->xs_runs[i].xr_cap = per;
+		xs_fill(xs, &xs->xs_runs[i]);
+		xs->xs_heap[xs->xs_nheap++] = i;
+	}
+
+	for (i = xs->xs_nheap / 2; i > 0; i--) {
+		xs_siftdown(xs, i - 1);
+	}
+}
+
+/*
+ * Copies the next record in order into "rec".  Returns 1 if there was one, or
+ * 0 if all records have been returned.
+ */
+static int
+xs_next(xsort_t *xs, void *rec)
+{
+	xrun_t *xr;
+
+	if (xs->xs_fp == NULL) {
+		if (xs->xs_pos == xs->xs_n) {
+			return (0);
+		}
+
+		(void) memcpy(rec, xs->xs_buf + xs->xs_pos++ * xs->xs_recsize,
+		    xs->xs_recsize);
+		return (1);
+	}
+
+	if (xs->xs_nheap == 0) {
+		return (0);
+	}
+
+	xr = &xs->xs_runs[xs->xs_heap[0]];
+	(void) memcpy(rec, xr->xr_buf + xr->xr_pos++ * xs->xs_recsize,
+	    xs->xs_recsize);
+	if (xr->xr_pos == xr->xr_nbuf) {
+		xs_fill(xs, xr);
+		if (xr->xr_nbuf == 0) {
+			xs->xs_heap[0] = xs->xs_heap[--xs->xs_nheap];
+		}
+	}
+
+	xs_siftdown(xs, 0);
+	return (1);
+}
+
+/*
+ * Reads the next part of a run into its buffer.
+ */
+static void
+xs_fill(xsort_t *xs, xrun_t *xr)
+{
+	size_t n, len, done;
+	ssize_t rv;
+
+	n = xr->xr_end - xr->xr_next < xr->xr_cap ?
+	    (size_t)(xr->xr_end - xr->xr_next) : xr->xr_cap;
+	len = n * xs->xs_recsize;
+	for (done = 0; done < len; done += (size_t)rv) {
+		rv = pread(fileno(xs->xs_fp), xr->xr_buf + done, len - done,
+		    (off_t)(xr->xr_next * xs->xs_recsize + done));
+		if (rv <= 0) {
+			if (rv < 0 && errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+
+			err(EXIT_FAILURE, "read temporary file");
+		}
+	}
+
+	xr->xr_next += n;
+	xr->xr_nbuf = n;
+	xr->xr_pos = 0;
+}
+
+static void
+xs_siftdown(xsort_t *xs, size_t i)
+{
+	size_t child, tmp;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= xs->xs_nheap) {
+			break;
+		}
+
+		if (child + 1 < xs->xs_nheap &&
+		    xs_cmp(xs_head(xs, child + 1), xs_head(xs, child)) < 0) {
+			child++;
+		}
+
+		if (xs_cmp(xs_head(xs, child), xs_head(xs, i)) >= 0) {
+			break;
+		}
+
+		tmp = xs->xs_heap[i];
+		xs->xs_heap[i] = xs->xs_heap[child];
+		xs->xs_heap[child] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * Returns the next record of the run at position "i" of the heap.
+ */
+static const uint8_t *
+xs_head(xsort_t *xs, size_t i)
+{
+	xrun_t *xr = &xs->xs_runs[xs->xs_heap[i]];
+
+	return (xr->xr_buf + xr->xr_pos * xs->xs_recsize);
+}
+
+static int
+xs_cmp(const void *a, const void *b)
+{
+	const uint64_t *ka = a, *kb = b;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (ka[i] != kb[i]) {
+			return (ka[i] < kb[i] ? -1 : 1);
+		}
+	}
+
+	return (0);
+}
+
+static void
+xs_fini(xsort_t *xs)
+{
+	free(xs->xs_buf);
+	free(xs->xs_runstart);
+	free(xs->xs_runs);
+	free(xs->xs_heap);
+	if (xs->xs_fp != NULL) {
+		(void) fclose(xs->xs_fp);
+	}
+
+	(void) memset(xs, 0, sizeof (*xs));
+}
+
+static void
+ht_init(htab_t *ht, size_t valsize)
+{
+	(void) memset(ht, 0, sizeof (*ht));
+	ht->ht_valsize = valsize;
+	ht->ht_nslots = DF_HTINITCAP;
+	ht->ht_keys = df_alloc(2 * ht->ht_nslots, sizeof (uint64_t));
+	ht->ht_used = df_alloc(ht->ht_nslots, 1);
+	ht->ht_vals = df_alloc(ht->ht_nslots, valsize);
+}
+
+/*
+ * Returns a pointer to the value stored with keys "k1" and "k2".  If there
+ * isn't one, this returns NULL unless "create" is set, in which case a
+ * zero-filled value is added.  Adding a value invalidates pointers returned
+ * earlier.
+ */
+static void *
+ht_lookup(htab_t *ht, uint64_t k1, uint64_t k2, int create)
+{
+	htab_t old;
+	size_t slot, i;
+	void *val;
+
+	slot = (size_t)df_mix(k1, k2) & (ht->ht_nslots - 1);
+	while (ht->ht_used[slot]) {
+		if (ht->ht_keys[2 * slot] == k1 &&
+		    ht->ht_keys[2 * slot + 1] == k2) {
+			return (ht->ht_vals + slot * ht->ht_valsize);
+		}
+
+		slot = (slot + 1) & (ht->ht_nslots - 1);
+	}
+
+	if (!create) {
+		return (NULL);
+	}
+
+	if (2 * (ht->ht_nused + 1) > ht->ht_nslots) {
+		old = *ht;
+		ht->ht_nslots *= 2;
+		ht->ht_nused = 0;
+		ht->ht_keys = df_alloc(2 * ht->ht_nslots, sizeof (uint64_t));
+		ht->ht_used = df_alloc(ht->ht_nslots, 1);
+		ht->ht_vals = df_alloc(ht->ht_nslots, ht->ht_valsize);
+		for (i = 0; i < old.ht_nslots; i++) {
+			if (!old.ht_used[i]) {
+				continue;
+			}
+
+			val = ht_lookup(ht, old.ht_keys[2 * i],
+			    old.ht_keys[2 * i + 1], 1);
+			(void) memcpy(val, old.ht_vals + i * old.ht_valsize,
+			    old.ht_valsize);
+		}
+
+		ht_fini(&old);
+		return (ht_lookup(ht, k1, k2, 1));
+	}
+
+	ht->ht_used[slot] = 1;
+	ht->ht_keys[2 * slot] = k1;
+	ht->ht_keys[2 * slot + 1] = k2;
+	ht->ht_nused++;
+	return (ht->ht_vals + slot * ht->ht_valsize);
+}
+
+static void
+ht_fini(htab_t *ht)
+{
+	free(ht->ht_keys);
+	free(ht->ht_used);
+	free(ht->ht_vals);
+}
@@ -9,7 +9,8 @@
  */
 
 /*
- * pmxemit.c: use libpmx to emit a sample postmortem export.
+ * pmxemit.c: use libpmx to emit a sample postmortem export, or a generated
+ * one of any size (see pmxgen.c).
  *
  * This program should not use private libpmx functions.
  */
@@ -21,30 +22,168 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <pmx/pmx.h>
+#include "pmxgen.h"
 
 #define	EXIT_USAGE 2
 
+static void emit_sample(pmx_stream_t *);
+static void print_stats(pmx_stream_t *);
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr,
+	    "usage: pmxemit [-f json|binary|sqlite|null] [-o OUTPUT [-m]] "
+	    "[-st] [-z [-i INDEX]]\n"
+	    "               [-g NAME=VALUE[,NAME=VALUE...]]\n");
+	exit(EXIT_USAGE);
+}
+
 int
-main(int argc __attribute__((__unused__)),
-    char *argv[] __attribute__((__unused__)))
+main(int argc, char *argv[])
 {
 	pmx_stream_t *pmxp;
+	pmx_format_t format = PMXF_JSON;
+	pmx_compress_t compress = PMXC_NONE;
+	int async = 0;
+	int mapped = 0;
+	int stats = 0;
+	const char *outpath = NULL;
+	const char *indexpath = NULL;
+	const char *genspec = NULL;
+	pmxgen_params_t genparams;
+	char genstr[256];
+	FILE *outfp = stdout;
+	FILE *indexfp = NULL;
 	time_t nowt;
-	struct timespec ts;
 	struct tm nowtm;
 	char nowstr[sizeof ("2016-08-29T00:00:00Z")];
+	int c;
+
+	pmxgen_defaults(&genparams);
+	while ((c = getopt(argc, argv, "f:g:i:mo:stz")) != -1) {
+		switch (c) {
+		case 'f':
+			if (strcmp(optarg, "json") == 0) {
+				format = PMXF_JSON;
+			} else if (strcmp(optarg, "binary") == 0) {
+				format = PMXF_BINARY;
+			} else if (strcmp(optarg, "sqlite") == 0) {
+				format = PMXF_SQLITE;
+			} else if (strcmp(optarg, "null") == 0) {
+				format = PMXF_NULL;
+			} else {
+				warnx("unsupported format: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'g':
+			genspec = optarg;
+			if (pmxgen_parse(&genparams, optarg) != 0) {
+				usage();
+			}
+			break;
+
+		case 'i':
+			indexpath = optarg;
+			break;
+
+		case 'm':
+			mapped = 1;
+			break;
+
+		case 'o':
+			outpath = optarg;
+			break;
+
+		case 's':
+			stats = 1;
+			break;
+
+		case 't':
+			async = 1;
+			break;
+
+		case 'z':
+			compress = PMXC_GZIP;
+			break;
+
+		default:
+			usage();
+		}
+	}
 
-	if (argc != 1) {
-		errx(EXIT_USAGE, "no arguments expected");
+	if (optind != argc) {
+		usage();
+	}
+
+	if (indexpath != NULL && compress == PMXC_NONE) {
+		warnx("-i requires -z");
+		usage();
+	}
+
+	if (compress != PMXC_NONE &&
+	    format != PMXF_JSON && format != PMXF_BINARY) {
+		warnx("-z is only supported for json and binary output");
+		usage();
+	}
+
+	if (async && format != PMXF_JSON && format != PMXF_BINARY) {
+		warnx("-t is only supported for json and binary output");
+		usage();
+	}
+
+	if (mapped && (outpath == NULL || compress != PMXC_NONE ||
+	    (format != PMXF_JSON && format != PMXF_BINARY))) {
+		warnx("-m requires -o and uncompressed json or binary output");
+		usage();
+	}
+
+	if (format == PMXF_SQLITE) {
+		if (outpath == NULL) {
+			warnx("-o is required for sqlite output");
+			usage();
+		}
+
+		pmxp = pmx_create_stream_sqlite(outpath, stderr);
+	} else if (mapped) {
+		pmxp = pmx_create_stream_mmap(outpath, stderr, format,
+		    PMXM_SEQUENTIAL);
+	} else {
+		if (outpath != NULL &&
+		    (outfp = fopen(outpath, "w")) == NULL) {
+			err(EXIT_FAILURE, "open \"%s\"", outpath);
+		}
+
+		if (indexpath != NULL &&
+		    (indexfp = fopen(indexpath, "w")) == NULL) {
+			err(EXIT_FAILURE, "open \"%s\"", indexpath);
+		}
+
+		if (compress != PMXC_NONE) {
+			pmxp = pmx_create_stream_compressed(outfp, stderr,
+			    format, compress, indexfp);
+		} else {
+			pmxp = pmx_create_stream_format(outfp, stderr, format);
+		}
 	}
 
-	pmxp = pmx_create_stream(stdout, stderr);
 	if (pmxp == NULL) {
 		err(EXIT_FAILURE, "pmx_create_stream");
 	}
 
+	if (async && pmx_async_output(pmxp, 0) != 0) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	if (stats) {
+		pmx_stats_timing(pmxp);
+	}
+
 	(void) time(&nowt);
 	(void) gmtime_r(&nowt, &nowtm);
 	(void) strftime(nowstr, sizeof (nowstr), "%FT%TZ", &nowtm);
@@ -59,6 +198,32 @@ main(int argc __attribute__((__unused__)),
 	pmx_emit_metadata(pmxp, "version_minor", "1");
 	pmx_emit_metadata(pmxp, "target_source", "synthetic");
 
+	if (genspec != NULL) {
+		pmxgen_describe(&genparams, genstr, sizeof (genstr));
+		pmx_emit_metadata(pmxp, "generator_params", genstr);
+		pmxgen_emit(pmxp, &genparams);
+	} else {
+		emit_sample(pmxp);
+	}
+
+	pmx_done(pmxp);
+	if (pmx_errno(pmxp) != PMXE_OK) {
+		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+	}
+
+	if (stats) {
+		print_stats(pmxp);
+	}
+
+	pmx_free(pmxp);
+	return (0);
+}
+
+static void
+emit_sample(pmx_stream_t *pmxp)
+{
+	struct timespec ts;
+
 	/*
 	 * For this test, we make up an address space:
 	 *
@@ -80,12 +245,14 @@ main(int argc __attribute__((__unused__)),
 	 *	0x8000	flat string of length 6 with contents at 0x600
 	 *	0x9000	flat string of length 5 with contents at 0x700
 	 *	0xa000	cons string of length 11 from 0x8000 and 0x9000
-	 *	0xb000	an array with 3 elements: null, null, 0xa000
+	 *	0xb000	an array with 4 elements: null, the hole, 0xa000, 7
 	 *	0xc000	an object with null constructor
 	 *	0xd000	a chunk of function metadata for a function called
 	 *		"hello world" in a script called "world"
-	 *	0xe000	a closure for the function defined at 0xd000
-	 *	0xf000	an object constructed using the closure at 0xe000
+	 *	0xe000	a closure for the function defined at 0xd000, with
+	 *		variable "greeting" referring to 0xa000
+	 *	0xf000	an object constructed using the closure at 0xe000,
+	 *		with properties "message" (0xa000) and "value" (0x6000)
 	 */
 	pmx_emit_string_data(pmxp, 0x0100, strlen("null"), (uint8_t *)"null");
 	pmx_emit_string_data(pmxp, 0x0200, strlen("false"), (uint8_t *)"false");
@@ -113,12 +280,15 @@ main(int argc __attribute__((__unused__)),
 	pmx_emit_node_string_cons(pmxp, 0xa000, PMX_SMI_VALUE(11),
 	    0x8000, 0x9000);
 
-	pmx_array(pmxp, 0xb000, 3);
-	/* TODO */
+	pmx_array(pmxp, 0xb000, 4);
+	pmx_array_element(pmxp, 0xb000, 0x1000, 0, 0);
+	pmx_array_element(pmxp, 0xb000, 0x5000, 0, 1);
+	pmx_array_element(pmxp, 0xb000, 0xa000, 0, 2);
+	pmx_array_element(pmxp, 0xb000, PMX_SMI_VALUE(7), 1, 3);
 
 	pmx_object_start(pmxp, 0xc000);
 	pmx_object_constructor(pmxp, 0x1000);
-	pmx_object_done(pmxp);
+	pmx_object_done(pmxp, 0);
 
 	pmx_function_start(pmxp, 0xd000);
 	pmx_function_label(pmxp, 0xa000);
@@ -128,16 +298,60 @@ main(int argc __attribute__((__unused__)),
 
 	pmx_closure_start(pmxp, 0xe000, 0xd000);
 	pmx_closure_parent(pmxp, 0x0100);
+	pmx_closure_variable(pmxp, 0xa000, "greeting");
 	pmx_closure_done(pmxp);
 
 	pmx_object_start(pmxp, 0xf000);
 	pmx_object_constructor(pmxp, 0xe000);
-	pmx_object_done(pmxp);
+	pmx_object_property(pmxp, 0xf000, 0xa000, "message");
+	pmx_object_property(pmxp, 0xf000, 0x6000, "value");
+	pmx_object_done(pmxp, 2);
+}
 
-	if (pmx_errno(pmxp) != PMXE_OK) {
-		errx(EXIT_FAILURE, "%s", pmx_errmsg(pmxp));
+/*
+ * Prints a summary of what was emitted (see pmx_stats()) to stderr.
+ */
+static void
+print_stats(pmx_stream_t *pmxp)
+{
+	static const char *rectypes[PMXR_NTYPES] = {
+	    "metadata", "strings", "contents", "names", "nodes", "edges"
+	};
+	pmx_stats_t st;
+	const char *name;
+	unsigned int i;
+
+	pmx_stats(pmxp, &st);
+	(void) fprintf(stderr, "%-16s %12s %14s\n", "RECORDS", "COUNT",
+	    "BYTES");
+	for (i = 0; i < PMXR_NTYPES; i++) {
+		(void) fprintf(stderr, "%-16s %12llu %14llu\n", rectypes[i],
+		    (unsigned long long)st.pxst_nrecords[i],
+		    (unsigned long long)st.pxst_nbytes[i]);
 	}
 
-	pmx_free(pmxp);
-	return (0);
+	(void) fprintf(stderr, "\n%-16s %12s %14s\n", "NODES", "COUNT",
+	    "BYTES");
+	for (i = 0; i < PMX_NODE_NTYPES; i++) {
+		if ((name = pmx_node_typename(i)) == NULL) {
+			continue;
+		}
+
+		(void) fprintf(stderr, "%-16s %12llu %14llu\n", name,
+		    (unsigned long long)st.pxst_nnodes[i],
+		    (unsigned long long)st.pxst_nnodebytes[i]);
+	}
+
+	(void) fprintf(stderr, "\nstring contents: %llu bytes, "
+	    "%llu interned (%llu bytes saved)\n",
+	    (unsigned long long)st.pxst_nstringbytes,
+	    (unsigned long long)st.pxst_ninternhits,
+	    (unsigned long long)st.pxst_ninternsaved);
+	(void) fprintf(stderr, "output: %llu bytes (%llu after compression), "
+	    "%llu warnings\n", (unsigned long long)st.pxst_nbytesraw,
+	    (unsigned long long)st.pxst_nbytesout,
+	    (unsigned long long)st.pxst_nwarnings);
+	(void) fprintf(stderr, "time: %.3f ms elapsed, %.3f ms serializing, "
+	    "%.3f ms writing output\n", st.pxst_elapsed_ns / 1e6,
+	    st.pxst_serialize_ns / 1e6, st.pxst_output_ns / 1e6);
 }
@@ -0,0 +1,686 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxgen.c: generate synthetic heaps of any size for benchmarking.
+ *
+ * This program should not use private libpmx functions.
+ *
+ * With -g, pmxemit emits a heap generated from the parameters described in
+ * pmxgen_params[] instead of its small sample address space.  The heap is
+ * emitted the way an exporter walking a real heap would emit it: heap numbers,
+ * flat and cons strings, and small arrays are collected and passed to the
+ * batch interfaces, and the rest (along with some heap numbers and large
+ * arrays) are emitted one at a time, so that each backend and option can be
+ * measured on heaps of any size.  Everything is derived from the seed, so the
+ * same parameters always produce the same export.
+ *
+ * The heap starts with the oddballs and, for each of the "classes"
+ * constructors, a function (named "ClassN") and a closure.  After that, until
+ * "nodes" values have been emitted (counting string data as values), each step
+ * emits one of:
+ *
+ *     40%  an object of a random class (skewed toward the first classes),
+ *          whose properties (up to PG_MAXPROPS) depend on its class
+ *     15%  a heap number
+ *     12%  a string
+ *      8%  a flat string, along with its data
+ *      5%  a cons string, along with the tree of strings it's made of, up to
+ *          "consdepth" deep
+ *     10%  an array, with "arraylen" elements on average (and at most
+ *          "arraymax"), a quarter of them small integers
+ *      5%  a chain of up to "closuredepth" closures, each the parent of the
+ *          next, with a few variables
+ *      5%  a date
+ *
+ * String lengths are geometrically distributed, with mean "strlen" and
+ * maximum "strmax".  The contents are mostly ASCII letters and digits, with
+ * occasional characters that JSON must escape and multi-byte UTF-8
+ * characters.  "dupstrings" percent of strings repeat the contents of one of
+ * PG_NDUPS strings, for measuring pmx_intern_strings().
+ *
+ * Idents increase in the order values are emitted, as if the heap were walked
+ * in address order.  Each reference is to one of the last PG_NRECENT values
+ * emitted, so every reference resolves, and memory use doesn't depend on the
+ * size of the heap.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pmx/pmx.h>
+#include "pmxgen.h"
+
+/* Ident of the first value, and the distance between values. */
+#define	PG_BASE		0x100000
+#define	PG_STRIDE	0x20
+/* Number of recent values that references are made to (a power of 2). */
+#define	PG_NRECENT	65536
+/* Number of distinct contents repeated by "dupstrings". */
+#define	PG_NDUPS	1024
+/* Nodes collected for each call to a batch interface. */
+#define	PG_BATCH	256
+/* Array elements collected for each call to pmx_emit_arrays(). */
+#define	PG_NELEMENTS	16384
+/* Longest array collected for pmx_emit_arrays() (longer ones are streamed). */
+#define	PG_SMALLARRAY	64
+/* Number of names used for properties and variables. */
+#define	PG_NNAMES	32
+/* Most properties of any object. */
+#define	PG_MAXPROPS	12
+/* Longest encoding of a character in generated strings. */
+#define	PG_MAXCHAR	3
+
+/*
+ * Parameters, as given to -g.
+ */
+static const struct {
+	const char	*pgd_name;
+	size_t		pgd_offset;
+	uint64_t	pgd_default;
+	uint64_t	pgd_min;
+	uint64_t	pgd_max;
+} pmxgen_params[] = {
+	{ "nodes", offsetof(pmxgen_params_t, pgp_nodes),
+	    1000000, 1, UINT64_MAX / PG_STRIDE / 2 },
+	{ "seed", offsetof(pmxgen_params_t, pgp_seed), 1, 0, UINT64_MAX },
+	{ "strlen", offsetof(pmxgen_params_t, pgp_strlen), 16, 1, 1 << 20 },
+	{ "strmax", offsetof(pmxgen_params_t, pgp_strmax), 256, 1, 1 << 20 },
+	{ "dupstrings", offsetof(pmxgen_params_t, pgp_dupstrings),
+	    20, 0, 100 },
+	{ "consdepth", offsetof(pmxgen_params_t, pgp_consdepth), 4, 1, 16 },
+	{ "arraylen", offsetof(pmxgen_params_t, pgp_arraylen),
+	    8, 1, 1 << 20 },
+	{ "arraymax", offsetof(pmxgen_params_t, pgp_arraymax),
+	    1024, 1, 1 << 24 },
+	{ "closuredepth", offsetof(pmxgen_params_t, pgp_closuredepth),
+	    4, 1, 1024 },
+	{ "classes", offsetof(pmxgen_params_t, pgp_classes),
+	    64, 1, 1 << 20 },
+};
+
+#define	PG_NPARAMS	(sizeof (pmxgen_params) / sizeof (pmxgen_params[0]))
+#define	PG_PARAM(pgp, i)	\
+	((uint64_t *)((char *)(pgp) + pmxgen_params[(i)].pgd_offset))
+
+/*
+ * Characters used in strings: mostly these, and occasionally (1 in 64) one of
+ * the escaped or multi-byte characters below.
+ */
+static const char pg_alphabet[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 _";
+static const char *pg_special[] = {
+	"\"", "\\", "\n", "\t", "\xc3\xa9", "\xe2\x82\xac"
+};
+
+typedef struct {
+	const pmxgen_params_t *pg_params;
+	pmx_stream_t	*pg_stream;
+	uint64_t	pg_rand;		/* random number state */
+	uint64_t	pg_nvalues;		/* values emitted */
+	uint64_t	pg_nunique;		/* unique contents generated */
+	pmx_value_t	pg_undefined;
+	pmx_value_t	*pg_funcs;		/* each class's function */
+	pmx_value_t	*pg_ctors;		/* each class's constructor */
+	uint8_t		*pg_buf;		/* contents of a string */
+	char		pg_names[PG_NNAMES][8];
+	pmx_value_t	pg_recent[PG_NRECENT];
+
+	/* nodes collected for the batch interfaces */
+	pmx_heapnumber_t	pg_numbers[PG_BATCH];
+	size_t			pg_nnumbers;
+	pmx_string_flat_t	pg_flats[PG_BATCH];
+	size_t			pg_nflats;
+	pmx_string_cons_t	pg_conses[PG_BATCH];
+	size_t			pg_nconses;
+	pmx_array_t		pg_arrays[PG_BATCH];
+	size_t			pg_narrays;
+	pmx_value_t		pg_elements[PG_NELEMENTS];
+	uint8_t			pg_smi[PG_NELEMENTS];
+	size_t			pg_nelements;
+} pmxgen_t;
+
+static uint64_t pg_mix(uint64_t);
+static uint64_t pg_random(uint64_t *);
+static uint64_t pg_length(uint64_t *, uint64_t, uint64_t);
+static pmx_value_t pg_new(pmxgen_t *);
+static pmx_value_t pg_ref(pmxgen_t *);
+static void pg_prologue(pmxgen_t *);
+static pmx_value_t pg_string(pmxgen_t *, uint64_t *);
+static pmx_value_t pg_label(pmxgen_t *, const char *);
+static pmx_value_t pg_flat(pmxgen_t *, uint64_t *);
+static pmx_value_t pg_cons(pmxgen_t *, uint64_t, uint64_t *);
+static void pg_object(pmxgen_t *);
+static void pg_number(pmxgen_t *);
+static void pg_array(pmxgen_t *);
+static void pg_closures(pmxgen_t *);
+static void pg_date(pmxgen_t *);
+static void pg_flush(pmxgen_t *);
+
+void
+pmxgen_defaults(pmxgen_params_t *pgp)
+{
+	size_t i;
+
+	for (i = 0; i < PG_NPARAMS; i++) {
+		*PG_PARAM(pgp, i) = pmxgen_params[i].pgd_default;
+	}
+}
+
+/*
+ * Parses a comma-separated list of NAME=VALUE parameters, updating "pgp".
+ * Returns -1 (after printing a warning) if any are invalid.
+ */
+int
+pmxgen_parse(pmxgen_params_t *pgp, const char *spec)
+{
+	char *copy, *name, *value, *next, *endp;
+	unsigned long long v;
+	size_t i;
+	int rv = 0;
+
+	if ((copy = malloc(strlen(spec) + 1)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	(void) strcpy(copy, spec);
+
+	for (name = copy; name != NULL && rv == 0; name = next) {
+		if ((next = strchr(name, ',')) != NULL) {
+			*next++ = '\0';
+		}
+
+		if ((value = strchr(name, '=')) == NULL) {
+			warnx("generator parameter has no value: \"%s\"",
+			    name);
+			rv = -1;
+			break;
+		}
+
+		*value++ = '\0';
+		for (i = 0; i < PG_NPARAMS; i++) {
+			if (strcmp(name, pmxgen_params[i].pgd_name) == 0) {
+				break;
+			}
+		}
+
+		if (i == PG_NPARAMS) {
+			warnx("unknown generator parameter: \"%s\"", name);
+			rv = -1;
+			break;
+		}
+
+		v = strtoull(value, &endp, 0);
+		if (*value == '\0' || *endp != '\0' ||
+		    v < pmxgen_params[i].pgd_min ||
+		    v > pmxgen_params[i].pgd_max) {
+			warnx("generator parameter \"%s\" must be an integer "
+			    "from %" PRIu64 " to %" PRIu64, name,
+			    pmxgen_params[i].pgd_min,
+			    pmxgen_params[i].pgd_max);
+			rv = -1;
+			break;
+		}
+
+		*PG_PARAM(pgp, i) = v;
+	}
+
+	free(copy);
+	return (rv);
+}
+
+/*
+ * Describes the parameters in the same form that pmxgen_parse() accepts.
+ */
+void
+pmxgen_describe(const pmxgen_params_t *pgp, char *buf, size_t bufsz)
+{
+	size_t i, len = 0;
+	int n;
+
+	buf[0] = '\0';
+	for (i = 0; i < PG_NPARAMS && len < bufsz; i++) {
+		n = snprintf(buf + len, bufsz - len, "%s%s=%" PRIu64,
+		    i == 0 ? "" : ",", pmxgen_params[i].pgd_name,
+		    *PG_PARAM(pgp, i));
+		if (n < 0) {
+			break;
+		}
+
+		len += (size_t)n;
+	}
+}
+
+void
+pmxgen_emit(pmx_stream_t *pmxp, const pmxgen_params_t *pgp)
+{
+	pmxgen_t *pg;
+	uint64_t len, r;
+	size_t i;
+
+	if ((pg = calloc(1, sizeof (*pg))) == NULL ||
+	    (pg->pg_funcs = calloc(pgp->pgp_classes,
+	    sizeof (pmx_value_t))) == NULL ||
+	    (pg->pg_ctors = calloc(pgp->pgp_classes,
+	    sizeof (pmx_value_t))) == NULL ||
+	    (pg->pg_buf = malloc(pgp->pgp_strmax * PG_MAXCHAR)) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	pg->pg_params = pgp;
+	pg->pg_stream = pmxp;
+	pg->pg_rand = pg_mix(pgp->pgp_seed);
+	for (i = 0; i < PG_NNAMES; i++) {
+		(void) snprintf(pg->pg_names[i], sizeof (pg->pg_names[i]),
+		    "p%zu", i);
+	}
+
+	pg_prologue(pg);
+
+	while (pg->pg_nvalues < pgp->pgp_nodes) {
+		r = pg_random(&pg->pg_rand) % 100;
+		if (r < 40) {
+			pg_object(pg);
+		} else if (r < 55) {
+			pg_number(pg);
+		} else if (r < 67) {
+			(void) pg_string(pg, &len);
+		} else if (r < 75) {
+			(void) pg_flat(pg, &len);
+		} else if (r < 80) {
+			(void) pg_cons(pg, 1 + pg_random(&pg->pg_rand) %
+			    pgp->pgp_consdepth, &len);
+		} else if (r < 90) {
+			pg_array(pg);
+		} else if (r < 95) {
+			pg_closures(pg);
+		} else {
+			pg_date(pg);
+		}
+	}
+
+	pg_flush(pg);
+	free(pg->pg_buf);
+	free(pg->pg_ctors);
+	free(pg->pg_funcs);
+	free(pg);
+}
+
+/*
+ * Scrambles a 64-bit value (the finalizer of SplitMix64).
+ */
+static uint64_t
+pg_mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (x == 0 ? 1 : x);
+}
+
+/*
+ * Returns the next number from a xorshift64* generator.
+ */
+static uint64_t
+pg_random(uint64_t *statep)
+{
+	uint64_t x = *statep;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*statep = x;
+	return (x * 0x2545f4914f6cdd1dULL);
+}
+
+/*
+ * Returns a length from a geometric distribution with the given mean, capped
+ * at "max".
+ */
+static uint64_t
+pg_length(uint64_t *statep, uint64_t mean, uint64_t max)
+{
+	uint64_t len = 0;
+
+	while (len < max && pg_random(statep) % (mean + 1) != 0) {
+		len++;
+	}
+
+	return (len);
+}
+
+/*
+ * Allocates the ident of a new value.
+ */
+static pmx_value_t
+pg_new(pmxgen_t *pg)
+{
+	pmx_value_t ident = PG_BASE + pg->pg_nvalues * PG_STRIDE;
+
+	pg->pg_recent[pg->pg_nvalues++ & (PG_NRECENT - 1)] = ident;
+	return (ident);
+}
+
+/*
+ * Returns a recently-emitted value to refer to.
+ */
+static pmx_value_t
+pg_ref(pmxgen_t *pg)
+{
+	return (pg->pg_recent[pg_random(&pg->pg_rand) & (PG_NRECENT - 1)]);
+}
+
+/*
+ * Emits the oddballs and the functions and constructors for each class.
+ */
+static void
+pg_prologue(pmxgen_t *pg)
+{
+	pmx_stream_t *pmxp = pg->pg_stream;
+	pmx_value_t script, label;
+	char name[sizeof ("Class18446744073709551615")];
+	uint64_t k;
+	size_t i;
+
+	pg->pg_undefined = pg_new(pg);
+	pmx_emit_node_undefined(pmxp, pg->pg_undefined,
+	    pg_label(pg, "undefined"));
+	for (i = 0; i < PG_NRECENT; i++) {
+		pg->pg_recent[i] = pg->pg_undefined;
+	}
+
+	pmx_emit_node_null(pmxp, pg_new(pg), pg_label(pg, "null"));
+	pmx_emit_node_boolean(pmxp, pg_new(pg), PB_TRUE, pg_label(pg, "true"));
+	pmx_emit_node_boolean(pmxp, pg_new(pg), PB_FALSE,
+	    pg_label(pg, "false"));
+	pmx_emit_node_hole(pmxp, pg_new(pg), pg_label(pg, "the_hole"));
+
+	script = pg_label(pg, "synthetic.js");
+	for (k = 0; k < pg->pg_params->pgp_classes; k++) {
+		(void) snprintf(name, sizeof (name), "Class%" PRIu64, k);
+		label = pg_label(pg, name);
+		pg->pg_funcs[k] = pg_new(pg);
+		pmx_function_start(pmxp, pg->pg_funcs[k]);
+		pmx_function_label(pmxp, label);
+		pmx_function_script_name(pmxp, script);
+		pmx_function_position(pmxp, 100 * k);
+		pmx_function_done(pmxp);
+
+		pg->pg_ctors[k] = pg_new(pg);
+		pmx_closure_start(pmxp, pg->pg_ctors[k], pg->pg_funcs[k]);
+		pmx_closure_parent(pmxp, pg->pg_undefined);
+		pmx_closure_done(pmxp);
+	}
+}
+
+/*
+ * Emits string data with the given contents.
+ */
+static pmx_value_t
+pg_label(pmxgen_t *pg, const char *str)
+{
+	pmx_value_t ident = pg_new(pg);
+
+	pmx_emit_string_data(pg->pg_stream, ident, strlen(str),
+	    (const uint8_t *)str);
+	return (ident);
+}
+
+/*
+ * Emits string data with generated contents, and stores its length (in
+ * characters) in *lenp.
+ */
+static pmx_value_t
+pg_string(pmxgen_t *pg, uint64_t *lenp)
+{
+	const pmxgen_params_t *pgp = pg->pg_params;
+	pmx_value_t ident = pg_new(pg);
+	uint64_t state, r, i, len;
+	const char *special;
+	size_t nbytes = 0;
+
+	/*
+	 * Contents depend only on this state, so repeated contents come from
+	 * reusing one of PG_NDUPS states.
+	 */
+	r = pg_random(&pg->pg_rand);
+	if (r % 100 < pgp->pgp_dupstrings) {
+		state = pg_mix(pgp->pgp_seed ^ pg_mix((r >> 32) % PG_NDUPS));
+	} else {
+		state = pg_mix(pgp->pgp_seed ^
+		    pg_mix(PG_NDUPS + pg->pg_nunique++));
+	}
+
+	len = pg_length(&state, pgp->pgp_strlen, pgp->pgp_strmax);
+	for (i = 0; i < len; i++) {
+		r = pg_random(&state);
+		if ((r & 63) != 0) {
+			pg->pg_buf[nbytes++] = pg_alphabet[(r >> 8) & 63];
+		} else {
+			special = pg_special[(r >> 8) %
+			    (sizeof (pg_special) / sizeof (pg_special[0]))];
+			(void) memcpy(pg->pg_buf + nbytes, special,
+			    strlen(special));
+			nbytes += strlen(special);
+		}
+	}
+
+	pmx_emit_string_data(pg->pg_stream, ident, nbytes, pg->pg_buf);
+	*lenp = len;
+	return (ident);
+}
+
+static pmx_value_t
+pg_flat(pmxgen_t *pg, uint64_t *lenp)
+{
+	pmx_value_t data = pg_string(pg, lenp);
+	pmx_value_t ident = pg_new(pg);
+	pmx_string_flat_t *sf;
+
+	if (pg->pg_nflats == PG_BATCH) {
+		pg_flush(pg);
+	}
+
+	sf = &pg->pg_flats[pg->pg_nflats++];
+	sf->pxsf_ident = ident;
+	sf->pxsf_length = PMX_SMI_VALUE(*lenp);
+	sf->pxsf_data = data;
+	return (ident);
+}
+
+/*
+ * Emits a cons string made of a tree of cons strings "depth" deep (at most),
+ * whose leaves are flat strings.
+ */
+static pmx_value_t
+pg_cons(pmxgen_t *pg, uint64_t depth, uint64_t *lenp)
+{
+	pmx_value_t s1, s2, ident;
+	pmx_string_cons_t *sc;
+	uint64_t len1, len2;
+
+	if (depth == 0) {
+		return (pg_flat(pg, lenp));
+	}
+
+	s1 = pg_cons(pg, depth - 1, &len1);
+	s2 = pg_cons(pg, pg_random(&pg->pg_rand) % depth, &len2);
+	ident = pg_new(pg);
+	if (pg->pg_nconses == PG_BATCH) {
+		pg_flush(pg);
+	}
+
+	sc = &pg->pg_conses[pg->pg_nconses++];
+	sc->pxsc_ident = ident;
+	sc->pxsc_length = PMX_SMI_VALUE(len1 + len2);
+	sc->pxsc_s1 = s1;
+	sc->pxsc_s2 = s2;
+	*lenp = len1 + len2;
+	return (ident);
+}
+
+static void
+pg_object(pmxgen_t *pg)
+{
+	uint64_t nclasses = pg->pg_params->pgp_classes;
+	pmx_value_t ident = pg_new(pg);
+	uint64_t k, k2, i, nprops;
+
+	/*
+	 * The smaller of two random classes, so that lower-numbered classes
+	 * are more common.
+	 */
+	k = pg_random(&pg->pg_rand) % nclasses;
+	k2 = pg_random(&pg->pg_rand) % nclasses;
+	if (k2 < k) {
+		k = k2;
+	}
+
+	nprops = 1 + k % PG_MAXPROPS;
+	pmx_object_start(pg->pg_stream, ident);
+	pmx_object_constructor(pg->pg_stream, pg->pg_ctors[k]);
+	for (i = 0; i < nprops; i++) {
+		pmx_object_property(pg->pg_stream, ident, pg_ref(pg),
+		    pg->pg_names[(k + i) % PG_NNAMES]);
+	}
+
+	pmx_object_done(pg->pg_stream, nprops);
+}
+
+/*
+ * Most heap numbers are batched, but some are emitted individually.
+ */
+static void
+pg_number(pmxgen_t *pg)
+{
+	pmx_value_t ident = pg_new(pg);
+	uint64_t r = pg_random(&pg->pg_rand);
+	double d = (double)(int64_t)(r >> 20) / 1024;
+
+	if ((r & 15) == 0) {
+		pmx_emit_node_heapnumber(pg->pg_stream, ident, d);
+		return;
+	}
+
+	if (pg->pg_nnumbers == PG_BATCH) {
+		pg_flush(pg);
+	}
+
+	pg->pg_numbers[pg->pg_nnumbers].pxh_ident = ident;
+	pg->pg_numbers[pg->pg_nnumbers++].pxh_value = d;
+}
+
+/*
+ * Small arrays are batched, and large ones are emitted element by element.
+ */
+static void
+pg_array(pmxgen_t *pg)
+{
+	const pmxgen_params_t *pgp = pg->pg_params;
+	pmx_value_t ident = pg_new(pg);
+	pmx_value_t value;
+	pmx_array_t *pa;
+	uint64_t len, i, r;
+	int smi;
+
+	len = pg_length(&pg->pg_rand, pgp->pgp_arraylen, pgp->pgp_arraymax);
+	if (len > PG_SMALLARRAY) {
+		pmx_array(pg->pg_stream, ident, len);
+		for (i = 0; i < len; i++) {
+			r = pg_random(&pg->pg_rand);
+			smi = (r & 3) == 0;
+			value = smi ? PMX_SMI_VALUE((r >> 2) % 1000) :
+			    pg_ref(pg);
+			pmx_array_element(pg->pg_stream, ident, value, smi, i);
+		}
+
+		return;
+	}
+
+	if (pg->pg_narrays == PG_BATCH ||
+	    pg->pg_nelements + len > PG_NELEMENTS) {
+		pg_flush(pg);
+	}
+
+	pa = &pg->pg_arrays[pg->pg_narrays++];
+	pa->pxa_ident = ident;
+	pa->pxa_length = len;
+	pa->pxa_elements = &pg->pg_elements[pg->pg_nelements];
+	pa->pxa_smi = &pg->pg_smi[pg->pg_nelements];
+	for (i = 0; i < len; i++) {
+		r = pg_random(&pg->pg_rand);
+		smi = (r & 3) == 0;
+		pg->pg_smi[pg->pg_nelements] = smi;
+		pg->pg_elements[pg->pg_nelements++] = smi ?
+		    PMX_SMI_VALUE((r >> 2) % 1000) : pg_ref(pg);
+	}
+}
+
+/*
+ * Emits a chain of closures, each of which is the parent of the next.
+ */
+static void
+pg_closures(pmxgen_t *pg)
+{
+	const pmxgen_params_t *pgp = pg->pg_params;
+	pmx_value_t parent = pg->pg_undefined;
+	pmx_value_t ident;
+	uint64_t n, i, nvars, j;
+
+	n = 1 + pg_random(&pg->pg_rand) % pgp->pgp_closuredepth;
+	for (i = 0; i < n; i++) {
+		ident = pg_new(pg);
+		pmx_closure_start(pg->pg_stream, ident, pg->pg_funcs[
+		    pg_random(&pg->pg_rand) % pgp->pgp_classes]);
+		pmx_closure_parent(pg->pg_stream, parent);
+		nvars = pg_random(&pg->pg_rand) % 3;
+		for (j = 0; j < nvars; j++) {
+			pmx_closure_variable(pg->pg_stream, pg_ref(pg),
+			    pg->pg_names[(i + j) % PG_NNAMES]);
+		}
+
+		pmx_closure_done(pg->pg_stream);
+		parent = ident;
+	}
+}
+
+static void
+pg_date(pmxgen_t *pg)
+{
+	struct timespec ts;
+	uint64_t r = pg_random(&pg->pg_rand);
+
+	ts.tv_sec = 1475688184 + (time_t)(r % 100000000);
+	ts.tv_nsec = (long)((r >> 32) % 1000) * 1000000;
+	pmx_emit_node_date(pg->pg_stream, pg_new(pg), &ts);
+}
+
+/*
+ * Emits all of the nodes collected for the batch interfaces.
+ */
+static void
+pg_flush(pmxgen_t *pg)
+{
+	pmx_emit_heapnumbers(pg->pg_stream, pg->pg_numbers, pg->pg_nnumbers);
+	pmx_emit_strings_flat(pg->pg_stream, pg->pg_flats, pg->pg_nflats);
+	pmx_emit_strings_cons(pg->pg_stream, pg->pg_conses, pg->pg_nconses);
+	pmx_emit_arrays(pg->pg_stream, pg->pg_arrays, pg->pg_narrays);
+	pg->pg_nnumbers = 0;
+	pg->pg_nflats = 0;
+	pg->pg_nconses = 0;
+	pg->pg_narrays = 0;
+	pg->pg_nelements = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxgen.h: synthetic heaps for pmxemit
+ */
+
+#ifndef	_PMXGEN_H
+#define	_PMXGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pmx/pmx.h>
+
+/*
+ * Parameters of a generated heap.  See pmxgen_params[] in pmxgen.c.
+ */
+typedef struct {
+	uint64_t	pgp_nodes;		/* values to emit */
+	uint64_t	pgp_seed;
+	uint64_t	pgp_strlen;		/* mean string length */
+	uint64_t	pgp_strmax;		/* longest string */
+	uint64_t	pgp_dupstrings;		/* percent repeated contents */
+	uint64_t	pgp_consdepth;		/* deepest cons string */
+	uint64_t	pgp_arraylen;		/* mean array length */
+	uint64_t	pgp_arraymax;		/* longest array */
+	uint64_t	pgp_closuredepth;	/* longest closure chain */
+	uint64_t	pgp_classes;		/* number of constructors */
+} pmxgen_params_t;
+
+void pmxgen_defaults(pmxgen_params_t *);
+int pmxgen_parse(pmxgen_params_t *, const char *);
+void pmxgen_describe(const pmxgen_params_t *, char *, size_t);
+void pmxgen_emit(pmx_stream_t *, const pmxgen_params_t *);
+
+#endif /* not defined _PMXGEN_H */
@@ -0,0 +1,1198 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxretain.c: report the values in a JSON postmortem export that keep the
+ * most memory alive.
+ *
+ * This program should not use private libpmx functions.
+ *
+ * The values of an export (node records and string records) form a graph.
+ * Value "u" refers to value "v" if one of u's reference fields (see
+ * pmx_node_fieldisref()) holds v's ident or if u has a property, element, or
+ * variable edge to v.  (Small integer elements aren't references.)  The roots
+ * of the graph are the values that nothing else refers to.  The export doesn't
+ * say which values the VM's own roots refer to, so cycles of values that are
+ * unreachable from those are rooted too: one value from each cycle that
+ * nothing outside it refers to is treated as a root (see rt_dfs()).
+ *
+ * Value "d" dominates value "v" if every path from the roots to "v" passes
+ * through "d", so if "d" were freed, "v" would be freed with it.  The memory
+ * retained by a value is the total shallow size of all the values it
+ * dominates (including itself).  Exports don't record the size of each value,
+ * so shallow sizes are estimated from the layout of V8's heap objects on
+ * 64-bit systems: a word for the value's map, plus a word for each field and
+ * edge, or for strings, a header of two words plus the contents as encoded in
+ * the export (rounded up to a whole word).  Retained counts (the number of
+ * values dominated) don't depend on this estimate.
+ *
+ * For each value reported, the output includes the value's immediate
+ * dominator, or "-" if no single value dominates it (either because it's a
+ * root or because it's reachable from more than one).
+ *
+ * Exports may describe hundreds of millions of values, so the graph is stored
+ * in flat arrays indexed by small integers and nothing is allocated per value.
+ * The export is read twice:
+ *
+ *     1. The ident of each value is collected.  The idents are sorted (with a
+ *        radix sort) and each value is thereafter identified by its position
+ *        in the sorted array, a 32-bit "id".  Idents are found with a
+ *        directory of the sorted array indexed by the high bits of the ident,
+ *        followed by a binary search of a few entries.
+ *
+ *     2. The type and estimated size of each value and the number of
+ *        references from each value are recorded, and the references
+ *        themselves (as pairs of ids) are written to a temporary file.
+ *
+ * The references are then read back and stored in compressed sparse row (CSR)
+ * form: the targets of all the references from value "i" are stored
+ * contiguously in one array, starting at an offset stored in another.
+ *
+ * Immediate dominators are computed with the Lengauer-Tarjan algorithm, using
+ * the "SNCA" variant described by Georgiadis: semidominators are computed as
+ * in Lengauer-Tarjan (with path compression), but each immediate dominator is
+ * then found by walking up the depth-first spanning tree, which avoids
+ * Lengauer-Tarjan's per-vertex buckets.  Everything in this phase is indexed
+ * by the depth-first preorder number of each value, with a virtual root
+ * (number 0) whose children are the roots.  The depth-first search and path
+ * compression are iterative, so deep graphs don't exhaust the stack.
+ *
+ * The arrays used take about 8 bytes per reference in the worst case (when
+ * references are converted from the forward CSR to the backward one used by
+ * the dominator computation) plus about 40 bytes per value.  -v reports how
+ * much memory was used.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+
+#define	EXIT_USAGE 2
+
+/* Number of values reported by default. */
+#define	RT_NTOP		20
+/* Marks unvisited values and missing ancestors. */
+#define	RT_NONE		UINT32_MAX
+/* Marks values that are only reachable from unreachable cycles. */
+#define	RT_SEEN		(UINT32_MAX - 1)
+/* Type recorded for values that are string records rather than nodes. */
+#define	RT_STRING	0
+/* Average number of values described by each directory entry. */
+#define	RT_DIRRATIO	4
+/* Number of references buffered for the temporary file at a time. */
+#define	RT_NPAIRS	(64 * 1024)
+/* Estimated size of a word. */
+#define	RT_WORD		8
+
+typedef struct {
+	const char	*rt_path;		/* export being read */
+
+	/* memory allocated, for -v */
+	size_t		rt_nbytes;
+	size_t		rt_maxbytes;
+
+	/* values, in order of ident (see rt_lookup()) */
+	uint32_t	rt_nvalues;
+	uint64_t	*rt_idents;
+	uint32_t	*rt_dir;		/* directory of rt_idents */
+	size_t		rt_ndir;
+	unsigned int	rt_dirshift;
+	uint8_t		*rt_types;		/* node type, or RT_STRING */
+	uint32_t	*rt_sizes;		/* estimated shallow size */
+
+	/* content lengths, indexed by content id */
+	uint32_t	*rt_contents;
+	uint64_t	rt_ncontents;
+
+	/* references found in pass 2, as pairs of ids */
+	FILE		*rt_pairsfp;
+	uint32_t	*rt_pairs;		/* buffer of RT_NPAIRS pairs */
+	size_t		rt_npairs;
+
+	/* references from each value (by id), in CSR form */
+	uint64_t	*rt_succstart;		/* rt_nvalues + 1 */
+	uint32_t	*rt_succ;
+	uint64_t	rt_nrefs;
+	uint64_t	rt_nunresolved;		/* to unknown idents */
+
+	/* references to each value (by preorder number), in CSR form */
+	uint64_t	*rt_predstart;		/* rt_nvalues + 2 */
+	uint32_t	*rt_preds;
+
+	/* depth-first spanning tree, indexed by preorder number */
+	uint32_t	*rt_vertex;		/* id of each vertex */
+	uint32_t	*rt_parent;		/* parent, and then idom */
+	uint32_t	rt_nroots;
+	uint32_t	rt_ncycles;		/* roots in cycles */
+
+	/* retained size and count, indexed by preorder number */
+	uint64_t	*rt_retained;
+	uint32_t	*rt_rcount;
+} retain_t;
+
+static void *rt_alloc(retain_t *, size_t, size_t);
+static void *rt_grow(retain_t *, void *, size_t, size_t, size_t);
+static void rt_free(retain_t *, void *, size_t, size_t);
+static pmx_reader_t *rt_open(retain_t *);
+static void rt_readerr(retain_t *, pmx_reader_t *);
+static void rt_changed(retain_t *);
+static uint32_t rt_id(retain_t *, uint64_t);
+static void rt_collect(retain_t *);
+static void rt_sort(uint64_t *, uint64_t *, size_t);
+static void rt_directory(retain_t *);
+static int rt_lookup(retain_t *, uint64_t, uint32_t *);
+static void rt_references(retain_t *);
+static void rt_reference(retain_t *, uint32_t, uint64_t);
+static void rt_flush(retain_t *);
+static void rt_store(retain_t *);
+static void rt_dfs(retain_t *);
+static void rt_finish(retain_t *, uint32_t *, uint32_t *, uint32_t *,
+    uint32_t *);
+static void rt_visit(retain_t *, uint32_t *, uint32_t *, uint32_t, uint32_t *);
+static void rt_predecessors(retain_t *, uint32_t *);
+static void rt_dominators(retain_t *);
+static uint32_t rt_eval(uint32_t, uint32_t *, uint32_t *, uint32_t *,
+    uint32_t *);
+static void rt_retain(retain_t *);
+static void rt_report(retain_t *, size_t);
+static void rt_siftdown(retain_t *, uint32_t *, size_t, size_t);
+static int rt_less(retain_t *, uint32_t, uint32_t);
+static const char *rt_typename(uint8_t);
+static void rt_fini(retain_t *);
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: pmxretain [-v] [-n COUNT] FILE\n");
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	retain_t rt;
+	unsigned long long ntop = RT_NTOP;
+	uint64_t total;
+	uint32_t i;
+	char *endp;
+	int verbose = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:v")) != -1) {
+		switch (c) {
+		case 'n':
+			ntop = strtoull(optarg, &endp, 0);
+			if (*endp != '\0' || ntop == 0) {
+				warnx("invalid count: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+		usage();
+	}
+
+	(void) memset(&rt, 0, sizeof (rt));
+	rt.rt_path = argv[0];
+
+	rt_collect(&rt);
+	rt_references(&rt);
+	rt_store(&rt);
+	rt_dfs(&rt);
+	rt_dominators(&rt);
+	rt_retain(&rt);
+
+	if (verbose) {
+		total = 0;
+		for (i = 0; i < rt.rt_nvalues; i++) {
+			total += rt.rt_sizes[i];
+		}
+
+		warnx("%" PRIu32 " values (%" PRIu32 " roots, of which %" PRIu32
+		    " were in unreachable cycles)", rt.rt_nvalues,
+		    rt.rt_nroots, rt.rt_ncycles);
+		warnx("%" PRIu64 " references (%" PRIu64 " more to values "
+		    "not in the export)", rt.rt_nrefs, rt.rt_nunresolved);
+		warnx("%" PRIu64 " bytes estimated in total", total);
+		warnx("%zu bytes of memory used at most", rt.rt_maxbytes);
+	}
+
+	rt_report(&rt, ntop > rt.rt_nvalues ? rt.rt_nvalues : (size_t)ntop);
+	rt_fini(&rt);
+	return (0);
+}
+
+/*
+ * Memory.  Allocation failures are fatal.  Callers say how much they're
+ * freeing so that -v can report the peak.
+ */
+static void *
+rt_alloc(retain_t *rt, size_t nelem, size_t elsize)
+{
+	return (rt_grow(rt, NULL, 0, nelem, elsize));
+}
+
+static void *
+rt_grow(retain_t *rt, void *buf, size_t oldnelem, size_t nelem,
+    size_t elsize)
+{
+	void *rv;
+
+	if (nelem == 0) {
+		nelem = 1;
+	}
+
+	if (nelem > SIZE_MAX / elsize ||
+	    (rv = realloc(buf, nelem * elsize)) == NULL) {
+		errx(EXIT_FAILURE, "out of memory (allocating %zu bytes, with "
+		    "%zu already in use)", nelem * elsize, rt->rt_nbytes);
+	}
+
+	rt->rt_nbytes -= oldnelem * elsize;
+	rt->rt_nbytes += nelem * elsize;
+	if (rt->rt_nbytes > rt->rt_maxbytes) {
+		rt->rt_maxbytes = rt->rt_nbytes;
+	}
+
+	return (rv);
+}
+
+static void
+rt_free(retain_t *rt, void *buf, size_t nelem, size_t elsize)
+{
+	if (buf == NULL) {
+		return;
+	}
+
+	if (nelem == 0) {
+		nelem = 1;
+	}
+
+	rt->rt_nbytes -= nelem * elsize;
+	free(buf);
+}
+
+/*
+ * Reading the export.
+ */
+static pmx_reader_t *
+rt_open(retain_t *rt)
+{
+	pmx_reader_t *pr;
+
+	if ((pr = pmx_reader_open(rt->rt_path)) == NULL) {
+		err(EXIT_FAILURE, "open \"%s\"", rt->rt_path);
+	}
+
+	return (pr);
+}
+
+static void
+rt_readerr(retain_t *rt, pmx_reader_t *pr)
+{
+	errx(EXIT_FAILURE, "read \"%s\": %s", rt->rt_path,
+	    pmx_reader_errmsg(pr));
+}
+
+static void
+rt_changed(retain_t *rt)
+{
+	errx(EXIT_FAILURE, "\"%s\" changed while being read", rt->rt_path);
+}
+
+/*
+ * Pass 1: find all the values and assign each one an id.
+ */
+static void
+rt_collect(retain_t *rt)
+{
+	pmx_reader_t *pr;
+	pmx_record_t rec;
+	uint64_t *idents = NULL, *tmp;
+	size_t nidents = 0, nalloc = 0, i, n;
+	int rv;
+
+	pr = rt_open(rt);
+	while ((rv = pmx_reader_next(pr, &rec)) == 1) {
+		if (rec.pxr_type != PMXR_NODE && rec.pxr_type != PMXR_STRING) {
+			continue;
+		}
+
+		if (nidents == nalloc) {
+			idents = rt_grow(rt, idents, nalloc,
+			    nalloc == 0 ? 1024 : 2 * nalloc, sizeof (uint64_t));
+			nalloc = nalloc == 0 ? 1024 : 2 * nalloc;
+		}
+
+		idents[nidents++] = rec.pxr_ident;
+	}
+
+	if (rv != 0) {
+		rt_readerr(rt, pr);
+	}
+
+	pmx_reader_close(pr);
+
+	tmp = rt_alloc(rt, nidents, sizeof (uint64_t));
+	rt_sort(idents, tmp, nidents);
+	rt_free(rt, tmp, nidents, sizeof (uint64_t));
+
+	/*
+	 * Values emitted more than once are only counted once.
+	 */
+	for (i = 0, n = 0; i < nidents; i++) {
+		if (n == 0 || idents[i] != idents[n - 1]) {
+			idents[n++] = idents[i];
+		}
+	}
+
+	/*
+	 * Preorder numbers run from 0 (the virtual root) to the number of
+	 * values, and RT_SEEN and RT_NONE must be left over.
+	 */
+	if (n >= RT_SEEN - 1) {
+		errx(EXIT_FAILURE, "too many values (%zu)", n);
+	}
+
+	rt->rt_idents = rt_grow(rt, idents, nalloc, n, sizeof (uint64_t));
+	rt->rt_nvalues = (uint32_t)n;
+	rt_directory(rt);
+}
+
+/*
+ * Sorts "keys" (using "tmp" as scratch space) with a least-significant-digit
+ * radix sort on each byte.  Bytes that are the same in every key (like the
+ * high bytes of most pointers) are skipped.
+ */
+static void
+rt_sort(uint64_t *keys, uint64_t *tmp, size_t n)
+{
+	size_t counts[8][256];
+	size_t i, d, sum, next;
+	uint64_t *src = keys, *dst = tmp, *swap;
+
+	(void) memset(counts, 0, sizeof (counts));
+	for (i = 0; i < n; i++) {
+		for (d = 0; d < 8; d++) {
+			counts[d][(keys[i] >> (8 * d)) & 0xff]++;
+		}
+	}
+
+	for (d = 0; d < 8; d++) {
+		if (n == 0 || counts[d][(keys[0] >> (8 * d)) & 0xff] == n) {
+			continue;
+		}
+
+		for (i = 0, sum = 0; i < 256; i++) {
+			next = sum + counts[d][i];
+			counts[d][i] = sum;
+			sum = next;
+		}
+
+		for (i = 0; i < n; i++) {
+			dst[counts[d][(src[i] >> (8 * d)) & 0xff]++] = src[i];
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != keys) {
+		(void) memcpy(keys, src, n * sizeof (uint64_t));
+	}
+}
+
+/*
+ * Builds the directory of rt_idents.  Entry "i" of the directory is the index
+ * of the first ident whose offset from the smallest ident, shifted right by
+ * rt_dirshift, is at least "i".  The shift is chosen so that there are about
+ * RT_DIRRATIO values per entry if idents are uniformly distributed.  (If
+ * they're not, lookups degrade gracefully to a binary search of more of the
+ * array.)
+ */
+static void
+rt_directory(retain_t *rt)
+{
+	uint64_t span, base;
+	size_t i, b;
+
+	if (rt->rt_nvalues == 0) {
+		rt->rt_ndir = 0;
+		rt->rt_dir = rt_alloc(rt, 1, sizeof (uint32_t));
+		rt->rt_dir[0] = 0;
+		return;
+	}
+
+	base = rt->rt_idents[0];
+	span = rt->rt_idents[rt->rt_nvalues - 1] - base;
+	rt->rt_dirshift = 0;
+	while ((span >> rt->rt_dirshift) >= rt->rt_nvalues / RT_DIRRATIO) {
+		rt->rt_dirshift++;
+	}
+
+	rt->rt_ndir = (size_t)(span >> rt->rt_dirshift) + 1;
+	rt->rt_dir = rt_alloc(rt, rt->rt_ndir + 1, sizeof (uint32_t));
+	for (i = 0, b = 0; i < rt->rt_nvalues; i++) {
+		while (b <= (rt->rt_idents[i] - base) >> rt->rt_dirshift) {
+			rt->rt_dir[b++] = (uint32_t)i;
+		}
+	}
+
+	assert(b == rt->rt_ndir);
+	rt->rt_dir[b] = rt->rt_nvalues;
+}
+
+/*
+ * Finds the id of the value with the given ident.  Returns -1 if there's no
+ * such value.
+ */
+static int
+rt_lookup(retain_t *rt, uint64_t ident, uint32_t *idp)
+{
+	uint64_t off;
+	uint32_t lo, hi, mid;
+
+	if (rt->rt_nvalues == 0 || ident < rt->rt_idents[0]) {
+		return (-1);
+	}
+
+	off = (ident - rt->rt_idents[0]) >> rt->rt_dirshift;
+	if (off >= rt->rt_ndir) {
+		return (-1);
+	}
+
+	lo = rt->rt_dir[off];
+	hi = rt->rt_dir[off + 1];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rt->rt_idents[mid] < ident) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == rt->rt_dir[off + 1] || rt->rt_idents[lo] != ident) {
+		return (-1);
+	}
+
+	*idp = lo;
+	return (0);
+}
+
+
+static uint32_t
+rt_id(retain_t *rt, uint64_t ident)
+{
+	uint32_t id;
+
+	if (rt_lookup(rt, ident, &id) != 0) {
+		rt_changed(rt);
+	}
+
+	return (id);
+}
+
+/*
+ * Pass 2: estimate the size of each value, count the references from each one,
+ * and write them (as pairs of ids) to a temporary file for rt_store().
+ */
+static void
+rt_references(retain_t *rt)
+{
+	pmx_reader_t *pr;
+	pmx_record_t rec;
+	uint64_t len;
+	uint32_t id;
+	unsigned int i;
+	size_t e;
+	int rv;
+
+	rt->rt_types = rt_alloc(rt, rt->rt_nvalues, sizeof (uint8_t));
+	rt->rt_sizes = rt_alloc(rt, rt->rt_nvalues, sizeof (uint32_t));
+	rt->rt_succstart = rt_alloc(rt, (size_t)rt->rt_nvalues + 1,
+	    sizeof (uint64_t));
+	(void) memset(rt->rt_types, RT_STRING, rt->rt_nvalues);
+	(void) memset(rt->rt_sizes, 0, rt->rt_nvalues * sizeof (uint32_t));
+	(void) memset(rt->rt_succstart, 0,
+	    ((size_t)rt->rt_nvalues + 1) * sizeof (uint64_t));
+	rt->rt_pairs = rt_alloc(rt, RT_NPAIRS, 2 * sizeof (uint32_t));
+	rt->rt_npairs = 0;
+	if ((rt->rt_pairsfp = tmpfile()) == NULL) {
+		err(EXIT_FAILURE, "create temporary file");
+	}
+
+	pr = rt_open(rt);
+	while ((rv = pmx_reader_next(pr, &rec)) == 1) {
+		switch (rec.pxr_type) {
+		case PMXR_CONTENT:
+			if (rec.pxr_id >= rt->rt_ncontents) {
+				len = rt->rt_ncontents == 0 ? 1024 :
+				    2 * rt->rt_ncontents;
+				while (len <= rec.pxr_id) {
+					len *= 2;
+				}
+
+				rt->rt_contents = rt_grow(rt, rt->rt_contents,
+				    rt->rt_ncontents, len, sizeof (uint32_t));
+				(void) memset(rt->rt_contents +
+				    rt->rt_ncontents, 0, (len -
+				    rt->rt_ncontents) * sizeof (uint32_t));
+				rt->rt_ncontents = len;
+			}
+
+			rt->rt_contents[rec.pxr_id] =
+			    rec.pxr_str.pxsv_len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)rec.pxr_str.pxsv_len;
+			break;
+
+		case PMXR_STRING:
+			len = 0;
+			if (!rec.pxr_hascontent) {
+				len = rec.pxr_str.pxsv_len;
+			} else if (rec.pxr_id < rt->rt_ncontents) {
+				len = rt->rt_contents[rec.pxr_id];
+			}
+
+			len = 2 * RT_WORD +
+			    (len + RT_WORD - 1) / RT_WORD * RT_WORD;
+			id = rt_id(rt, rec.pxr_ident);
+			rt->rt_sizes[id] = len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)len;
+			break;
+
+		case PMXR_NODE:
+			id = rt_id(rt, rec.pxr_ident);
+			len = rt->rt_sizes[id] + RT_WORD;
+			for (i = 0; i < PMXR_MAXFIELDS; i++) {
+				if ((rec.pxr_fieldmask & (1U << i)) == 0) {
+					continue;
+				}
+
+				len += RT_WORD;
+				if (pmx_node_fieldisref(rec.pxr_subtype, i)) {
+					rt_reference(rt, id,
+					    rec.pxr_fields[i]);
+				}
+			}
+
+			rt->rt_types[id] = (uint8_t)rec.pxr_subtype;
+			rt->rt_sizes[id] = len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)len;
+			break;
+
+		case PMXR_EDGES:
+			/*
+			 * Edges of values that aren't in the export are
+			 * ignored.
+			 */
+			if (rt_lookup(rt, rec.pxr_ident, &id) != 0) {
+				break;
+			}
+
+			for (e = 0; e < rec.pxr_nedges; e++) {
+				if (rec.pxr_edges[e].pxre_kind != 4) {
+					rt_reference(rt, id,
+					    rec.pxr_edges[e].pxre_target);
+				}
+			}
+
+			len = rt->rt_sizes[id] +
+			    (uint64_t)rec.pxr_nedges * RT_WORD;
+			rt->rt_sizes[id] = len > UINT32_MAX ? UINT32_MAX :
+			    (uint32_t)len;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (rv != 0) {
+		rt_readerr(rt, pr);
+	}
+
+	pmx_reader_close(pr);
+	rt_flush(rt);
+	rt_free(rt, rt->rt_contents, rt->rt_ncontents, sizeof (uint32_t));
+	rt_free(rt, rt->rt_dir, rt->rt_ndir + 1, sizeof (uint32_t));
+	rt->rt_contents = NULL;
+	rt->rt_dir = NULL;
+}
+
+/*
+ * Records a reference from the value "src" to the value with ident "ident", if
+ * there is one.
+ */
+static void
+rt_reference(retain_t *rt, uint32_t src, uint64_t ident)
+{
+	uint32_t dst;
+
+	if (rt_lookup(rt, ident, &dst) != 0) {
+		rt->rt_nunresolved++;
+		return;
+	}
+
+	rt->rt_succstart[src]++;
+	rt->rt_pairs[2 * rt->rt_npairs] = src;
+	rt->rt_pairs[2 * rt->rt_npairs + 1] = dst;
+	if (++rt->rt_npairs == RT_NPAIRS) {
+		rt_flush(rt);
+	}
+}
+
+static void
+rt_flush(retain_t *rt)
+{
+	if (rt->rt_npairs > 0 && fwrite(rt->rt_pairs, 2 * sizeof (uint32_t),
+	    rt->rt_npairs, rt->rt_pairsfp) != rt->rt_npairs) {
+		err(EXIT_FAILURE, "write temporary file");
+	}
+
+	rt->rt_npairs = 0;
+}
+
+/*
+ * Pass 3: store the references in CSR form.  The counts from pass 2 are turned
+ * into the offset of the end of each value's references, and each value's
+ * references are stored backwards from there, leaving the offset of the start.
+ */
+static void
+rt_store(retain_t *rt)
+{
+	uint64_t sum;
+	uint32_t id, src;
+	size_t i, n;
+
+	for (id = 0, sum = 0; id < rt->rt_nvalues; id++) {
+		if (rt->rt_succstart[id] > UINT32_MAX) {
+			errx(EXIT_FAILURE, "value %" PRIu64 " has too many "
+			    "references", rt->rt_idents[id]);
+		}
+
+		sum += rt->rt_succstart[id];
+		rt->rt_succstart[id] = sum;
+	}
+
+	rt->rt_succstart[rt->rt_nvalues] = sum;
+	rt->rt_nrefs = sum;
+	if (sum > SIZE_MAX / sizeof (uint32_t)) {
+		errx(EXIT_FAILURE, "too many references (%" PRIu64 ") to hold "
+		    "in memory", sum);
+	}
+
+	rt->rt_succ = rt_alloc(rt, sum, sizeof (uint32_t));
+
+	if (fflush(rt->rt_pairsfp) != 0 ||
+	    fseek(rt->rt_pairsfp, 0, SEEK_SET) != 0) {
+		err(EXIT_FAILURE, "rewind temporary file");
+	}
+
+	while ((n = fread(rt->rt_pairs, 2 * sizeof (uint32_t), RT_NPAIRS,
+	    rt->rt_pairsfp)) > 0) {
+		for (i = 0; i < n; i++) {
+			src = rt->rt_pairs[2 * i];
+			rt->rt_succ[--rt->rt_succstart[src]] =
+			    rt->rt_pairs[2 * i + 1];
+		}
+
+		sum -= n;
+	}
+
+	if (ferror(rt->rt_pairsfp)) {
+		err(EXIT_FAILURE, "read temporary file");
+	}
+
+	assert(sum == 0);
+	(void) fclose(rt->rt_pairsfp);
+	rt->rt_pairsfp = NULL;
+	rt_free(rt, rt->rt_pairs, RT_NPAIRS, 2 * sizeof (uint32_t));
+	rt->rt_pairs = NULL;
+}
+
+/*
+ * Numbers the values in depth-first preorder, starting from the roots.  This
+ * builds the depth-first spanning tree (rt_vertex and rt_parent) and the
+ * backward CSR (see rt_predecessors()), after which the forward one is no
+ * longer needed.
+ */
+static void
+rt_dfs(retain_t *rt)
+{
+	uint32_t n = rt->rt_nvalues;
+	uint32_t *pre, *cursor, *order, *stack;
+	uint8_t *referenced;
+	uint32_t npre, r, norder, i;
+	uint64_t e;
+
+	referenced = rt_alloc(rt, n / 8 + 1, sizeof (uint8_t));
+	(void) memset(referenced, 0, n / 8 + 1);
+	for (e = 0; e < rt->rt_nrefs; e++) {
+		r = rt->rt_succ[e];
+		referenced[r / 8] |= 1U << (r % 8);
+	}
+
+	pre = rt_alloc(rt, n, sizeof (uint32_t));
+	(void) memset(pre, 0xff, n * sizeof (uint32_t));
+	rt->rt_vertex = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	rt->rt_parent = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	cursor = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	rt->rt_vertex[0] = RT_NONE;
+	rt->rt_parent[0] = 0;
+	npre = 1;
+
+	for (r = 0; r < n; r++) {
+		if (pre[r] == RT_NONE &&
+		    (referenced[r / 8] & (1U << (r % 8))) == 0) {
+			rt->rt_nroots++;
+			rt_visit(rt, pre, cursor, r, &npre);
+		}
+	}
+
+	rt_free(rt, referenced, n / 8 + 1, sizeof (uint8_t));
+
+	/*
+	 * Whatever's left is only reachable from cycles that nothing else
+	 * refers to.  A depth-first search of what's left, as in Kosaraju's
+	 * algorithm for finding strongly-connected components, orders it so
+	 * that the first value in reverse postorder is in a cycle with no
+	 * references from outside it.  Each value in that order that still
+	 * hasn't been visited after starting from the ones before it is
+	 * likewise in such a cycle (among the values not yet visited), and
+	 * becomes a root.
+	 */
+	if (npre <= n) {
+		norder = n - (npre - 1);
+		order = rt_alloc(rt, norder, sizeof (uint32_t));
+		stack = rt_alloc(rt, norder, sizeof (uint32_t));
+		rt_finish(rt, pre, cursor, order, stack);
+		rt_free(rt, stack, norder, sizeof (uint32_t));
+
+		for (i = norder; i > 0; i--) {
+			if (pre[order[i - 1]] == RT_SEEN) {
+				rt->rt_nroots++;
+				rt->rt_ncycles++;
+				rt_visit(rt, pre, cursor, order[i - 1], &npre);
+			}
+		}
+
+		rt_free(rt, order, norder, sizeof (uint32_t));
+	}
+
+	assert(npre == n + 1);
+	rt_free(rt, cursor, (size_t)n + 1, sizeof (uint32_t));
+	rt_predecessors(rt, pre);
+	rt_free(rt, pre, n, sizeof (uint32_t));
+}
+
+/*
+ * Stores the values that haven't been visited in "order", in depth-first
+ * postorder, and marks them RT_SEEN.  "stack" and "cursor" must have room for
+ * all of them.
+ */
+static void
+rt_finish(retain_t *rt, uint32_t *pre, uint32_t *cursor, uint32_t *order,
+    uint32_t *stack)
+{
+	uint32_t r, id, t, depth, norder = 0;
+	uint64_t e;
+
+	for (r = 0; r < rt->rt_nvalues; r++) {
+		if (pre[r] != RT_NONE) {
+			continue;
+		}
+
+		pre[r] = RT_SEEN;
+		stack[0] = r;
+		cursor[0] = 0;
+		depth = 1;
+		while (depth > 0) {
+			id = stack[depth - 1];
+			e = rt->rt_succstart[id] + cursor[depth - 1];
+			if (e == rt->rt_succstart[id + 1]) {
+				order[norder++] = id;
+				depth--;
+				continue;
+			}
+
+			cursor[depth - 1]++;
+			t = rt->rt_succ[e];
+			if (pre[t] == RT_NONE) {
+				pre[t] = RT_SEEN;
+				stack[depth] = t;
+				cursor[depth] = 0;
+				depth++;
+			}
+		}
+	}
+}
+
+/*
+ * Numbers the values reachable from "root" (which becomes a child of the
+ * virtual root) that haven't already been numbered.
+ */
+static void
+rt_visit(retain_t *rt, uint32_t *pre, uint32_t *cursor, uint32_t root,
+    uint32_t *nprep)
+{
+	uint32_t v, w, id, t;
+	uint64_t e;
+
+	v = 0;
+	t = root;
+	for (;;) {
+		if (t != RT_NONE) {
+			w = (*nprep)++;
+			pre[t] = w;
+			rt->rt_vertex[w] = t;
+			rt->rt_parent[w] = v;
+			cursor[w] = 0;
+			v = w;
+		}
+
+		if (v == 0) {
+			break;
+		}
+
+		id = rt->rt_vertex[v];
+		e = rt->rt_succstart[id] + cursor[v];
+		if (e == rt->rt_succstart[id + 1]) {
+			v = rt->rt_parent[v];
+			t = RT_NONE;
+			continue;
+		}
+
+		cursor[v]++;
+		t = rt->rt_succ[e];
+		if (pre[t] != RT_NONE && pre[t] != RT_SEEN) {
+			t = RT_NONE;
+		}
+	}
+}
+
+/*
+ * Builds the backward CSR, in which the references to each value are indexed
+ * by preorder number (as are the values referring to it), and frees the
+ * forward one.
+ */
+static void
+rt_predecessors(retain_t *rt, uint32_t *pre)
+{
+	uint32_t n = rt->rt_nvalues;
+	uint32_t id, v;
+	uint64_t e, sum;
+
+	rt->rt_predstart = rt_alloc(rt, (size_t)n + 2, sizeof (uint64_t));
+	(void) memset(rt->rt_predstart, 0, ((size_t)n + 2) * sizeof (uint64_t));
+	for (e = 0; e < rt->rt_nrefs; e++) {
+		rt->rt_predstart[pre[rt->rt_succ[e]]]++;
+	}
+
+	for (v = 0, sum = 0; v <= n; v++) {
+		sum += rt->rt_predstart[v];
+		rt->rt_predstart[v] = sum;
+	}
+
+	rt->rt_predstart[n + 1] = sum;
+	rt->rt_preds = rt_alloc(rt, sum, sizeof (uint32_t));
+	for (id = 0; id < n; id++) {
+		for (e = rt->rt_succstart[id]; e < rt->rt_succstart[id + 1];
+		    e++) {
+			v = pre[rt->rt_succ[e]];
+			rt->rt_preds[--rt->rt_predstart[v]] = pre[id];
+		}
+	}
+
+	rt_free(rt, rt->rt_succ, rt->rt_nrefs, sizeof (uint32_t));
+	rt_free(rt, rt->rt_succstart, (size_t)n + 1, sizeof (uint64_t));
+	rt->rt_succ = NULL;
+	rt->rt_succstart = NULL;
+}
+
+/*
+ * Computes the immediate dominator of each value (see above), replacing its
+ * parent in rt_parent.  Frees the backward CSR.
+ */
+static void
+rt_dominators(retain_t *rt)
+{
+	uint32_t n = rt->rt_nvalues;
+	uint32_t *semi, *label, *ancestor, *stack;
+	uint32_t v, w, u, d;
+	uint64_t e;
+
+	semi = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	label = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	ancestor = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	stack = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	for (v = 0; v <= n; v++) {
+		semi[v] = v;
+		label[v] = v;
+		ancestor[v] = RT_NONE;
+	}
+
+	/*
+	 * Compute semidominators in reverse preorder.  The virtual root is a
+	 * predecessor of each root, so their semidominator is the virtual
+	 * root.
+	 */
+	for (w = n; w >= 1; w--) {
+		if (rt->rt_parent[w] == 0) {
+			semi[w] = 0;
+		} else {
+			for (e = rt->rt_predstart[w];
+			    e < rt->rt_predstart[w + 1]; e++) {
+				u = rt_eval(rt->rt_preds[e], semi, label,
+				    ancestor, stack);
+				if (semi[u] < semi[w]) {
+					semi[w] = semi[u];
+				}
+			}
+		}
+
+		ancestor[w] = rt->rt_parent[w];
+	}
+
+	rt_free(rt, rt->rt_preds, rt->rt_nrefs, sizeof (uint32_t));
+	rt_free(rt, rt->rt_predstart, (size_t)n + 2, sizeof (uint64_t));
+	rt->rt_preds = NULL;
+	rt->rt_predstart = NULL;
+
+	/*
+	 * The immediate dominator of each value is its nearest ancestor in the
+	 * spanning tree whose preorder number is no more than the value's
+	 * semidominator.  Since the ancestors are processed first, this walk
+	 * can skip from each ancestor to its own immediate dominator.
+	 */
+	for (w = 1; w <= n; w++) {
+		d = rt->rt_parent[w];
+		while (d > semi[w]) {
+			d = rt->rt_parent[d];
+		}
+
+		rt->rt_parent[w] = d;
+	}
+
+	rt_free(rt, stack, (size_t)n + 1, sizeof (uint32_t));
+	rt_free(rt, ancestor, (size_t)n + 1, sizeof (uint32_t));
+	rt_free(rt, label, (size_t)n + 1, sizeof (uint32_t));
+	rt_free(rt, semi, (size_t)n + 1, sizeof (uint32_t));
+}
+
+/*
+ * Returns the vertex with the smallest semidominator on the path from "v" up
+ * to (but not including) the root of the tree in the forest formed by
+ * "ancestor" that contains "v", compressing the path as it goes.
+ */
+static uint32_t
+rt_eval(uint32_t v, uint32_t *semi, uint32_t *label, uint32_t *ancestor,
+    uint32_t *stack)
+{
+	uint32_t x, a;
+	size_t depth = 0;
+
+	if (ancestor[v] == RT_NONE) {
+		return (v);
+	}
+
+	for (x = v; ancestor[ancestor[x]] != RT_NONE; x = ancestor[x]) {
+		stack[depth++] = x;
+	}
+
+	while (depth > 0) {
+		x = stack[--depth];
+		a = ancestor[x];
+		if (semi[label[a]] < semi[label[x]]) {
+			label[x] = label[a];
+		}
+		ancestor[x] = ancestor[a];
+	}
+
+	return (label[v]);
+}
+
+/*
+ * Computes the memory retained by each value.  Since each value's immediate
+ * dominator precedes it in preorder, this can be done by adding each value's
+ * totals to its dominator's in reverse preorder.
+ */
+static void
+rt_retain(retain_t *rt)
+{
+	uint32_t n = rt->rt_nvalues;
+	uint32_t v, d;
+
+	rt->rt_retained = rt_alloc(rt, (size_t)n + 1, sizeof (uint64_t));
+	rt->rt_rcount = rt_alloc(rt, (size_t)n + 1, sizeof (uint32_t));
+	rt->rt_retained[0] = 0;
+	rt->rt_rcount[0] = 0;
+	for (v = 1; v <= n; v++) {
+		rt->rt_retained[v] = rt->rt_sizes[rt->rt_vertex[v]];
+		rt->rt_rcount[v] = 1;
+	}
+
+	for (v = n; v >= 1; v--) {
+		d = rt->rt_parent[v];
+		rt->rt_retained[d] += rt->rt_retained[v];
+		rt->rt_rcount[d] += rt->rt_rcount[v];
+	}
+}
+
+/*
+ * Prints the "ntop" values that retain the most memory, with a min-heap of
+ * the largest ones seen so far.
+ */
+static void
+rt_report(retain_t *rt, size_t ntop)
+{
+	uint32_t *heap;
+	size_t nheap, i, parent;
+	uint32_t v, id, d;
+
+	heap = rt_alloc(rt, ntop, sizeof (uint32_t));
+	nheap = 0;
+	for (v = 1; v <= rt->rt_nvalues; v++) {
+		if (nheap < ntop) {
+			for (i = nheap++; i > 0; i = parent) {
+				parent = (i - 1) / 2;
+				if (!rt_less(rt, v, heap[parent])) {
+					break;
+				}
+
+				heap[i] = heap[parent];
+			}
+
+			heap[i] = v;
+		} else if (rt_less(rt, heap[0], v)) {
+			heap[0] = v;
+			rt_siftdown(rt, heap, nheap, 0);
+		}
+	}
+
+	/*
+	 * Sort the heap in place, largest first.
+	 */
+	for (i = nheap; i > 1; i--) {
+		v = heap[0];
+		heap[0] = heap[i - 1];
+		heap[i - 1] = v;
+		rt_siftdown(rt, heap, i - 1, 0);
+	}
+
+	(void) printf("%12s %10s %8s %-12s %16s %16s\n", "RETAINED", "VALUES",
+	    "SHALLOW", "TYPE", "IDENT", "DOMINATOR");
+	for (i = 0; i < nheap; i++) {
+		v = heap[i];
+		id = rt->rt_vertex[v];
+		d = rt->rt_parent[v];
+		(void) printf("%12" PRIu64 " %10" PRIu32 " %8" PRIu32
+		    " %-12s %16" PRIu64 " ", rt->rt_retained[v],
+		    rt->rt_rcount[v], rt->rt_sizes[id],
+		    rt_typename(rt->rt_types[id]), rt->rt_idents[id]);
+		if (d == 0) {
+			(void) printf("%16s\n", "-");
+		} else {
+			(void) printf("%16" PRIu64 "\n",
+			    rt->rt_idents[rt->rt_vertex[d]]);
+		}
+	}
+
+	rt_free(rt, heap, ntop, sizeof (uint32_t));
+}
+
+static void
+rt_siftdown(retain_t *rt, uint32_t *heap, size_t nheap, size_t i)
+{
+	size_t child;
+	uint32_t v = heap[i];
+
+	while ((child = 2 * i + 1) < nheap) {
+		if (child + 1 < nheap && rt_less(rt, heap[child + 1],
+		    heap[child])) {
+			child++;
+		}
+
+		if (!rt_less(rt, heap[child], v)) {
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = v;
+}
+
+/*
+ * Returns whether value "a" (by preorder number) should be reported after
+ * value "b": if it retains less memory, or fewer values, or has a larger
+ * ident.
+ */
+static int
+rt_less(retain_t *rt, uint32_t a, uint32_t b)
+{
+	if (rt->rt_retained[a] != rt->rt_retained[b]) {
+		return (rt->rt_retained[a] < rt->rt_retained[b]);
+	}
+
+	if (rt->rt_rcount[a] != rt->rt_rcount[b]) {
+		return (rt->rt_rcount[a] < rt->rt_rcount[b]);
+	}
+
+	return (rt->rt_idents[rt->rt_vertex[a]] >
+	    rt->rt_idents[rt->rt_vertex[b]]);
+}
+
+static const char *
+rt_typename(uint8_t type)
+{
+	const char *name;
+
+	if (type == RT_STRING) {
+		return ("string");
+	}
+
+	name = pmx_node_typename(type);
+	return (name == NULL ? "unknown" : name);
+}
+
+static void
+rt_fini(retain_t *rt)
+{
+	size_t n = rt->rt_nvalues;
+
+	rt_free(rt, rt->rt_rcount, n + 1, sizeof (uint32_t));
+	rt_free(rt, rt->rt_retained, n + 1, sizeof (uint64_t));
+	rt_free(rt, rt->rt_parent, n + 1, sizeof (uint32_t));
+	rt_free(rt, rt->rt_vertex, n + 1, sizeof (uint32_t));
+	rt_free(rt, rt->rt_sizes, n, sizeof (uint32_t));
+	rt_free(rt, rt->rt_types, n, sizeof (uint8_t));
+	rt_free(rt, rt->rt_idents, n, sizeof (uint64_t));
+	assert(rt->rt_nbytes == 0);
+}
@@ -0,0 +1,675 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2017, Joyent, Inc.
+ */
+
+/*
+ * pmxtest.c: check libpmx behavior that the tools don't exercise
+ *
+ * This program should not use private libpmx functions.
+ *
+ * It's run by "make check", and exits with status 1 (or aborts) after
+ * describing the first problem it finds.  Each test can also be run by name.
+ *
+ * "static" checks that streams created with pmx_create_stream_static() never
+ * call malloc() or stdio.  This program defines malloc(), calloc(), realloc(),
+ * free(), and the stdio functions that libpmx and libjsonemitter could use,
+ * forwarding each to the next definition (normally the C library's), found
+ * with dlsym(RTLD_NEXT).  While a static export is running, each of them
+ * instead reports which function was called and aborts.  The export runs in a
+ * signal handler, as it would after a crash, and exercises each kind of
+ * record, strings that need escaping, invalid UTF-8 (which produces a
+ * warning), and string interning, in both JSON and binary form, with the
+ * stream's memory in a fixed block.  Each export must succeed and produce
+ * exactly the same output as an ordinary stream.
+ *
+ * Like pmxbench's allocation counting, the interposition relies on the dynamic
+ * linker resolving libpmx's calls to this program's definitions, as it does on
+ * ELF systems.  Elsewhere, the "static" test is skipped.
+ */
+
+/* RTLD_NEXT is an extension. */
+#define	_GNU_SOURCE
+
+#include <dlfcn.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pmx/pmx.h>
+
+#define	EXIT_USAGE 2
+
+#if defined(RTLD_NEXT) && !defined(__APPLE__)
+#define	PT_INTERPOSE	1
+#else
+#define	PT_INTERPOSE	0
+#endif
+
+/* Size of the block used by static streams. */
+#define	PT_BLOCKSZ	(4 * 1024 * 1024)
+/* Number of values in each export. */
+#define	PT_NVALUES	200000
+/* Words of memory for allocations made while finding malloc(). */
+#define	PT_NBOOTSTRAP	512
+/* Idents of emitted values. */
+#define	PT_IDENT(i)	(0x100000 + (pmx_value_t)(i) * 0x40)
+
+static int pt_test_static(void);
+
+static struct {
+	const char	*ptt_name;
+	int		(*ptt_func)(void);
+} pt_tests[] = {
+	{ "static", pt_test_static },
+};
+
+#define	PT_NTESTS	(sizeof (pt_tests) / sizeof (pt_tests[0]))
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: pmxtest [TEST...]\n");
+	exit(EXIT_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t i;
+	int j;
+
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < PT_NTESTS; i++) {
+			if (strcmp(argv[j], pt_tests[i].ptt_name) == 0) {
+				break;
+			}
+		}
+
+		if (i == PT_NTESTS) {
+			warnx("no such test: \"%s\"", argv[j]);
+			usage();
+		}
+	}
+
+	for (i = 0; i < PT_NTESTS; i++) {
+		for (j = 1; j < argc; j++) {
+			if (strcmp(argv[j], pt_tests[i].ptt_name) == 0) {
+				break;
+			}
+		}
+
+		if (argc > 1 && j == argc) {
+			continue;
+		}
+
+		if (pt_tests[i].ptt_func() != 0) {
+			(void) printf("pmxtest: %s: FAILED\n",
+			    pt_tests[i].ptt_name);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Interposition.  See the comment at the top of this file.
+ */
+static volatile sig_atomic_t pt_armed;
+
+#if PT_INTERPOSE
+
+/*
+ * Reports a call to "func" while armed, using only write(2).
+ */
+static void
+pt_trap(const char *func)
+{
+	static const char prefix[] = "pmxtest: static stream called ";
+
+	if (!pt_armed) {
+		return;
+	}
+
+	(void) write(STDERR_FILENO, prefix, sizeof (prefix) - 1);
+	(void) write(STDERR_FILENO, func, strlen(func));
+	(void) write(STDERR_FILENO, "()\n", 3);
+	abort();
+}
+
+static void *
+pt_next(const char *func)
+{
+	void *addr;
+
+	if ((addr = dlsym(RTLD_NEXT, func)) == NULL) {
+		abort();
+	}
+
+	return (addr);
+}
+
+static void *(*pt_malloc)(size_t);
+static void *(*pt_calloc)(size_t, size_t);
+static void *(*pt_realloc)(void *, size_t);
+static void (*pt_free)(void *);
+
+/*
+ * dlsym() may itself allocate memory while we're looking up the functions
+ * above.  That's satisfied from here, and never freed.  The union makes each
+ * allocation suitably aligned for any type.
+ */
+typedef union {
+	long double	ptw_ld;
+	uint64_t	ptw_u64;
+	void		*ptw_ptr;
+} pt_word_t;
+
+static int pt_resolving;
+static pt_word_t pt_bootstrap[PT_NBOOTSTRAP];
+static size_t pt_bootstrapused;
+
+static void
+pt_resolve(void)
+{
+	pt_resolving = 1;
+	pt_malloc = (void *(*)(size_t))pt_next("malloc");
+	pt_calloc = (void *(*)(size_t, size_t))pt_next("calloc");
+	pt_realloc = (void *(*)(void *, size_t))pt_next("realloc");
+	pt_free = (void (*)(void *))pt_next("free");
+	pt_resolving = 0;
+}
+
+static void *
+pt_bootstrap_alloc(size_t sz)
+{
+	size_t nwords = (sz + sizeof (pt_word_t) - 1) / sizeof (pt_word_t);
+	void *p;
+
+	if (nwords > PT_NBOOTSTRAP - pt_bootstrapused) {
+		return (NULL);
+	}
+
+	p = &pt_bootstrap[pt_bootstrapused];
+	pt_bootstrapused += nwords;
+	return (p);
+}
+
+static int
+pt_bootstrap_owns(void *p)
+{
+	return ((pt_word_t *)p >= &pt_bootstrap[0] &&
+	    (pt_word_t *)p < &pt_bootstrap[PT_NBOOTSTRAP]);
+}
+
+void *
+malloc(size_t sz)
+{
+	pt_trap("malloc");
+	if (pt_malloc == NULL) {
+		if (pt_resolving) {
+			return (pt_bootstrap_alloc(sz));
+		}
+
+		pt_resolve();
+	}
+
+	return (pt_malloc(sz));
+}
+
+void *
+calloc(size_t nelem, size_t elsize)
+{
+	pt_trap("calloc");
+	if (pt_calloc == NULL) {
+		if (pt_resolving) {
+			/* The bootstrap area is never reused, so it's zero. */
+			if (elsize != 0 && nelem > SIZE_MAX / elsize) {
+				return (NULL);
+			}
+
+			return (pt_bootstrap_alloc(nelem * elsize));
+		}
+
+		pt_resolve();
+	}
+
+	return (pt_calloc(nelem, elsize));
+}
+
+void *
+realloc(void *p, size_t sz)
+{
+	void *newp;
+	size_t avail;
+
+	pt_trap("realloc");
+	if (pt_realloc == NULL) {
+		pt_resolve();
+	}
+
+	if (p != NULL && pt_bootstrap_owns(p)) {
+		/* We don't know the old size, but it's all in the area. */
+		avail = (size_t)((char *)&pt_bootstrap[PT_NBOOTSTRAP] -
+		    (char *)p);
+		if ((newp = malloc(sz)) != NULL) {
+			(void) memcpy(newp, p, sz < avail ? sz : avail);
+		}
+
+		return (newp);
+	}
+
+	return (pt_realloc(p, sz));
+}
+
+void
+free(void *p)
+{
+	pt_trap("free");
+	if (p == NULL || pt_bootstrap_owns(p)) {
+		return;
+	}
+
+	if (pt_free == NULL) {
+		pt_resolve();
+	}
+
+	pt_free(p);
+}
+
+/*
+ * stdio.  Each function is looked up the first time it's called.
+ */
+FILE *
+fopen(const char *path, const char *mode)
+{
+	static FILE *(*next)(const char *, const char *);
+
+	pt_trap("fopen");
+	if (next == NULL) {
+		next = (FILE *(*)(const char *, const char *))pt_next("fopen");
+	}
+
+	return (next(path, mode));
+}
+
+FILE *
+fdopen(int fd, const char *mode)
+{
+	static FILE *(*next)(int, const char *);
+
+	pt_trap("fdopen");
+	if (next == NULL) {
+		next = (FILE *(*)(int, const char *))pt_next("fdopen");
+	}
+
+	return (next(fd, mode));
+}
+
+int
+fclose(FILE *fp)
+{
+	static int (*next)(FILE *);
+
+	pt_trap("fclose");
+	if (next == NULL) {
+		next = (int (*)(FILE *))pt_next("fclose");
+	}
+
+	return (next(fp));
+}
+
+size_t
+fwrite(const void *buf, size_t size, size_t nitems, FILE *fp)
+{
+	static size_t (*next)(const void *, size_t, size_t, FILE *);
+
+	pt_trap("fwrite");
+	if (next == NULL) {
+		next = (size_t (*)(const void *, size_t, size_t, FILE *))
+		    pt_next("fwrite");
+	}
+
+	return (next(buf, size, nitems, fp));
+}
+
+int
+fputs(const char *str, FILE *fp)
+{
+	static int (*next)(const char *, FILE *);
+
+	pt_trap("fputs");
+	if (next == NULL) {
+		next = (int (*)(const char *, FILE *))pt_next("fputs");
+	}
+
+	return (next(str, fp));
+}
+
+int
+fputc(int c, FILE *fp)
+{
+	static int (*next)(int, FILE *);
+
+	pt_trap("fputc");
+	if (next == NULL) {
+		next = (int (*)(int, FILE *))pt_next("fputc");
+	}
+
+	return (next(c, fp));
+}
+
+int
+fflush(FILE *fp)
+{
+	static int (*next)(FILE *);
+
+	pt_trap("fflush");
+	if (next == NULL) {
+		next = (int (*)(FILE *))pt_next("fflush");
+	}
+
+	return (next(fp));
+}
+
+int
+vfprintf(FILE *fp, const char *fmt, va_list args)
+{
+	static int (*next)(FILE *, const char *, va_list);
+
+	pt_trap("vfprintf");
+	if (next == NULL) {
+		next = (int (*)(FILE *, const char *, va_list))
+		    pt_next("vfprintf");
+	}
+
+	return (next(fp, fmt, args));
+}
+
+int
+fprintf(FILE *fp, const char *fmt, ...)
+{
+	va_list args;
+	int rv;
+
+	pt_trap("fprintf");
+	va_start(args, fmt);
+	rv = vfprintf(fp, fmt, args);
+	va_end(args);
+	return (rv);
+}
+
+int
+vsnprintf(char *buf, size_t bufsz, const char *fmt, va_list args)
+{
+	static int (*next)(char *, size_t, const char *, va_list);
+
+	pt_trap("vsnprintf");
+	if (next == NULL) {
+		next = (int (*)(char *, size_t, const char *, va_list))
+		    pt_next("vsnprintf");
+	}
+
+	return (next(buf, bufsz, fmt, args));
+}
+
+int
+snprintf(char *buf, size_t bufsz, const char *fmt, ...)
+{
+	va_list args;
+	int rv;
+
+	pt_trap("snprintf");
+	va_start(args, fmt);
+	rv = vsnprintf(buf, bufsz, fmt, args);
+	va_end(args);
+	return (rv);
+}
+
+#endif /* PT_INTERPOSE */
+
+/*
+ * static test.  See the comment at the top of this file.
+ */
+
+/*
+ * The block for static streams.  The union makes it suitably aligned for any
+ * type.
+ */
+static union {
+	long double	ptb_ld;
+	uint64_t	ptb_u64;
+	void		*ptb_ptr;
+	char		ptb_mem[PT_BLOCKSZ];
+} pt_block;
+
+/* State shared with the signal handler. */
+static struct {
+	pmx_format_t	pts_format;
+	int		pts_fd;
+	pmx_error_t	pts_error;	/* result of the export */
+	int		pts_created;	/* whether the stream was created */
+	int		pts_errno;	/* if not, why not */
+	size_t		pts_used;	/* memory used, when done */
+	size_t		pts_reserved;
+} pt_static;
+
+static void
+pt_export(pmx_stream_t *pmxp)
+{
+	static const char *names[] = { "foo", "bar", "baz", "quux" };
+	pmx_value_t ident;
+	uint8_t buf[32];
+	size_t len, v;
+	unsigned int i, k;
+
+	pmx_emit_metadata(pmxp, "generator", "pmxtest");
+	(void) pmx_intern_strings(pmxp, 64 * 1024, PMXI_EVICT_CLOCK);
+	pmx_emit_node_null(pmxp, 0x10, 0x11);
+
+	for (i = 0; i < PT_NVALUES; i++) {
+		ident = PT_IDENT(i);
+		switch (i % 4) {
+		case 0:
+			pmx_object_start(pmxp, ident);
+			pmx_object_constructor(pmxp, PT_IDENT(i / 2));
+			for (k = 0; k < 4; k++) {
+				pmx_object_property(pmxp, ident,
+				    PT_IDENT(i / 2 + k), names[(i + k) % 4]);
+			}
+
+			pmx_object_done(pmxp, 4);
+			break;
+
+		case 1:
+			pmx_emit_node_heapnumber(pmxp, ident, i * 0.25);
+			break;
+
+		case 2:
+			/*
+			 * A control character that must be escaped, a few
+			 * hundred distinct strings for interning to find, and
+			 * occasionally invalid UTF-8.
+			 */
+			len = 0;
+			buf[len++] = 'x';
+			buf[len++] = '\t';
+			buf[len++] = 0x01;
+			for (v = i % 500; v != 0; v /= 10) {
+				buf[len++] = (uint8_t)('0' + v % 10);
+			}
+
+			(void) memcpy(buf + len, "-module", 7);
+			len += 7;
+			if (i % 1000 == 2) {
+				buf[len++] = 0xff;
+			}
+
+			pmx_emit_string_data(pmxp, ident, len, buf);
+			break;
+
+		default:
+			pmx_array(pmxp, ident, 2);
+			pmx_array_element(pmxp, ident, PT_IDENT(i / 2), 0, 0);
+			pmx_array_element(pmxp, ident, PMX_SMI_VALUE(i), 1, 1);
+			break;
+		}
+	}
+
+	pmx_done(pmxp);
+}
+
+/*
+ * Runs a static export as if after a crash, with malloc() and stdio armed to
+ * abort.
+ */
+static void
+pt_static_handler(int sig __attribute__((__unused__)))
+{
+	pmx_stream_t *pmxp;
+
+	pt_armed = 1;
+	pmxp = pmx_create_stream_static(pt_static.pts_fd,
+	    pt_static.pts_format, pt_block.ptb_mem, sizeof (pt_block.ptb_mem));
+	if (pmxp == NULL) {
+		pt_static.pts_created = 0;
+		pt_static.pts_errno = errno;
+	} else {
+		pt_static.pts_created = 1;
+		pt_export(pmxp);
+		pt_static.pts_error = pmx_errno(pmxp);
+		pmx_memory_usage(pmxp, &pt_static.pts_used,
+		    &pt_static.pts_reserved);
+		pmx_free(pmxp);
+	}
+
+	pt_armed = 0;
+}
+
+/*
+ * Returns whether the contents of "fp1" and "fp2" are identical, and stores
+ * the size of the former into "nbytesp".
+ */
+static int
+pt_same_contents(FILE *fp1, FILE *fp2, size_t *nbytesp)
+{
+	char buf1[8192], buf2[8192];
+	size_t n1, n2;
+
+	rewind(fp1);
+	rewind(fp2);
+	*nbytesp = 0;
+	do {
+		n1 = fread(buf1, 1, sizeof (buf1), fp1);
+		n2 = fread(buf2, 1, sizeof (buf2), fp2);
+		if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
+			return (0);
+		}
+
+		*nbytesp += n1;
+	} while (n1 > 0);
+
+	return (!ferror(fp1) && !ferror(fp2));
+}
+
+static int
+pt_static_check(pmx_format_t format, const char *label)
+{
+	struct sigaction act;
+	pmx_stream_t *pmxp;
+	FILE *staticfp, *ordinaryfp, *nullfp;
+	size_t nbytes;
+
+	if ((staticfp = tmpfile()) == NULL ||
+	    (ordinaryfp = tmpfile()) == NULL) {
+		err(EXIT_FAILURE, "tmpfile");
+	}
+
+	/* The ordinary stream's warnings are expected. */
+	if ((nullfp = fopen("/dev/null", "w")) == NULL) {
+		err(EXIT_FAILURE, "open \"/dev/null\"");
+	}
+
+	(void) memset(&pt_static, 0, sizeof (pt_static));
+	pt_static.pts_format = format;
+	pt_static.pts_fd = fileno(staticfp);
+
+	(void) memset(&act, 0, sizeof (act));
+	act.sa_handler = pt_static_handler;
+	(void) sigemptyset(&act.sa_mask);
+	if (sigaction(SIGUSR1, &act, NULL) != 0) {
+		err(EXIT_FAILURE, "sigaction");
+	}
+
+	(void) raise(SIGUSR1);
+
+	if (!pt_static.pts_created) {
+		(void) fprintf(stderr, "pmxtest: static: %s: failed to create "
+		    "stream: %s\n", label, strerror(pt_static.pts_errno));
+		return (-1);
+	}
+
+	if (pt_static.pts_error != PMXE_OK) {
+		(void) fprintf(stderr, "pmxtest: static: %s: export failed "
+		    "(error %d)\n", label, (int)pt_static.pts_error);
+		return (-1);
+	}
+
+	if ((pmxp = pmx_create_stream_format(ordinaryfp, nullfp,
+	    format)) == NULL) {
+		err(EXIT_FAILURE, "pmx_create_stream_format");
+	}
+
+	pt_export(pmxp);
+	if (pmx_errno(pmxp) != PMXE_OK) {
+		errx(EXIT_FAILURE, "%s: %s", label, pmx_errmsg(pmxp));
+	}
+
+	pmx_free(pmxp);
+	if (fflush(ordinaryfp) != 0) {
+		err(EXIT_FAILURE, "fflush");
+	}
+
+	if (!pt_same_contents(staticfp, ordinaryfp, &nbytes)) {
+		(void) fprintf(stderr, "pmxtest: static: %s: output differs "
+		    "from an ordinary stream's\n", label);
+		return (-1);
+	}
+
+	(void) printf("pmxtest: static: %s: %zu bytes, %zu of %zu bytes of "
+	    "memory used\n", label, nbytes, pt_static.pts_used,
+	    pt_static.pts_reserved);
+	(void) fclose(staticfp);
+	(void) fclose(ordinaryfp);
+	(void) fclose(nullfp);
+	return (0);
+}
+
+static int
+pt_test_static(void)
+{
+	if (!PT_INTERPOSE) {
+		(void) printf("pmxtest: static: can't interpose on malloc() "
+		    "here, skipped\n");
+		return (0);
+	}
+
+	if (pt_static_check(PMXF_JSON, "json") != 0 ||
+	    pt_static_check(PMXF_BINARY, "binary") != 0) {
+		return (-1);
+	}
+
+	return (0);
+}